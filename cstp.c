@@ -563,6 +563,8 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 		return -EINVAL;
 	}
 	vpninfo->ip_info.mtu = mtu;
+	/* A new ceiling for DTLS path MTU discovery */
+	vpninfo->mtu_ceiling = 0;
 
 	if (!vpninfo->ip_info.addr && !vpninfo->ip_info.addr6 &&
 	    !vpninfo->ip_info.netmask6) {
@@ -639,8 +641,7 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	if (vpninfo->ssl_times.rekey <= 0)
 		vpninfo->ssl_times.rekey_method = REKEY_NONE;
 
-	vpninfo->ssl_times.last_rekey = vpninfo->ssl_times.last_rx =
-		vpninfo->ssl_times.last_tx = time(NULL);
+	ka_reset(vpninfo, &vpninfo->ssl_times);
 	return 0;
 }
 
@@ -669,6 +670,12 @@ int cstp_connect(struct openconnect_info *vpninfo)
 	if (ret)
 		goto out;
 
+	ssl_enable_ktls(vpninfo);
+
+	/* Any partial packet left from a previous connection is useless now */
+	free_pkt(vpninfo, vpninfo->cstp_pkt);
+	vpninfo->cstp_pkt = NULL;
+
 	/* Allow for the theoretical possibility of having *different*
 	 * compression type for CSTP and DTLS. Although all we've seen
 	 * in practice is that one is enabled and the other isn't. */
@@ -738,10 +745,11 @@ static int cstp_reconnect(struct openconnect_info *vpninfo)
 	return ssl_reconnect(vpninfo);
 }
 
-int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
+int decompress_and_queue_packet(struct openconnect_info *vpninfo,
+				struct oc_stats *via, int compr_type,
 				unsigned char *buf, int len)
 {
-	struct pkt *new = malloc(sizeof(struct pkt) + vpninfo->ip_info.mtu);
+	struct pkt *new = alloc_pkt(vpninfo, vpninfo->ip_info.mtu);
 	const char *comprname = "";
 
 	if (!new)
@@ -763,7 +771,8 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 
 		if (inflate(&vpninfo->inflate_strm, Z_SYNC_FLUSH)) {
 			vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
-			free(new);
+			count_drop(vpninfo, decompress);
+			free_pkt(vpninfo, new);
 			return -EINVAL;
 		}
 
@@ -787,7 +796,8 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 				len = -EINVAL;
 			vpn_progress(vpninfo, PRG_ERR, _("LZS decompression failed: %s\n"),
 				     strerror(-len));
-			free(new);
+			count_drop(vpninfo, decompress);
+			free_pkt(vpninfo, new);
 			return len;
 		}
 #ifdef HAVE_LZ4
@@ -799,21 +809,22 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 			if (len == 0)
 				len = -EINVAL;
 			vpn_progress(vpninfo, PRG_ERR, _("LZ4 decompression failed\n"));
-			free(new);
+			count_drop(vpninfo, decompress);
+			free_pkt(vpninfo, new);
 			return len;
 		}
 #endif
 	} else {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Unknown compression type %d\n"), compr_type);
-		free(new);
+		free_pkt(vpninfo, new);
 		return -EINVAL;
 	}
-	vpn_progress(vpninfo, PRG_TRACE,
-		     _("Received %s compressed data packet of %d bytes (was %d)\n"),
-		     comprname, new->len, len);
+	vpn_pkt_trace(vpninfo,
+		      _("Received %s compressed data packet of %d bytes (was %d)\n"),
+		      comprname, new->len, len);
 
-	queue_packet(&vpninfo->incoming_queue, new);
+	queue_rx_packet(vpninfo, via, new);
 	return 0;
 }
 
@@ -879,6 +890,65 @@ int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt
 	return 0;
 }
 
+/* The most plaintext that TLS will carry in a single record */
+#define TLS_MAX_RECORD 16384
+
+/* Gather 'this' and as many of the packets queued behind it as will fit
+ * into cstp_tx_pkt, each with its own CSTP header, so that they all go
+ * out in a single TLS record. LZS and LZ4 compress each packet by itself
+ * so those can be coalesced too. Deflate can't: on reconnect the packet
+ * in flight has to be requeued and compressed again in the new stream. */
+static int cstp_coalesce(struct openconnect_info *vpninfo, struct pkt *this)
+{
+	int pktlen = MAX(vpninfo->ip_info.mtu, vpninfo->deflate_pkt_size);
+	int len = MAX(TLS_MAX_RECORD - 8, pktlen);
+	struct pkt *tx = vpninfo->cstp_tx_pkt;
+	struct pkt *src;
+	unsigned char *p;
+	int space;
+
+	if (tx && tx->alloc_len < len) {
+		free_pkt(vpninfo, tx);
+		tx = vpninfo->cstp_tx_pkt = NULL;
+	}
+	if (!tx) {
+		tx = vpninfo->cstp_tx_pkt = alloc_pkt(vpninfo, len);
+		if (!tx)
+			return -ENOMEM;
+	}
+
+	p = tx->cstp.hdr;
+	space = tx->alloc_len + 8;
+	do {
+		memcpy(p, data_hdr, 8);
+		src = this;
+		if (vpninfo->cstp_compr &&
+		    !compress_packet(vpninfo, vpninfo->cstp_compr, this)) {
+			src = vpninfo->deflate_pkt;
+			p[6] = AC_PKT_COMPRESSED;
+		}
+		if (8 + src->len > space) {
+			requeue_packet(&vpninfo->outgoing_queue, this);
+			break;
+		}
+
+		store_be16(p + 4, src->len);
+		memcpy(p + 8, src->data, src->len);
+		p += 8 + src->len;
+		space -= 8 + src->len;
+
+		vpn_pkt_trace(vpninfo,
+			      _("Coalescing data packet of %d bytes (was %d)\n"),
+			      src->len, this->len);
+		record_tx_packet(vpninfo, &vpninfo->data_stats.cstp, this);
+		free_pkt(vpninfo, this);
+	} while ((this = dequeue_packet(&vpninfo->outgoing_queue)));
+
+	/* As for a single packet, ->len excludes the first header */
+	tx->len = p - tx->cstp.hdr - 8;
+	return 0;
+}
+
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	int ret;
@@ -895,116 +965,133 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	   fairly unlikely situation, until the write backlog clears. */
 	while (1) {
 		int len = MAX(16384, vpninfo->deflate_pkt_size ? : vpninfo->ip_info.mtu);
-		int payload_len;
+		int payload_len, off;
+		unsigned char *hdr;
 
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
 			}
+			vpninfo->cstp_pkt->len = 0;
 		}
 
-		len = ssl_nonblock_read(vpninfo, vpninfo->cstp_pkt->cstp.hdr, len + 8);
+		/* The server may put several packets into one TLS record, or
+		 * split a packet across records. So treat the TLS session as
+		 * a stream, and read as much as will fit. cstp_pkt->len is
+		 * the number of bytes held, starting with the header of the
+		 * first packet that hasn't been handled yet. */
+		len = ssl_nonblock_read(vpninfo,
+					vpninfo->cstp_pkt->cstp.hdr + vpninfo->cstp_pkt->len,
+					vpninfo->cstp_pkt->alloc_len + 8 - vpninfo->cstp_pkt->len);
 		if (!len)
 			break;
 		if (len < 0)
 			goto do_reconnect;
-		if (len < 8) {
-			vpn_progress(vpninfo, PRG_ERR, _("Short packet received (%d bytes)\n"), len);
-			vpninfo->quit_reason = "Short packet received";
-			return 1;
-		}
 
-		if (vpninfo->cstp_pkt->cstp.hdr[0] != 'S' || vpninfo->cstp_pkt->cstp.hdr[1] != 'T' ||
-		    vpninfo->cstp_pkt->cstp.hdr[2] != 'F' || vpninfo->cstp_pkt->cstp.hdr[3] != 1 ||
-		    vpninfo->cstp_pkt->cstp.hdr[7])
-			goto unknown_pkt;
+		vpninfo->cstp_pkt->len += len;
+		vpninfo->ssl_times.last_rx = vpninfo->now;
 
-		payload_len = load_be16(vpninfo->cstp_pkt->cstp.hdr + 4);
-		if (len != 8 + payload_len) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Unexpected packet length. SSL_read returned %d but packet is\n"),
-				     len);
-			vpn_progress(vpninfo, PRG_ERR,
-				     "%02x %02x %02x %02x %02x %02x %02x %02x\n",
-				     vpninfo->cstp_pkt->cstp.hdr[0], vpninfo->cstp_pkt->cstp.hdr[1],
-				     vpninfo->cstp_pkt->cstp.hdr[2], vpninfo->cstp_pkt->cstp.hdr[3],
-				     vpninfo->cstp_pkt->cstp.hdr[4], vpninfo->cstp_pkt->cstp.hdr[5],
-				     vpninfo->cstp_pkt->cstp.hdr[6], vpninfo->cstp_pkt->cstp.hdr[7]);
-			continue;
-		}
-		vpninfo->ssl_times.last_rx = time(NULL);
-		switch (vpninfo->cstp_pkt->cstp.hdr[6]) {
-		case AC_PKT_DPD_OUT:
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Got CSTP DPD request\n"));
-			vpninfo->owe_ssl_dpd_response = 1;
-			continue;
+		for (off = 0; vpninfo->cstp_pkt->len - off >= 8; off += 8 + payload_len) {
+			hdr = vpninfo->cstp_pkt->cstp.hdr + off;
 
-		case AC_PKT_DPD_RESP:
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Got CSTP DPD response\n"));
-			continue;
+			if (hdr[0] != 'S' || hdr[1] != 'T' ||
+			    hdr[2] != 'F' || hdr[3] != 1 || hdr[7])
+				goto unknown_pkt;
 
-		case AC_PKT_KEEPALIVE:
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Got CSTP Keepalive\n"));
-			continue;
+			payload_len = load_be16(hdr + 4);
+			if (payload_len > vpninfo->cstp_pkt->alloc_len) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Packet too large (%d bytes) for receive buffer\n"),
+					     payload_len);
+				vpninfo->quit_reason = "Oversized packet received";
+				return 1;
+			}
+			/* Wait for the rest of it */
+			if (vpninfo->cstp_pkt->len - off < 8 + payload_len)
+				break;
 
-		case AC_PKT_DATA:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received uncompressed data packet of %d bytes\n"),
-				     payload_len);
-			vpninfo->cstp_pkt->len = payload_len;
-			queue_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt);
-			vpninfo->cstp_pkt = NULL;
-			work_done = 1;
-			continue;
+			switch (hdr[6]) {
+			case AC_PKT_DPD_OUT:
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Got CSTP DPD request\n"));
+				vpninfo->owe_ssl_dpd_response = 1;
+				continue;
+
+			case AC_PKT_DPD_RESP:
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Got CSTP DPD response\n"));
+				continue;
+
+			case AC_PKT_KEEPALIVE:
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Got CSTP Keepalive\n"));
+				continue;
 
-		case AC_PKT_DISCONN: {
-			int i;
-			if (payload_len >= 2) {
-				for (i = 1; i < payload_len; i++) {
-					if (!isprint(vpninfo->cstp_pkt->data[i]))
-						vpninfo->cstp_pkt->data[i] = '.';
+			case AC_PKT_DATA:
+				vpn_pkt_trace(vpninfo,
+					      _("Received uncompressed data packet of %d bytes\n"),
+					      payload_len);
+				/* cstp_pkt is big enough for any record the server may
+				   send. Copy the packet out of it into a pool buffer, so
+				   that packets sitting on the queue don't each pin 16KiB. */
+				if (queue_new_packet(vpninfo, &vpninfo->data_stats.cstp,
+						     hdr + 8, payload_len))
+					vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+				work_done = 1;
+				continue;
+
+			case AC_PKT_DISCONN: {
+				int i;
+				if (payload_len >= 2) {
+					for (i = 1; i < payload_len; i++) {
+						if (!isprint(hdr[8 + i]))
+							hdr[8 + i] = '.';
+					}
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Received server disconnect: %02x '%.*s'\n"),
+						     hdr[8], payload_len - 1, hdr + 9);
+				} else {
+					vpn_progress(vpninfo, PRG_ERR, _("Received server disconnect\n"));
 				}
-				vpninfo->cstp_pkt->data[payload_len] = 0;
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Received server disconnect: %02x '%s'\n"),
-					     vpninfo->cstp_pkt->data[0], vpninfo->cstp_pkt->data + 1);
-			} else {
-				vpn_progress(vpninfo, PRG_ERR, _("Received server disconnect\n"));
+				vpninfo->quit_reason = "Server request";
+				return -EPIPE;
 			}
-			vpninfo->quit_reason = "Server request";
-			return -EPIPE;
-		}
-		case AC_PKT_COMPRESSED:
-			if (!vpninfo->cstp_compr) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Compressed packet received in !deflate mode\n"));
-				goto unknown_pkt;
+			case AC_PKT_COMPRESSED:
+				if (!vpninfo->cstp_compr) {
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Compressed packet received in !deflate mode\n"));
+					goto unknown_pkt;
+				}
+				decompress_and_queue_packet(vpninfo, &vpninfo->data_stats.cstp,
+							    vpninfo->cstp_compr,
+							    hdr + 8, payload_len);
+				work_done = 1;
+				continue;
+
+			case AC_PKT_TERM_SERVER:
+				vpn_progress(vpninfo, PRG_ERR, _("received server terminate packet\n"));
+				vpninfo->quit_reason = "Server request";
+				return -EPIPE;
 			}
-			decompress_and_queue_packet(vpninfo, vpninfo->cstp_compr,
-						    vpninfo->cstp_pkt->data, payload_len);
-			work_done = 1;
-			continue;
 
-		case AC_PKT_TERM_SERVER:
-			vpn_progress(vpninfo, PRG_ERR, _("received server terminate packet\n"));
-			vpninfo->quit_reason = "Server request";
-			return -EPIPE;
+		unknown_pkt:
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Unknown packet %02x %02x %02x %02x %02x %02x %02x %02x\n"),
+				     hdr[0], hdr[1], hdr[2], hdr[3],
+				     hdr[4], hdr[5], hdr[6], hdr[7]);
+			vpninfo->quit_reason = "Unknown packet received";
+			return 1;
 		}
 
-	unknown_pkt:
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Unknown packet %02x %02x %02x %02x %02x %02x %02x %02x\n"),
-			     vpninfo->cstp_pkt->cstp.hdr[0], vpninfo->cstp_pkt->cstp.hdr[1],
-			     vpninfo->cstp_pkt->cstp.hdr[2], vpninfo->cstp_pkt->cstp.hdr[3],
-			     vpninfo->cstp_pkt->cstp.hdr[4], vpninfo->cstp_pkt->cstp.hdr[5],
-			     vpninfo->cstp_pkt->cstp.hdr[6], vpninfo->cstp_pkt->cstp.hdr[7]);
-		vpninfo->quit_reason = "Unknown packet received";
-		return 1;
+		/* Keep any partial packet for next time */
+		if (off) {
+			vpninfo->cstp_pkt->len -= off;
+			memmove(vpninfo->cstp_pkt->cstp.hdr,
+				vpninfo->cstp_pkt->cstp.hdr + off,
+				vpninfo->cstp_pkt->len);
+		}
 	}
 
 
@@ -1013,7 +1100,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = vpninfo->now;
 		unmonitor_write_fd(vpninfo, ssl);
 
 		ret = ssl_nonblock_write(vpninfo,
@@ -1026,7 +1113,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			   fd to ->select_wfds if appropriate, so we can just
 			   return and wait. Unless it's been stalled for so long
 			   that DPD kicks in and we kill the connection. */
-			switch (ka_stalled_action(&vpninfo->ssl_times, timeout)) {
+			switch (ka_stalled_action(vpninfo, &vpninfo->ssl_times)) {
 			case KA_DPD_DEAD:
 				goto peer_dead;
 			case KA_REKEY:
@@ -1048,12 +1135,13 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 		/* Don't free the 'special' packets */
 		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
-			free(vpninfo->pending_deflated_pkt);
+			free_pkt(vpninfo, vpninfo->pending_deflated_pkt);
 			vpninfo->pending_deflated_pkt = NULL;
 		} else if (vpninfo->current_ssl_pkt != &dpd_pkt &&
 			 vpninfo->current_ssl_pkt != &dpd_resp_pkt &&
+			 vpninfo->current_ssl_pkt != vpninfo->cstp_tx_pkt &&
 			 vpninfo->current_ssl_pkt != &keepalive_pkt)
-			free(vpninfo->current_ssl_pkt);
+			free_pkt(vpninfo, vpninfo->current_ssl_pkt);
 
 		vpninfo->current_ssl_pkt = NULL;
 	}
@@ -1064,7 +1152,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		goto handle_outgoing;
 	}
 
-	switch (keepalive_action(&vpninfo->ssl_times, timeout)) {
+	switch (keepalive_action(vpninfo, &vpninfo->ssl_times)) {
 	case KA_REKEY:
 	do_rekey:
 		/* Not that this will ever happen; we don't even process
@@ -1073,6 +1161,10 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (vpninfo->ssl_times.rekey_method == REKEY_TUNNEL)
 			goto do_reconnect;
 		else if (vpninfo->ssl_times.rekey_method == REKEY_SSL) {
+			/* The TLS library no longer has the keys */
+			if (vpninfo->ktls_active)
+				goto do_reconnect;
+
 			ret = cstp_handshake(vpninfo, 0);
 			if (ret) {
 				/* if we failed rehandshake try establishing a new-tunnel instead of failing */
@@ -1133,6 +1225,16 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
+		/* With more packets waiting, send as many as fit in one record */
+		if (vpninfo->outgoing_queue.head &&
+		    vpninfo->cstp_compr != COMPR_DEFLATE &&
+		    !cstp_coalesce(vpninfo, this)) {
+			vpninfo->current_ssl_pkt = vpninfo->cstp_tx_pkt;
+			goto handle_outgoing;
+		}
+
+		record_tx_packet(vpninfo, &vpninfo->data_stats.cstp, this);
+
 		if (vpninfo->cstp_compr) {
 			ret = compress_packet(vpninfo, vpninfo->cstp_compr, this);
 			if (ret < 0)
@@ -1143,9 +1245,9 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			/* DTLS compression may have screwed with this */
 			vpninfo->deflate_pkt->cstp.hdr[7] = 0;
 
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Sending compressed data packet of %d bytes (was %d)\n"),
-				     vpninfo->deflate_pkt->len, this->len);
+			vpn_pkt_trace(vpninfo,
+				      _("Sending compressed data packet of %d bytes (was %d)\n"),
+				      vpninfo->deflate_pkt->len, this->len);
 
 			vpninfo->pending_deflated_pkt = this;
 			vpninfo->current_ssl_pkt = vpninfo->deflate_pkt;
@@ -1154,9 +1256,9 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			memcpy(this->cstp.hdr, data_hdr, 8);
 			store_be16(this->cstp.hdr + 4, this->len);
 
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Sending uncompressed data packet of %d bytes\n"),
-				     this->len);
+			vpn_pkt_trace(vpninfo,
+				      _("Sending uncompressed data packet of %d bytes\n"),
+				      this->len);
 
 			vpninfo->current_ssl_pkt = this;
 		}
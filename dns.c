@@ -0,0 +1,253 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_DNS_THREAD
+#include <pthread.h>
+#endif
+
+#include "openconnect-internal.h"
+
+/*
+ * Cache of the last address lookup. A server which says it uses dynamic
+ * DNS is looked up again on each reconnect instead of reusing its last
+ * address, and doing that with the tunnel down adds the resolver's round
+ * trip (or timeout) to the outage. So while the tunnel is up, the
+ * mainloop calls dns_refresh() to look the server up again in a
+ * background thread every DNS_REFRESH_INTERVAL seconds, and a reconnect
+ * can use the result straight away.
+ *
+ * getaddrinfo() says nothing about the TTL of the records, so a lookup
+ * is trusted for DNS_CACHE_TTL seconds. Beyond that, or if none of its
+ * addresses work, the lookup is done again there and then.
+ *
+ * The getaddrinfo_override hook is only ever called from the main
+ * thread, so with that in use there is no refreshing in the background.
+ */
+#define DNS_CACHE_TTL 120
+#define DNS_REFRESH_INTERVAL 60
+
+struct dns_query {
+	char *host;
+	char port[6];
+	struct addrinfo hints;
+	struct addrinfo *result;
+	int err;
+	uint64_t started;	/* From timer_now() */
+#ifdef HAVE_DNS_THREAD
+	int refs;	/* The thread's and vpninfo's */
+#endif
+};
+
+static struct dns_query *new_query(const char *host, const char *port,
+				   const struct addrinfo *hints, uint64_t now)
+{
+	struct dns_query *q = calloc(1, sizeof(*q));
+
+	if (!q)
+		return NULL;
+	q->host = strdup(host);
+	if (!q->host) {
+		free(q);
+		return NULL;
+	}
+	snprintf(q->port, sizeof(q->port), "%s", port);
+	q->hints = *hints;
+	q->started = now;
+	return q;
+}
+
+static void free_query(struct dns_query *q)
+{
+	if (q->result)
+		freeaddrinfo(q->result);
+	free(q->host);
+	free(q);
+}
+
+static int query_matches(struct dns_query *q, const char *host, const char *port,
+			 const struct addrinfo *hints)
+{
+	return !strcmp(q->host, host) && !strcmp(q->port, port) &&
+		q->hints.ai_flags == hints->ai_flags &&
+		q->hints.ai_family == hints->ai_family;
+}
+
+static void set_cache(struct openconnect_info *vpninfo, struct dns_query *q)
+{
+	if (vpninfo->dns_cache)
+		free_query(vpninfo->dns_cache);
+	vpninfo->dns_cache = q;
+}
+
+#ifdef HAVE_DNS_THREAD
+static void put_query(struct dns_query *q)
+{
+	if (!__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL))
+		free_query(q);
+}
+
+static void *dns_thread(void *arg)
+{
+	struct dns_query *q = arg;
+
+	q->err = getaddrinfo(q->host, q->port, &q->hints, &q->result);
+	if (q->err)
+		q->result = NULL;
+	put_query(q);
+	return NULL;
+}
+
+/* Pick up the result of a background lookup, once the thread has
+   finished with it and dropped its reference */
+static void collect_refresh(struct openconnect_info *vpninfo)
+{
+	struct dns_query *q = vpninfo->dns_pending;
+
+	if (!q || __atomic_load_n(&q->refs, __ATOMIC_ACQUIRE) != 1)
+		return;
+
+	vpninfo->dns_pending = NULL;
+	if (q->err) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Background lookup of %s failed: %s\n"),
+			     q->host, gai_strerror(q->err));
+		put_query(q);
+		return;
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Refreshed addresses for %s\n"), q->host);
+	set_cache(vpninfo, q);
+}
+#endif
+
+/* Called from the mainloop to keep the cached addresses of a dynamic
+   DNS server fresh, ready for when the tunnel needs to reconnect. */
+void dns_refresh(struct openconnect_info *vpninfo, int *timeout)
+{
+#ifdef HAVE_DNS_THREAD
+	struct dns_query *q;
+	pthread_t thread;
+	uint64_t now, due;
+
+	collect_refresh(vpninfo);
+
+	q = vpninfo->dns_cache;
+	if (!q || !vpninfo->is_dyndns || vpninfo->proxy ||
+	    vpninfo->getaddrinfo_override || vpninfo->dns_pending)
+		return;
+
+	/* From the last attempt, even if it failed */
+	now = vpninfo->now;
+	due = q->started;
+	if (due < vpninfo->dns_refresh_time)
+		due = vpninfo->dns_refresh_time;
+	due += DNS_REFRESH_INTERVAL * 1000ULL;
+	if (now < due) {
+		if (due - now < (uint64_t)*timeout)
+			*timeout = due - now;
+		return;
+	}
+
+	q = new_query(q->host, q->port, &q->hints, now);
+	if (!q)
+		return;
+	q->refs = 2;
+	if (pthread_create(&thread, NULL, dns_thread, q)) {
+		free_query(q);
+		return;
+	}
+	pthread_detach(thread);
+	vpninfo->dns_refresh_time = now;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Looking up %s in the background\n"), q->host);
+	vpninfo->dns_pending = q;
+#endif
+}
+
+/* Look up host, using the cache if it's recent enough. *result belongs
+   to the cache and stays valid until the next lookup or flush. *cached
+   says whether it came from the cache. Returns a getaddrinfo() error. */
+int dns_lookup(struct openconnect_info *vpninfo, const char *host,
+	       const char *port, const struct addrinfo *hints,
+	       struct addrinfo **result, int *cached)
+{
+	/* Not vpninfo->now; this may be well after the mainloop last ran */
+	uint64_t now = timer_now();
+	struct dns_query *q;
+	int err;
+
+#ifdef HAVE_DNS_THREAD
+	collect_refresh(vpninfo);
+#endif
+	q = vpninfo->dns_cache;
+	if (q && query_matches(q, host, port, hints) &&
+	    now - q->started < DNS_CACHE_TTL * 1000ULL) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Using addresses for %s looked up %ld seconds ago\n"),
+			     host, (long)((now - q->started) / 1000));
+		*result = q->result;
+		*cached = 1;
+		return 0;
+	}
+
+	q = new_query(host, port, hints, now);
+	if (!q)
+		return EAI_MEMORY;
+
+	if (vpninfo->getaddrinfo_override)
+		err = vpninfo->getaddrinfo_override(vpninfo->cbdata, host, port,
+						    hints, &q->result);
+	else
+		err = getaddrinfo(host, port, hints, &q->result);
+	if (err) {
+		q->result = NULL;
+		free_query(q);
+		return err;
+	}
+
+	set_cache(vpninfo, q);
+	*result = q->result;
+	*cached = 0;
+	return 0;
+}
+
+/* The cached addresses didn't work */
+void dns_cache_flush(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->dns_cache) {
+		free_query(vpninfo->dns_cache);
+		vpninfo->dns_cache = NULL;
+	}
+}
+
+void dns_cache_free(struct openconnect_info *vpninfo)
+{
+	dns_cache_flush(vpninfo);
+#ifdef HAVE_DNS_THREAD
+	/* A lookup still in progress frees itself when it's done */
+	if (vpninfo->dns_pending) {
+		put_query(vpninfo->dns_pending);
+		vpninfo->dns_pending = NULL;
+	}
+#endif
+}
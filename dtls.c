@@ -32,6 +32,10 @@
 
 #include "openconnect-internal.h"
 
+#if defined(OPENCONNECT_GNUTLS)
+#include <gnutls/dtls.h>
+#endif
+
 /*
  * The master-secret is generated randomly by the client. The server
  * responds with a DTLS Session-ID. These, done over the HTTPS
@@ -133,7 +137,7 @@ static int connect_dtls_socket(struct openconnect_info *vpninfo)
 	monitor_read_fd(vpninfo, dtls);
 	monitor_except_fd(vpninfo, dtls);
 
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = timer_update(vpninfo);
 
 	return dtls_try_handshake(vpninfo);
 }
@@ -150,6 +154,11 @@ void dtls_close(struct openconnect_info *vpninfo)
 		vpninfo->dtls_fd = -1;
 	}
 	vpninfo->dtls_state = DTLS_SLEEPING;
+	vpninfo->mtu_state = MTU_NONE;
+	vpninfo->mtu_probe = 0;
+	timer_cancel(vpninfo, &vpninfo->mtu_timer);
+	/* Nothing to keep alive until the next connection */
+	timer_cancel(vpninfo, &vpninfo->dtls_times.timer);
 }
 
 static int dtls_reconnect(struct openconnect_info *vpninfo)
@@ -220,6 +229,328 @@ int dtls_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	return 0;
 }
 
+#define MTU_ID_SIZE 4
+#define MTU_MAX_PROBES 3	/* Sent at each size before giving up on it */
+#define MTU_PROBE_TIMEOUT 2000	/* Milliseconds to wait for each response */
+#define MTU_RAISE_INTERVAL 600	/* Seconds between searches for a larger MTU */
+
+/*
+ * Path MTU discovery runs alongside the traffic, rather than holding it
+ * up. A probe is a DPD request padded to the size of a data packet of
+ * the MTU being tried, and the server echoes it back. It's a binary
+ * search between what is known to get through (mtu_min) and what isn't
+ * known not to (mtu_max), starting with the MTU we already have since
+ * that is usually right. A size is given up on after MTU_MAX_PROBES
+ * probes have gone unanswered, or when it can't even be sent.
+ *
+ * Once the search is done, a new one starts every MTU_RAISE_INTERVAL to
+ * see if the path will now take more, up to the MTU the server offered,
+ * as in RFC8899 (Packetization Layer Path MTU Discovery).
+ */
+
+#if defined(IPPROTO_IPV6)
+/* This symbol is missing in glibc < 2.22 (bug 18643). */
+#if defined(__linux__) && !defined(HAVE_IPV6_PATHMTU)
+# define HAVE_IPV6_PATHMTU 1
+# define IPV6_PATHMTU 61
+#endif
+#endif
+
+/* With an IPv6 peer, the kernel knows the path MTU from any ICMPv6
+ * Packet Too Big messages that came back. Returns the largest data
+ * packet which that leaves room for, or zero if it has nothing to say. */
+static int dtls_kernel_path_mtu(struct openconnect_info *vpninfo)
+{
+	int mtu = 0;
+#if defined(IPPROTO_IPV6) && (defined(HAVE_IPV6_PATHMTU) || defined(IPV6_MTU))
+	socklen_t len;
+
+	if (vpninfo->dtls_fd < 0 || !vpninfo->peer_addr ||
+	    vpninfo->peer_addr->sa_family != AF_INET6)
+		return 0;
+
+#ifdef HAVE_IPV6_PATHMTU
+	{
+		struct ip6_mtuinfo mtuinfo;
+
+		len = sizeof(mtuinfo);
+		if (getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_PATHMTU,
+			       (void *)&mtuinfo, &len) >= 0)
+			mtu = mtuinfo.ip6m_mtu;
+	}
+#endif
+#ifdef IPV6_MTU
+	/* On a connected socket this is the path MTU too */
+	len = sizeof(mtu);
+	if (mtu <= 0 &&
+	    getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_MTU,
+		       (void *)&mtu, &len) < 0)
+		mtu = 0;
+#endif
+	/* As the MTU was worked out from the base MTU in the first place */
+	mtu -= 40 /* IPv6 header */ + 8 /* UDP header */ + DTLS_OVERHEAD;
+#endif
+	return mtu > 0 ? mtu : 0;
+}
+
+/* If the kernel knows the path won't take mtu_max, there's no point in
+ * probing above what it says will fit. Returns non-zero if it does. */
+static int dtls_mtu_clamp(struct openconnect_info *vpninfo)
+{
+	int mtu = dtls_kernel_path_mtu(vpninfo);
+
+	if (mtu <= vpninfo->mtu_min || mtu >= vpninfo->mtu_max)
+		return 0;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Kernel reports path MTU allows %d bytes\n"), mtu);
+	vpninfo->mtu_max = mtu;
+	return 1;
+}
+
+/* Use a new MTU, for the tun device and the packet pool too. Returns
+ * non-zero if the tun device couldn't take it. That happens once -U has
+ * dropped the privileges for it, or when the device is the script's or
+ * the caller's. Then the MTU stays as it was, and the search stops. */
+static int dtls_set_path_mtu(struct openconnect_info *vpninfo, int mtu)
+{
+	int prev_mtu = vpninfo->ip_info.mtu;
+	int ret = 0;
+
+	if (mtu == prev_mtu) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("No change in MTU after detection (was %d)\n"), prev_mtu);
+		return 0;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Detected MTU of %d bytes (was %d)\n"), mtu, prev_mtu);
+
+	/* alloc_pkt() resizes the packet pool when it sees the change */
+	vpninfo->ip_info.mtu = mtu;
+	if (tun_is_up(vpninfo))
+		ret = vpninfo->script_tun ? -EOPNOTSUPP : os_set_tun_mtu(vpninfo);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot change the tun device's MTU (%s); keeping %d bytes\n"),
+			     strerror(-ret), prev_mtu);
+		vpninfo->ip_info.mtu = prev_mtu;
+		/* Nor is there any point looking for a larger one */
+		vpninfo->mtu_ceiling = prev_mtu;
+		vpninfo->mtu_state = MTU_DONE;
+		timer_cancel(vpninfo, &vpninfo->mtu_timer);
+	}
+	return ret;
+}
+
+static void dtls_mtu_search_done(struct openconnect_info *vpninfo)
+{
+	vpninfo->mtu_state = MTU_DONE;
+	vpninfo->mtu_probe = 0;
+	vpninfo->mtu_probe_time = vpninfo->now + MTU_RAISE_INTERVAL * 1000ULL;
+	timer_set(vpninfo, &vpninfo->mtu_timer, vpninfo->mtu_probe_time);
+
+	if (!vpninfo->mtu_ok) {
+		/* Hm, we never got *anything* back successfully? */
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("No response to MTU probes; assuming negotiated MTU.\n"));
+		return;
+	}
+	dtls_set_path_mtu(vpninfo, vpninfo->mtu_min);
+}
+
+/* Move on to the next size to try, once the last one has been answered
+ * or given up on. Returns zero if there is nothing left to try. */
+static int dtls_mtu_next_probe(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->mtu_max <= vpninfo->mtu_min) {
+		dtls_mtu_search_done(vpninfo);
+		return 0;
+	}
+
+	/* The MTU in use is too big. Until the search is done, drop to
+	   the largest that has been seen to get through. */
+	if (vpninfo->mtu_ok && vpninfo->ip_info.mtu > vpninfo->mtu_max &&
+	    dtls_set_path_mtu(vpninfo, vpninfo->mtu_min))
+		return 0;
+
+	/* What the kernel says will fit is most likely right, so try that
+	   before carrying on with the binary search. */
+	if (dtls_mtu_clamp(vpninfo))
+		vpninfo->mtu_probe = vpninfo->mtu_max;
+	else
+		vpninfo->mtu_probe = (vpninfo->mtu_min + vpninfo->mtu_max + 1) / 2;
+	vpninfo->mtu_probes = 0;
+	return 1;
+}
+
+static void dtls_mtu_start_search(struct openconnect_info *vpninfo, int min, int max, int ok)
+{
+	vpninfo->mtu_state = MTU_SEARCH;
+	vpninfo->mtu_min = min;
+	vpninfo->mtu_max = max;
+	vpninfo->mtu_ok = ok;
+	dtls_mtu_clamp(vpninfo);
+	/* Common case will be that the MTU we have is correct.
+	   So try the largest first. Then search lower values. */
+	vpninfo->mtu_probe = vpninfo->mtu_max;
+	vpninfo->mtu_probes = 0;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Initiating MTU detection (min=%d, max=%d)\n"),
+		     min, vpninfo->mtu_max);
+}
+
+static int dtls_send_mtu_probe(struct openconnect_info *vpninfo)
+{
+	int len = vpninfo->mtu_probe + 1;
+	unsigned char *buf;
+	int ret;
+
+	/* A new ID for each size, so a late answer isn't taken for another */
+	if (!vpninfo->mtu_probes &&
+	    openconnect_random(vpninfo->mtu_probe_id, MTU_ID_SIZE) < 0)
+		return -EIO;
+
+	buf = calloc(1, len);
+	if (!buf)
+		return -ENOMEM;
+
+	buf[0] = AC_PKT_DPD_OUT;
+	memcpy(&buf[1], vpninfo->mtu_probe_id, MTU_ID_SIZE);
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Sending MTU DPD probe (%u bytes, min=%u, max=%u)\n"),
+		     vpninfo->mtu_probe, vpninfo->mtu_min, vpninfo->mtu_max);
+	ret = DTLS_SEND(vpninfo->dtls_ssl, buf, len);
+	free(buf);
+
+	if (ret != len) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Failed to send DPD request (%d %d)\n"),
+			     vpninfo->mtu_probe, ret);
+		return -EMSGSIZE;
+	}
+
+	vpninfo->mtu_probes++;
+	vpninfo->mtu_probe_time = vpninfo->now;
+	return 0;
+}
+
+/* Is this DPD response the answer to an MTU probe? */
+static int dtls_mtu_probe_resp(struct openconnect_info *vpninfo,
+			       unsigned char *buf, int len)
+{
+	if (vpninfo->mtu_state != MTU_SEARCH || !vpninfo->mtu_probes ||
+	    len < 1 + MTU_ID_SIZE ||
+	    memcmp(&buf[1], vpninfo->mtu_probe_id, MTU_ID_SIZE))
+		return 0;
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Received MTU DPD probe (%u bytes of %u)\n"),
+		     len - 1, vpninfo->mtu_probe);
+
+	vpninfo->mtu_min = vpninfo->mtu_probe;
+	vpninfo->mtu_ok = 1;
+	dtls_mtu_next_probe(vpninfo);
+	return 1;
+}
+
+static void dtls_mtu_mainloop(struct openconnect_info *vpninfo)
+{
+	uint64_t due;
+
+	if (vpninfo->mtu_state == MTU_DONE) {
+		if (vpninfo->ip_info.mtu >= vpninfo->mtu_ceiling) {
+			timer_cancel(vpninfo, &vpninfo->mtu_timer);
+			return;
+		}
+
+		due = vpninfo->mtu_probe_time;
+		if (vpninfo->now < due) {
+			timer_set(vpninfo, &vpninfo->mtu_timer, due);
+			return;
+		}
+		/* The MTU in use is known to get through */
+		dtls_mtu_start_search(vpninfo, vpninfo->ip_info.mtu,
+				      vpninfo->mtu_ceiling, 1);
+	}
+
+	if (vpninfo->mtu_state != MTU_SEARCH) {
+		timer_cancel(vpninfo, &vpninfo->mtu_timer);
+		return;
+	}
+
+	while (1) {
+		if (vpninfo->mtu_probes) {
+			due = vpninfo->mtu_probe_time + MTU_PROBE_TIMEOUT;
+			if (vpninfo->now < due) {
+				timer_set(vpninfo, &vpninfo->mtu_timer, due);
+				return;
+			}
+			/* Either it was too large, or it just got lost */
+			if (vpninfo->mtu_probes < MTU_MAX_PROBES) {
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("Timeout while waiting for DPD response; resending probe.\n"));
+			} else {
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("No response to %d-byte MTU probes\n"),
+					     vpninfo->mtu_probe);
+				vpninfo->mtu_max = vpninfo->mtu_probe - 1;
+				if (!dtls_mtu_next_probe(vpninfo))
+					return;
+			}
+		}
+
+		switch (dtls_send_mtu_probe(vpninfo)) {
+		case 0:
+			break;
+		case -EMSGSIZE:
+			/* If it didn't even manage to send, don't wait for it */
+			vpninfo->mtu_max = vpninfo->mtu_probe - 1;
+			if (!dtls_mtu_next_probe(vpninfo))
+				return;
+			continue;
+		default:
+			vpninfo->mtu_state = MTU_NONE;
+			timer_cancel(vpninfo, &vpninfo->mtu_timer);
+			return;
+		}
+	}
+}
+
+/* Start path MTU discovery on a newly established DTLS session. It is
+ * carried on by dtls_mainloop(). */
+void dtls_detect_mtu(struct openconnect_info *vpninfo)
+{
+	/* Already running, and a rehandshake doesn't change the path */
+	if (vpninfo->mtu_state != MTU_NONE)
+		return;
+
+	if (vpninfo->ip_info.mtu < 1+MTU_ID_SIZE)
+		return;
+
+	/* Any later searches go no higher than the MTU we start with */
+	if (!vpninfo->mtu_ceiling)
+		vpninfo->mtu_ceiling = vpninfo->ip_info.mtu;
+
+#if defined(OPENCONNECT_GNUTLS)
+	/* The MTU came down in an earlier DTLS session. Make sure GnuTLS
+	   will send probes for anything up to the ceiling. */
+	if (vpninfo->mtu_ceiling > vpninfo->ip_info.mtu) {
+#ifdef HAVE_GNUTLS_DTLS_SET_DATA_MTU
+		gnutls_dtls_set_data_mtu(vpninfo->dtls_ssl, vpninfo->mtu_ceiling + 1);
+#else
+		gnutls_dtls_set_mtu(vpninfo->dtls_ssl,
+				    vpninfo->mtu_ceiling + DTLS_OVERHEAD);
+#endif
+	}
+#endif
+
+	dtls_mtu_start_search(vpninfo, vpninfo->ip_info.mtu / 2,
+			      vpninfo->ip_info.mtu, 0);
+}
+
 int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	int work_done = 0;
@@ -237,23 +568,36 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	}
 
 	if (vpninfo->dtls_state == DTLS_SLEEPING) {
-		int when = vpninfo->new_dtls_started + vpninfo->dtls_attempt_period - time(NULL);
+		uint64_t due = vpninfo->new_dtls_started +
+			vpninfo->dtls_attempt_period * 1000ULL;
 
-		if (when <= 0) {
+		if (!vpninfo->new_dtls_started || vpninfo->now >= due) {
 			vpn_progress(vpninfo, PRG_DEBUG, _("Attempt new DTLS connection\n"));
 			connect_dtls_socket(vpninfo);
-		} else if ((when * 1000) < *timeout) {
-			*timeout = when * 1000;
+			if (vpninfo->dtls_state != DTLS_SLEEPING)
+				return 0;
+			/* It failed; try again after another period */
+			due = vpninfo->now + vpninfo->dtls_attempt_period * 1000ULL;
 		}
+		/* No period means no waiting to try again, or no retries at all */
+		if (vpninfo->dtls_attempt_period)
+			timer_set(vpninfo, &vpninfo->dtls_timer, due);
+		else
+			timer_cancel(vpninfo, &vpninfo->dtls_timer);
 		return 0;
 	}
 
 	while (1) {
-		int len = vpninfo->ip_info.mtu;
+		/* Big enough for the answer to a probe for a larger MTU */
+		int len = MAX(vpninfo->ip_info.mtu, vpninfo->mtu_probe);
 		unsigned char *buf;
 
+		if (vpninfo->dtls_pkt && vpninfo->dtls_pkt->alloc_len < len) {
+			free_pkt(vpninfo, vpninfo->dtls_pkt);
+			vpninfo->dtls_pkt = NULL;
+		}
 		if (!vpninfo->dtls_pkt) {
-			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->dtls_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->dtls_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -265,16 +609,18 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (len <= 0)
 			break;
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Received DTLS packet 0x%02x of %d bytes\n"),
-			     buf[0], len);
+		vpn_pkt_trace(vpninfo,
+			      _("Received DTLS packet 0x%02x of %d bytes\n"),
+			      buf[0], len);
+		oc_probe(dtls_rx, buf[0], len);
 
-		vpninfo->dtls_times.last_rx = time(NULL);
+		vpninfo->dtls_times.last_rx = vpninfo->now;
 
 		switch (buf[0]) {
 		case AC_PKT_DATA:
 			vpninfo->dtls_pkt->len = len - 1;
-			queue_packet(&vpninfo->incoming_queue, vpninfo->dtls_pkt);
+			queue_rx_packet(vpninfo, &vpninfo->data_stats.dtls,
+					vpninfo->dtls_pkt);
 			vpninfo->dtls_pkt = NULL;
 			work_done = 1;
 			break;
@@ -290,7 +636,8 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			continue;
 
 		case AC_PKT_DPD_RESP:
-			vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
+			if (!dtls_mtu_probe_resp(vpninfo, buf, len))
+				vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
 			break;
 
 		case AC_PKT_KEEPALIVE:
@@ -303,7 +650,8 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 					     _("Compressed DTLS packet received when compression not enabled\n"));
 				goto unknown_pkt;
 			}
-			decompress_and_queue_packet(vpninfo, vpninfo->dtls_compr,
+			decompress_and_queue_packet(vpninfo, &vpninfo->data_stats.dtls,
+						    vpninfo->dtls_compr,
 						    vpninfo->dtls_pkt->data, len - 1);
 			break;
 		default:
@@ -326,14 +674,16 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 	}
 
-	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
+	dtls_mtu_mainloop(vpninfo);
+
+	switch (keepalive_action(vpninfo, &vpninfo->dtls_times)) {
 	case KA_REKEY: {
 		int ret;
 
 		vpn_progress(vpninfo, PRG_INFO, _("DTLS rekey due\n"));
 
 		if (vpninfo->dtls_times.rekey_method == REKEY_SSL) {
-			time(&vpninfo->new_dtls_started);
+			vpninfo->new_dtls_started = vpninfo->now;
 			vpninfo->dtls_state = DTLS_CONNECTING;
 			ret = dtls_try_handshake(vpninfo);
 			if (ret) {
@@ -376,7 +726,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (DTLS_SEND(vpninfo->dtls_ssl, &magic_pkt, 1) != 1)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to send keepalive request. Expect disconnect\n"));
-		time(&vpninfo->dtls_times.last_tx);
+		vpninfo->dtls_times.last_tx = vpninfo->now;
 		work_done = 1;
 		break;
 
@@ -475,270 +825,13 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			return work_done;
 		}
 #endif
-		time(&vpninfo->dtls_times.last_tx);
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sent DTLS packet of %d bytes; DTLS send returned %d\n"),
-			     this->len, ret);
-		free(this);
+		vpninfo->dtls_times.last_tx = vpninfo->now;
+		record_tx_packet(vpninfo, &vpninfo->data_stats.dtls, this);
+		vpn_pkt_trace(vpninfo,
+			      _("Sent DTLS packet of %d bytes; DTLS send returned %d\n"),
+			      this->len, ret);
+		free_pkt(vpninfo, this);
 	}
 
 	return work_done;
 }
-
-#define MTU_ID_SIZE 4
-#define MTU_MAX_TRIES 10
-#define MTU_TIMEOUT_MS 2400
-
-/* Performs a binary search to detect MTU.
- * @buf: is preallocated with MTU size
- * @id: a unique ID for our DPD exchange
- *
- * Returns: new MTU or 0
- */
-static int detect_mtu_ipv4(struct openconnect_info *vpninfo, unsigned char *buf)
-{
-	int max, min, cur, ret, orig_min;
-	int tries = 0; /* Number of loops in bin search - includes resends */
-	char id[MTU_ID_SIZE];
-
-	cur = max = vpninfo->ip_info.mtu;
-	orig_min = min = vpninfo->ip_info.mtu/2;
-
-	vpn_progress(vpninfo, PRG_DEBUG,
-		     _("Initiating IPv4 MTU detection (min=%d, max=%d)\n"), min, max);
-
-	while (max > min) {
-		/* Common case will be that the negotiated MTU is correct.
-		   So try that first. Then search lower values. */
-		if (!tries)
-			cur = max;
-		else
-			cur = (min + max + 1) / 2;
-
-	next_rnd:
-		/* Generate unique ID */
-		if (openconnect_random(id, sizeof(id)) < 0)
-			goto fail;
-
-	next_nornd:
-		if (tries++ >= MTU_MAX_TRIES) {
-			if (orig_min == min) {
-				/* Hm, we never got *anything* back successfully? */
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Too long time in MTU detect loop; assuming negotiated MTU.\n"));
-				goto fail;
-			} else {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Too long time in MTU detect loop; MTU set to %d.\n"), min);
-				return min;
-			}
-		}
-
-		buf[0] = AC_PKT_DPD_OUT;
-		memcpy(&buf[1], id, sizeof(id));
-
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sending MTU DPD probe (%u bytes, min=%u, max=%u)\n"), cur, min, max);
-		ret = openconnect_dtls_write(vpninfo, buf, cur+1);
-		if (ret != cur+1) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to send DPD request (%d %d)\n"), cur, ret);
-			/* If it didn't even manage to send, it took basically zero time.
-			   So don't count it as a 'try' for the purpose of our timeout. */
-			max = --cur;
-			tries--;
-			goto next_rnd;
-		}
-
-	reread:
-		memset(buf, 0, sizeof(id)+1);
-
-		ret = openconnect_dtls_read(vpninfo, buf, cur+1, MTU_TIMEOUT_MS);
-		if (ret > 0 && (buf[0] != AC_PKT_DPD_RESP || memcmp(&buf[1], id, sizeof(id)) != 0)) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received unexpected packet (%.2x) in MTU detection; skipping.\n"), (unsigned)buf[0]);
-			goto reread;
-		}
-
-		/* Timeout. Either it was too large, or it just got lost. Try again
-		 * with a smaller value, but don't actually reduce 'max' because we
-		 * don't *know* it was too large. */
-		if (ret == -ETIMEDOUT) {
-			int next = (min + cur + 1) / 2;
-
-			if (next < cur && next > min) {
-				vpn_progress(vpninfo, PRG_DEBUG,
-					     _("Timeout while waiting for DPD response; trying %d\n"),
-					     next);
-				cur = next;
-				/* We don't set 'max' because we don't *know* it won't get through */
-				goto next_rnd;
-			} else {
-				vpn_progress(vpninfo, PRG_DEBUG,
-					     _("Timeout while waiting for DPD response; resending probe.\n"));
-				goto next_nornd;
-			}
-		}
-
-		if (ret <= 0) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to recv DPD request (%d)\n"), cur);
-			goto fail;
-		}
-
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Received MTU DPD probe (%u bytes of %u)\n"), ret, cur);
-
-		/* If we reached the max, success */
-		if (cur == max)
-			break;
-
-		min = cur;
-	}
-
-	return cur;
- fail:
- 	return 0;
-}
-
-#if defined(IPPROTO_IPV6)
-
-/* This symbol is missing in glibc < 2.22 (bug 18643). */
-#if defined(__linux__) && !defined(HAVE_IPV6_PATHMTU)
-# define HAVE_IPV6_PATHMTU 1
-# define IPV6_PATHMTU 61
-#endif
-
-/* Verifies whether current MTU is ok, or detects new MTU using IPv6's ICMP6 messages
- * @buf: is preallocated with MTU size
- * @id: a unique ID for our DPD exchange
- *
- * Returns: new MTU or 0
- */
-static int detect_mtu_ipv6(struct openconnect_info *vpninfo, unsigned char *buf)
-{
-	int max, cur, ret;
-	int max_resends = 5; /* maximum number of resends */
-	char id[MTU_ID_SIZE];
-	unsigned re_use_rnd_val = 0;
-
-	cur = max = vpninfo->ip_info.mtu;
-
-	vpn_progress(vpninfo, PRG_DEBUG,
-	     _("Initiating IPv6 MTU detection\n"));
-
-	while(max_resends-- > 0) {
-		/* generate unique ID */
-		if (!re_use_rnd_val) {
-			if (openconnect_random(id, sizeof(id)) < 0)
-				goto fail;
-		} else {
-			re_use_rnd_val = 0;
-		}
-
-		buf[0] = AC_PKT_DPD_OUT;
-		memcpy(&buf[1], id, sizeof(id));
-
-		vpn_progress(vpninfo, PRG_TRACE,
-		     _("Sending MTU DPD probe (%u bytes)\n"), cur);
-		ret = openconnect_dtls_write(vpninfo, buf, cur+1);
-		if (ret != cur+1) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Failed to send DPD request (%d)\n"), cur);
-			goto mtu6_fail;
-		}
-
- reread:
-		memset(buf, 0, sizeof(id)+1);
-		ret = openconnect_dtls_read(vpninfo, buf, cur+1, MTU_TIMEOUT_MS);
-
-		/* timeout, probably our original request was lost,
-		 * let's resend the DPD */
-		if (ret == -ETIMEDOUT) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Timeout while waiting for DPD response; resending probe.\n"));
-			re_use_rnd_val = 1;
-			continue;
-		}
-
-		/* something unexpected was received, let's ignore it */
-		if (ret > 0 && (buf[0] != AC_PKT_DPD_RESP || memcmp(&buf[1], id, sizeof(id)) != 0)) {
-			vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received unexpected packet (%.2x) in MTU detection; skipping.\n"), (unsigned)buf[0]);
-			goto reread;
-		}
-
-		vpn_progress(vpninfo, PRG_TRACE,
-		     _("Received MTU DPD probe (%u bytes)\n"), cur);
-
-		/* we received what we expected, move on */
-		break;
-	}
-
-#ifdef HAVE_IPV6_PATHMTU
-	/* If we received back our DPD packet, do nothing; otherwise,
-	 * attempt to get MTU from the ICMP6 packet we received */
-	if (ret <= 0) {
-		struct ip6_mtuinfo mtuinfo;
-		socklen_t len = sizeof(mtuinfo);
-		max = 0;
-		vpn_progress(vpninfo, PRG_ERR,
-		     _("Failed to recv DPD request (%d)\n"), cur);
- mtu6_fail:
-		if (getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_PATHMTU, &mtuinfo, &len) >= 0) {
-			max = mtuinfo.ip6m_mtu;
-			if (max >= 0 && max < cur) {
-				cur = dtls_set_mtu(vpninfo, max) - /*ipv6*/40 - /*udp*/20 - /*oc dtls*/1;
-			}
-		}
-	}
-#else
- mtu6_fail:
-#endif
-
-	return cur;
- fail:
-	return 0;
-}
-#endif
-
-void dtls_detect_mtu(struct openconnect_info *vpninfo)
-{
-	int mtu = vpninfo->ip_info.mtu;
-	int prev_mtu = vpninfo->ip_info.mtu;
-	unsigned char *buf;
-
-	if (vpninfo->ip_info.mtu < 1+MTU_ID_SIZE)
-		return;
-
-	/* detect MTU */
-	buf = calloc(1, 1 + vpninfo->ip_info.mtu);
-	if (!buf) {
-		vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
-		return;
-	}
-
-	if (vpninfo->peer_addr->sa_family == AF_INET) { /* IPv4 */
-		mtu = detect_mtu_ipv4(vpninfo, buf);
-		if (mtu == 0)
-			goto skip_mtu;
-#if defined(IPPROTO_IPV6)
-	} else if (vpninfo->peer_addr->sa_family == AF_INET6) { /* IPv6 */
-		mtu = detect_mtu_ipv6(vpninfo, buf);
-		if (mtu == 0)
-			goto skip_mtu;
-#endif
-	}
-
-	vpninfo->ip_info.mtu = mtu;
-	if (prev_mtu != vpninfo->ip_info.mtu) {
-		vpn_progress(vpninfo, PRG_INFO,
-		     _("Detected MTU of %d bytes (was %d)\n"), vpninfo->ip_info.mtu, prev_mtu);
-	} else {
-		vpn_progress(vpninfo, PRG_DEBUG,
-		     _("No change in MTU after detection (was %d)\n"), prev_mtu);
-	}
-
- skip_mtu:
-	free(buf);
-}
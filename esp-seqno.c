@@ -26,11 +26,19 @@
 
 #define DTLS_EMPTY_BITMAP		(0xFFFFFFFFFFFFFFFFULL)
 
-/* Eventually we're going to have to have more than one incoming ESP
-   context at a time, to allow for the overlap period during a rekey.
-   So pass the 'esp' even though for now it's redundant. */
-int verify_packet_seqno(struct openconnect_info *vpninfo,
-			struct esp *esp, uint32_t seq)
+/* The ESP worker threads pass a NULL vpninfo, since they mustn't call
+   the progress callback; nothing is logged for them. */
+#define seqno_progress(v, lvl, ...) do {				\
+	if (v)								\
+		vpn_progress(v, lvl, __VA_ARGS__);			\
+	} while(0)
+#define seqno_trace(v, ...) do {					\
+	if (v)								\
+		vpn_pkt_trace(v, __VA_ARGS__);				\
+	} while(0)
+
+static int check_packet_seqno(struct openconnect_info *vpninfo,
+			      struct esp *esp, uint32_t seq)
 {
 	/*
 	 * For incoming, esp->seq is the next *expected* packet, being
@@ -57,9 +65,9 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 		 * happens, we'll do the right thing and just not accept any
 		 * newer packets. Someone needs to start a new epoch. */
 		esp->seq++;
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Accepting expected ESP packet with seq %u\n"),
-			     seq);
+		seqno_trace(vpninfo,
+			    _("Accepting expected ESP packet with seq %u\n"),
+			    seq);
 		return 0;
 	} else if (seq > esp->seq) {
 		/* The packet we were expecting has gone missing; this one is newer.
@@ -87,9 +95,9 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 			esp->seq_backlog <<= delta + 1;
 			esp->seq_backlog |= (1ULL << delta) - 1;
 		}
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Accepting later-than-expected ESP packet with seq %u (expected %" PRIu64 ")\n"),
-			     seq, esp->seq);
+		seqno_trace(vpninfo,
+			    _("Accepting later-than-expected ESP packet with seq %u (expected %" PRIu64 ")\n"),
+			    seq, esp->seq);
 		esp->seq = (uint64_t)seq + 1;
 		return 0;
 	} else {
@@ -99,16 +107,16 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 		/* delta==0 is the overflow case where esp->seq is 0x100000000 and seq is 0 */
 		if (delta > 65 || delta == 0) {
 			/* Too old. We can't know if it's a replay. */
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Discarding ancient ESP packet with seq %u (expected %" PRIu64 ")\n"),
-				     seq, esp->seq);
+			seqno_progress(vpninfo, PRG_DEBUG,
+				       _("Discarding ancient ESP packet with seq %u (expected %" PRIu64 ")\n"),
+				       seq, esp->seq);
 			return -EINVAL;
 		} else if (delta == 1) {
 			/* Not in the bitmask since it is by definition already received. */
 		replayed:
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Discarding replayed ESP packet with seq %u\n"),
-				     seq);
+			seqno_progress(vpninfo, PRG_DEBUG,
+				       _("Discarding replayed ESP packet with seq %u\n"),
+				       seq);
 			return -EINVAL;
 		} else {
 			/* Within the backlog window, so we remember whether we've seen it or not. */
@@ -118,11 +126,29 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 				goto replayed;
 
 			esp->seq_backlog &= ~mask;
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Accepting out-of-order ESP packet with seq %u (expected %" PRIu64 ")\n"),
-				     seq, esp->seq);
+			seqno_trace(vpninfo,
+				    _("Accepting out-of-order ESP packet with seq %u (expected %" PRIu64 ")\n"),
+				    seq, esp->seq);
 			return 0;
 		}
 	}
 }
 
+/* There are two incoming ESP contexts, so that packets on the old SA
+   are still accepted for a while after a rekey. The caller says which
+   one's replay window to check.
+
+   The ESP worker threads all check against the same window, so it is
+   held under a simple spinlock; the critical section is tiny. */
+int verify_packet_seqno(struct openconnect_info *vpninfo,
+			struct esp *esp, uint32_t seq)
+{
+	int ret;
+
+	while (__atomic_test_and_set(&esp->seq_lock, __ATOMIC_ACQUIRE))
+		;
+	ret = check_packet_seqno(vpninfo, esp, seq);
+	__atomic_clear(&esp->seq_lock, __ATOMIC_RELEASE);
+
+	return ret;
+}
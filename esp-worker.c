@@ -0,0 +1,542 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "openconnect-internal.h"
+#include "lzo.h"
+
+/*
+ * With --tun-queues=N the tun device is created with IFF_MULTI_QUEUE,
+ * and os_setup_tun() opens all N queues while it still can, leaving the
+ * extra ones detached. The main thread keeps serving the first queue
+ * from the mainloop as usual. Once ESP is established, each of the
+ * other N-1 queues is attached and gets a worker thread which reads
+ * packets from its queue, encrypts them and sends them on the main ESP
+ * socket. When ESP goes down they are detached again, so that the kernel
+ * doesn't leave packets on queues which nobody reads.
+ *
+ * Everything from the server still arrives on that one socket, since
+ * it's a single flow which the kernel would only ever steer to one
+ * socket anyway. The main thread receives it, and hands datagrams on
+ * the current SA to the workers and itself in turn. Each worker has a
+ * ring of buffers which only the main thread fills and only the worker
+ * empties; it decrypts what it finds there into its own tun queue.
+ * Whatever isn't on the current SA, like the last of the old SA after
+ * a rekey, stays with the main thread.
+ *
+ * Each worker has its own cipher contexts. The only state shared with
+ * the main thread is the outbound sequence number, which is allocated
+ * atomically, the replay window, which verify_packet_seqno() locks,
+ * the rings, and the drop counters. Everything else the workers have
+ * to tell the main thread, like when they last sent or received, they
+ * keep in struct esp_worker for it to collect. The workers never call
+ * the progress callback.
+ */
+
+/* Packets handled per direction before polling again */
+#define WORKER_BURST 64
+
+/* Received datagrams which can wait for the workers, between them.
+ * Since the replay window only reaches 64 packets back, a worker which
+ * had any more than that to catch up on would find them too old. */
+#define WORKER_RXQ 64
+
+struct esp_worker {
+	struct openconnect_info *vpninfo;
+	pthread_t thread;
+	int started;
+
+	int tun_fd;	/* From vpninfo->tun_queue_fds[], attached or -1 */
+	int udp_fd;	/* The main ESP socket; not ours to close */
+	int mtu;
+
+	struct esp esp_out;
+	struct esp esp_in;
+	struct esp *replay;	/* The window in vpninfo->esp_in[] */
+
+	struct pkt *pkt;
+	struct pkt *lzo_pkt;
+
+	/* Only the main thread advances rxq_head, only the worker rxq_tail */
+	struct pkt *rxq[WORKER_RXQ];
+	unsigned int rxq_len;	/* A power of two */
+	unsigned int rxq_head, rxq_tail;
+	int rxq_fd;	/* eventfd, written when the ring stops being empty */
+	struct oc_stats stats;	/* Collected by the main thread */
+	uint64_t last_tx, last_rx;	/* Ditto, from timer_now() */
+	int send_err;			/* Ditto, the last errno from send() */
+	int encrypt_err;		/* Ditto, from encrypt_esp_packet() */
+	unsigned int encrypt_errs;	/* Ditto, how many packets failed */
+};
+
+static void esp_worker_tx(struct esp_worker *w)
+{
+	struct openconnect_info *vpninfo = w->vpninfo;
+	struct pkt *pkt = w->pkt;
+	int i, len;
+
+	for (i = 0; i < WORKER_BURST; i++) {
+		len = read(w->tun_fd, pkt->data, w->mtu);
+		if (len <= 0)
+			break;
+
+		pkt->len = len;
+		__atomic_fetch_add(&w->stats.tx_pkts, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->stats.tx_bytes, len, __ATOMIC_RELAXED);
+
+		len = encrypt_esp_packet(vpninfo, &w->esp_out, pkt);
+		if (len < 0) {
+			/* No vpn_progress() from here; see esp_collect_worker_times() */
+			if (len != -ENOSPC) {
+				__atomic_store_n(&w->encrypt_err, -len, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&w->encrypt_errs, 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+
+		/* As in esp_mainloop(), a full socket buffer drops the packet */
+		if (send(w->udp_fd, (void *)esp_pkt_hdr(vpninfo, pkt), len, 0) >= 0)
+			continue;
+		if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK)
+			count_drop(vpninfo, sock_full);
+		else
+			__atomic_store_n(&w->send_err, errno, __ATOMIC_RELAXED);
+	}
+	if (i)
+		__atomic_store_n(&w->last_tx, timer_now(), __ATOMIC_RELAXED);
+}
+
+/* As esp_decrypt_rx(), without the parts which belong to the main
+ * thread. The worker's SA is the current one, since a rekey stops the
+ * workers, and ESP is established before they start, so a probe reply
+ * only needs to be kept out of the tun device. Returns the next header
+ * type, or zero; *authentic says whether the packet was the server's. */
+static int esp_worker_decrypt(struct esp_worker *w, struct pkt *pkt, int len,
+			      int *authentic)
+{
+	struct openconnect_info *vpninfo = w->vpninfo;
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	int i, padlen, next_hdr;
+
+	if (len <= vpninfo->esp_hdrlen + vpninfo->esp_icvlen)
+		return 0;
+
+	oc_probe(esp_rx, ntohl(hdr->spi), ntohl(hdr->seq), len);
+
+	len -= vpninfo->esp_hdrlen + vpninfo->esp_icvlen;
+	pkt->len = len;
+
+	if (hdr->spi != w->esp_in.spi) {
+		count_drop(vpninfo, unknown_spi);
+		return 0;
+	}
+	if (decrypt_esp_packet(vpninfo, &w->esp_in, pkt)) {
+		count_drop(vpninfo, bad_hmac);
+		return 0;
+	}
+	if (vpninfo->esp_replay_protect &&
+	    verify_packet_seqno(NULL, w->replay, ntohl(hdr->seq))) {
+		count_drop(vpninfo, replay);
+		return 0;
+	}
+
+	next_hdr = pkt->data[len - 1];
+	if (next_hdr != 0x04 && next_hdr != 0x29 && next_hdr != 0x05)
+		return 0;
+
+	padlen = pkt->data[len - 2];
+	if (len <= 2 + padlen) {
+		count_drop(vpninfo, bad_padding);
+		return 0;
+	}
+	pkt->len = len - 2 - padlen;
+	if (!ENC_IS_AEAD(vpninfo->esp_enc)) {
+		for (i = 0; i < padlen; i++) {
+			if (pkt->data[pkt->len + i] != i + 1) {
+				count_drop(vpninfo, bad_padding);
+				return 0;
+			}
+		}
+	}
+
+	oc_probe(esp_decrypt, ntohl(hdr->spi), ntohl(hdr->seq), pkt->len);
+	*authentic = 1;
+
+	if (vpninfo->proto->udp_catch_probe &&
+	    vpninfo->proto->udp_catch_probe(vpninfo, pkt))
+		return 0;
+	return next_hdr;
+}
+
+/* Decrypt what the main thread has queued for us. Returns non-zero if
+ * there is more to do than fits in one burst. */
+static int esp_worker_rx(struct esp_worker *w)
+{
+	struct openconnect_info *vpninfo = w->vpninfo;
+	struct pkt *pkt, *out;
+	unsigned int head, tail = w->rxq_tail;
+	uint64_t wakeups;
+	int i, next_hdr, authentic = 0;
+
+	/* Clear the wakeup before looking, so that none is missed */
+	if (read(w->rxq_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+		return 0;
+
+	for (i = 0; i < WORKER_BURST; i++) {
+		head = __atomic_load_n(&w->rxq_head, __ATOMIC_SEQ_CST);
+		if (tail == head)
+			break;
+
+		pkt = w->rxq[tail & (w->rxq_len - 1)];
+		next_hdr = esp_worker_decrypt(w, pkt, pkt->len, &authentic);
+		out = pkt;
+		if (next_hdr == 0x05) {
+			int outlen = w->mtu;
+
+			out = w->lzo_pkt;
+			if (av_lzo1x_decode(out->data, &outlen, pkt->data, &pkt->len) ||
+			    pkt->len) {
+				count_drop(vpninfo, decompress);
+				next_hdr = 0;
+			}
+			out->len = w->mtu - outlen;
+		}
+
+		if (next_hdr && write(w->tun_fd, out->data, out->len) >= 0) {
+			__atomic_fetch_add(&w->stats.rx_pkts, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&w->stats.rx_bytes, out->len, __ATOMIC_RELAXED);
+		}
+
+		/* The buffer goes back to the main thread */
+		__atomic_store_n(&w->rxq_tail, ++tail, __ATOMIC_SEQ_CST);
+	}
+	/* The main thread may be asleep, with vpninfo->now going stale */
+	if (authentic)
+		__atomic_store_n(&w->last_rx, timer_now(), __ATOMIC_RELAXED);
+
+	return i == WORKER_BURST;
+}
+
+/* Called by the main thread for each datagram received on the ESP
+ * socket. Returns non-zero if a worker has taken it (or it was dropped
+ * because that worker is too far behind), in which case the caller is
+ * done with it. Otherwise the main thread is to decrypt it itself. */
+int esp_worker_queue_rx(struct openconnect_info *vpninfo, struct pkt *pkt, int len)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	struct esp_worker *w;
+	struct pkt *slot;
+	unsigned int head, tail;
+	uint64_t one = 1;
+	int n;
+
+	if (len <= vpninfo->esp_hdrlen + vpninfo->esp_icvlen ||
+	    hdr->spi != vpninfo->esp_in[vpninfo->current_esp_in].spi)
+		return 0;
+
+	/* The main thread takes its turn too */
+	n = vpninfo->esp_worker_next++ % (vpninfo->nr_esp_workers + 1);
+	if (n == vpninfo->nr_esp_workers)
+		return 0;
+
+	w = &vpninfo->esp_workers[n];
+	if (len > w->mtu + vpninfo->pkt_trailer + vpninfo->esp_hdrlen)
+		return 0;
+
+	/* Sequentially consistent, against the worker's store of rxq_tail
+	   and load of rxq_head, so that one of us sees the other's */
+	head = w->rxq_head;
+	tail = __atomic_load_n(&w->rxq_tail, __ATOMIC_SEQ_CST);
+	if (head - tail >= w->rxq_len) {
+		count_drop(vpninfo, queue_full);
+		return 1;
+	}
+
+	slot = w->rxq[head & (w->rxq_len - 1)];
+	memcpy(esp_pkt_hdr(vpninfo, slot), hdr, len);
+	slot->len = len;
+	__atomic_store_n(&w->rxq_head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (head == tail &&
+	    write(w->rxq_fd, &one, sizeof(one)) != sizeof(one))
+		vpn_perror(vpninfo, _("Wake ESP worker"));
+	return 1;
+}
+
+static void *esp_worker_thread(void *arg)
+{
+	struct esp_worker *w = arg;
+	struct pollfd pfd[3];
+	int more_rx = 0;
+
+	pfd[0].fd = w->tun_fd;
+	pfd[1].fd = w->rxq_fd;
+	pfd[2].fd = w->vpninfo->esp_worker_stop_fd;
+	pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+
+	while (1) {
+		/* The wakeup for a ring left non-empty has been used up */
+		if (poll(pfd, 3, more_rx ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[2].revents)
+			break;
+		if (pfd[0].revents & POLLIN)
+			esp_worker_tx(w);
+		if (more_rx || (pfd[1].revents & POLLIN))
+			more_rx = esp_worker_rx(w);
+	}
+	return NULL;
+}
+
+/* Attach a queue to the tun device, or detach it. Unlike opening it,
+   this works after privileges have been dropped. */
+static int tun_queue_attach(struct openconnect_info *vpninfo, int fd, int attach)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+	if (ioctl(fd, TUNSETQUEUE, (void *)&ifr) < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     attach ? _("Failed to attach tun queue (TUNSETQUEUE): %s\n") :
+			     _("Failed to detach tun queue (TUNSETQUEUE): %s\n"),
+			     strerror(errno));
+		return -EIO;
+	}
+	return 0;
+}
+
+static int esp_setup_worker(struct openconnect_info *vpninfo,
+			    struct esp_worker *w, int tun_fd)
+{
+	int i, len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+
+	w->mtu = vpninfo->ip_info.mtu;
+	w->pkt = malloc(sizeof(struct pkt) + len);
+	w->lzo_pkt = malloc(sizeof(struct pkt) + len);
+	if (!w->pkt || !w->lzo_pkt)
+		return -ENOMEM;
+
+	/* An equal share of WORKER_RXQ, counting the main thread's */
+	w->rxq_len = WORKER_RXQ;
+	while (w->rxq_len > 1 &&
+	       w->rxq_len * (vpninfo->nr_esp_workers + 1) > WORKER_RXQ)
+		w->rxq_len >>= 1;
+	for (i = 0; i < w->rxq_len; i++) {
+		w->rxq[i] = malloc(sizeof(struct pkt) + len);
+		if (!w->rxq[i])
+			return -ENOMEM;
+	}
+
+	w->rxq_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (w->rxq_fd < 0) {
+		vpn_perror(vpninfo, _("eventfd"));
+		return -EIO;
+	}
+
+	if (tun_queue_attach(vpninfo, tun_fd, 1))
+		return -EIO;
+	w->tun_fd = tun_fd;
+
+	w->udp_fd = vpninfo->dtls_fd;
+
+	w->replay = &vpninfo->esp_in[vpninfo->current_esp_in];
+	if (clone_esp_ciphers(vpninfo, &w->esp_out, &vpninfo->esp_out, 0) ||
+	    clone_esp_ciphers(vpninfo, &w->esp_in,
+			      &vpninfo->esp_in[vpninfo->current_esp_in], 1))
+		return -EIO;
+
+	if (pthread_create(&w->thread, NULL, esp_worker_thread, w))
+		return -EIO;
+
+	w->started = 1;
+	return 0;
+}
+
+int esp_start_workers(struct openconnect_info *vpninfo)
+{
+	int i, ret, nr = vpninfo->nr_tun_queue_fds;
+	int sndbuf, cur;
+	socklen_t len = sizeof(cur);
+
+	if (vpninfo->esp_workers || nr < 1)
+		return 0;
+
+	/* Room for a burst from each of the workers, and from us */
+	sndbuf = vpninfo->ip_info.mtu * 2 * WORKER_BURST * (nr + 1);
+	if (!getsockopt(vpninfo->dtls_fd, SOL_SOCKET, SO_SNDBUF, (void *)&cur, &len) &&
+	    cur < sndbuf)
+		setsockopt(vpninfo->dtls_fd, SOL_SOCKET, SO_SNDBUF,
+			   (void *)&sndbuf, sizeof(sndbuf));
+
+	vpninfo->esp_worker_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (vpninfo->esp_worker_stop_fd < 0) {
+		vpn_perror(vpninfo, _("eventfd"));
+		return -EIO;
+	}
+
+	vpninfo->esp_workers = calloc(nr, sizeof(*vpninfo->esp_workers));
+	if (!vpninfo->esp_workers) {
+		close(vpninfo->esp_worker_stop_fd);
+		vpninfo->esp_worker_stop_fd = -1;
+		return -ENOMEM;
+	}
+	vpninfo->nr_esp_workers = nr;
+
+	for (i = 0; i < nr; i++) {
+		vpninfo->esp_workers[i].vpninfo = vpninfo;
+		vpninfo->esp_workers[i].tun_fd = -1;
+		vpninfo->esp_workers[i].udp_fd = -1;
+		vpninfo->esp_workers[i].rxq_fd = -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = esp_setup_worker(vpninfo, &vpninfo->esp_workers[i],
+				       vpninfo->tun_queue_fds[i]);
+		if (ret) {
+			esp_stop_workers(vpninfo);
+			return ret;
+		}
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("Started %d ESP worker threads for tun queues\n"), nr);
+	return 0;
+}
+
+static void add_stats(struct oc_stats *to, const struct oc_stats *from)
+{
+	to->tx_pkts += from->tx_pkts;
+	to->tx_bytes += from->tx_bytes;
+	to->rx_pkts += from->rx_pkts;
+	to->rx_bytes += from->rx_bytes;
+}
+
+/* Fold the workers' packet counts into vpninfo->stats, and into the ESP
+   counters since that's all the workers do */
+void esp_collect_worker_stats(struct openconnect_info *vpninfo)
+{
+	struct esp_worker *w;
+	struct oc_stats s;
+	int i;
+
+	for (i = 0; i < vpninfo->nr_esp_workers; i++) {
+		w = &vpninfo->esp_workers[i];
+
+		s.tx_pkts = __atomic_exchange_n(&w->stats.tx_pkts, 0, __ATOMIC_RELAXED);
+		s.tx_bytes = __atomic_exchange_n(&w->stats.tx_bytes, 0, __ATOMIC_RELAXED);
+		s.rx_pkts = __atomic_exchange_n(&w->stats.rx_pkts, 0, __ATOMIC_RELAXED);
+		s.rx_bytes = __atomic_exchange_n(&w->stats.rx_bytes, 0, __ATOMIC_RELAXED);
+		add_stats(&vpninfo->stats, &s);
+		add_stats(&vpninfo->data_stats.esp, &s);
+	}
+}
+
+/* Traffic on the workers' queues counts for DPD and keepalives too. The
+   main thread calls this before it looks at vpninfo->dtls_times, which
+   only it ever writes. */
+void esp_collect_worker_times(struct openconnect_info *vpninfo)
+{
+	struct keepalive_info *ka = &vpninfo->dtls_times;
+	struct esp_worker *w;
+	uint64_t t;
+	unsigned int n;
+	int i, err;
+
+	for (i = 0; i < vpninfo->nr_esp_workers; i++) {
+		w = &vpninfo->esp_workers[i];
+
+		t = __atomic_load_n(&w->last_rx, __ATOMIC_RELAXED);
+		if (t > ka->last_rx)
+			ka->last_rx = t;
+		t = __atomic_load_n(&w->last_tx, __ATOMIC_RELAXED);
+		if (t > ka->last_tx)
+			ka->last_tx = t;
+
+		err = __atomic_exchange_n(&w->send_err, 0, __ATOMIC_RELAXED);
+		if (err)
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to send ESP packet: %s\n"),
+				     strerror(err));
+
+		n = __atomic_exchange_n(&w->encrypt_errs, 0, __ATOMIC_RELAXED);
+		if (n) {
+			err = __atomic_load_n(&w->encrypt_err, __ATOMIC_RELAXED);
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to encrypt %u ESP packets: %s\n"),
+				     n, strerror(err));
+		}
+	}
+}
+
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+	struct esp_worker *w;
+	uint64_t one = 1;
+	int i, j;
+
+	if (!vpninfo->esp_workers)
+		return;
+
+	if (write(vpninfo->esp_worker_stop_fd, &one, sizeof(one)) != sizeof(one))
+		vpn_perror(vpninfo, _("Stop ESP workers"));
+
+	for (i = 0; i < vpninfo->nr_esp_workers; i++) {
+		w = &vpninfo->esp_workers[i];
+		if (w->started)
+			pthread_join(w->thread, NULL);
+	}
+
+	esp_collect_worker_stats(vpninfo);
+	esp_collect_worker_times(vpninfo);
+
+	for (i = 0; i < vpninfo->nr_esp_workers; i++) {
+		w = &vpninfo->esp_workers[i];
+		/* Only the tun device can close the queue */
+		if (w->tun_fd != -1)
+			tun_queue_attach(vpninfo, w->tun_fd, 0);
+		if (w->rxq_fd != -1)
+			close(w->rxq_fd);
+		destroy_esp_ciphers(&w->esp_out);
+		destroy_esp_ciphers(&w->esp_in);
+		free(w->pkt);
+		free(w->lzo_pkt);
+		for (j = 0; j < WORKER_RXQ; j++)
+			free(w->rxq[j]);
+	}
+
+	close(vpninfo->esp_worker_stop_fd);
+	vpninfo->esp_worker_stop_fd = -1;
+	free(vpninfo->esp_workers);
+	vpninfo->esp_workers = NULL;
+	vpninfo->nr_esp_workers = 0;
+}
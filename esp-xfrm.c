@@ -0,0 +1,687 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/xfrm.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * With --esp-offload, once ESP is established the current SAs are
+ * installed in the kernel over NETLINK_XFRM, along with tunnel mode
+ * policies which send everything from the VPN address through them.
+ * The ESP socket is switched to UDP_ENCAP_ESPINUDP, so the kernel also
+ * takes what arrives on it, and the tun device just sits idle.
+ *
+ * Everything else stays here. For a rekey the SAs are taken out of the
+ * kernel again, with their sequence numbers and the replay window copied
+ * back into vpninfo, and esp_mainloop() carries on as usual until it puts
+ * them back. DPD probes are still sent from here, but on sequence numbers
+ * set aside in the kernel's outbound SA, so the SAs can stay where they
+ * are. While they're installed, the kernel's packet counters stand in for
+ * the timestamps that DPD relies upon, and see the replies too.
+ */
+
+/* Legacy XFRM replay state has a 32-bit bitmap */
+#define XFRM_REPLAY_WINDOW 32
+
+/* Sequence numbers set aside for DPD probes; more than any protocol sends */
+#define XFRM_PROBE_SEQS 4
+
+/* How far the kernel's outbound sequence number is moved on to make room
+   for them. No further than the replay window, so that if a packet the
+   kernel sent just before arrives after one it sent just after, the peer
+   won't take it for a replay. */
+#define XFRM_SEQ_GAP XFRM_REPLAY_WINDOW
+
+struct esp_xfrm {
+	int fd;				/* NETLINK_XFRM */
+	uint32_t nlseq;
+
+	int family;			/* Of the outer addresses */
+	xfrm_address_t local, remote;
+	uint16_t local_port, remote_port;
+	uint32_t reqid;
+
+	/* The SAs which were installed, to put their state back in */
+	struct esp *esp_in, *esp_out;
+	uint32_t spi_in, spi_out;
+
+	/* Inner selectors for the policies; Legacy IP and IPv6 */
+	struct xfrm_selector sel[2];
+	int nr_sel;
+
+	struct xfrm_lifetime_cur rx, tx;
+	uint64_t polled;	/* vpninfo->now when last polled */
+};
+
+struct xfrm_msg {
+	struct nlmsghdr nlh;
+	char buf[2048];
+};
+
+static void *xfrm_msg_init(struct xfrm_msg *msg, int type, int flags, int len)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->nlh.nlmsg_len = NLMSG_LENGTH(len);
+	msg->nlh.nlmsg_type = type;
+	msg->nlh.nlmsg_flags = NLM_F_REQUEST | flags;
+	return NLMSG_DATA(&msg->nlh);
+}
+
+/* Append an attribute of 'len' bytes, and return where to put it */
+static void *xfrm_msg_attr(struct xfrm_msg *msg, int type, int len)
+{
+	struct nlattr *nla = (void *)((char *)msg + NLMSG_ALIGN(msg->nlh.nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	msg->nlh.nlmsg_len = NLMSG_ALIGN(msg->nlh.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return (char *)nla + NLA_HDRLEN;
+}
+
+/* Send a request and wait for the answer. Returns zero or a negative errno
+ * from the kernel. For a GET request, the answer is left in 'reply'. */
+static int xfrm_talk(struct esp_xfrm *x, struct xfrm_msg *msg, struct xfrm_msg *reply)
+{
+	struct xfrm_msg ack;
+	int len;
+
+	if (!reply)
+		reply = &ack;
+
+	msg->nlh.nlmsg_seq = ++x->nlseq;
+	if (send(x->fd, msg, msg->nlh.nlmsg_len, 0) < 0)
+		return -errno;
+
+	while (1) {
+		len = recv(x->fd, reply, sizeof(*reply), 0);
+		if (len < 0)
+			return -errno;
+		if (len < sizeof(reply->nlh) || reply->nlh.nlmsg_len > len)
+			return -EIO;
+		/* Something left over from an earlier request */
+		if (reply->nlh.nlmsg_seq != msg->nlh.nlmsg_seq)
+			continue;
+		if (reply->nlh.nlmsg_type == NLMSG_ERROR)
+			return ((struct nlmsgerr *)NLMSG_DATA(&reply->nlh))->error;
+		return 0;
+	}
+}
+
+static void xfrm_set_addr(xfrm_address_t *xa, uint16_t *port, struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (void *)sa;
+		memcpy(xa->a6, &sin6->sin6_addr, sizeof(xa->a6));
+		*port = sin6->sin6_port;
+	} else {
+		struct sockaddr_in *sin = (void *)sa;
+		xa->a4 = sin->sin_addr.s_addr;
+		*port = sin->sin_port;
+	}
+}
+
+static void xfrm_infinite_lft(struct xfrm_lifetime_cfg *lft)
+{
+	lft->soft_byte_limit = lft->hard_byte_limit = XFRM_INF;
+	lft->soft_packet_limit = lft->hard_packet_limit = XFRM_INF;
+}
+
+static int xfrm_add_algs(struct openconnect_info *vpninfo, struct xfrm_msg *msg,
+			 struct esp *esp)
+{
+	struct xfrm_algo *crypt;
+	struct xfrm_algo_auth *auth;
+	struct xfrm_algo_aead *aead;
+	const char *macname;
+	int enclen, maclen;
+
+	switch (vpninfo->esp_enc) {
+	case ENC_AES_128_CBC:
+	case ENC_AES_128_GCM:
+		enclen = 16;
+		break;
+	case ENC_AES_256_CBC:
+	case ENC_AES_256_GCM:
+		enclen = 32;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+		/* The salt follows the key, which is how RFC4106 wants it */
+		aead = xfrm_msg_attr(msg, XFRMA_ALG_AEAD, sizeof(*aead) + enclen + 4);
+		strcpy(aead->alg_name, "rfc4106(gcm(aes))");
+		aead->alg_key_len = (enclen + 4) * 8;
+		aead->alg_icv_len = 128;
+		memcpy(aead->alg_key, esp->secrets, enclen + 4);
+		return 0;
+	}
+
+	switch (vpninfo->esp_hmac) {
+	case HMAC_MD5:
+		macname = "hmac(md5)";
+		maclen = 16;
+		break;
+	case HMAC_SHA1:
+		macname = "hmac(sha1)";
+		maclen = 20;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	crypt = xfrm_msg_attr(msg, XFRMA_ALG_CRYPT, sizeof(*crypt) + enclen);
+	strcpy(crypt->alg_name, "cbc(aes)");
+	crypt->alg_key_len = enclen * 8;
+	memcpy(crypt->alg_key, esp->secrets, enclen);
+
+	/* As in the userspace ESP, the HMAC key follows the encryption key */
+	auth = xfrm_msg_attr(msg, XFRMA_ALG_AUTH_TRUNC, sizeof(*auth) + maclen);
+	strcpy(auth->alg_name, macname);
+	auth->alg_key_len = maclen * 8;
+	auth->alg_trunc_len = 96;
+	memcpy(auth->alg_key, esp->secrets + enclen, maclen);
+	return 0;
+}
+
+static int xfrm_add_sa(struct openconnect_info *vpninfo, struct esp_xfrm *x,
+		       struct esp *esp, int out)
+{
+	struct xfrm_msg msg;
+	struct xfrm_usersa_info *sa;
+	struct xfrm_encap_tmpl *encap;
+	struct xfrm_replay_state *replay;
+	int ret;
+
+	sa = xfrm_msg_init(&msg, XFRM_MSG_NEWSA, NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL,
+			   sizeof(*sa));
+	sa->family = x->family;
+	sa->id.proto = IPPROTO_ESP;
+	sa->id.spi = esp->spi;
+	sa->id.daddr = out ? x->remote : x->local;
+	sa->saddr = out ? x->local : x->remote;
+	sa->mode = XFRM_MODE_TUNNEL;
+	sa->reqid = x->reqid;
+	/* Carry both Legacy IP and IPv6, whatever the outer family */
+	sa->flags = XFRM_STATE_AF_UNSPEC;
+	xfrm_infinite_lft(&sa->lft);
+	if (!out && vpninfo->esp_replay_protect)
+		sa->replay_window = XFRM_REPLAY_WINDOW;
+
+	ret = xfrm_add_algs(vpninfo, &msg, esp);
+	if (ret)
+		return ret;
+
+	encap = xfrm_msg_attr(&msg, XFRMA_ENCAP, sizeof(*encap));
+	encap->encap_type = UDP_ENCAP_ESPINUDP;
+	encap->encap_sport = out ? x->local_port : x->remote_port;
+	encap->encap_dport = out ? x->remote_port : x->local_port;
+
+	/* Pick up the sequence numbers where we left off. For outbound,
+	 * esp->seq is the next to be sent, while the kernel holds the last
+	 * one sent. For inbound, esp->seq is the one after the latest
+	 * received, and the backlog starts at the one before that with
+	 * a set bit for each packet *not* seen; the kernel's bitmap has
+	 * the latest at the bottom and sets a bit for each packet seen. */
+	replay = xfrm_msg_attr(&msg, XFRMA_REPLAY_VAL, sizeof(*replay));
+	if (out) {
+		replay->oseq = esp->seq ? esp->seq - 1 : 0;
+	} else if (esp->seq) {
+		replay->seq = esp->seq - 1;
+		replay->bitmap = 1 | ((uint32_t)~esp->seq_backlog << 1);
+	}
+
+	return xfrm_talk(x, &msg, NULL);
+}
+
+static int xfrm_get_sa(struct esp_xfrm *x, uint32_t spi, int out,
+		       struct xfrm_usersa_info **sa, struct xfrm_replay_state **replay,
+		       struct xfrm_msg *reply)
+{
+	struct xfrm_msg msg;
+	struct xfrm_usersa_id *id;
+	struct nlattr *nla;
+	int ret, len;
+
+	id = xfrm_msg_init(&msg, XFRM_MSG_GETSA, 0, sizeof(*id));
+	id->daddr = out ? x->remote : x->local;
+	id->spi = spi;
+	id->family = x->family;
+	id->proto = IPPROTO_ESP;
+
+	ret = xfrm_talk(x, &msg, reply);
+	if (ret)
+		return ret;
+	if (reply->nlh.nlmsg_type != XFRM_MSG_NEWSA ||
+	    reply->nlh.nlmsg_len < NLMSG_LENGTH(sizeof(**sa)))
+		return -EIO;
+
+	*sa = NLMSG_DATA(&reply->nlh);
+	if (!replay)
+		return 0;
+
+	*replay = NULL;
+	nla = (void *)((char *)*sa + NLMSG_ALIGN(sizeof(**sa)));
+	len = reply->nlh.nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(**sa)));
+	while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == XFRMA_REPLAY_VAL &&
+		    nla->nla_len >= NLA_HDRLEN + sizeof(**replay)) {
+			*replay = (void *)((char *)nla + NLA_HDRLEN);
+			return 0;
+		}
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (void *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+	return -EIO;
+}
+
+/* The outbound SA's last sequence number used, and packets sent */
+static int xfrm_get_oseq(struct esp_xfrm *x, uint32_t *oseq, uint64_t *packets)
+{
+	struct xfrm_usersa_info *sa;
+	struct xfrm_replay_state *replay;
+	struct xfrm_msg reply;
+	int ret;
+
+	ret = xfrm_get_sa(x, x->spi_out, 1, &sa, &replay, &reply);
+	if (ret)
+		return ret;
+
+	*oseq = replay->oseq;
+	*packets = sa->curlft.packets;
+	return 0;
+}
+
+static int xfrm_set_oseq(struct esp_xfrm *x, uint32_t oseq)
+{
+	struct xfrm_msg msg;
+	struct xfrm_aevent_id *ae;
+	struct xfrm_replay_state *replay;
+
+	ae = xfrm_msg_init(&msg, XFRM_MSG_NEWAE, NLM_F_ACK | NLM_F_REPLACE,
+			   sizeof(*ae));
+	ae->sa_id.daddr = x->remote;
+	ae->sa_id.spi = x->spi_out;
+	ae->sa_id.family = x->family;
+	ae->sa_id.proto = IPPROTO_ESP;
+	ae->saddr = x->local;
+	ae->reqid = x->reqid;
+
+	replay = xfrm_msg_attr(&msg, XFRMA_REPLAY_VAL, sizeof(*replay));
+	replay->oseq = oseq;
+
+	return xfrm_talk(x, &msg, NULL);
+}
+
+static int xfrm_del_sa(struct esp_xfrm *x, uint32_t spi, int out)
+{
+	struct xfrm_msg msg;
+	struct xfrm_usersa_id *id;
+
+	id = xfrm_msg_init(&msg, XFRM_MSG_DELSA, NLM_F_ACK, sizeof(*id));
+	id->daddr = out ? x->remote : x->local;
+	id->spi = spi;
+	id->family = x->family;
+	id->proto = IPPROTO_ESP;
+
+	return xfrm_talk(x, &msg, NULL);
+}
+
+static int xfrm_add_policy(struct esp_xfrm *x, struct xfrm_selector *sel, int dir)
+{
+	struct xfrm_msg msg;
+	struct xfrm_userpolicy_info *pol;
+	struct xfrm_user_tmpl *tmpl;
+	int out = dir == XFRM_POLICY_OUT;
+
+	/* UPDPOLICY rather than NEWPOLICY, to replace any policy for our
+	   address which was left behind by a previous session */
+	pol = xfrm_msg_init(&msg, XFRM_MSG_UPDPOLICY, NLM_F_ACK | NLM_F_CREATE,
+			    sizeof(*pol));
+	pol->sel = *sel;
+	pol->dir = dir;
+	pol->action = XFRM_POLICY_ALLOW;
+	xfrm_infinite_lft(&pol->lft);
+
+	tmpl = xfrm_msg_attr(&msg, XFRMA_TMPL, sizeof(*tmpl));
+	tmpl->family = x->family;
+	tmpl->id.proto = IPPROTO_ESP;
+	tmpl->id.daddr = out ? x->remote : x->local;
+	tmpl->saddr = out ? x->local : x->remote;
+	tmpl->mode = XFRM_MODE_TUNNEL;
+	tmpl->reqid = x->reqid;
+	tmpl->aalgos = tmpl->ealgos = tmpl->calgos = ~0;
+
+	return xfrm_talk(x, &msg, NULL);
+}
+
+static int xfrm_del_policy(struct esp_xfrm *x, struct xfrm_selector *sel, int dir)
+{
+	struct xfrm_msg msg;
+	struct xfrm_userpolicy_id *id;
+
+	id = xfrm_msg_init(&msg, XFRM_MSG_DELPOLICY, NLM_F_ACK, sizeof(*id));
+	id->sel = *sel;
+	id->dir = dir;
+
+	return xfrm_talk(x, &msg, NULL);
+}
+
+/* The outbound policy selects on the source address and the inbound one
+ * on the destination; set both, and xfrm_policy_sel() picks which. */
+static int xfrm_add_selector(struct esp_xfrm *x, int family, const char *addr)
+{
+	struct xfrm_selector *sel = &x->sel[x->nr_sel];
+	char buf[INET6_ADDRSTRLEN];
+	char *p;
+
+	if (!addr)
+		return 0;
+
+	/* The IPv6 address may come with its prefix length */
+	strncpy(buf, addr, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	p = strchr(buf, '/');
+	if (p)
+		*p = 0;
+
+	memset(sel, 0, sizeof(*sel));
+	if (inet_pton(family, buf, &sel->saddr) != 1)
+		return -EINVAL;
+	sel->daddr = sel->saddr;
+	sel->family = family;
+	sel->prefixlen_s = sel->prefixlen_d = family == AF_INET6 ? 128 : 32;
+	x->nr_sel++;
+	return 0;
+}
+
+static struct xfrm_selector *xfrm_policy_sel(struct xfrm_selector *sel, int dir,
+					     struct xfrm_selector *buf)
+{
+	*buf = *sel;
+	if (dir == XFRM_POLICY_OUT) {
+		memset(&buf->daddr, 0, sizeof(buf->daddr));
+		buf->prefixlen_d = 0;
+	} else {
+		memset(&buf->saddr, 0, sizeof(buf->saddr));
+		buf->prefixlen_s = 0;
+	}
+	return buf;
+}
+
+static void xfrm_free(struct esp_xfrm *x)
+{
+	if (x->fd != -1)
+		close(x->fd);
+	free(x);
+}
+
+/* Delete the first 'nr_pol' policies and 'nr_sa' SAs, in reverse order
+   of their installation */
+static void xfrm_remove(struct esp_xfrm *x, int nr_pol, int nr_sa)
+{
+	struct xfrm_selector sel;
+	int i, dir;
+
+	for (i = 0; i < nr_pol; i++) {
+		dir = i & 1 ? XFRM_POLICY_IN : XFRM_POLICY_OUT;
+		xfrm_del_policy(x, xfrm_policy_sel(&x->sel[i / 2], dir, &sel), dir);
+	}
+	if (nr_sa > 1)
+		xfrm_del_sa(x, x->spi_in, 0);
+	if (nr_sa > 0)
+		xfrm_del_sa(x, x->spi_out, 1);
+}
+
+int esp_xfrm_install(struct openconnect_info *vpninfo)
+{
+	struct sockaddr_storage local;
+	socklen_t locallen = sizeof(local);
+	struct xfrm_selector sel;
+	struct esp_xfrm *x;
+	int encap = UDP_ENCAP_ESPINUDP;
+	int ret, i, nr_pol = 0, nr_sa = 0;
+
+	if (vpninfo->esp_compr) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot offload compressed ESP to the kernel\n"));
+		return -EINVAL;
+	}
+
+	if (getsockname(vpninfo->dtls_fd, (void *)&local, &locallen)) {
+		vpn_perror(vpninfo, _("getsockname"));
+		return -EIO;
+	}
+
+	x = calloc(1, sizeof(*x));
+	if (!x)
+		return -ENOMEM;
+
+	x->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_XFRM);
+	if (x->fd < 0) {
+		ret = -errno;
+		vpn_perror(vpninfo, _("Open XFRM netlink socket"));
+		free(x);
+		return ret;
+	}
+
+	x->family = vpninfo->dtls_addr->sa_family;
+	xfrm_set_addr(&x->local, &x->local_port, (void *)&local);
+	xfrm_set_addr(&x->remote, &x->remote_port, vpninfo->dtls_addr);
+	x->esp_out = &vpninfo->esp_out;
+	x->esp_in = &vpninfo->esp_in[vpninfo->current_esp_in];
+	x->spi_out = x->esp_out->spi;
+	x->spi_in = x->esp_in->spi;
+	/* Anything unique to this session will do, to tie policies to SAs */
+	x->reqid = ntohl(x->spi_out);
+
+	if (xfrm_add_selector(x, AF_INET, vpninfo->ip_info.addr) ||
+	    xfrm_add_selector(x, AF_INET6, vpninfo->ip_info.addr6) ||
+	    !x->nr_sel) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("No usable VPN address for ESP offload\n"));
+		ret = -EINVAL;
+		goto err;
+	}
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* They'd be using the same sequence numbers as the kernel */
+	esp_stop_workers(vpninfo);
+#endif
+
+	ret = xfrm_add_sa(vpninfo, x, x->esp_out, 1);
+	if (ret)
+		goto err_sa;
+	nr_sa++;
+	ret = xfrm_add_sa(vpninfo, x, x->esp_in, 0);
+	if (ret)
+		goto err_sa;
+	nr_sa++;
+
+	for (i = 0; i < x->nr_sel * 2; i++) {
+		int dir = i & 1 ? XFRM_POLICY_IN : XFRM_POLICY_OUT;
+
+		ret = xfrm_add_policy(x, xfrm_policy_sel(&x->sel[i / 2], dir, &sel), dir);
+		if (ret) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to add XFRM policy: %s\n"),
+				     strerror(-ret));
+			goto err;
+		}
+		nr_pol++;
+	}
+
+	if (setsockopt(vpninfo->dtls_fd, IPPROTO_UDP, UDP_ENCAP, &encap, sizeof(encap))) {
+		ret = -errno;
+		vpn_perror(vpninfo, _("Set UDP_ENCAP on ESP socket"));
+		goto err;
+	}
+
+	vpninfo->esp_xfrm = x;
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("ESP offloaded to the kernel (SPIs 0x%08x in, 0x%08x out)\n"),
+		     (unsigned)ntohl(x->spi_in), (unsigned)ntohl(x->spi_out));
+	return 0;
+
+ err_sa:
+	vpn_progress(vpninfo, PRG_ERR, _("Failed to add XFRM SA: %s\n"),
+		     strerror(-ret));
+ err:
+	xfrm_remove(x, nr_pol, nr_sa);
+	xfrm_free(x);
+	return ret;
+}
+
+/* Take the SAs back out of the kernel, and with them the state that
+ * userspace ESP needs to carry on from where the kernel left off. */
+void esp_xfrm_remove(struct openconnect_info *vpninfo)
+{
+	struct esp_xfrm *x = vpninfo->esp_xfrm;
+	struct xfrm_usersa_info *sa;
+	struct xfrm_replay_state *replay;
+	struct xfrm_msg reply;
+	int encap = 0;
+
+	if (!x)
+		return;
+
+	esp_xfrm_poll(vpninfo, 1);
+
+	/* Stop the kernel sending first, then receiving */
+	xfrm_remove(x, x->nr_sel * 2, 0);
+	if (!xfrm_get_sa(x, x->spi_out, 1, &sa, &replay, &reply) && replay)
+		x->esp_out->seq = (uint64_t)replay->oseq + 1;
+	else
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to read outbound sequence number from XFRM SA\n"));
+
+	if (setsockopt(vpninfo->dtls_fd, IPPROTO_UDP, UDP_ENCAP, &encap, sizeof(encap)))
+		vpn_perror(vpninfo, _("Clear UDP_ENCAP on ESP socket"));
+
+	if (!xfrm_get_sa(x, x->spi_in, 0, &sa, &replay, &reply) && replay) {
+		if (replay->seq) {
+			x->esp_in->seq = (uint64_t)replay->seq + 1;
+			/* Beyond the kernel's window, count everything as missing */
+			x->esp_in->seq_backlog = ~(uint64_t)(replay->bitmap >> 1);
+		}
+	} else
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to read inbound replay state from XFRM SA\n"));
+
+	xfrm_remove(x, 0, 2);
+	xfrm_free(x);
+	vpninfo->esp_xfrm = NULL;
+
+	vpn_progress(vpninfo, PRG_DEBUG, _("ESP SAs removed from the kernel\n"));
+}
+
+/* Set aside some of the outbound SA's sequence numbers, for DPD probes to
+ * be sent from userspace while it stays in the kernel. On success, they
+ * start at vpninfo->esp_out.seq.
+ *
+ * The kernel may send packets between reading its sequence number and
+ * moving it on. Those sent after have numbers beyond the gap, and the
+ * packet counter says how many were sent altogether, so the rest must
+ * have taken the first numbers in the gap. */
+int esp_xfrm_reserve_seq(struct openconnect_info *vpninfo)
+{
+	struct esp_xfrm *x = vpninfo->esp_xfrm;
+	uint64_t packets, packets_now;
+	uint32_t oseq, oseq_now;
+	int64_t used;
+	int tries, ret;
+
+	if (!x)
+		return -EINVAL;
+
+	ret = xfrm_get_oseq(x, &oseq, &packets);
+	for (tries = 0; !ret && tries < 3; tries++) {
+		ret = xfrm_set_oseq(x, oseq + XFRM_SEQ_GAP);
+		if (!ret)
+			ret = xfrm_get_oseq(x, &oseq_now, &packets_now);
+		if (ret)
+			break;
+
+		used = (int64_t)(packets_now - packets) -
+			(uint32_t)(oseq_now - oseq - XFRM_SEQ_GAP);
+		if (used >= 0 && used + XFRM_PROBE_SEQS <= XFRM_SEQ_GAP) {
+			x->esp_out->seq = (uint64_t)oseq + used + 1;
+			return 0;
+		}
+		/* Too busy; go again from where it has got to */
+		oseq = oseq_now;
+		packets = packets_now;
+	}
+	if (!ret)
+		ret = -EBUSY;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Failed to set aside ESP sequence numbers in the kernel: %s\n"),
+		     strerror(-ret));
+	return ret;
+}
+
+/* Bring the timestamps and statistics up to date with the kernel's packet
+ * counters. Not more than once a second, unless 'force' is set. */
+int esp_xfrm_poll(struct openconnect_info *vpninfo, int force)
+{
+	struct esp_xfrm *x = vpninfo->esp_xfrm;
+	struct xfrm_usersa_info *sa;
+	struct xfrm_msg reply;
+	int ret;
+
+	if (!x || (!force && x->polled && vpninfo->now < x->polled + 1000))
+		return 0;
+	x->polled = vpninfo->now;
+
+	ret = xfrm_get_sa(x, x->spi_in, 0, &sa, NULL, &reply);
+	if (ret)
+		return ret;
+	if (sa->curlft.packets != x->rx.packets) {
+		vpninfo->stats.rx_pkts += sa->curlft.packets - x->rx.packets;
+		vpninfo->stats.rx_bytes += sa->curlft.bytes - x->rx.bytes;
+		vpninfo->data_stats.esp.rx_pkts += sa->curlft.packets - x->rx.packets;
+		vpninfo->data_stats.esp.rx_bytes += sa->curlft.bytes - x->rx.bytes;
+		vpninfo->dtls_times.last_rx = vpninfo->now;
+		x->rx = sa->curlft;
+	}
+
+	ret = xfrm_get_sa(x, x->spi_out, 1, &sa, NULL, &reply);
+	if (ret)
+		return ret;
+	if (sa->curlft.packets != x->tx.packets) {
+		vpninfo->stats.tx_pkts += sa->curlft.packets - x->tx.packets;
+		vpninfo->stats.tx_bytes += sa->curlft.bytes - x->tx.bytes;
+		vpninfo->data_stats.esp.tx_pkts += sa->curlft.packets - x->tx.packets;
+		vpninfo->data_stats.esp.tx_bytes += sa->curlft.bytes - x->tx.bytes;
+		vpninfo->dtls_times.last_tx = vpninfo->now;
+		x->tx = sa->curlft;
+	}
+	return 0;
+}
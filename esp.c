@@ -29,11 +29,18 @@
 #include "openconnect-internal.h"
 #include "lzo.h"
 
+#ifdef HAVE_UDP_SEGMENT
+#include <netinet/udp.h>
+/* Kernel limits on a single UDP_SEGMENT send */
+#define UDP_MAX_SEGMENTS 64
+#define UDP_MAX_GSO_LEN 65000
+#endif
+
 int print_esp_keys(struct openconnect_info *vpninfo, const char *name, struct esp *esp)
 {
 	int i;
 	const char *enctype, *mactype;
-	char enckey[256], mackey[256];
+	char enckey[256], mackey[256] = "";
 	int enclen, maclen;
 
 	switch(vpninfo->esp_enc) {
@@ -45,21 +52,34 @@ int print_esp_keys(struct openconnect_info *vpninfo, const char *name, struct es
 		enctype = "AES-256-CBC (RFC3602)";
 		enclen = 32;
 		break;
-	default:
-		return -EINVAL;
-	}
-	switch(vpninfo->esp_hmac) {
-	case 0x01:
-		mactype = "HMAC-MD5-96 (RFC2403)";
-		maclen = 16;
+	case ENC_AES_128_GCM:
+		enctype = "AES-128-GCM (RFC4106)";
+		enclen = 16 + 4;
 		break;
-	case 0x02:
-		mactype = "HMAC-SHA-1-96 (RFC2404)";
-		maclen = 20;
+	case ENC_AES_256_GCM:
+		enctype = "AES-256-GCM (RFC4106)";
+		enclen = 32 + 4;
 		break;
 	default:
 		return -EINVAL;
 	}
+	if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+		mactype = "none (AEAD)";
+		maclen = 0;
+	} else {
+		switch(vpninfo->esp_hmac) {
+		case 0x01:
+			mactype = "HMAC-MD5-96 (RFC2403)";
+			maclen = 16;
+			break;
+		case 0x02:
+			mactype = "HMAC-SHA-1-96 (RFC2404)";
+			maclen = 20;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
 
 	for (i = 0; i < enclen; i++)
 		sprintf(enckey + (2 * i), "%02x", esp->secrets[i]);
@@ -78,6 +98,20 @@ int print_esp_keys(struct openconnect_info *vpninfo, const char *name, struct es
 	return 0;
 }
 
+/* encrypt_esp_packet() logs nothing, since the ESP worker threads use it
+   too. Running out of sequence numbers isn't reported here either;
+   esp_mainloop() rekeys or falls back to SSL before that. */
+static int esp_encrypt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	int len = encrypt_esp_packet(vpninfo, &vpninfo->esp_out, pkt);
+
+	if (len < 0 && len != -ENOSPC)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to encrypt ESP packet: %s\n"),
+			     strerror(-len));
+	return len;
+}
+
 int esp_send_probes(struct openconnect_info *vpninfo)
 {
 	struct pkt *pkt;
@@ -96,25 +130,25 @@ int esp_send_probes(struct openconnect_info *vpninfo)
 		monitor_except_fd(vpninfo, dtls);
 	}
 
-	pkt = malloc(sizeof(*pkt) + 1 + vpninfo->pkt_trailer);
+	pkt = alloc_pkt(vpninfo, 1 + vpninfo->pkt_trailer);
 	if (!pkt)
 		return -ENOMEM;
 
 	pkt->len = 1;
 	pkt->data[0] = 0;
-	pktlen = encrypt_esp_packet(vpninfo, pkt);
+	pktlen = esp_encrypt(vpninfo, pkt);
 	if (pktlen >= 0)
-		send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+		send(vpninfo->dtls_fd, (void *)esp_pkt_hdr(vpninfo, pkt), pktlen, 0);
 
 	pkt->len = 1;
 	pkt->data[0] = 0;
-	pktlen = encrypt_esp_packet(vpninfo, pkt);
+	pktlen = esp_encrypt(vpninfo, pkt);
 	if (pktlen >= 0)
-		send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+		send(vpninfo->dtls_fd, (void *)esp_pkt_hdr(vpninfo, pkt), pktlen, 0);
 
-	free(pkt);
+	free_pkt(vpninfo, pkt);
 
-	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
+	vpninfo->dtls_times.last_tx = vpninfo->new_dtls_started = timer_update(vpninfo);
 
 	return 0;
 };
@@ -139,17 +173,25 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 	static char magic[16] = "monitor\x00\x00pan ha ";
 
 	int pktlen, seq;
-	struct pkt *pkt = malloc(sizeof(*pkt) + sizeof(struct ip) + ICMP_MINLEN + sizeof(magic) + vpninfo->pkt_trailer);
-	struct ip *iph = (void *)pkt->data;
-	struct icmp *icmph = (void *)(pkt->data + sizeof(*iph));
-	char *pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
+	struct pkt *pkt;
+	struct ip *iph;
+	struct icmp *icmph;
+	char *pmagic;
+
+	pkt = alloc_pkt(vpninfo, sizeof(struct ip) + ICMP_MINLEN + sizeof(magic) + vpninfo->pkt_trailer);
 	if (!pkt)
 		return -ENOMEM;
 
+	iph = (void *)pkt->data;
+	icmph = (void *)(pkt->data + sizeof(*iph));
+	pmagic = (void *)(pkt->data + sizeof(*iph) + ICMP_MINLEN);
+
 	if (vpninfo->dtls_fd == -1) {
 		int fd = udp_connect(vpninfo);
-		if (fd < 0)
+		if (fd < 0) {
+			free_pkt(vpninfo, pkt);
 			return fd;
+		}
 
 		/* We are not connected until we get an ESP packet back */
 		vpninfo->dtls_state = DTLS_SLEEPING;
@@ -160,7 +202,8 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 	}
 
 	for (seq=1; seq <= (vpninfo->dtls_state==DTLS_CONNECTED ? 1 : 3); seq++) {
-		memset(pkt, 0, sizeof(*pkt) + sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
+		/* Leave the header alone; alloc_len is what free_pkt() recycles by */
+		memset(pkt->data, 0, sizeof(*iph) + ICMP_MINLEN + sizeof(magic));
 		pkt->len = sizeof(struct ip) + ICMP_MINLEN + sizeof(magic);
 
 		/* IP Header */
@@ -182,14 +225,14 @@ int esp_send_probes_gp(struct openconnect_info *vpninfo)
 		memcpy(pmagic, magic, sizeof(magic)); /* required to get gateway to respond */
 		icmph->icmp_cksum = csum((uint16_t *)icmph, (ICMP_MINLEN+sizeof(magic))/2);
 
-		pktlen = encrypt_esp_packet(vpninfo, pkt);
+		pktlen = esp_encrypt(vpninfo, pkt);
 		if (pktlen >= 0)
-			send(vpninfo->dtls_fd, (void *)&pkt->esp, pktlen, 0);
+			send(vpninfo->dtls_fd, (void *)esp_pkt_hdr(vpninfo, pkt), pktlen, 0);
 	}
 
-	free(pkt);
+	free_pkt(vpninfo, pkt);
 
-	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
+	vpninfo->dtls_times.last_tx = vpninfo->new_dtls_started = timer_update(vpninfo);
 
 	return 0;
 }
@@ -220,6 +263,15 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 
 	vpninfo->dtls_attempt_period = dtls_attempt_period;
 
+	/* Ask for new keys before the gateway lets the old ones expire */
+	if (vpninfo->proto->udp_rekey && vpninfo->esp_lifetime_seconds) {
+		vpninfo->dtls_times.rekey_method = REKEY_TUNNEL;
+		vpninfo->dtls_times.rekey = vpninfo->esp_lifetime_seconds -
+			vpninfo->esp_lifetime_seconds / 10;
+	}
+	/* Any timer left over from before is for the old intervals */
+	timer_cancel(vpninfo, &vpninfo->dtls_times.timer);
+
 	print_esp_keys(vpninfo, _("incoming"), &vpninfo->esp_in[vpninfo->current_esp_in]);
 	print_esp_keys(vpninfo, _("outgoing"), &vpninfo->esp_out);
 
@@ -230,142 +282,774 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	return 0;
 }
 
-int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
+/* A packet which decrypt_esp_packet() refused */
+static int esp_decrypt_failed(struct openconnect_info *vpninfo, int err)
 {
-	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
-	struct esp *old_esp = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
-	struct pkt *this;
-	int work_done = 0;
-	int ret;
+	if (err == -EINVAL)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     ENC_IS_AEAD(vpninfo->esp_enc) ?
+			     _("Received ESP packet with invalid ICV\n") :
+			     _("Received ESP packet with invalid HMAC\n"));
+	else
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Decrypting ESP packet failed\n"));
+	count_drop(vpninfo, bad_hmac);
+	return 0;
+}
 
-	if (vpninfo->dtls_state == DTLS_SLEEPING) {
-		int when = vpninfo->new_dtls_started + vpninfo->dtls_attempt_period - time(NULL);
-		if (when <= 0 || vpninfo->dtls_need_reconnect) {
-			vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
-			if (vpninfo->proto->udp_send_probes)
-				vpninfo->proto->udp_send_probes(vpninfo);
-			when = vpninfo->dtls_attempt_period;
+/* Check and decrypt a received ESP datagram of 'len' bytes. Returns the
+ * next header type (0x04, 0x29 or 0x05) if the payload should be passed
+ * to esp_queue_rx(), or zero if it was a probe or was rejected.
+ *
+ * This is for the main thread only. The ESP worker threads have
+ * esp_worker_decrypt() instead. */
+int esp_decrypt_rx(struct openconnect_info *vpninfo, struct esp *esp,
+		   struct esp *old_esp, struct pkt *pkt, int len)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	struct esp *replay;
+	int i, ret;
+
+	vpn_pkt_trace(vpninfo, _("Received ESP packet of %d bytes\n"),
+		      len);
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* Most of what arrives on the current SA is shared out among the
+	   worker threads, which decrypt it in parallel */
+	if (vpninfo->esp_workers && esp_worker_queue_rx(vpninfo, pkt, len))
+		return 0;
+#endif
+
+	if (len <= vpninfo->esp_hdrlen + vpninfo->esp_icvlen)
+		return 0;
+
+	oc_probe(esp_rx, ntohl(hdr->spi), ntohl(hdr->seq), len);
+
+	len -= vpninfo->esp_hdrlen + vpninfo->esp_icvlen;
+	pkt->len = len;
+
+	if (hdr->spi == esp->spi) {
+		ret = decrypt_esp_packet(vpninfo, esp, pkt);
+		if (ret)
+			return esp_decrypt_failed(vpninfo, ret);
+		replay = &vpninfo->esp_in[vpninfo->current_esp_in];
+	} else if (hdr->spi == old_esp->spi &&
+		   ntohl(hdr->seq) + esp->seq < vpninfo->old_esp_maxseq) {
+		vpn_pkt_trace(vpninfo,
+			      _("Consider SPI 0x%x, seq %u against outgoing ESP setup\n"),
+			      (unsigned)ntohl(old_esp->spi), (unsigned)ntohl(hdr->seq));
+		ret = decrypt_esp_packet(vpninfo, old_esp, pkt);
+		if (ret)
+			return esp_decrypt_failed(vpninfo, ret);
+		replay = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
+	} else {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Received ESP packet with invalid SPI 0x%08x\n"),
+			     (unsigned)ntohl(hdr->spi));
+		count_drop(vpninfo, unknown_spi);
+		return 0;
+	}
+
+	/* Why in $DEITY's name would you ever *not* set this? Perhaps we
+	 * should do th check anyway, but only warn instead of discarding
+	 * the packet? */
+	if (vpninfo->esp_replay_protect &&
+	    verify_packet_seqno(vpninfo, replay, ntohl(hdr->seq))) {
+		count_drop(vpninfo, replay);
+		return 0;
+	}
+
+	/* The server is using the keys from the last rekey, so it will
+	   accept the new outgoing SA too. (No workers run meanwhile.) */
+	if (vpninfo->esp_rekey_pending &&
+	    replay == &vpninfo->esp_in[vpninfo->current_esp_in]) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Received packet on new ESP SA; switching outgoing SA\n"));
+		esp_switch_out(vpninfo);
+	}
+
+	if (pkt->data[len - 1] != 0x04 && pkt->data[len - 1] != 0x29 &&
+	    pkt->data[len - 1] != 0x05) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Received ESP packet with unrecognised payload type %02x\n"),
+			     pkt->data[len-1]);
+		return 0;
+	}
+
+	if (len <= 2 + pkt->data[len - 2]) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Invalid padding length %02x in ESP\n"),
+			     pkt->data[len - 2]);
+		count_drop(vpninfo, bad_padding);
+		return 0;
+	}
+	pkt->len = len - 2 - pkt->data[len - 2];
+	/* With AES-GCM the padding was authenticated along with the rest */
+	if (!ENC_IS_AEAD(vpninfo->esp_enc)) {
+		for (i = 0 ; i < pkt->data[len - 2]; i++) {
+			if (pkt->data[pkt->len + i] != i + 1) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Invalid padding bytes in ESP\n"));
+				count_drop(vpninfo, bad_padding);
+				return 0;
+			}
 		}
-		if (*timeout > when * 1000)
-			*timeout = when * 1000;
 	}
-	if (vpninfo->dtls_fd == -1)
+	oc_probe(esp_decrypt, ntohl(hdr->spi), ntohl(hdr->seq), pkt->len);
+
+	vpninfo->dtls_times.last_rx = vpninfo->now;
+
+	if (vpninfo->proto->udp_catch_probe) {
+		if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
+			if (vpninfo->dtls_state == DTLS_SLEEPING) {
+				vpn_progress(vpninfo, PRG_INFO,
+					     _("ESP session established with server\n"));
+				queue_esp_control(vpninfo, 1);
+				vpninfo->dtls_state = DTLS_CONNECTING;
+			}
+			return 0;
+		}
+	}
+	return pkt->data[len - 1];
+}
+
+/* Start sending with the keys staged by the last rekey */
+void esp_switch_out(struct openconnect_info *vpninfo)
+{
+	destroy_esp_ciphers(&vpninfo->esp_out);
+	vpninfo->esp_out = vpninfo->esp_out_next;
+	memset(&vpninfo->esp_out_next, 0, sizeof(vpninfo->esp_out_next));
+	vpninfo->esp_rekey_pending = 0;
+	timer_cancel(vpninfo, &vpninfo->esp_rekey_timer);
+}
+
+/* Outbound sequence numbers used on the current SA. With XFRM the kernel
+   has them, and they only show in the packet counts. */
+static uint64_t esp_seq_used(struct openconnect_info *vpninfo)
+{
+	uint64_t seq = __atomic_load_n(&vpninfo->esp_out.seq, __ATOMIC_RELAXED);
+	uint64_t pkts = vpninfo->data_stats.esp.tx_pkts - vpninfo->esp_sa_stats.tx_pkts;
+
+	return seq > pkts ? seq : pkts;
+}
+
+/* An SA can also run out of bytes or sequence numbers before its time is
+   up. Returns non-zero if new keys should be fetched now. */
+static int esp_volume_rekey_due(struct openconnect_info *vpninfo)
+{
+	const struct oc_stats *now = &vpninfo->data_stats.esp;
+	const struct oc_stats *then = &vpninfo->esp_sa_stats;
+	uint64_t limit = vpninfo->esp_lifetime_bytes;
+
+	/* Not while one is under way, and not again straight after one */
+	if (vpninfo->esp_rekey_pending || vpninfo->udp_rekey_due ||
+	    vpninfo->now < vpninfo->dtls_times.last_rekey + 10000)
 		return 0;
 
-	while (1) {
-		int len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
-		int i;
-		struct pkt *pkt;
+	if (esp_seq_used(vpninfo) >= ESP_SEQ_REKEY) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("ESP rekey due: sequence numbers running out\n"));
+		return 1;
+	}
+	limit -= limit / 10;
+	if (limit && (now->tx_bytes - then->tx_bytes >= limit ||
+		      now->rx_bytes - then->rx_bytes >= limit)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("ESP rekey due: byte lifetime nearly reached\n"));
+		return 1;
+	}
+	return 0;
+}
+
+/* Queue a decrypted packet for the tun device. Returns non-zero if the
+ * packet itself was queued, and the caller no longer owns it. */
+static int esp_queue_rx(struct openconnect_info *vpninfo, struct pkt *pkt,
+			int next_hdr)
+{
+	if (next_hdr == 0x05) {
+		struct pkt *newpkt = alloc_pkt(vpninfo, vpninfo->ip_info.mtu + vpninfo->pkt_trailer);
+		int newlen = vpninfo->ip_info.mtu;
+		int complen = pkt->len;
+
+		if (!newpkt) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to allocate memory to decrypt ESP packet\n"));
+			return 0;
+		}
+		if (av_lzo1x_decode(newpkt->data, &newlen,
+				    pkt->data, &pkt->len) || pkt->len) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("LZO decompression of ESP packet failed\n"));
+			count_drop(vpninfo, decompress);
+			free_pkt(vpninfo, newpkt);
+			return 0;
+		}
+		newpkt->len = vpninfo->ip_info.mtu - newlen;
+		vpn_pkt_trace(vpninfo,
+			      _("LZO decompressed %d bytes into %d\n"),
+			      complen, newpkt->len);
+		queue_rx_packet(vpninfo, &vpninfo->data_stats.esp, newpkt);
+		return 0;
+	}
+
+	queue_rx_packet(vpninfo, &vpninfo->data_stats.esp, pkt);
+	return 1;
+}
+
+/* The receive buffers are kept from one call to the next, but the MTU
+ * may have gone up since they were allocated. Returns a buffer for 'len'
+ * bytes in *pp, replacing any that is too small, or NULL. */
+static struct pkt *esp_rx_buf(struct openconnect_info *vpninfo,
+			      struct pkt **pp, int len)
+{
+	if (*pp && (*pp)->alloc_len < len) {
+		free_pkt(vpninfo, *pp);
+		*pp = NULL;
+	}
+	if (!*pp)
+		*pp = alloc_pkt(vpninfo, len);
+	return *pp;
+}
+
+#ifdef HAVE_RECVMMSG
+/* Receive up to vpninfo->udp_batch datagrams with a single recvmmsg() call
+ * into the preallocated vpninfo->udp_rx_pkts[] buffers. The whole batch is
+ * decrypted before any of it is queued. Returns the number of datagrams
+ * received, or a negative errno. */
+static int esp_recv_batch(struct openconnect_info *vpninfo, struct esp *esp,
+			  struct esp *old_esp)
+{
+	struct mmsghdr msgs[MAX_UDP_BATCH];
+	struct iovec iov[MAX_UDP_BATCH];
+	int next_hdr[MAX_UDP_BATCH];
+	int len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+	int batch = vpninfo->udp_batch;
+	int i, ret;
 
-		if (!vpninfo->dtls_pkt) {
-			vpninfo->dtls_pkt = malloc(sizeof(struct pkt) + len);
-			if (!vpninfo->dtls_pkt) {
+	for (i = 0; i < batch; i++) {
+		struct pkt *pkt = esp_rx_buf(vpninfo, &vpninfo->udp_rx_pkts[i], len);
+
+		if (!pkt) {
+			if (!i) {
+				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+				return -ENOMEM;
+			}
+			batch = i;
+			break;
+		}
+		iov[i].iov_base = (void *)esp_pkt_hdr(vpninfo, pkt);
+		iov[i].iov_len = len + vpninfo->esp_hdrlen;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(vpninfo->dtls_fd, msgs, batch, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		if (errno == ENOSYS) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("recvmmsg() not supported; receiving one ESP packet at a time\n"));
+			vpninfo->udp_batch = 1;
+		}
+		return -errno;
+	}
+
+	for (i = 0; i < ret; i++)
+		next_hdr[i] = esp_decrypt_rx(vpninfo, esp, old_esp,
+					     vpninfo->udp_rx_pkts[i], msgs[i].msg_len);
+
+	for (i = 0; i < ret; i++) {
+		if (next_hdr[i] &&
+		    esp_queue_rx(vpninfo, vpninfo->udp_rx_pkts[i], next_hdr[i]))
+			vpninfo->udp_rx_pkts[i] = NULL;
+	}
+	return ret;
+}
+#endif
+
+#ifdef HAVE_UDP_GRO
+/* Copy 'len' bytes from 'off' into the data scattered over 'iov' */
+static void gro_gather(struct iovec *iov, int off, unsigned char *dst, int len)
+{
+	int n;
+
+	while (off >= iov->iov_len) {
+		off -= iov->iov_len;
+		iov++;
+	}
+	while (len) {
+		n = iov->iov_len - off;
+		if (n > len)
+			n = len;
+		memcpy(dst, (unsigned char *)iov->iov_base + off, n);
+		dst += n;
+		len -= n;
+		off = 0;
+		iov++;
+	}
+}
+
+/* Receive from a socket with UDP_GRO, which can return a train of up to
+ * 64 datagrams at once. The data are scattered over the udp_rx_pkts[]
+ * buffers in chunks of the segment size seen last time. While the server
+ * keeps sending datagrams of that size, as it will while it's busy, each
+ * lands at the start of a buffer of its own and is decrypted in place.
+ * Otherwise each is copied into a buffer of its own first, and the chunk
+ * size is changed for next time. Whatever doesn't fit in the buffers goes
+ * to udp_gro_buf, and is copied too. Returns the number of datagrams
+ * received, or a negative errno. */
+static int esp_recv_gro(struct openconnect_info *vpninfo, struct esp *esp,
+			struct esp *old_esp)
+{
+	struct iovec iov[MAX_UDP_BATCH + 1];
+	struct pkt *pkt;
+	int len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+	int maxlen = len + vpninfo->esp_hdrlen;
+	int chunk = vpninfo->udp_gro_chunk;
+	int i, n, ret, seg, nr, dglen, off, next_hdr;
+
+	if (!chunk || chunk > maxlen)
+		chunk = maxlen;
+
+	if (!vpninfo->udp_gro_buf) {
+		vpninfo->udp_gro_buf = malloc(UDP_GRO_BUFLEN);
+		if (!vpninfo->udp_gro_buf)
+			return -ENOMEM;
+	}
+
+	for (n = 0; n < MAX_UDP_BATCH; n++) {
+		pkt = esp_rx_buf(vpninfo, &vpninfo->udp_rx_pkts[n], len);
+		if (!pkt)
+			break;
+		iov[n].iov_base = (void *)esp_pkt_hdr(vpninfo, pkt);
+		iov[n].iov_len = chunk;
+	}
+	iov[n].iov_base = vpninfo->udp_gro_buf;
+	iov[n].iov_len = UDP_GRO_BUFLEN;
+
+	ret = udp_recv_gro(vpninfo, iov, n + 1, &seg);
+	if (ret < 0)
+		return ret;
+	/* An empty datagram, with perhaps more behind it. Only -EAGAIN
+	   says the socket has been drained. */
+	if (!ret)
+		return 1;
+
+	nr = (ret + seg - 1) / seg;
+	for (i = 0, off = 0; i < nr; i++, off += seg) {
+		dglen = ret - off < seg ? ret - off : seg;
+
+		/* Only if every datagram lines up with a buffer; otherwise
+		   decrypting one in place could clobber the next */
+		if (i < n && (seg == chunk || nr == 1) && dglen <= chunk) {
+			pkt = vpninfo->udp_rx_pkts[i];
+		} else if (dglen > maxlen) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Discarding oversized ESP packet of %d bytes\n"),
+				     dglen);
+			continue;
+		} else {
+			pkt = alloc_pkt(vpninfo, len);
+			if (!pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
 			}
+			gro_gather(iov, off, (void *)esp_pkt_hdr(vpninfo, pkt), dglen);
 		}
-		pkt = vpninfo->dtls_pkt;
-		len = recv(vpninfo->dtls_fd, (void *)&pkt->esp, len + sizeof(pkt->esp), 0);
-		if (len <= 0)
+
+		next_hdr = esp_decrypt_rx(vpninfo, esp, old_esp, pkt, dglen);
+		if (next_hdr && esp_queue_rx(vpninfo, pkt, next_hdr)) {
+			if (i < n && pkt == vpninfo->udp_rx_pkts[i])
+				vpninfo->udp_rx_pkts[i] = NULL;
+		} else if (i >= n || pkt != vpninfo->udp_rx_pkts[i]) {
+			free_pkt(vpninfo, pkt);
+		}
+	}
+
+	/* Line the buffers up with what the server is sending now */
+	if (nr > 1 && seg != chunk)
+		vpninfo->udp_gro_chunk = seg;
+	else if (nr == 1 && ret > chunk)
+		vpninfo->udp_gro_chunk = maxlen;
+
+	return nr;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/* A datagram has been received into esp_pkt_hdr() by a posted io_uring recv */
+void esp_uring_rx(struct openconnect_info *vpninfo, struct pkt *pkt, int len)
+{
+	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
+	struct esp *old_esp = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
+	int next_hdr;
+
+	next_hdr = esp_decrypt_rx(vpninfo, esp, old_esp, pkt, len);
+	if (!next_hdr || !esp_queue_rx(vpninfo, pkt, next_hdr))
+		free_pkt(vpninfo, pkt);
+}
+
+/* Keep udp_batch receives posted on the ESP socket. They complete
+   through esp_uring_rx(). */
+static void esp_uring_post_recvs(struct openconnect_info *vpninfo)
+{
+	int len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+	struct pkt *pkt;
+
+	while (vpninfo->uring_udp_recvs < vpninfo->udp_batch) {
+		pkt = alloc_pkt(vpninfo, len);
+		if (!pkt) {
+			vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+			break;
+		}
+		if (uring_post(vpninfo, URING_UDP_RECV, vpninfo->dtls_fd, pkt,
+			       esp_pkt_hdr(vpninfo, pkt), len + vpninfo->esp_hdrlen)) {
+			free_pkt(vpninfo, pkt);
 			break;
+		}
+		vpninfo->uring_udp_recvs++;
+	}
+}
 
-		vpn_progress(vpninfo, PRG_TRACE, _("Received ESP packet of %d bytes\n"),
-			     len);
+/* Encrypt the outgoing queue and post a send for each packet. The
+   buffers go back to the pool as the sends complete. */
+static int esp_uring_send(struct openconnect_info *vpninfo)
+{
+	struct pkt *this;
+	int work_done = 0;
+	int len;
+
+	while ((this = dequeue_packet(&vpninfo->outgoing_queue))) {
 		work_done = 1;
 
-		if (len <= sizeof(pkt->esp) + 12)
+		len = esp_encrypt(vpninfo, this);
+		if (len <= 0) {
+			free_pkt(vpninfo, this);
 			continue;
+		}
+		if (uring_post(vpninfo, URING_UDP_SEND, vpninfo->dtls_fd, this,
+			       esp_pkt_hdr(vpninfo, this), len)) {
+			/* Ring full. Drop it, as we do on EAGAIN from send() */
+			count_drop(vpninfo, sock_full);
+			free_pkt(vpninfo, this);
+			break;
+		}
+		vpninfo->dtls_times.last_tx = vpninfo->now;
+	}
+	return work_done;
+}
+#endif
 
-		len -= sizeof(pkt->esp) + 12;
-		pkt->len = len;
-
-		if (pkt->esp.spi == esp->spi) {
-			if (decrypt_esp_packet(vpninfo, esp, pkt))
-				continue;
-		} else if (pkt->esp.spi == old_esp->spi &&
-			   ntohl(pkt->esp.seq) + esp->seq < vpninfo->old_esp_maxseq) {
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Consider SPI 0x%x, seq %u against outgoing ESP setup\n"),
-				     (unsigned)ntohl(old_esp->spi), (unsigned)ntohl(pkt->esp.seq));
-			if (decrypt_esp_packet(vpninfo, old_esp, pkt))
-				continue;
-		} else {
-			vpn_progress(vpninfo, PRG_DEBUG,
-				     _("Received ESP packet with invalid SPI 0x%08x\n"),
-				     (unsigned)ntohl(pkt->esp.spi));
+#ifdef HAVE_SENDMMSG
+/* Encrypt a burst of up to vpninfo->udp_batch packets from the outgoing
+ * queue and send them with a single sendmmsg() call. Where the kernel
+ * supports it, runs of packets of the same size are coalesced into one
+ * UDP_SEGMENT (GSO) message so that the kernel does the segmentation.
+ * Returns the number of packets taken from the queue, or -EAGAIN if the
+ * socket was full. */
+static int esp_send_batch(struct openconnect_info *vpninfo)
+{
+	struct pkt *pkts[MAX_UDP_BATCH];
+	int lens[MAX_UDP_BATCH];
+	struct iovec iov[MAX_UDP_BATCH];
+	struct mmsghdr msgs[MAX_UDP_BATCH];
+#ifdef HAVE_UDP_SEGMENT
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} cmsgs[MAX_UDP_BATCH];
+	int msglen[MAX_UDP_BATCH];
+#endif
+	int nr = 0, npkts = 0, nmsgs = 0, sent = 0;
+	int i, j, ret;
+
+	/* Those which didn't fit last time go first. They're encrypted
+	   already, with the sequence numbers they have to go out in. */
+	for (i = 0; i < vpninfo->nr_esp_unsent; i++, nr++) {
+		pkts[nr] = vpninfo->esp_unsent[i];
+		lens[nr] = vpninfo->esp_unsent_len[i];
+	}
+	vpninfo->nr_esp_unsent = 0;
+
+	i = nr;
+	while (nr < vpninfo->udp_batch &&
+	       (pkts[nr] = dequeue_packet(&vpninfo->outgoing_queue)))
+		nr++;
+
+	if (encrypt_esp_packets(vpninfo, &vpninfo->esp_out, pkts + i, lens + i, nr - i) < nr - i) {
+		/* Once per burst is enough; they probably all failed alike */
+		for (j = i; j < nr; j++) {
+			if (lens[j] < 0 && lens[j] != -ENOSPC) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to encrypt ESP packet: %s\n"),
+					     strerror(-lens[j]));
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct pkt *this = pkts[i];
+		int len = lens[i];
+
+		if (len <= 0) {
+			/* XXX: Fall back to TCP transport? */
+			free_pkt(vpninfo, this);
 			continue;
 		}
+		pkts[npkts] = this;
+		iov[npkts].iov_base = (void *)esp_pkt_hdr(vpninfo, this);
+		iov[npkts].iov_len = len;
 
-		if (pkt->data[len - 1] != 0x04 && pkt->data[len - 1] != 0x29 &&
-		    pkt->data[len - 1] != 0x05) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Received ESP packet with unrecognised payload type %02x\n"),
-				     pkt->data[len-1]);
+#ifdef HAVE_UDP_SEGMENT
+		/* Each segment but the last must be exactly gso_size bytes, so
+		 * only extend a run whose previous packet was full-sized. */
+		if (vpninfo->udp_gso && nmsgs &&
+		    len <= msgs[nmsgs - 1].msg_hdr.msg_iov[0].iov_len &&
+		    iov[npkts - 1].iov_len == msgs[nmsgs - 1].msg_hdr.msg_iov[0].iov_len &&
+		    msgs[nmsgs - 1].msg_hdr.msg_iovlen < UDP_MAX_SEGMENTS &&
+		    msglen[nmsgs - 1] + len <= UDP_MAX_GSO_LEN) {
+			msgs[nmsgs - 1].msg_hdr.msg_iovlen++;
+			msglen[nmsgs - 1] += len;
+			npkts++;
 			continue;
 		}
+		msglen[nmsgs] = len;
+#endif
+		memset(&msgs[nmsgs], 0, sizeof(msgs[nmsgs]));
+		msgs[nmsgs].msg_hdr.msg_iov = &iov[npkts];
+		msgs[nmsgs].msg_hdr.msg_iovlen = 1;
+		nmsgs++;
+		npkts++;
+	}
 
-		if (len <= 2 + pkt->data[len - 2]) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Invalid padding length %02x in ESP\n"),
-				     pkt->data[len - 2]);
+	if (!nmsgs)
+		return npkts;
+
+#ifdef HAVE_UDP_SEGMENT
+	for (i = 0; i < nmsgs; i++) {
+		struct msghdr *msg = &msgs[i].msg_hdr;
+		struct cmsghdr *cmsg;
+		uint16_t gso_size;
+
+		if (msg->msg_iovlen == 1)
 			continue;
+
+		msg->msg_control = cmsgs[i].buf;
+		msg->msg_controllen = sizeof(cmsgs[i].buf);
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+		gso_size = msg->msg_iov[0].iov_len;
+		memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+	}
+#endif
+
+	ret = sendmmsg(vpninfo->dtls_fd, msgs, nmsgs, 0);
+	if (ret < 0) {
+		if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+			ret = -EAGAIN;
+		} else {
+#ifdef HAVE_UDP_SEGMENT
+			/* The egress device may not be able to checksum for us */
+			if (vpninfo->udp_gso && msgs[0].msg_hdr.msg_iovlen > 1 &&
+			    (errno == EIO || errno == EINVAL)) {
+				vpn_progress(vpninfo, PRG_DEBUG,
+					     _("UDP GSO failed; disabling it\n"));
+				vpninfo->udp_gso = 0;
+			}
+#endif
+			/* A real error in sending. Fall back to TCP? */
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to send ESP packet: %s\n"),
+				     strerror(errno));
+			ret = 0;
 		}
-		pkt->len = len - 2 - pkt->data[len - 2];
-		for (i = 0 ; i < pkt->data[len - 2]; i++) {
-			if (pkt->data[pkt->len + i] != i + 1)
-				break; /* We can't just 'continue' here because it
-					* would only break out of this 'for' loop */
+	} else {
+		if (ret)
+			vpninfo->dtls_times.last_tx = vpninfo->now;
+
+		for (i = 0; i < ret; i++)
+			vpn_pkt_trace(vpninfo,
+				      _("Sent %d ESP packets of %d bytes\n"),
+				      (int)msgs[i].msg_hdr.msg_iovlen,
+				      (int)msgs[i].msg_hdr.msg_iov[0].iov_len);
+
+		/* The messages went in order, so these are the packets sent */
+		sent = ret ? msgs[ret - 1].msg_hdr.msg_iov - iov +
+			msgs[ret - 1].msg_hdr.msg_iovlen : 0;
+
+		/* A short count means the next message would have blocked */
+		ret = (ret < nmsgs) ? -EAGAIN : 0;
+	}
+
+	for (i = 0; i < npkts; i++) {
+		if (i >= sent && ret == -EAGAIN) {
+			/* Keep it for when the socket has room again */
+			vpninfo->esp_unsent[vpninfo->nr_esp_unsent] = pkts[i];
+			vpninfo->esp_unsent_len[vpninfo->nr_esp_unsent++] = iov[i].iov_len;
+			continue;
 		}
-		if (i != pkt->data[len - 2]) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Invalid padding bytes in ESP\n"));
-			continue; /* We can here, though */
+		if (i < sent)
+			record_tx_packet(vpninfo, &vpninfo->data_stats.esp, pkts[i]);
+		free_pkt(vpninfo, pkts[i]);
+	}
+
+	if (ret == -EAGAIN) {
+		monitor_write_fd(vpninfo, dtls);
+		return ret;
+	}
+	return npkts;
+}
+#endif
+
+int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct esp *esp = &vpninfo->esp_in[vpninfo->current_esp_in];
+	struct esp *old_esp = &vpninfo->esp_in[vpninfo->current_esp_in ^ 1];
+	struct pkt *this;
+	int work_done = 0;
+	int ret;
+
+	if (vpninfo->dtls_state == DTLS_SLEEPING) {
+		uint64_t now = vpninfo->now;
+		uint64_t due = vpninfo->new_dtls_started +
+			vpninfo->dtls_attempt_period * 1000ULL;
+
+		if (!vpninfo->new_dtls_started || now >= due ||
+		    vpninfo->dtls_need_reconnect) {
+			vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
+			if (vpninfo->proto->udp_send_probes)
+				vpninfo->proto->udp_send_probes(vpninfo);
+			due = now + vpninfo->dtls_attempt_period * 1000ULL;
 		}
-		vpninfo->dtls_times.last_rx = time(NULL);
-
-		if (vpninfo->proto->udp_catch_probe) {
-			if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
-				if (vpninfo->dtls_state == DTLS_SLEEPING) {
-					vpn_progress(vpninfo, PRG_INFO,
-						     _("ESP session established with server\n"));
-					queue_esp_control(vpninfo, 1);
-					vpninfo->dtls_state = DTLS_CONNECTING;
-				}
-				continue;
-			}
+		if (vpninfo->dtls_attempt_period)
+			timer_set(vpninfo, &vpninfo->dtls_timer, due);
+		else
+			timer_cancel(vpninfo, &vpninfo->dtls_timer);
+	} else
+		timer_cancel(vpninfo, &vpninfo->dtls_timer);
+	if (vpninfo->dtls_fd == -1)
+		return 0;
+
+#ifdef HAVE_IO_URING
+	if (vpninfo->uring) {
+		esp_uring_post_recvs(vpninfo);
+		goto rx_done;
+	}
+#endif
+#ifdef HAVE_UDP_GRO
+	while (vpninfo->udp_gro) {
+		if (esp_recv_gro(vpninfo, esp, old_esp) <= 0)
+			break;
+		work_done = 1;
+	}
+#endif
+#ifdef HAVE_RECVMMSG
+	while (!vpninfo->udp_gro && vpninfo->udp_batch > 1) {
+		ret = esp_recv_batch(vpninfo, esp, old_esp);
+		if (ret > 0)
+			work_done = 1;
+		/* A short batch means the socket has been drained */
+		if (ret < vpninfo->udp_batch)
+			break;
+	}
+	if (!vpninfo->udp_gro && vpninfo->udp_batch <= 1)
+#endif
+	while (1) {
+		int len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+		int next_hdr;
+		struct pkt *pkt;
+
+		pkt = esp_rx_buf(vpninfo, &vpninfo->dtls_pkt, len);
+		if (!pkt) {
+			vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+			break;
 		}
-		if (pkt->data[len - 1] == 0x05) {
-			struct pkt *newpkt = malloc(sizeof(*pkt) + vpninfo->ip_info.mtu + vpninfo->pkt_trailer);
-			int newlen = vpninfo->ip_info.mtu;
-			if (!newpkt) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Failed to allocate memory to decrypt ESP packet\n"));
-				continue;
-			}
-			if (av_lzo1x_decode(newpkt->data, &newlen,
-					    pkt->data, &pkt->len) || pkt->len) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("LZO decompression of ESP packet failed\n"));
-				free(newpkt);
-				continue;
-			}
-			newpkt->len = vpninfo->ip_info.mtu - newlen;
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("LZO decompressed %d bytes into %d\n"),
-				     len - 2 - pkt->data[len-2], newpkt->len);
-			queue_packet(&vpninfo->incoming_queue, newpkt);
-		} else {
-			queue_packet(&vpninfo->incoming_queue, pkt);
+		len = recv(vpninfo->dtls_fd, (void *)esp_pkt_hdr(vpninfo, pkt),
+			   len + vpninfo->esp_hdrlen, 0);
+		if (len <= 0)
+			break;
+
+		work_done = 1;
+
+		next_hdr = esp_decrypt_rx(vpninfo, esp, old_esp, pkt, len);
+		if (next_hdr && esp_queue_rx(vpninfo, pkt, next_hdr))
 			vpninfo->dtls_pkt = NULL;
-		}
 	}
+#ifdef HAVE_IO_URING
+ rx_done:
+#endif
 
 	if (vpninfo->dtls_state != DTLS_CONNECTED)
 		return 0;
 
-	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
+#ifdef HAVE_XFRM
+	/* The kernel's counters, for DPD and the statistics. There are none
+	   during a rekey, since setup_esp_keys() took the SAs out. */
+	if (vpninfo->esp_xfrm)
+		esp_xfrm_poll(vpninfo, 0);
+#endif
+
+	if (vpninfo->esp_rekey_pending) {
+		/* If nothing arrives on the new SA, switch anyway after a while */
+		uint64_t due = vpninfo->esp_rekey_start + 10000;
+
+		if (vpninfo->now >= due) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("No packets on new ESP SA; switching outgoing SA anyway\n"));
+			esp_switch_out(vpninfo);
+		} else
+			timer_set(vpninfo, &vpninfo->esp_rekey_timer, due);
+	}
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* Once ESP is up, the extra tun queues can be served by workers.
+	   Not during a rekey though, since they'd pick up the old SA, nor
+	   when the kernel is to have the SAs. */
+	if (vpninfo->nr_tun_queue_fds && !vpninfo->esp_workers &&
+	    !vpninfo->esp_rekey_pending &&
+#ifdef HAVE_XFRM
+	    !vpninfo->esp_offload &&
+#endif
+	    tun_is_up(vpninfo) && esp_start_workers(vpninfo)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to start ESP worker threads; using a single queue\n"));
+		os_close_tun_queues(vpninfo);
+	}
+
+	esp_collect_worker_times(vpninfo);
+	if (vpninfo->esp_lifetime_bytes)
+		esp_collect_worker_stats(vpninfo);
+#endif
+
+	if (vpninfo->proto->udp_rekey) {
+		/* Make-before-break, just as when the time is up */
+		if (esp_volume_rekey_due(vpninfo)) {
+			vpninfo->dtls_times.last_rekey = vpninfo->now;
+			vpninfo->udp_rekey_due = 1;
+			work_done = 1;
+		}
+	} else if (esp_seq_used(vpninfo) >= ESP_SEQ_MAX) {
+		/* The server decides when to rekey (oNCP), and hasn't. Nothing
+		   more can be sent on this SA, so carry on over the SSL tunnel
+		   until it does; new keys bring ESP back up. */
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("ESP sequence numbers exhausted; falling back to SSL until rekeyed\n"));
+		queue_esp_control(vpninfo, 0);
+		esp_close(vpninfo);
+		return 1;
+	}
+
+	switch (keepalive_action(vpninfo, &vpninfo->dtls_times)) {
 	case KA_REKEY:
-		vpn_progress(vpninfo, PRG_ERR, _("Rekey not implemented for ESP\n"));
+		vpn_progress(vpninfo, PRG_INFO, _("ESP rekey due\n"));
+		if (vpninfo->proto->udp_rekey)
+			vpninfo->udp_rekey_due = 1;
+		else
+			vpn_progress(vpninfo, PRG_ERR, _("Rekey not implemented for ESP\n"));
+		work_done = 1;
 		break;
 
 	case KA_DPD_DEAD:
@@ -378,6 +1062,13 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes for DPD\n"));
+#ifdef HAVE_XFRM
+		/* The probes mustn't use sequence numbers which the kernel
+		   does. Only if it can't set some aside for them, take the
+		   SAs out; they go back in below, in time for the reply. */
+		if (vpninfo->esp_xfrm && esp_xfrm_reserve_seq(vpninfo))
+			esp_xfrm_remove(vpninfo);
+#endif
 		if (vpninfo->proto->udp_send_probes)
 			vpninfo->proto->udp_send_probes(vpninfo);
 		work_done = 1;
@@ -390,19 +1081,54 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_NONE:
 		break;
 	}
+
+#ifdef HAVE_XFRM
+	if (vpninfo->esp_offload && !vpninfo->esp_xfrm &&
+	    !vpninfo->esp_rekey_pending && esp_xfrm_install(vpninfo)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to offload ESP to the kernel; continuing in userspace\n"));
+		vpninfo->esp_offload = 0;
+	}
+	if (vpninfo->esp_xfrm) {
+		/* Whatever still comes through the tun device didn't match
+		   the policies. Sending it here would reuse sequence numbers
+		   which the kernel is using. */
+		while ((this = dequeue_packet(&vpninfo->outgoing_queue))) {
+			vpn_pkt_trace(vpninfo,
+				      _("Dropping packet of %d bytes outside the ESP offload\n"),
+				      this->len);
+			free_pkt(vpninfo, this);
+		}
+		return work_done;
+	}
+#endif
 	unmonitor_write_fd(vpninfo, dtls);
+#ifdef HAVE_IO_URING
+	if (vpninfo->uring)
+		return esp_uring_send(vpninfo) || work_done;
+#endif
+#ifdef HAVE_SENDMMSG
+	while (vpninfo->nr_esp_unsent ||
+	       (vpninfo->udp_batch > 1 && vpninfo->outgoing_queue.head)) {
+		ret = esp_send_batch(vpninfo);
+		if (ret < 0)
+			return work_done;
+		work_done = 1;
+	}
+#endif
 	while ((this = dequeue_packet(&vpninfo->outgoing_queue))) {
 		int len;
 
-		len = encrypt_esp_packet(vpninfo, this);
+		len = esp_encrypt(vpninfo, this);
 		if (len > 0) {
-			ret = send(vpninfo->dtls_fd, (void *)&this->esp, len, 0);
+			ret = send(vpninfo->dtls_fd, (void *)esp_pkt_hdr(vpninfo, this), len, 0);
 			if (ret < 0) {
 				/* Not that this is likely to happen with UDP, but... */
 				if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
 					monitor_write_fd(vpninfo, dtls);
 					/* XXX: Keep the packet somewhere? */
-					free(this);
+					count_drop(vpninfo, sock_full);
+					free_pkt(vpninfo, this);
 					return work_done;
 				} else {
 					/* A real error in sending. Fall back to TCP? */
@@ -411,15 +1137,16 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 						     strerror(errno));
 				}
 			} else {
-				vpninfo->dtls_times.last_tx = time(NULL);
+				vpninfo->dtls_times.last_tx = vpninfo->now;
+				record_tx_packet(vpninfo, &vpninfo->data_stats.esp, this);
 
-				vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"),
-					     len);
+				vpn_pkt_trace(vpninfo, _("Sent ESP packet of %d bytes\n"),
+					      len);
 			}
 		} else {
 			/* XXX: Fall back to TCP transport? */
 		}
-		free(this);
+		free_pkt(vpninfo, this);
 		work_done = 1;
 	}
 
@@ -428,15 +1155,40 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 void esp_close(struct openconnect_info *vpninfo)
 {
+	int i;
+
+#ifdef HAVE_XFRM
+	/* This needs the socket, and leaves nothing behind in the kernel */
+	esp_xfrm_remove(vpninfo);
+#endif
 	/* We close and reopen the socket in case we roamed and our
 	   local IP address has changed. */
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* The workers are using the keys and the socket we're about to drop */
+	esp_stop_workers(vpninfo);
+#endif
 	if (vpninfo->dtls_fd != -1) {
+#ifdef HAVE_IO_URING
+		/* Posted receives hold a reference to the socket */
+		uring_cancel_fd(vpninfo, vpninfo->dtls_fd);
+#endif
 		closesocket(vpninfo->dtls_fd);
 		unmonitor_read_fd(vpninfo, dtls);
 		unmonitor_write_fd(vpninfo, dtls);
 		unmonitor_except_fd(vpninfo, dtls);
 		vpninfo->dtls_fd = -1;
 	}
+	/* Packets still waiting for the socket go with it */
+	for (i = 0; i < vpninfo->nr_esp_unsent; i++)
+		free_pkt(vpninfo, vpninfo->esp_unsent[i]);
+	vpninfo->nr_esp_unsent = 0;
+	/* There's no point holding on to the old SA when we start again */
+	if (vpninfo->esp_rekey_pending)
+		esp_switch_out(vpninfo);
+	/* Nor in asking for new keys; reconnecting brings them anyway */
+	vpninfo->udp_rekey_due = 0;
+	timer_cancel(vpninfo, &vpninfo->esp_rekey_timer);
+	timer_cancel(vpninfo, &vpninfo->dtls_times.timer);
 	vpninfo->dtls_state = DTLS_SLEEPING;
 }
 
@@ -451,5 +1203,7 @@ void esp_shutdown(struct openconnect_info *vpninfo)
 	destroy_esp_ciphers(&vpninfo->esp_in[0]);
 	destroy_esp_ciphers(&vpninfo->esp_in[1]);
 	destroy_esp_ciphers(&vpninfo->esp_out);
+	destroy_esp_ciphers(&vpninfo->esp_out_next);
+	vpninfo->esp_rekey_pending = 0;
 	esp_close(vpninfo);
 }
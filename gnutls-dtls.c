@@ -30,6 +30,9 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_UDP_GRO
+#include <netinet/udp.h>
+#endif
 
 
 #include <gnutls/dtls.h>
@@ -81,6 +84,78 @@ struct {
 	 * draft-jay-tls-psk-identity-extension before we do that. */
 };
 
+#if defined(HAVE_UDP_GRO) && GNUTLS_VERSION_NUMBER >= 0x030400
+/* With UDP_GRO, one read from the socket may return a whole train of
+ * datagrams. Read into udp_gro_buf, and give them to GnuTLS one at a
+ * time. */
+static ssize_t dtls_gro_pull(gnutls_transport_ptr_t ptr, void *data, size_t len)
+{
+	struct openconnect_info *vpninfo = ptr;
+	struct iovec iov;
+	int dglen, ret;
+
+	/* Skip empty datagrams; GnuTLS would take a zero return as EOF */
+	while (vpninfo->udp_gro_off >= vpninfo->udp_gro_len) {
+		iov.iov_base = vpninfo->udp_gro_buf;
+		iov.iov_len = UDP_GRO_BUFLEN;
+		ret = udp_recv_gro(vpninfo, &iov, 1, &vpninfo->udp_gro_seg);
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		vpninfo->udp_gro_off = 0;
+		vpninfo->udp_gro_len = ret;
+	}
+
+	dglen = vpninfo->udp_gro_len - vpninfo->udp_gro_off;
+	if (dglen > vpninfo->udp_gro_seg)
+		dglen = vpninfo->udp_gro_seg;
+	/* Like recv(), truncate a datagram which doesn't fit */
+	memcpy(data, vpninfo->udp_gro_buf + vpninfo->udp_gro_off,
+	       dglen < len ? dglen : len);
+	vpninfo->udp_gro_off += dglen;
+	return dglen < len ? dglen : len;
+}
+
+static int dtls_gro_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
+{
+	struct openconnect_info *vpninfo = ptr;
+
+	if (vpninfo->udp_gro_off < vpninfo->udp_gro_len)
+		return 1;
+	return gnutls_system_recv_timeout((gnutls_transport_ptr_t)(intptr_t)vpninfo->dtls_fd, ms);
+}
+#endif
+
+static void dtls_set_transport(struct openconnect_info *vpninfo,
+			       gnutls_session_t dtls_ssl, int dtls_fd)
+{
+#if defined(HAVE_UDP_GRO) && GNUTLS_VERSION_NUMBER >= 0x030400
+	if (vpninfo->udp_gro && !vpninfo->udp_gro_buf)
+		vpninfo->udp_gro_buf = malloc(UDP_GRO_BUFLEN);
+	if (vpninfo->udp_gro && vpninfo->udp_gro_buf) {
+		/* Sending is still done on the file descriptor */
+		gnutls_transport_set_ptr2(dtls_ssl, (gnutls_transport_ptr_t)vpninfo,
+					  (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+		gnutls_transport_set_pull_function(dtls_ssl, dtls_gro_pull);
+		gnutls_transport_set_pull_timeout_function(dtls_ssl, dtls_gro_pull_timeout);
+		vpninfo->udp_gro_off = vpninfo->udp_gro_len = 0;
+		return;
+	}
+#endif
+#ifdef HAVE_UDP_GRO
+	/* GnuTLS would read the coalesced datagrams as one */
+	if (vpninfo->udp_gro) {
+		int off = 0;
+
+		setsockopt(dtls_fd, SOL_UDP, UDP_GRO, &off, sizeof(off));
+		vpninfo->udp_gro = 0;
+	}
+#endif
+	gnutls_transport_set_ptr(dtls_ssl,
+				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+}
+
 #if GNUTLS_VERSION_NUMBER < 0x030009
 void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *buf)
 {
@@ -188,8 +263,7 @@ static int start_dtls_psk_handshake(struct openconnect_info *vpninfo, int dtls_f
 		goto fail;
 	}
 
-	gnutls_transport_set_ptr(dtls_ssl,
-				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+	dtls_set_transport(vpninfo, dtls_ssl, dtls_fd);
 
 	/* set PSK credentials */
 	err = gnutls_psk_allocate_client_credentials(&vpninfo->psk_cred);
@@ -285,8 +359,7 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 		return -EINVAL;
 	}
 
-	gnutls_transport_set_ptr(dtls_ssl,
-				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+	dtls_set_transport(vpninfo, dtls_ssl, dtls_fd);
 
 	gnutls_record_disable_padding(dtls_ssl);
 	master_secret.data = vpninfo->dtls_secret;
@@ -389,8 +462,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 			}
 		}
 
-		vpninfo->dtls_times.last_rekey = vpninfo->dtls_times.last_rx = 
-			vpninfo->dtls_times.last_tx = time(NULL);
+		ka_reset(vpninfo, &vpninfo->dtls_times);
 
 		dtls_detect_mtu(vpninfo);
 		/* XXX: For OpenSSL we explicitly prevent retransmits here. */
@@ -398,7 +470,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	}
 
 	if (err == GNUTLS_E_AGAIN || err == GNUTLS_E_INTERRUPTED) {
-		if (time(NULL) < vpninfo->new_dtls_started + 12)
+		if (vpninfo->now < vpninfo->new_dtls_started + 12000)
 			return 0;
 		vpn_progress(vpninfo, PRG_DEBUG, _("DTLS handshake timed out\n"));
 	}
@@ -412,7 +484,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	dtls_close(vpninfo);
 
 	vpninfo->dtls_state = DTLS_SLEEPING;
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = timer_update(vpninfo);
 	return -EINVAL;
 }
 
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
@@ -37,6 +38,12 @@ void destroy_esp_ciphers(struct esp *esp)
 		gnutls_hmac_deinit(esp->hmac, NULL);
 		esp->hmac = NULL;
 	}
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	if (esp->aead) {
+		gnutls_aead_cipher_deinit(esp->aead);
+		esp->aead = NULL;
+	}
+#endif
 }
 
 static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
@@ -50,6 +57,19 @@ static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
 	enc_key.size = gnutls_cipher_get_key_size(encalg);
 	enc_key.data = esp->secrets;
 
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+		/* The salt for the nonce follows the key; there's no HMAC */
+		err = gnutls_aead_cipher_init(&esp->aead, encalg, &enc_key);
+		if (err) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to initialise ESP cipher: %s\n"),
+				     gnutls_strerror(err));
+			return -EIO;
+		}
+		goto out;
+	}
+#endif
 	err = gnutls_cipher_init(&esp->cipher, encalg, &enc_key, NULL);
 	if (err) {
 		vpn_progress(vpninfo, PRG_ERR,
@@ -67,44 +87,78 @@ static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
 			     gnutls_strerror(err));
 		destroy_esp_ciphers(esp);
 	}
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+ out:
+#endif
 	esp->seq = 0;
 	esp->seq_backlog = 0;
 	return 0;
 }
 
-int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
+static int esp_algs(struct openconnect_info *vpninfo,
+		    gnutls_mac_algorithm_t *macalg, gnutls_cipher_algorithm_t *encalg)
 {
-	struct esp *esp_in;
-	gnutls_mac_algorithm_t macalg;
-	gnutls_cipher_algorithm_t encalg;
-	int ret;
-
-	if (vpninfo->dtls_state == DTLS_DISABLED)
-		return -EOPNOTSUPP;
-	if (!vpninfo->dtls_addr)
-		return -EINVAL;
-
 	switch (vpninfo->esp_enc) {
 	case 0x02:
-		encalg = GNUTLS_CIPHER_AES_128_CBC;
+		*encalg = GNUTLS_CIPHER_AES_128_CBC;
 		break;
 	case 0x05:
-		encalg = GNUTLS_CIPHER_AES_256_CBC;
+		*encalg = GNUTLS_CIPHER_AES_256_CBC;
 		break;
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	case ENC_AES_128_GCM:
+		*encalg = GNUTLS_CIPHER_AES_128_GCM;
+		*macalg = GNUTLS_MAC_UNKNOWN;
+		return 0;
+	case ENC_AES_256_GCM:
+		*encalg = GNUTLS_CIPHER_AES_256_GCM;
+		*macalg = GNUTLS_MAC_UNKNOWN;
+		return 0;
+#endif
 	default:
 		return -EINVAL;
 	}
 
 	switch (vpninfo->esp_hmac) {
 	case 0x01:
-		macalg = GNUTLS_MAC_MD5;
+		*macalg = GNUTLS_MAC_MD5;
 		break;
 	case 0x02:
-		macalg = GNUTLS_MAC_SHA1;
+		*macalg = GNUTLS_MAC_SHA1;
 		break;
 	default:
 		return -EINVAL;
 	}
+	return 0;
+}
+
+int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
+{
+	struct esp *esp_in;
+	gnutls_mac_algorithm_t macalg;
+	gnutls_cipher_algorithm_t encalg;
+	int ret;
+
+	if (vpninfo->dtls_state == DTLS_DISABLED)
+		return -EOPNOTSUPP;
+	if (!vpninfo->dtls_addr)
+		return -EINVAL;
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* Workers are restarted with the new keys by esp_mainloop() */
+	esp_stop_workers(vpninfo);
+#endif
+#ifdef HAVE_XFRM
+	/* Nor can the kernel switch to a new SA by itself; it would drop
+	   whatever arrived on it. So the rekey is done in userspace, from
+	   where the kernel's SAs had got to. esp_mainloop() puts them back
+	   once the old SA is finished with. */
+	esp_xfrm_remove(vpninfo);
+#endif
+
+	ret = esp_algs(vpninfo, &macalg, &encalg);
+	if (ret)
+		return ret;
 
 	if (new_keys) {
 		vpninfo->old_esp_maxseq = vpninfo->esp_in[vpninfo->current_esp_in].seq + 32;
@@ -123,78 +177,169 @@ int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
 		}
 	}
 
-	ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out, macalg, encalg);
+	ret = init_esp_ciphers(vpninfo, esp_in, macalg, encalg);
 	if (ret)
 		return ret;
 
-	ret = init_esp_ciphers(vpninfo, esp_in, macalg, encalg);
-	if (ret) {
-		destroy_esp_ciphers(&vpninfo->esp_out);
-		return ret;
+	if (vpninfo->dtls_state == DTLS_CONNECTED) {
+		/* Keep sending on the old SA until the server is seen using
+		   the new one. Then esp_switch_out() installs it. */
+		ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out_next, macalg, encalg);
+		if (ret)
+			return ret;
+		vpninfo->esp_rekey_pending = 1;
+		vpninfo->esp_rekey_start = timer_update(vpninfo);
+	} else {
+		vpninfo->esp_out.spi = vpninfo->esp_out_next.spi;
+		memcpy(vpninfo->esp_out.secrets, vpninfo->esp_out_next.secrets,
+		       sizeof(vpninfo->esp_out.secrets));
+		ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out, macalg, encalg);
+		if (ret)
+			return ret;
 	}
 
+	/* Byte lifetimes count from here */
+	vpninfo->esp_sa_stats = vpninfo->data_stats.esp;
+
 	if (vpninfo->dtls_state == DTLS_NOSECRET)
 		vpninfo->dtls_state = DTLS_SECRET;
-	vpninfo->pkt_trailer = 16 + 20; /* 16 for pad, 20 for HMAC (of which we use 16) */
+	if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+		vpninfo->esp_hdrlen = 8 + 8;
+		vpninfo->esp_icvlen = 16;
+		vpninfo->pkt_trailer = 3 + 2 + 16; /* 3 for pad, 2 for pad length and next header, 16 for ICV */
+	} else {
+		vpninfo->esp_hdrlen = 8 + 16;
+		vpninfo->esp_icvlen = 12;
+		vpninfo->pkt_trailer = 16 + 20; /* 16 for pad, 20 for HMAC (of which we use 16) */
+	}
+	return 0;
+}
+
+/* Give an ESP worker thread its own cipher state, keyed the same as 'src'.
+   An outbound clone goes on drawing sequence numbers from 'src'. */
+int clone_esp_ciphers(struct openconnect_info *vpninfo, struct esp *dst,
+		      struct esp *src, int decrypt)
+{
+	gnutls_mac_algorithm_t macalg;
+	gnutls_cipher_algorithm_t encalg;
+	int ret;
+
+	ret = esp_algs(vpninfo, &macalg, &encalg);
+	if (ret)
+		return ret;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->spi = src->spi;
+	memcpy(dst->secrets, src->secrets, sizeof(dst->secrets));
+	ret = init_esp_ciphers(vpninfo, dst, macalg, encalg);
+	if (!ret && !decrypt)
+		dst->shared_seq = &src->seq;
+	return ret;
+}
+
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+/* RFC4106: the 4-byte salt which follows the key, then the explicit IV */
+static void esp_gcm_nonce(struct openconnect_info *vpninfo, struct esp *esp,
+			  const unsigned char *iv, unsigned char *nonce)
+{
+	int keylen = vpninfo->esp_enc == ENC_AES_128_GCM ? 16 : 32;
+
+	memcpy(nonce, esp->secrets + keylen, 4);
+	memcpy(nonce + 4, iv, 8);
+}
+
+static int decrypt_esp_gcm(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	unsigned char nonce[12];
+	size_t ptext_len = pkt->len + 16;
+	int err;
+
+	esp_gcm_nonce(vpninfo, esp, hdr->iv, nonce);
+
+	/* SPI and sequence number are the additional authenticated data */
+	err = gnutls_aead_cipher_decrypt(esp->aead, nonce, sizeof(nonce), hdr, 8, 16,
+					 pkt->data, pkt->len + 16, pkt->data, &ptext_len);
+	if (err)
+		return err == GNUTLS_E_DECRYPTION_FAILED ? -EINVAL : -EIO;
 	return 0;
 }
 
-/* pkt->len shall be the *payload* length. Omitting the header and the 12-byte HMAC */
+static int encrypt_esp_gcm(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	unsigned char nonce[12];
+	uint32_t seq;
+	size_t ctext_len;
+	int i, padlen, err;
+
+	if (esp_next_seq(esp, &seq))
+		return -ENOSPC;
+
+	/* The IV need only be unique for the key, and the sequence number is.
+	   So there's no need for a random one. */
+	hdr->spi = esp->spi;
+	hdr->seq = htonl(seq);
+	store_be32(hdr->iv, 0);
+	store_be32(hdr->iv + 4, seq);
+	esp_gcm_nonce(vpninfo, esp, hdr->iv, nonce);
+
+	/* Pad to a multiple of four bytes; GCM itself needs no block padding */
+	padlen = 3 - ((pkt->len + 1) & 3);
+	for (i = 0; i < padlen; i++)
+		pkt->data[pkt->len + i] = i + 1;
+	pkt->data[pkt->len + padlen] = padlen;
+	pkt->data[pkt->len + padlen + 1] = 0x04; /* Legacy IP */
+
+	ctext_len = pkt->len + padlen + 2 + 16;
+	err = gnutls_aead_cipher_encrypt(esp->aead, nonce, sizeof(nonce), hdr, 8, 16,
+					 pkt->data, pkt->len + padlen + 2,
+					 pkt->data, &ctext_len);
+	if (err)
+		return -EIO;
+	return vpninfo->esp_hdrlen + ctext_len;
+}
+#endif
+
+/* pkt->len shall be the *payload* length. Omitting the header and the 12-byte HMAC (or 16-byte GCM ICV)
+ *
+ * Returns -EINVAL if the packet fails authentication, or -EIO if the
+ * crypto library does. Nothing is logged, since the ESP worker threads
+ * use this too; esp_decrypt_rx() reports failures for the main thread. */
 int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
 {
 	unsigned char hmac_buf[20];
-	int err;
 
-	err = gnutls_hmac(esp->hmac, &pkt->esp, sizeof(pkt->esp) + pkt->len);
-	if (err) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to calculate HMAC for ESP packet: %s\n"),
-			     gnutls_strerror(err));
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	if (ENC_IS_AEAD(vpninfo->esp_enc))
+		return decrypt_esp_gcm(vpninfo, esp, pkt);
+#endif
+	if (gnutls_hmac(esp->hmac, &pkt->esp, sizeof(pkt->esp) + pkt->len))
 		return -EIO;
-	}
 	gnutls_hmac_output(esp->hmac, hmac_buf);
-	if (memcmp(hmac_buf, pkt->data + pkt->len, 12)) {
-		vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received ESP packet with invalid HMAC\n"));
-		return -EINVAL;
-	}
-
-	/* Why in $DEITY's name would you ever *not* set this? Perhaps we
-	 * should do th check anyway, but only warn instead of discarding
-	 * the packet? */
-	if (vpninfo->esp_replay_protect &&
-	    verify_packet_seqno(vpninfo, esp, ntohl(pkt->esp.seq)))
+	if (memcmp(hmac_buf, pkt->data + pkt->len, 12))
 		return -EINVAL;
 
 	gnutls_cipher_set_iv(esp->cipher, pkt->esp.iv, sizeof(pkt->esp.iv));
 
-	err = gnutls_cipher_decrypt(esp->cipher, pkt->data, pkt->len);
-	if (err) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Decrypting ESP packet failed: %s\n"),
-			     gnutls_strerror(err));
-		return -EINVAL;
-	}
+	if (gnutls_cipher_decrypt(esp->cipher, pkt->data, pkt->len))
+		return -EIO;
 
 	return 0;
 }
 
-int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
+/* The CBC transform proper, once the caller has filled in the IV */
+static int encrypt_esp_cbc(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
 {
 	int i, padlen;
 	const int blksize = 16;
-	int err;
+	uint32_t seq;
 
-	/* This gets much more fun if the IV is variable-length */
-	pkt->esp.spi = vpninfo->esp_out.spi;
-	pkt->esp.seq = htonl(vpninfo->esp_out.seq++);
-	err = gnutls_rnd(GNUTLS_RND_NONCE, pkt->esp.iv, sizeof(pkt->esp.iv));
-	if (err) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to generate ESP packet IV: %s\n"),
-			     gnutls_strerror(err));
-		return -EIO;
-	}
+	if (esp_next_seq(esp, &seq))
+		return -ENOSPC;
+
+	pkt->esp.spi = esp->spi;
+	pkt->esp.seq = htonl(seq);
 
 	padlen = blksize - 1 - ((pkt->len + 1) % blksize);
 	for (i=0; i<padlen; i++)
@@ -202,22 +347,56 @@ int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
 	pkt->data[pkt->len + padlen] = padlen;
 	pkt->data[pkt->len + padlen + 1] = 0x04; /* Legacy IP */
 
-	gnutls_cipher_set_iv(vpninfo->esp_out.cipher, pkt->esp.iv, sizeof(pkt->esp.iv));
-	err = gnutls_cipher_encrypt(vpninfo->esp_out.cipher, pkt->data, pkt->len + padlen + 2);
-	if (err) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to encrypt ESP packet: %s\n"),
-			     gnutls_strerror(err));
+	gnutls_cipher_set_iv(esp->cipher, pkt->esp.iv, sizeof(pkt->esp.iv));
+	if (gnutls_cipher_encrypt(esp->cipher, pkt->data, pkt->len + padlen + 2) ||
+	    gnutls_hmac(esp->hmac, &pkt->esp, sizeof(pkt->esp) + pkt->len + padlen + 2))
 		return -EIO;
-	}
+	gnutls_hmac_output(esp->hmac, pkt->data + pkt->len + padlen + 2);
+	return sizeof(pkt->esp) + pkt->len + padlen + 2 + 12;
+}
 
-	err = gnutls_hmac(vpninfo->esp_out.hmac, &pkt->esp, sizeof(pkt->esp) + pkt->len + padlen + 2);
-	if (err) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to calculate HMAC for ESP packet: %s\n"),
-			     gnutls_strerror(err));
+/* Returns the length to send, -ENOSPC once the sequence numbers for the
+ * SA run out, or -EIO if the crypto library fails. As with decryption,
+ * nothing is logged; the callers in esp.c report failures for the main
+ * thread, and the workers count theirs for esp_collect_worker_times(). */
+int encrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	if (ENC_IS_AEAD(vpninfo->esp_enc))
+		return encrypt_esp_gcm(vpninfo, esp, pkt);
+#endif
+	/* This gets much more fun if the IV is variable-length */
+	if (gnutls_rnd(GNUTLS_RND_NONCE, pkt->esp.iv, sizeof(pkt->esp.iv)))
 		return -EIO;
+	return encrypt_esp_cbc(vpninfo, esp, pkt);
+}
+
+/* As encrypt_esp_packet() on each of the packets in turn, leaving the
+ * result for each in lens[]. The CBC IVs for a whole batch come from a
+ * single call into the RNG, which otherwise costs about as much as
+ * encrypting a small packet. Returns the number of packets encrypted. */
+int encrypt_esp_packets(struct openconnect_info *vpninfo, struct esp *esp,
+			struct pkt **pkts, int *lens, int n)
+{
+	unsigned char ivs[MAX_UDP_BATCH][sizeof(pkts[0]->esp.iv)];
+	int i, iv, done = 0;
+
+	for (i = 0; i < n; i++) {
+		if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+			lens[i] = encrypt_esp_packet(vpninfo, esp, pkts[i]);
+		} else {
+			iv = i % MAX_UDP_BATCH;
+			if (!iv && gnutls_rnd(GNUTLS_RND_NONCE, ivs, sizeof(ivs[0]) *
+					      (n - i < MAX_UDP_BATCH ? n - i : MAX_UDP_BATCH))) {
+				while (i < n)
+					lens[i++] = -EIO;
+				break;
+			}
+			memcpy(pkts[i]->esp.iv, ivs[iv], sizeof(ivs[iv]));
+			lens[i] = encrypt_esp_cbc(vpninfo, esp, pkts[i]);
+		}
+		if (lens[i] > 0)
+			done++;
 	}
-	gnutls_hmac_output(vpninfo->esp_out.hmac, pkt->data + pkt->len + padlen + 2);
-	return sizeof(pkt->esp) + pkt->len + padlen + 2 + 12;
+	return done;
 }
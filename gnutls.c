@@ -39,6 +39,15 @@
 #include <gnutls/pkcs12.h>
 #include <gnutls/abstract.h>
 
+#ifdef HAVE_KTLS
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
+#endif
+
 #ifdef HAVE_TROUSERS
 #include <trousers/tss.h>
 #include <trousers/trousers.h>
@@ -140,11 +149,6 @@ static int openconnect_gnutls_write(struct openconnect_info *vpninfo, char *buf,
 	return _openconnect_gnutls_write(vpninfo->https_sess, vpninfo->ssl_fd, vpninfo, buf, len);
 }
 
-int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len)
-{
-	return _openconnect_gnutls_write(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len);
-}
-
 static int _openconnect_gnutls_read(gnutls_session_t ses, int fd, struct openconnect_info *vpninfo, char *buf, size_t len, unsigned ms)
 {
 	int done, ret;
@@ -219,11 +223,6 @@ static int openconnect_gnutls_read(struct openconnect_info *vpninfo, char *buf,
 	return _openconnect_gnutls_read(vpninfo->https_sess, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
-int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms)
-{
-	return _openconnect_gnutls_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
-}
-
 static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
 	int i = 0;
@@ -284,10 +283,254 @@ static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf,
 	return i ?: ret;
 }
 
+#ifdef HAVE_KTLS
+/* Install the current keys for one direction of the session (TLS_RX or
+   TLS_TX) in the kernel. Only AES-GCM with TLS 1.2 or 1.3 gets here. */
+static int ktls_set_keys(struct openconnect_info *vpninfo, int dir)
+{
+	gnutls_session_t s = vpninfo->https_sess;
+	gnutls_datum_t mac_key, iv, key;
+	unsigned char seq[8];
+	unsigned char *k, *salt, *nonce, *rec_seq;
+	union {
+		struct tls_crypto_info info;
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+	} ci;
+	int tls12 = gnutls_protocol_get_version(s) == GNUTLS_TLS1_2;
+	int klen, cilen, ret = 0;
+
+	if (gnutls_record_get_state(s, dir == TLS_RX, &mac_key, &iv, &key, seq))
+		return -EIO;
+
+	memset(&ci, 0, sizeof(ci));
+	if (gnutls_cipher_get(s) == GNUTLS_CIPHER_AES_128_GCM) {
+		ci.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		k = ci.gcm128.key;
+		salt = ci.gcm128.salt;
+		nonce = ci.gcm128.iv;
+		rec_seq = ci.gcm128.rec_seq;
+		klen = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		cilen = sizeof(ci.gcm128);
+	} else {
+		ci.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		k = ci.gcm256.key;
+		salt = ci.gcm256.salt;
+		nonce = ci.gcm256.iv;
+		rec_seq = ci.gcm256.rec_seq;
+		klen = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		cilen = sizeof(ci.gcm256);
+	}
+	ci.info.version = tls12 ? TLS_1_2_VERSION : TLS_1_3_VERSION;
+
+	/* For TLS 1.2 GnuTLS gives only the implicit part of the nonce, and
+	   uses the sequence number as the explicit part. For TLS 1.3 the IV
+	   is the whole 12 bytes. Both are split into salt and IV here. */
+	if (key.size != klen ||
+	    iv.size != TLS_CIPHER_AES_GCM_128_SALT_SIZE +
+		       (tls12 ? 0 : TLS_CIPHER_AES_GCM_128_IV_SIZE))
+		return -EINVAL;
+
+	memcpy(k, key.data, klen);
+	memcpy(salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+	memcpy(nonce, tls12 ? seq : iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+	       TLS_CIPHER_AES_GCM_128_IV_SIZE);
+	memcpy(rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+
+	if (setsockopt(vpninfo->ssl_fd, SOL_TLS, dir, &ci, cilen))
+		ret = -errno;
+
+	memset(&ci, 0, sizeof(ci));
+	return ret;
+}
+
+/* Once the tunnel is up, hand the TLS record layer for the data channel
+   over to the kernel if we can. Anything that doesn't work out just
+   leaves GnuTLS doing it as before. */
+void ssl_enable_ktls(struct openconnect_info *vpninfo)
+{
+	gnutls_session_t s = vpninfo->https_sess;
+	gnutls_protocol_t ver;
+	gnutls_cipher_algorithm_t cipher;
+	int ret;
+
+	if (!vpninfo->ktls || !vpninfo->proto->tls_stream || vpninfo->ktls_active)
+		return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+	/* GnuTLS may be configured to do it all by itself */
+	if (gnutls_transport_is_ktls_enabled(s)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("GnuTLS is already using kernel TLS\n"));
+		return;
+	}
+#endif
+
+	ver = gnutls_protocol_get_version(s);
+	cipher = gnutls_cipher_get(s);
+	if ((ver != GNUTLS_TLS1_2 && ver != GNUTLS_TLS1_3) ||
+	    (cipher != GNUTLS_CIPHER_AES_128_GCM &&
+	     cipher != GNUTLS_CIPHER_AES_256_GCM)) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Kernel TLS not supported with %s\n"),
+			     vpninfo->cstp_cipher);
+		return;
+	}
+
+	/* The kernel can only take over at a record boundary */
+	if (gnutls_record_check_pending(s)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Not using kernel TLS: received data already buffered\n"));
+		return;
+	}
+
+	if (setsockopt(vpninfo->ssl_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Kernel TLS not available: %s\n"),
+			     strerror(errno));
+		return;
+	}
+
+	/* Until keys are set for a direction the kernel just passes data
+	   through, so GnuTLS can carry on sending if only receive works.
+	   Receiving without being able to send would leave it unable to
+	   respond to anything, so don't offload sending alone. */
+	vpninfo->ktls_tx_buf = NULL;
+	vpninfo->ktls_tx_done = 0;
+	ret = ktls_set_keys(vpninfo, TLS_RX);
+	if (!ret) {
+		vpninfo->ktls_active = KTLS_RX;
+		ret = ktls_set_keys(vpninfo, TLS_TX);
+		if (!ret)
+			vpninfo->ktls_active |= KTLS_TX;
+	}
+	if (ret)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Failed to set kernel TLS keys: %s\n"),
+			     strerror(-ret));
+
+	if (vpninfo->ktls_active)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Kernel TLS enabled for %s\n"),
+			     vpninfo->ktls_active == KTLS_RX ? _("receive") :
+			     _("send and receive"));
+}
+
+/* With the receive side in the kernel, application data comes from
+   recvmsg() and anything else is flagged with its record type. */
+static int ktls_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	unsigned char type = 23; /* application_data */
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int ret;
+
+ again:
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = maxlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(vpninfo->ssl_fd, &msg, 0);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("SSL read error: %s; reconnecting.\n"),
+			     strerror(errno));
+		return -EIO;
+	}
+	if (!ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("SSL connection closed; reconnecting.\n"));
+		return -EIO;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+		type = *CMSG_DATA(cmsg);
+
+	if (type == 23)
+		return ret;
+
+	/* TLS 1.3 session tickets are no use once GnuTLS has handed over
+	   the keys; the ones which came before will have to do. */
+	if (type == 22 && ((unsigned char *)buf)[0] == 4) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Ignoring TLS session ticket\n"));
+		goto again;
+	}
+
+	/* Anything else (an alert, a KeyUpdate or a renegotiation) needs the
+	   TLS library, which no longer has the keys. Start again instead. */
+	if (type == 21 && ret >= 2)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Received TLS alert %d; reconnecting.\n"),
+			     ((unsigned char *)buf)[1]);
+	else
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Unexpected TLS record type %d with kernel TLS; reconnecting.\n"),
+			     type);
+	return -EIO;
+}
+
+/* The kernel can send part of a buffer, but the callers expect the
+   all-or-nothing behaviour of gnutls_record_send(), and retry with
+   the same buffer after a stall. So remember how far we got, and with
+   which buffer; any other is a new write from the start. */
+static int ktls_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen)
+{
+	int ret;
+
+	if (buf != vpninfo->ktls_tx_buf || vpninfo->ktls_tx_done >= buflen) {
+		vpninfo->ktls_tx_buf = buf;
+		vpninfo->ktls_tx_done = 0;
+	}
+
+	ret = send(vpninfo->ssl_fd, (char *)buf + vpninfo->ktls_tx_done,
+		   buflen - vpninfo->ktls_tx_done, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			monitor_write_fd(vpninfo, ssl);
+			return 0;
+		}
+		vpn_progress(vpninfo, PRG_ERR, _("SSL send failed: %s\n"),
+			     strerror(errno));
+		return -1;
+	}
+
+	vpninfo->ktls_tx_done += ret;
+	if (vpninfo->ktls_tx_done < buflen) {
+		monitor_write_fd(vpninfo, ssl);
+		return 0;
+	}
+	vpninfo->ktls_tx_buf = NULL;
+	vpninfo->ktls_tx_done = 0;
+	return buflen;
+}
+#else
+void ssl_enable_ktls(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->ktls && vpninfo->proto->tls_stream)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("This build does not support kernel TLS\n"));
+}
+#endif /* HAVE_KTLS */
+
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	if (vpninfo->ktls_active & KTLS_RX)
+		return ktls_nonblock_read(vpninfo, buf, maxlen);
+#endif
 	ret = gnutls_record_recv(vpninfo->https_sess, buf, maxlen);
 	if (ret > 0)
 		return ret;
@@ -305,6 +548,10 @@ int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	if (vpninfo->ktls_active & KTLS_TX)
+		return ktls_nonblock_write(vpninfo, buf, buflen);
+#endif
 	ret = gnutls_record_send(vpninfo->https_sess, buf, buflen);
 	if (ret > 0)
 		return ret;
@@ -2208,10 +2455,80 @@ static int verify_peer(gnutls_session_t session)
 	return err;
 }
 
+static void store_tls_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t data;
+
+	if (gnutls_session_get_data2(vpninfo->https_sess, &data))
+		return;
+	if (!data.size) {
+		gnutls_free(data.data);
+		return;
+	}
+	gnutls_free(vpninfo->https_session.data);
+	vpninfo->https_session = data;
+	save_tls_session(vpninfo, data.data, data.size);
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+/* With TLS 1.3 a session can only be resumed with a ticket, which the
+   server sends some time after the handshake. */
+static int tls13_ticket_hook(gnutls_session_t session, unsigned int htype,
+			     unsigned when, unsigned int incoming,
+			     const gnutls_datum_t *msg)
+{
+	struct openconnect_info *vpninfo = gnutls_session_get_ptr(session);
+
+	if (gnutls_protocol_get_version(session) == GNUTLS_TLS1_3)
+		store_tls_session(vpninfo);
+	return 0;
+}
+#endif
+
+/* Offer the session from the last connection to this server, or from
+   the cache file. Returns nonzero if there was one. */
+static int offer_tls_session(struct openconnect_info *vpninfo)
+{
+	unsigned char *data;
+	int len;
+
+	if (vpninfo->https_session.size && !tls_session_matches(vpninfo)) {
+		gnutls_free(vpninfo->https_session.data);
+		vpninfo->https_session.data = NULL;
+		vpninfo->https_session.size = 0;
+	}
+	if (!vpninfo->https_session.size) {
+		len = load_tls_session(vpninfo, &data);
+		if (!len)
+			return 0;
+		vpninfo->https_session.data = gnutls_malloc(len);
+		if (!vpninfo->https_session.data) {
+			free(data);
+			return 0;
+		}
+		memcpy(vpninfo->https_session.data, data, len);
+		vpninfo->https_session.size = len;
+		free(data);
+	}
+
+	if (gnutls_session_set_data(vpninfo->https_sess,
+				    vpninfo->https_session.data,
+				    vpninfo->https_session.size)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Discarding unusable TLS session\n"));
+		gnutls_free(vpninfo->https_session.data);
+		vpninfo->https_session.data = NULL;
+		vpninfo->https_session.size = 0;
+		return 0;
+	}
+	return 1;
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	const char *default_prio;
 	int ssl_sock = -1;
+	int offered, resumed = 0;
 	int err;
 
 	if (vpninfo->https_sess)
@@ -2400,6 +2717,13 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_CERTIFICATE, vpninfo->https_cred);
 	gnutls_transport_set_ptr(vpninfo->https_sess,(gnutls_transport_ptr_t)(intptr_t)ssl_sock);
 
+	offered = offer_tls_session(vpninfo);
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	gnutls_handshake_set_hook_function(vpninfo->https_sess,
+					   GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+					   GNUTLS_HOOK_POST, tls13_ticket_hook);
+#endif
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
@@ -2412,6 +2736,28 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	if (err)
 		return err;
 
+	if (offered) {
+		resumed = gnutls_session_is_resumed(vpninfo->https_sess);
+		tls_session_resumed(vpninfo, resumed);
+	}
+	if (resumed) {
+		/* The server sent no certificate this time. Check the one
+		   the session was set up with, as if it had. */
+		if (verify_peer(vpninfo->https_sess)) {
+			gnutls_free(vpninfo->https_session.data);
+			vpninfo->https_session.data = NULL;
+			vpninfo->https_session.size = 0;
+			gnutls_deinit(vpninfo->https_sess);
+			vpninfo->https_sess = NULL;
+			closesocket(ssl_sock);
+			return -EIO;
+		}
+	} else
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	if (gnutls_protocol_get_version(vpninfo->https_sess) != GNUTLS_TLS1_3)
+#endif
+		store_tls_session(vpninfo);
+
 	gnutls_free(vpninfo->cstp_cipher);
 	vpninfo->cstp_cipher = get_gnutls_cipher(vpninfo->https_sess);
 
@@ -2485,6 +2831,9 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
+	vpninfo->ktls_active = 0;
+	vpninfo->ktls_tx_buf = NULL;
+	vpninfo->ktls_tx_done = 0;
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -2492,6 +2841,13 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		unmonitor_except_fd(vpninfo, ssl);
 		vpninfo->ssl_fd = -1;
 	}
+	/* Nothing to keep alive until the next connection */
+	timer_cancel(vpninfo, &vpninfo->ssl_times.timer);
+	if (final) {
+		gnutls_free(vpninfo->https_session.data);
+		vpninfo->https_session.data = NULL;
+		vpninfo->https_session.size = 0;
+	}
 	if (final && vpninfo->https_cred) {
 		gnutls_certificate_free_credentials(vpninfo->https_cred);
 		vpninfo->https_cred = NULL;
@@ -306,10 +306,14 @@ static int set_esp_algo(struct openconnect_info *vpninfo, const char *s, int hma
 	if (hmac) {
 		if (!strcmp(s, "sha1"))		{ vpninfo->esp_hmac = HMAC_SHA1; return 20; }
 		if (!strcmp(s, "md5"))		{ vpninfo->esp_hmac = HMAC_MD5; return 16; }
+		if (!strcmp(s, "none"))		return 0; /* AES-GCM */
 	} else {
 		if (!strcmp(s, "aes128") || !strcmp(s, "aes-128-cbc"))
 		                                { vpninfo->esp_enc = ENC_AES_128_CBC; return 16; }
 		if (!strcmp(s, "aes-256-cbc"))	{ vpninfo->esp_enc = ENC_AES_256_CBC; return 32; }
+		/* RFC4106 keying material has a 4-byte salt after the key */
+		if (!strcmp(s, "aes-128-gcm"))	{ vpninfo->esp_enc = ENC_AES_128_GCM; return 16 + 4; }
+		if (!strcmp(s, "aes-256-gcm"))	{ vpninfo->esp_enc = ENC_AES_256_GCM; return 32 + 4; }
 	}
 	vpn_progress(vpninfo, PRG_ERR, _("Unknown ESP %s algorithm: %s"), hmac ? "MAC" : "encryption", s);
 	return -ENOENT;
@@ -334,6 +338,44 @@ static int get_key_bits(xmlNode *xml_node, unsigned char *dest, int keybytes)
 	return (bits == (keybytes<<3)) ? 0 : -EINVAL;
 }
 
+/* The <ipsec> section of the getconfig response. On a rekey the ESP
+ * socket is already connected, so the port is left alone. */
+static void gpst_parse_esp_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
+			       int rekey)
+{
+#ifdef HAVE_ESP
+	xmlNode *member;
+	const char *s;
+	int c = (vpninfo->current_esp_in ^= 1);
+	int enclen=0, maclen=0;
+	/* Accept the old incoming SA for a while, as setup_esp_keys() does */
+	vpninfo->old_esp_maxseq = vpninfo->esp_in[c ^ 1].seq + 32;
+	for (member = xml_node->children; member; member=member->next) {
+		s = NULL;
+		if (!rekey && !xmlnode_get_text(member, "udp-port", &s))	udp_sockaddr(vpninfo, atoi(s));
+		else if (!xmlnode_get_text(member, "enc-algo", &s)) 	enclen = set_esp_algo(vpninfo, s, 0);
+		else if (!xmlnode_get_text(member, "hmac-algo", &s))	maclen = set_esp_algo(vpninfo, s, 1);
+		else if (!xmlnode_get_text(member, "c2s-spi", &s))	vpninfo->esp_out_next.spi = htonl(strtoul(s, NULL, 16));
+		else if (!xmlnode_get_text(member, "s2c-spi", &s))	vpninfo->esp_in[c].spi = htonl(strtoul(s, NULL, 16));
+		else if (!xmlnode_get_text(member, "lifetime", &s))	vpninfo->esp_lifetime_seconds = atoi(s);
+		/* FIXME: this won't work if ekey or akey tags appears before algo tags */
+		else if (xmlnode_is_named(member, "ekey-c2s"))		get_key_bits(member, vpninfo->esp_out_next.secrets, enclen);
+		else if (xmlnode_is_named(member, "ekey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].secrets, enclen);
+		else if (xmlnode_is_named(member, "akey-c2s"))		get_key_bits(member, vpninfo->esp_out_next.secrets+enclen, maclen);
+		else if (xmlnode_is_named(member, "akey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].secrets+enclen, maclen);
+		free((void *)s);
+	}
+	if (vpninfo->dtls_state != DTLS_DISABLED) {
+		if (setup_esp_keys(vpninfo, 0))
+			vpn_progress(vpninfo, PRG_ERR, "Failed to setup ESP keys.\n");
+		else
+			vpninfo->dtls_times.last_rekey = timer_update(vpninfo);
+	}
+#else
+	vpn_progress(vpninfo, PRG_DEBUG, _("Ignoring ESP keys since ESP support not available in this build\n"));
+#endif
+}
+
 /* Return value:
  *  < 0, on error
  *  = 0, on success; *form is populated
@@ -388,32 +430,7 @@ static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_
 				}
 			}
 		} else if (xmlnode_is_named(xml_node, "ipsec")) {
-#ifdef HAVE_ESP
-			int c = (vpninfo->current_esp_in ^= 1);
-			int enclen=0, maclen=0;
-			for (member = xml_node->children; member; member=member->next) {
-				s = NULL;
-				if (!xmlnode_get_text(member, "udp-port", &s))		udp_sockaddr(vpninfo, atoi(s));
-				else if (!xmlnode_get_text(member, "enc-algo", &s)) 	enclen = set_esp_algo(vpninfo, s, 0);
-				else if (!xmlnode_get_text(member, "hmac-algo", &s))	maclen = set_esp_algo(vpninfo, s, 1);
-				else if (!xmlnode_get_text(member, "c2s-spi", &s))	vpninfo->esp_out.spi = htonl(strtoul(s, NULL, 16));
-				else if (!xmlnode_get_text(member, "s2c-spi", &s))	vpninfo->esp_in[c].spi = htonl(strtoul(s, NULL, 16));
-				/* FIXME: this won't work if ekey or akey tags appears before algo tags */
-				else if (xmlnode_is_named(member, "ekey-c2s"))		get_key_bits(member, vpninfo->esp_out.secrets, enclen);
-				else if (xmlnode_is_named(member, "ekey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].secrets, enclen);
-				else if (xmlnode_is_named(member, "akey-c2s"))		get_key_bits(member, vpninfo->esp_out.secrets+enclen, maclen);
-				else if (xmlnode_is_named(member, "akey-s2c"))		get_key_bits(member, vpninfo->esp_in[c].secrets+enclen, maclen);
-				free((void *)s);
-			}
-			if (vpninfo->dtls_state != DTLS_DISABLED) {
-				if (setup_esp_keys(vpninfo, 0))
-					vpn_progress(vpninfo, PRG_ERR, "Failed to setup ESP keys.\n");
-				else
-					vpninfo->dtls_times.last_rekey = time(NULL);
-			}
-#else
-			vpn_progress(vpninfo, PRG_DEBUG, _("Ignoring ESP keys since ESP support not available in this build\n"));
-#endif
+			gpst_parse_esp_xml(vpninfo, xml_node, 0);
 		}
 	}
 
@@ -430,7 +447,23 @@ static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_
 	return 0;
 }
 
-static int gpst_get_config(struct openconnect_info *vpninfo)
+/* For a rekey, only the new ESP keys are wanted from the response. The
+ * addresses, routes and MTU in the rest of it are what the tunnel was
+ * set up with, and changing them under it would do no good. */
+static int gpst_parse_rekey_xml(struct openconnect_info *vpninfo, xmlNode *xml_node)
+{
+	if (!xml_node || !xmlnode_is_named(xml_node, "response"))
+		return -EINVAL;
+
+	for (xml_node = xml_node->children; xml_node; xml_node=xml_node->next) {
+		if (xmlnode_is_named(xml_node, "ipsec"))
+			gpst_parse_esp_xml(vpninfo, xml_node, 1);
+	}
+	return 0;
+}
+
+/* With 'rekey' set, only the new ESP keys are taken from the response */
+static int gpst_get_config(struct openconnect_info *vpninfo, int rekey)
 {
 	char *orig_path, *orig_ua;
 	int result;
@@ -445,7 +478,11 @@ static int gpst_get_config(struct openconnect_info *vpninfo)
 	append_opt(request_body, "os-version", vpninfo->platname);
 	append_opt(request_body, "clientos", vpninfo->platname);
 	append_opt(request_body, "hmac-algo", "sha1,md5");
+#ifdef HAVE_ESP_GCM
+	append_opt(request_body, "enc-algo", "aes-128-gcm,aes-256-gcm,aes-128-cbc,aes-256-cbc");
+#else
 	append_opt(request_body, "enc-algo", "aes-128-cbc,aes-256-cbc");
+#endif
 	if (old_addr)
 		append_opt(request_body, "preferred-ip", old_addr);
 	buf_append(request_body, "&%s", vpninfo->cookie);
@@ -464,9 +501,11 @@ static int gpst_get_config(struct openconnect_info *vpninfo)
 		goto out;
 
 	/* parse getconfig result */
-	result = gpst_xml_or_error(vpninfo, result, xml_buf, gpst_parse_config_xml, NULL, NULL);
-	if (result)
-		return result;
+	result = gpst_xml_or_error(vpninfo, result, xml_buf,
+				   rekey ? gpst_parse_rekey_xml : gpst_parse_config_xml,
+				   NULL, NULL);
+	if (result || rekey)
+		goto out;
 
 	if (!vpninfo->ip_info.mtu) {
 		/* FIXME: GP gateway config always seems to be <mtu>0</mtu> */
@@ -506,6 +545,22 @@ out:
 	return result;
 }
 
+/* The gateway hands out new ESP keys with each getconfig request. The
+ * new incoming SA is used straight away, while the old one is accepted
+ * for a while, and esp_decrypt_rx() switches to the new outgoing SA as
+ * soon as the gateway is seen using the new keys. */
+int gpst_esp_rekey(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+	vpn_progress(vpninfo, PRG_INFO, _("Requesting new ESP keys from gateway\n"));
+	ret = gpst_get_config(vpninfo, 1);
+
+	/* Don't leave the HTTPS socket open while ESP carries the traffic */
+	openconnect_close_https(vpninfo, 0);
+	return ret;
+}
+
 static int gpst_connect(struct openconnect_info *vpninfo)
 {
 	int ret;
@@ -559,7 +614,7 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
-		vpninfo->ssl_times.last_rekey = vpninfo->ssl_times.last_rx = vpninfo->ssl_times.last_tx = time(NULL);
+		ka_reset(vpninfo, &vpninfo->ssl_times);
 		vpninfo->dtls_state = DTLS_NOSECRET;
 	}
 
@@ -571,7 +626,7 @@ int gpst_setup(struct openconnect_info *vpninfo)
 	int ret;
 
 	/* Get configuration */
-	ret = gpst_get_config(vpninfo);
+	ret = gpst_get_config(vpninfo, 0);
 	if (ret)
 		return ret;
 
@@ -585,7 +640,7 @@ int gpst_setup(struct openconnect_info *vpninfo)
 		/* We want to prevent the mainloop timers from frantically
 		 * calling the GPST mainloop.
 		 */
-		vpninfo->ssl_times.last_rx = vpninfo->ssl_times.last_tx = time(NULL);
+		ka_reset(vpninfo, &vpninfo->ssl_times);
 
 		/* Using (abusing?) last_rekey as the time when the SSL tunnel
 		 * was brought up.
@@ -616,7 +671,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		return 0;
 	case DTLS_SECRET:
 	case DTLS_SLEEPING:
-		if (time(NULL) < vpninfo->dtls_times.last_rekey + 5) {
+		if (vpninfo->now < vpninfo->dtls_times.last_rekey + 5000) {
 			/* Allow 5 seconds after configuration for ESP to start */
 			if (*timeout > 5000)
 				*timeout = 5000;
@@ -646,7 +701,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		int payload_len;
 
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -684,7 +739,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			continue;
 		}
 
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = vpninfo->now;
 		switch (ethertype) {
 		case 0:
 			vpn_progress(vpninfo, PRG_DEBUG,
@@ -697,12 +752,13 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			}
 			continue;
 		case 0x0800:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received data packet of %d bytes\n"),
-				     payload_len);
-			vpninfo->cstp_pkt->len = payload_len;
-			queue_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt);
-			vpninfo->cstp_pkt = NULL;
+			vpn_pkt_trace(vpninfo,
+				      _("Received data packet of %d bytes\n"),
+				      payload_len);
+			/* As in cstp_mainloop(), keep the big receive buffer */
+			if (queue_new_packet(vpninfo, &vpninfo->data_stats.cstp,
+					     vpninfo->cstp_pkt->data, payload_len))
+				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 			work_done = 1;
 
 			if (one != 1 || zero != 0) {
@@ -727,7 +783,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = vpninfo->now;
 		unmonitor_write_fd(vpninfo, ssl);
 
 		ret = ssl_nonblock_write(vpninfo,
@@ -736,7 +792,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (ret < 0)
 			goto do_reconnect;
 		else if (!ret) {
-			switch (ka_stalled_action(&vpninfo->ssl_times, timeout)) {
+			switch (ka_stalled_action(vpninfo, &vpninfo->ssl_times)) {
 			case KA_DPD_DEAD:
 				goto peer_dead;
 			case KA_NONE:
@@ -753,12 +809,12 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 		/* Don't free the 'special' packets */
 		if (vpninfo->current_ssl_pkt != &dpd_pkt)
-			free(vpninfo->current_ssl_pkt);
+			free_pkt(vpninfo, vpninfo->current_ssl_pkt);
 
 		vpninfo->current_ssl_pkt = NULL;
 	}
 
-	switch (keepalive_action(&vpninfo->ssl_times, timeout)) {
+	switch (keepalive_action(vpninfo, &vpninfo->ssl_times)) {
 	case KA_DPD_DEAD:
 	peer_dead:
 		vpn_progress(vpninfo, PRG_ERR,
@@ -793,6 +849,8 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
+		record_tx_packet(vpninfo, &vpninfo->data_stats.cstp, this);
+
 		/* store header */
 		store_be32(this->gpst.hdr, 0x1a2b3c4d);
 		store_be16(this->gpst.hdr + 4, 0x0800); /* IPv4 EtherType */
@@ -800,9 +858,9 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		store_le32(this->gpst.hdr + 8, 1);
 		store_le32(this->gpst.hdr + 12, 0);
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sending data packet of %d bytes\n"),
-			     this->len);
+		vpn_pkt_trace(vpninfo,
+			      _("Sending data packet of %d bytes\n"),
+			      this->len);
 
 		goto handle_outgoing;
 	}
@@ -64,6 +64,17 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 #endif
 #ifndef _WIN32
 	vpninfo->tun_fd = -1;
+#endif
+#ifdef HAVE_EPOLL
+	vpninfo->epoll_fd = -1;
+	vpninfo->event_loop = EVENT_LOOP_EPOLL;
+#endif
+#ifdef HAVE_IO_URING
+	vpninfo->uring_fd = -1;
+#endif
+#ifdef HAVE_TUN_MULTIQUEUE
+	vpninfo->tun_queues = 1;
+	vpninfo->esp_worker_stop_fd = -1;
 #endif
 	init_pkt_queue(&vpninfo->incoming_queue);
 	init_pkt_queue(&vpninfo->outgoing_queue);
@@ -76,6 +87,7 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 	vpninfo->cert_expire_warning = 60 * 86400;
 	vpninfo->req_compr = COMPR_STATELESS;
 	vpninfo->max_qlen = 10;
+	vpninfo->udp_batch = DEFAULT_UDP_BATCH;
 	vpninfo->localname = strdup("localhost");
 	vpninfo->useragent = openconnect_create_useragent(useragent);
 	vpninfo->validate_peer_cert = validate_peer_cert;
@@ -114,6 +126,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.tcp_mainloop = cstp_mainloop,
 		.add_http_headers = cstp_common_headers,
 		.obtain_cookie = cstp_obtain_cookie,
+		.tls_stream = 1,
 #ifdef HAVE_DTLS
 		.udp_setup = dtls_setup,
 		.udp_mainloop = dtls_mainloop,
@@ -127,6 +140,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.tcp_mainloop = oncp_mainloop,
 		.add_http_headers = oncp_common_headers,
 		.obtain_cookie = oncp_obtain_cookie,
+		.tls_stream = 1,
 #ifdef HAVE_ESP
 		.udp_setup = esp_setup,
 		.udp_mainloop = esp_mainloop,
@@ -149,6 +163,7 @@ const struct vpn_proto openconnect_protos[] = {
 		.udp_shutdown = esp_shutdown,
 		.udp_send_probes = esp_send_probes_gp,
 		.udp_catch_probe = esp_catch_probe_gp,
+		.udp_rekey = gpst_esp_rekey,
 #endif
 	},
 	{ /* NULL */ }
@@ -259,6 +274,8 @@ static void free_optlist(struct oc_vpn_option *opt)
 
 void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 {
+	int i;
+
 	openconnect_close_https(vpninfo, 1);
 	if (vpninfo->proto->udp_shutdown)
 		vpninfo->proto->udp_shutdown(vpninfo);
@@ -268,6 +285,10 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 		closesocket(vpninfo->cmd_fd);
 		closesocket(vpninfo->cmd_fd_write);
 	}
+#ifdef HAVE_EPOLL
+	if (vpninfo->epoll_fd != -1)
+		close(vpninfo->epoll_fd);
+#endif
 
 #ifdef HAVE_ICONV
 	if (vpninfo->ic_utf8_to_legacy != (iconv_t)-1)
@@ -303,6 +324,13 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->proxy_pass);
 	free(vpninfo->vpnc_script);
 	free(vpninfo->cafile);
+	free(vpninfo->tls_session_cache);
+	free(vpninfo->tls_session_host);
+	dns_cache_free(vpninfo);
+#ifndef _WIN32
+	metrics_close(vpninfo);
+	free(vpninfo->metrics_file);
+#endif
 	free(vpninfo->ifname);
 	free(vpninfo->dtls_cipher);
 #ifdef OPENCONNECT_GNUTLS
@@ -399,9 +427,14 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	deflateEnd(&vpninfo->deflate_strm);
 
 	free(vpninfo->deflate_pkt);
-	free(vpninfo->tun_pkt);
-	free(vpninfo->dtls_pkt);
-	free(vpninfo->cstp_pkt);
+	free_pkt(vpninfo, vpninfo->tun_pkt);
+	free_pkt(vpninfo, vpninfo->dtls_pkt);
+	for (i = 0; i < MAX_UDP_BATCH; i++)
+		free_pkt(vpninfo, vpninfo->udp_rx_pkts[i]);
+	free(vpninfo->udp_gro_buf);
+	free_pkt(vpninfo, vpninfo->cstp_pkt);
+	free_pkt(vpninfo, vpninfo->cstp_tx_pkt);
+	free_pkt_pool(vpninfo);
 	free(vpninfo);
 }
 
@@ -838,6 +871,22 @@ void openconnect_set_stats_handler(struct openconnect_info *vpninfo,
 	vpninfo->stats_handler = stats_handler;
 }
 
+int openconnect_get_stats_ext(struct openconnect_info *vpninfo,
+			      struct oc_stats_ext *stats, size_t size)
+{
+	struct oc_stats_ext s = vpninfo->data_stats;
+
+	s.size = sizeof(s);
+	if (size < s.size)
+		s.size = size;
+	s.total = vpninfo->stats;
+	s.incoming_queue_max = vpninfo->incoming_queue.max;
+	s.outgoing_queue_max = vpninfo->outgoing_queue.max;
+
+	memcpy(stats, &s, s.size);
+	return s.size;
+}
+
 /* Set up a traditional OS-based tunnel device, optionally specified in 'ifname'. */
 int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
 				 const char *vpnc_script, const char *ifname)
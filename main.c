@@ -188,6 +188,14 @@ enum {
 	OPT_LOCAL_HOSTNAME,
 	OPT_PROTOCOL,
 	OPT_PASSTOS,
+	OPT_UDP_BATCH,
+	OPT_EVENT_LOOP,
+	OPT_IO_URING,
+	OPT_TUN_QUEUES,
+	OPT_KTLS,
+	OPT_ESP_OFFLOAD,
+	OPT_TLS_SESSION_CACHE,
+	OPT_METRICS_FILE,
 };
 
 #ifdef __sun__
@@ -262,6 +270,14 @@ static const struct option long_options[] = {
 	OPTION("force-dpd", 1, OPT_FORCE_DPD),
 	OPTION("non-inter", 0, OPT_NON_INTER),
 	OPTION("dtls-local-port", 1, OPT_DTLS_LOCAL_PORT),
+	OPTION("udp-batch", 1, OPT_UDP_BATCH),
+	OPTION("event-loop", 1, OPT_EVENT_LOOP),
+	OPTION("io-uring", 0, OPT_IO_URING),
+	OPTION("tun-queues", 1, OPT_TUN_QUEUES),
+	OPTION("ktls", 0, OPT_KTLS),
+	OPTION("esp-offload", 0, OPT_ESP_OFFLOAD),
+	OPTION("tls-session-cache", 1, OPT_TLS_SESSION_CACHE),
+	OPTION("metrics-file", 1, OPT_METRICS_FILE),
 	OPTION("token-mode", 1, OPT_TOKEN_MODE),
 	OPTION("token-secret", 1, OPT_TOKEN_SECRET),
 	OPTION("os", 1, OPT_OS),
@@ -832,6 +848,26 @@ static void usage(void)
 	printf("      --resolve=HOST:IP           %s\n", _("Use IP when connecting to HOST"));
 	printf("      --os=STRING                 %s\n", _("OS type (linux,linux-64,win,...) to report"));
 	printf("      --dtls-local-port=PORT      %s\n", _("Set local port for DTLS datagrams"));
+	printf("      --udp-batch=NUM             %s\n", _("Send/receive up to NUM ESP packets per system call"));
+#ifdef HAVE_EPOLL
+	printf("      --event-loop=TYPE           %s\n", _("Wait for events with select, epoll or epoll-edge"));
+#endif
+#ifdef HAVE_IO_URING
+	printf("      --io-uring                  %s\n", _("Use io_uring for tun and ESP packet I/O"));
+#endif
+#ifdef HAVE_TUN_MULTIQUEUE
+	printf("      --tun-queues=NUM            %s\n", _("Use NUM tun queues, with a thread for each extra ESP queue"));
+#endif
+#ifdef HAVE_KTLS
+	printf("      --ktls                      %s\n", _("Use kernel TLS for the tunnel's TCP connection"));
+#endif
+#ifdef HAVE_XFRM
+	printf("      --esp-offload               %s\n", _("Hand ESP encryption over to the kernel (XFRM)"));
+#endif
+	printf("      --tls-session-cache=FILE    %s\n", _("Keep the TLS session in FILE to resume it next time"));
+#ifndef _WIN32
+	printf("      --metrics-file=FILE         %s\n", _("Keep traffic statistics up to date in FILE"));
+#endif
 	printf("\n");
 
 	helpmessage();
@@ -1355,6 +1391,77 @@ int main(int argc, char **argv)
 		case OPT_DTLS_LOCAL_PORT:
 			vpninfo->dtls_local_port = atoi(config_arg);
 			break;
+		case OPT_EVENT_LOOP:
+			if (!strcmp(config_arg, "select"))
+				vpninfo->event_loop = EVENT_LOOP_SELECT;
+#ifdef HAVE_EPOLL
+			else if (!strcmp(config_arg, "epoll"))
+				vpninfo->event_loop = EVENT_LOOP_EPOLL;
+			else if (!strcmp(config_arg, "epoll-edge"))
+				vpninfo->event_loop = EVENT_LOOP_EPOLL_ET;
+#endif
+			else {
+				fprintf(stderr, _("Invalid event loop type \"%s\"\n"),
+					config_arg);
+				exit(1);
+			}
+			break;
+		case OPT_IO_URING:
+#ifdef HAVE_IO_URING
+			vpninfo->use_uring = 1;
+#else
+			fprintf(stderr, _("This build does not support io_uring\n"));
+			exit(1);
+#endif
+			break;
+		case OPT_TUN_QUEUES:
+#ifdef HAVE_TUN_MULTIQUEUE
+			vpninfo->tun_queues = atoi(config_arg);
+			if (vpninfo->tun_queues < 1 || vpninfo->tun_queues > MAX_TUN_QUEUES) {
+				fprintf(stderr, _("Number of tun queues must be between 1 and %d\n"),
+					MAX_TUN_QUEUES);
+				exit(1);
+			}
+#else
+			fprintf(stderr, _("This build does not support multi-queue tun\n"));
+			exit(1);
+#endif
+			break;
+		case OPT_KTLS:
+#ifdef HAVE_KTLS
+			vpninfo->ktls = 1;
+#else
+			fprintf(stderr, _("This build does not support kernel TLS\n"));
+			exit(1);
+#endif
+			break;
+		case OPT_TLS_SESSION_CACHE:
+			vpninfo->tls_session_cache = dup_config_arg();
+			break;
+		case OPT_METRICS_FILE:
+#ifndef _WIN32
+			vpninfo->metrics_file = dup_config_arg();
+#else
+			fprintf(stderr, _("This build does not support a metrics file\n"));
+			exit(1);
+#endif
+			break;
+		case OPT_ESP_OFFLOAD:
+#ifdef HAVE_XFRM
+			vpninfo->esp_offload = 1;
+#else
+			fprintf(stderr, _("This build does not support ESP offload\n"));
+			exit(1);
+#endif
+			break;
+		case OPT_UDP_BATCH:
+			vpninfo->udp_batch = atoi(config_arg);
+			if (vpninfo->udp_batch < 1 || vpninfo->udp_batch > MAX_UDP_BATCH) {
+				fprintf(stderr, _("UDP batch size must be between 1 and %d\n"),
+					MAX_UDP_BATCH);
+				exit(1);
+			}
+			break;
 		case OPT_TOKEN_MODE:
 			if (strcasecmp(config_arg, "rsa") == 0) {
 				token_mode = OC_TOKEN_MODE_STOKEN;
@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 #ifndef _WIN32
 /* for setgroups() */
 # include <sys/types.h>
@@ -29,40 +31,560 @@
 #endif
 
 #include "openconnect-internal.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+/* Packet buffers which fit within the current MTU (plus the ESP trailer)
+ * are all allocated at the same size, and recycled through a per-vpninfo
+ * free list instead of going back to malloc() for every packet. Anything
+ * larger is allocated and freed directly. */
+void free_pkt_pool(struct openconnect_info *vpninfo)
+{
+	struct pkt *pkt;
+
+	while ((pkt = vpninfo->pkt_pool)) {
+		vpninfo->pkt_pool = pkt->next;
+		vpninfo->pkt_mem -= sizeof(*pkt) + pkt->alloc_len;
+		free(pkt);
+	}
+	vpninfo->pkt_pool_count = 0;
+}
+
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	int pool_len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
+	struct pkt *pkt;
+
+	vpninfo->pkt_pool_allocs++;
 
-int queue_new_packet(struct pkt_q *q, void *buf, int len)
+	/* The MTU changed (e.g. after DTLS MTU detection, or on reconnect).
+	 * Buffers still in flight at the old size get freed by free_pkt(). */
+	if (pool_len != vpninfo->pkt_pool_len) {
+		free_pkt_pool(vpninfo);
+		vpninfo->pkt_pool_len = pool_len;
+	}
+
+	if (len <= pool_len) {
+		pkt = vpninfo->pkt_pool;
+		if (pkt) {
+			vpninfo->pkt_pool = pkt->next;
+			vpninfo->pkt_pool_count--;
+			vpninfo->pkt_pool_hits++;
+			pkt->next = NULL;
+			pkt->stamp = 0;
+			return pkt;
+		}
+		len = pool_len;
+	}
+
+	pkt = malloc(sizeof(*pkt) + len);
+	if (pkt) {
+		pkt->alloc_len = len;
+		pkt->next = NULL;
+		pkt->stamp = 0;
+		vpninfo->pkt_mem += sizeof(*pkt) + len;
+		if (vpninfo->pkt_mem > vpninfo->pkt_mem_max)
+			vpninfo->pkt_mem_max = vpninfo->pkt_mem;
+	}
+	return pkt;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
 {
-	struct pkt *new = malloc(sizeof(struct pkt) + len);
+	if (!pkt)
+		return;
+
+	if (pkt->alloc_len == vpninfo->pkt_pool_len &&
+	    vpninfo->pkt_pool_count < MAX_PKT_POOL) {
+		pkt->next = vpninfo->pkt_pool;
+		vpninfo->pkt_pool = pkt;
+		vpninfo->pkt_pool_count++;
+		return;
+	}
+	vpninfo->pkt_mem -= sizeof(*pkt) + pkt->alloc_len;
+	free(pkt);
+}
+
+void print_pkt_pool_stats(struct openconnect_info *vpninfo)
+{
+	unsigned long allocs = vpninfo->pkt_pool_allocs;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Packet pool: %lu allocations, %lu recycled (%lu%%), %d idle buffers of %d bytes\n"),
+		     allocs, vpninfo->pkt_pool_hits,
+		     allocs ? vpninfo->pkt_pool_hits * 100 / allocs : 0,
+		     vpninfo->pkt_pool_count, vpninfo->pkt_pool_len);
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Packet buffers: %lu bytes allocated, peak %lu bytes\n"),
+		     vpninfo->pkt_mem, vpninfo->pkt_mem_max);
+}
+
+int queue_new_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		     void *buf, int len)
+{
+	struct pkt *new = alloc_pkt(vpninfo, len);
 	if (!new)
 		return -ENOMEM;
 
 	new->len = len;
 	new->next = NULL;
 	memcpy(new->data, buf, len);
-	queue_packet(q, new);
+	queue_rx_packet(vpninfo, via, new);
 	return 0;
 }
 
+/* Packets are stamped as they enter the data path, and the time they
+ * took to get through is recorded as they leave it. Even as a vDSO call
+ * on Linux the clock costs too much to read for every packet. So it is
+ * read once per burst at the tun device, and the transports use the
+ * reading in vpninfo->now_us taken at the start of each mainloop pass. */
+uint64_t stats_clock_us(void)
+{
+	struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* As described with OC_LATENCY_BUCKETS in openconnect.h */
+static int latency_bucket(uint64_t us)
+{
+	int msb;
+
+	if (us < 4)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	if (msb > OC_LATENCY_BUCKETS / 4)
+		return OC_LATENCY_BUCKETS - 1;
+
+	return (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+}
+
+static uint64_t latency_bucket_start(int i)
+{
+	if (i < 4)
+		return i;
+
+	return (uint64_t)(4 + (i & 3)) << (i / 4 - 1);
+}
+
+static void record_latency(struct oc_latency_hist *h, struct pkt *pkt,
+			   uint64_t now)
+{
+	uint64_t us;
+
+	if (!pkt->stamp)
+		return;
+
+	/* Stamped later in the same pass, as io_uring completions may be */
+	us = now > pkt->stamp ? now - pkt->stamp : 0;
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->buckets[latency_bucket(us)]++;
+}
+
+/* A data packet from the server, now written to the tun device */
+static void record_tun_write(struct openconnect_info *vpninfo, struct pkt *pkt,
+			     uint64_t now)
+{
+	vpninfo->stats.rx_pkts++;
+	vpninfo->stats.rx_bytes += pkt->len;
+	record_latency(&vpninfo->data_stats.wire_to_tun, pkt, now);
+	oc_probe(tun_write, pkt->len, pkt->stamp ? now - pkt->stamp : 0);
+}
+
+/* A data packet from the server, received over the transport whose
+   counters are in via. Returns the length of the incoming queue. */
+int queue_rx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		    struct pkt *pkt)
+{
+	int qlen;
+
+	via->rx_pkts++;
+	via->rx_bytes += pkt->len;
+	pkt->stamp = vpninfo->now_us;
+	qlen = queue_packet(&vpninfo->incoming_queue, pkt);
+	oc_probe(rx_queue, pkt->len, qlen);
+	return qlen;
+}
+
+/* A data packet from the tun device, sent over the transport whose
+   counters are in via */
+void record_tx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		      struct pkt *pkt)
+{
+	via->tx_pkts++;
+	via->tx_bytes += pkt->len;
+	record_latency(&vpninfo->data_stats.tun_to_wire, pkt, vpninfo->now_us);
+}
+
+/* The latency which percent of packets came in under */
+static uint64_t latency_percentile(struct oc_latency_hist *h, int percent)
+{
+	uint64_t seen = 0, want = (h->count * percent + 99) / 100;
+	int i;
+
+	for (i = 0; i < OC_LATENCY_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == OC_LATENCY_BUCKETS - 1)
+		return h->max_us + 1;
+	return latency_bucket_start(i + 1);
+}
+
+static void print_latency(struct openconnect_info *vpninfo, const char *name,
+			  struct oc_latency_hist *h)
+{
+	if (!h->count)
+		return;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("%s latency: %llu packets, mean %llu µs, 50%% under %llu µs, 99%% under %llu µs, max %llu µs\n"),
+		     name, (unsigned long long)h->count,
+		     (unsigned long long)(h->total_us / h->count),
+		     (unsigned long long)latency_percentile(h, 50),
+		     (unsigned long long)latency_percentile(h, 99),
+		     (unsigned long long)h->max_us);
+}
+
+void print_data_stats(struct openconnect_info *vpninfo)
+{
+	struct oc_stats_ext *s = &vpninfo->data_stats;
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Packets sent/received: CSTP %llu/%llu, DTLS %llu/%llu, ESP %llu/%llu\n"),
+		     (unsigned long long)s->cstp.tx_pkts, (unsigned long long)s->cstp.rx_pkts,
+		     (unsigned long long)s->dtls.tx_pkts, (unsigned long long)s->dtls.rx_pkts,
+		     (unsigned long long)s->esp.tx_pkts, (unsigned long long)s->esp.rx_pkts);
+	if (s->drop_bad_hmac || s->drop_replay || s->drop_bad_padding ||
+	    s->drop_unknown_spi || s->drop_decompress || s->drop_sock_full ||
+	    s->drop_queue_full)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Packets dropped: %llu bad HMAC, %llu replayed, %llu bad padding, %llu unknown SPI, %llu failed decompression, %llu socket full, %llu queue full\n"),
+			     (unsigned long long)s->drop_bad_hmac,
+			     (unsigned long long)s->drop_replay,
+			     (unsigned long long)s->drop_bad_padding,
+			     (unsigned long long)s->drop_unknown_spi,
+			     (unsigned long long)s->drop_decompress,
+			     (unsigned long long)s->drop_sock_full,
+			     (unsigned long long)s->drop_queue_full);
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Queue high-water marks: %d incoming, %d outgoing\n"),
+		     vpninfo->incoming_queue.max, vpninfo->outgoing_queue.max);
+	print_latency(vpninfo, _("Tun to wire"), &s->tun_to_wire);
+	print_latency(vpninfo, _("Wire to tun"), &s->wire_to_tun);
+}
+
+#ifdef HAVE_IO_URING
+/* With io_uring, reads are kept posted on the tun device and the ESP
+ * socket, and writes are posted straight from the packet queues. All the
+ * requests queued in one pass of the mainloop go to the kernel with a
+ * single io_uring_enter() in uring_mainloop(), and the mainloop waits
+ * on the ring fd instead of on the tun and ESP fds. */
+static const uint8_t uring_opcodes[] = {
+	[URING_TUN_READ] = IORING_OP_READ,
+	[URING_TUN_WRITE] = IORING_OP_WRITE,
+	[URING_UDP_RECV] = IORING_OP_RECV,
+	[URING_UDP_SEND] = IORING_OP_SEND,
+};
+
+static struct io_uring_sqe *uring_get_sqe(struct openconnect_info *vpninfo)
+{
+	struct io_uring_sqe *sqe = oc_uring_get_sqe(vpninfo->uring);
+
+	if (!sqe) {
+		/* Submission queue is full; flush it to the kernel */
+		if (oc_uring_submit(vpninfo->uring, 0) > 0)
+			vpninfo->uring_enters++;
+		sqe = oc_uring_get_sqe(vpninfo->uring);
+	}
+	if (sqe)
+		vpninfo->uring_inflight++;
+	return sqe;
+}
+
+/* Returns -EAGAIN if the ring is full. On success, pkt belongs to the
+   ring until its completion is reaped. */
+int uring_post(struct openconnect_info *vpninfo, int op, int fd,
+	       struct pkt *pkt, void *buf, int len)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Never have more in flight than the completion queue can hold */
+	if (vpninfo->uring_inflight >= vpninfo->uring->cq_entries)
+		return -EAGAIN;
+
+	sqe = uring_get_sqe(vpninfo);
+	if (!sqe)
+		return -EAGAIN;
+
+	oc_uring_prep_rw(sqe, uring_opcodes[op], fd, buf, len,
+			 (uintptr_t)pkt | op);
+	if (op == URING_TUN_READ || op == URING_TUN_WRITE)
+		sqe->off = -1; /* Current file position, as read()/write() */
+	return 0;
+}
+
+static void uring_post_cancel(struct openconnect_info *vpninfo, int fd,
+			      unsigned flags)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(vpninfo);
+
+	if (!sqe)
+		return;
+
+	oc_uring_prep_rw(sqe, IORING_OP_ASYNC_CANCEL, fd, NULL, 0, 0);
+	sqe->cancel_flags = flags;
+}
+
+/* Must be called before closing an fd which may have requests posted */
+void uring_cancel_fd(struct openconnect_info *vpninfo, int fd)
+{
+	if (!vpninfo->uring)
+		return;
+
+	uring_post_cancel(vpninfo, fd,
+			  IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL);
+	if (oc_uring_submit(vpninfo->uring, 0) > 0)
+		vpninfo->uring_enters++;
+}
+
+static void uring_complete(struct openconnect_info *vpninfo, struct pkt *pkt,
+			   int op, int res, uint64_t now)
+{
+	switch (op) {
+	case URING_TUN_READ:
+		vpninfo->uring_tun_reads--;
+		if (res > 0) {
+			pkt->len = res;
+			pkt->stamp = now;
+			vpninfo->stats.tx_pkts++;
+			vpninfo->stats.tx_bytes += res;
+			queue_packet(&vpninfo->outgoing_queue, pkt);
+			return;
+		}
+		break;
+
+	case URING_TUN_WRITE:
+		if (res >= 0) {
+			record_tun_write(vpninfo, pkt, now);
+		} else if (vpninfo->script_tun && res == -ENOTCONN) {
+			/* Handle death of "script" socket */
+			vpninfo->quit_reason = "Client connection terminated";
+		}
+		break;
+
+	case URING_UDP_RECV:
+		vpninfo->uring_udp_recvs--;
+#ifdef HAVE_ESP
+		if (res > 0) {
+			esp_uring_rx(vpninfo, pkt, res);
+			return;
+		}
+#endif
+		break;
+
+	case URING_UDP_SEND:
+		/* Not that errors are likely to happen with UDP, but... */
+		if (res >= 0)
+			record_tx_packet(vpninfo, &vpninfo->data_stats.esp, pkt);
+		else if (res == -ENOBUFS || res == -EAGAIN)
+			count_drop(vpninfo, sock_full);
+		else if (res != -ECANCELED)
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to send ESP packet: %s\n"),
+				     strerror(-res));
+		break;
+	}
+	free_pkt(vpninfo, pkt);
+}
+
+static int uring_reap(struct openconnect_info *vpninfo)
+{
+	struct io_uring_cqe *cqe;
+	uint64_t user_data, now = stats_clock_us();
+	int work_done = 0;
+	int res;
+
+	while ((cqe = oc_uring_peek_cqe(vpninfo->uring))) {
+		user_data = cqe->user_data;
+		res = cqe->res;
+		oc_uring_cqe_seen(vpninfo->uring);
+
+		vpninfo->uring_inflight--;
+		vpninfo->uring_cqes++;
+		work_done = 1;
+
+		/* Cancellations have no packet attached */
+		if (user_data & ~(uint64_t)URING_OP_MASK)
+			uring_complete(vpninfo,
+				       (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK),
+				       user_data & URING_OP_MASK, res, now);
+	}
+	return work_done;
+}
+
+/* Submit everything posted during this pass, then harvest completions */
+static int uring_mainloop(struct openconnect_info *vpninfo)
+{
+	int ret = oc_uring_submit(vpninfo->uring, 0);
+
+	if (ret > 0)
+		vpninfo->uring_enters++;
+	else if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR)
+		vpn_progress(vpninfo, PRG_ERR, _("io_uring_enter: %s\n"),
+			     strerror(-ret));
+
+	return uring_reap(vpninfo);
+}
+
+static int tun_uring_mainloop(struct openconnect_info *vpninfo)
+{
+	int len = vpninfo->ip_info.mtu;
+	struct pkt *this;
+
+	/* Keep enough reads posted to fill the outgoing queue */
+	while (vpninfo->outgoing_queue.count + vpninfo->uring_tun_reads <
+	       vpninfo->max_qlen) {
+		this = alloc_pkt(vpninfo, len + vpninfo->pkt_trailer);
+		if (!this) {
+			vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
+			break;
+		}
+		if (uring_post(vpninfo, URING_TUN_READ, vpninfo->tun_fd, this,
+			       this->data, len)) {
+			free_pkt(vpninfo, this);
+			break;
+		}
+		vpninfo->uring_tun_reads++;
+	}
+
+	while ((this = dequeue_packet(&vpninfo->incoming_queue))) {
+		if (uring_post(vpninfo, URING_TUN_WRITE, vpninfo->tun_fd, this,
+			       this->data, this->len)) {
+			requeue_packet(&vpninfo->incoming_queue, this);
+			break;
+		}
+	}
+
+	/* The work is counted as the completions are reaped */
+	return 0;
+}
+
+static void setup_uring(struct openconnect_info *vpninfo)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	if (!vpninfo->use_uring || vpninfo->uring)
+		return;
+
+	vpninfo->uring = calloc(1, sizeof(*vpninfo->uring));
+	if (!vpninfo->uring)
+		return;
+
+	ret = oc_uring_init(vpninfo->uring, URING_ENTRIES);
+	if (!ret) {
+		/* We rely on cancelling by fd (Linux 5.19) when the ESP
+		   socket is closed, so make sure the kernel has it. */
+		uring_post_cancel(vpninfo, -1, IORING_ASYNC_CANCEL_ANY);
+		ret = oc_uring_submit(vpninfo->uring, 1);
+		cqe = oc_uring_peek_cqe(vpninfo->uring);
+		if (ret >= 0 && cqe) {
+			ret = cqe->res == -ENOENT ? 0 : cqe->res;
+			oc_uring_cqe_seen(vpninfo->uring);
+		}
+		vpninfo->uring_inflight = 0;
+	}
+	if (ret < 0) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to set up io_uring: %s\n"),
+			     strerror(-ret));
+		vpn_progress(vpninfo, PRG_INFO, _("Falling back to non-blocking I/O\n"));
+		oc_uring_free(vpninfo->uring);
+		free(vpninfo->uring);
+		vpninfo->uring = NULL;
+		vpninfo->use_uring = 0;
+		return;
+	}
+
+	vpninfo->uring_fd = vpninfo->uring->fd;
+	vpninfo->uring_enters = vpninfo->uring_cqes = 0;
+	monitor_read_fd(vpninfo, uring);
+}
+
+static void shutdown_uring(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->uring)
+		return;
+
+	/* The kernel may still be reading into our packet buffers.
+	   Cancel everything and wait for it all to come back. */
+	uring_post_cancel(vpninfo, -1, IORING_ASYNC_CANCEL_ANY);
+	while (vpninfo->uring_inflight > 0) {
+		int ret = oc_uring_submit(vpninfo->uring, 1);
+
+		if (ret < 0 && ret != -EINTR) {
+			vpn_progress(vpninfo, PRG_ERR, _("io_uring_enter: %s\n"),
+				     strerror(-ret));
+			break;
+		}
+		uring_reap(vpninfo);
+	}
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("io_uring: %lu completions in %lu submissions\n"),
+		     vpninfo->uring_cqes, vpninfo->uring_enters);
+
+	unmonitor_read_fd(vpninfo, uring);
+	oc_uring_free(vpninfo->uring);
+	free(vpninfo->uring);
+	vpninfo->uring = NULL;
+	vpninfo->uring_fd = -1;
+	vpninfo->uring_inflight = 0;
+	vpninfo->uring_tun_reads = vpninfo->uring_udp_recvs = 0;
+}
+#endif
+
 /* This is here because it's generic and hence can't live in either of the
    tun*.c files for specific platforms */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	struct pkt *this;
+	uint64_t now;
 	int work_done = 0;
 
 	if (!tun_is_up(vpninfo)) {
 		/* no tun yet, clear any queued packets */
-		while ((this = dequeue_packet(&vpninfo->incoming_queue)));
+		while ((this = dequeue_packet(&vpninfo->incoming_queue)))
+			free_pkt(vpninfo, this);
 		return 0;
 	}
 
+#ifdef HAVE_IO_URING
+	if (vpninfo->uring)
+		return tun_uring_mainloop(vpninfo);
+#endif
+
 	if (read_fd_monitored(vpninfo, tun)) {
 		struct pkt *out_pkt = vpninfo->tun_pkt;
+
+		now = stats_clock_us();
 		while (1) {
 			int len = vpninfo->ip_info.mtu;
 
 			if (!out_pkt) {
-				out_pkt = malloc(sizeof(struct pkt) + len + vpninfo->pkt_trailer);
+				out_pkt = alloc_pkt(vpninfo, len + vpninfo->pkt_trailer);
 				if (!out_pkt) {
 					vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 					break;
@@ -73,6 +595,7 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			if (os_read_tun(vpninfo, out_pkt))
 				break;
 
+			out_pkt->stamp = now;
 			vpninfo->stats.tx_pkts++;
 			vpninfo->stats.tx_bytes += out_pkt->len;
 			work_done = 1;
@@ -90,6 +613,8 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		monitor_read_fd(vpninfo, tun);
 	}
 
+	if (vpninfo->incoming_queue.head)
+		now = stats_clock_us();
 	while ((this = dequeue_packet(&vpninfo->incoming_queue))) {
 
 		unmonitor_write_fd(vpninfo, tun);
@@ -99,15 +624,101 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			break;
 		}
 
-		vpninfo->stats.rx_pkts++;
-		vpninfo->stats.rx_bytes += this->len;
+		record_tun_write(vpninfo, this, now);
 
-		free(this);
+		free_pkt(vpninfo, this);
 	}
 	/* Work is not done if we just got rid of packets off the queue */
 	return work_done;
 }
 
+#ifdef HAVE_EPOLL
+/* Interest in each fd is only pushed to the kernel when it changes. When
+ * epoll isn't in use, this just records it for the select() fallback. */
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd,
+		       uint32_t *monitored, uint32_t events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (*monitored == events)
+		return;
+
+	if (vpninfo->epoll_fd != -1 && fd != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		/* The command pipe stays level-triggered, as only one
+		   command is read from it each time it polls readable */
+		if (vpninfo->event_loop == EVENT_LOOP_EPOLL_ET && fd != vpninfo->cmd_fd)
+			ev.events |= EPOLLET;
+		ev.data.fd = fd;
+
+		if (!*monitored)
+			op = EPOLL_CTL_ADD;
+		else if (!events)
+			op = EPOLL_CTL_DEL;
+		else
+			op = EPOLL_CTL_MOD;
+
+		/* The fd may have been closed (which drops it from the epoll
+		   set) and its number reused since we last looked at it. */
+		if (epoll_ctl(vpninfo->epoll_fd, op, fd, &ev) && events) {
+			if (errno == ENOENT)
+				epoll_ctl(vpninfo->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+			else if (errno == EEXIST)
+				epoll_ctl(vpninfo->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		}
+	}
+	*monitored = events;
+}
+
+/* Interest registered before the mainloop started was only recorded */
+static void epoll_add_monitored(struct openconnect_info *vpninfo, int fd,
+				uint32_t *monitored)
+{
+	uint32_t events = *monitored;
+
+	*monitored = 0;
+	monitor_fd_events(vpninfo, fd, monitored, events);
+}
+
+static void setup_epoll(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->epoll_fd != -1 || vpninfo->event_loop == EVENT_LOOP_SELECT)
+		return;
+
+	vpninfo->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (vpninfo->epoll_fd < 0) {
+		vpn_perror(vpninfo, _("epoll_create1"));
+		vpn_progress(vpninfo, PRG_INFO, _("Falling back to select()\n"));
+		vpninfo->epoll_fd = -1;
+		vpninfo->event_loop = EVENT_LOOP_SELECT;
+		return;
+	}
+
+	epoll_add_monitored(vpninfo, vpninfo->tun_fd, &vpninfo->tun_monitored);
+	epoll_add_monitored(vpninfo, vpninfo->ssl_fd, &vpninfo->ssl_monitored);
+	epoll_add_monitored(vpninfo, vpninfo->dtls_fd, &vpninfo->dtls_monitored);
+	epoll_add_monitored(vpninfo, vpninfo->cmd_fd, &vpninfo->cmd_monitored);
+}
+
+static void select_monitored(int fd, uint32_t monitored, int *nfds,
+			     fd_set *rfds, fd_set *wfds, fd_set *efds)
+{
+	if (fd == -1 || !monitored)
+		return;
+
+	if (monitored & EPOLLIN)
+		FD_SET(fd, rfds);
+	if (monitored & EPOLLOUT)
+		FD_SET(fd, wfds);
+	if (monitored & EPOLLPRI)
+		FD_SET(fd, efds);
+	if (*nfds <= fd)
+		*nfds = fd + 1;
+}
+#endif
+
 static int setup_tun_device(struct openconnect_info *vpninfo)
 {
 	int ret;
@@ -162,6 +773,9 @@ static int setup_tun_device(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+/* Busy passes through the mainloop between looks at the command pipe */
+#define CMD_POLL_LOOPS 16
+
 /* Return value:
  *  = 0, when successfully paused (may call again)
  *  = -EINTR, if aborted locally via OC_CMD_CANCEL
@@ -175,6 +789,7 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			 int reconnect_interval)
 {
 	int ret = 0;
+	int busy_loops = 0;
 
 	vpninfo->reconnect_timeout = reconnect_timeout;
 	vpninfo->reconnect_interval = reconnect_interval;
@@ -183,6 +798,17 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		monitor_fd_new(vpninfo, cmd);
 		monitor_read_fd(vpninfo, cmd);
 	}
+#ifdef HAVE_EPOLL
+	setup_epoll(vpninfo);
+#endif
+#ifdef HAVE_IO_URING
+	setup_uring(vpninfo);
+#endif
+#ifndef _WIN32
+	/* Carry on without it if it can't be set up */
+	if (vpninfo->metrics_file && !vpninfo->metrics)
+		metrics_open(vpninfo);
+#endif
 
 	while (!vpninfo->quit_reason) {
 		int did_work = 0;
@@ -193,8 +819,45 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 #else
 		struct timeval tv;
 		fd_set rfds, wfds, efds;
+#ifdef HAVE_EPOLL
+		struct epoll_event evs[8];
+		int i, nfds = 0;
+#endif
 #endif
 
+		if (vpninfo->got_cancel_cmd) {
+			if (vpninfo->cancel_type == OC_CMD_CANCEL) {
+				vpninfo->quit_reason = "Aborted by caller";
+				ret = -EINTR;
+			} else {
+				ret = -ECONNABORTED;
+			}
+			vpninfo->got_cancel_cmd = 0;
+			break;
+		}
+
+		if (vpninfo->got_pause_cmd) {
+			/* close all connections and wait for the user to call
+			   openconnect_mainloop() again */
+			openconnect_close_https(vpninfo, 0);
+			if (vpninfo->dtls_state > DTLS_DISABLED) {
+				vpninfo->proto->udp_close(vpninfo);
+				vpninfo->new_dtls_started = 0;
+			}
+
+			vpninfo->got_pause_cmd = 0;
+#ifdef HAVE_IO_URING
+			shutdown_uring(vpninfo);
+#endif
+			vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
+			return 0;
+		}
+
+		/* The clock readings for everything this time round: coarse
+		   for the timers, and finer for the latency statistics */
+		timer_update(vpninfo);
+		vpninfo->now_us = stats_clock_us();
+
 		/* If tun is not up, loop more often to detect
 		 * a DTLS timeout (due to a firewall block) as soon. */
 		if (tun_is_up(vpninfo))
@@ -232,43 +895,55 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			break;
 		did_work += ret;
 
+		/* Keep a dynamic DNS server's address ready for reconnecting */
+		dns_refresh(vpninfo, &timeout);
+
 		/* Tun must be last because it will set/clear its bit
 		   in the select_rfds according to the queue length */
 		did_work += tun_mainloop(vpninfo, &timeout);
 		if (vpninfo->quit_reason)
 			break;
 
-		poll_cmd_fd(vpninfo, 0);
-		if (vpninfo->got_cancel_cmd) {
-			if (vpninfo->cancel_type == OC_CMD_CANCEL) {
-				vpninfo->quit_reason = "Aborted by caller";
-				ret = -EINTR;
-			} else {
-				ret = -ECONNABORTED;
-			}
-			vpninfo->got_cancel_cmd = 0;
-			break;
+#ifdef HAVE_IO_URING
+		if (vpninfo->uring) {
+			did_work += uring_mainloop(vpninfo);
+			if (vpninfo->quit_reason)
+				break;
 		}
-
-		if (vpninfo->got_pause_cmd) {
-			/* close all connections and wait for the user to call
-			   openconnect_mainloop() again */
-			openconnect_close_https(vpninfo, 0);
-			if (vpninfo->dtls_state > DTLS_DISABLED) {
-				vpninfo->proto->udp_close(vpninfo);
-				vpninfo->new_dtls_started = 0;
-			}
-
-			vpninfo->got_pause_cmd = 0;
-			vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
-			return 0;
+#endif
+		/* Fetching new ESP keys may mean waiting for the server, so
+		   it's done here, once everything received so far has gone
+		   to the tun device, rather than in the middle of handling
+		   packets. Any ESP worker threads carry on meanwhile. */
+		if (vpninfo->udp_rekey_due) {
+			vpninfo->udp_rekey_due = 0;
+			if (vpninfo->proto->udp_rekey(vpninfo))
+				vpn_progress(vpninfo, PRG_ERR, _("ESP rekey failed\n"));
+			if (vpninfo->quit_reason)
+				break;
+			timer_update(vpninfo);
+			did_work = 1;
 		}
 
-		if (did_work)
-			continue;
+#ifndef _WIN32
+		metrics_update(vpninfo, did_work, &timeout);
+#endif
+		timers_next(vpninfo, &timeout);
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("No work to do; sleeping for %d ms...\n"), timeout);
+		/* The command pipe is only read when the wait below finds it
+		   readable. While there is work to do we go round again
+		   without waiting, but every CMD_POLL_LOOPS passes we still
+		   wait, with a zero timeout, so that a steady stream of traffic
+		   can't hold off a cancel or pause indefinitely. */
+		if (did_work) {
+			if (++busy_loops < CMD_POLL_LOOPS)
+				continue;
+			timeout = 0;
+		} else {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("No work to do; sleeping for %d ms...\n"), timeout);
+		}
+		busy_loops = 0;
 
 #ifdef _WIN32
 		if (vpninfo->dtls_monitored) {
@@ -293,6 +968,42 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 				     errstr);
 			free(errstr);
 		}
+		poll_cmd_fd(vpninfo, 0);
+#else
+#ifdef HAVE_EPOLL
+		if (vpninfo->epoll_fd != -1) {
+			/* Beyond the command pipe we don't care which fds are
+			   ready; each of the protocol mainloops will just try
+			   its own I/O. */
+			nfds = epoll_wait(vpninfo->epoll_fd, evs, 8, timeout);
+			if (nfds < 0 && errno != EINTR)
+				vpn_perror(vpninfo, _("epoll_wait"));
+
+			FD_ZERO(&rfds);
+			for (i = 0; i < nfds; i++) {
+				if (evs[i].data.fd == vpninfo->cmd_fd)
+					FD_SET(vpninfo->cmd_fd, &rfds);
+			}
+			check_cmd_fd(vpninfo, &rfds);
+			continue;
+		}
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		select_monitored(vpninfo->tun_fd, vpninfo->tun_monitored, &nfds, &rfds, &wfds, &efds);
+		select_monitored(vpninfo->ssl_fd, vpninfo->ssl_monitored, &nfds, &rfds, &wfds, &efds);
+		select_monitored(vpninfo->dtls_fd, vpninfo->dtls_monitored, &nfds, &rfds, &wfds, &efds);
+		select_monitored(vpninfo->cmd_fd, vpninfo->cmd_monitored, &nfds, &rfds, &wfds, &efds);
+#ifdef HAVE_IO_URING
+		select_monitored(vpninfo->uring_fd, vpninfo->uring_monitored, &nfds, &rfds, &wfds, &efds);
+#endif
+
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+
+		if (select(nfds, &rfds, &wfds, &efds, &tv) < 0)
+			FD_ZERO(&rfds);
 #else
 		memcpy(&rfds, &vpninfo->_select_rfds, sizeof(rfds));
 		memcpy(&wfds, &vpninfo->_select_wfds, sizeof(wfds));
@@ -301,62 +1012,101 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		tv.tv_sec = timeout / 1000;
 		tv.tv_usec = (timeout % 1000) * 1000;
 
-		select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv);
+		if (select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv) < 0)
+			FD_ZERO(&rfds);
+#endif
+		check_cmd_fd(vpninfo, &rfds);
 #endif
 	}
 
 	if (vpninfo->quit_reason && vpninfo->proto->vpn_close_session)
 		vpninfo->proto->vpn_close_session(vpninfo, vpninfo->quit_reason);
 
+#if defined(HAVE_ESP) && defined(HAVE_TUN_MULTIQUEUE)
+	esp_stop_workers(vpninfo);
+#endif
+#ifdef HAVE_IO_URING
+	shutdown_uring(vpninfo);
+#endif
 	if (tun_is_up(vpninfo))
 		os_shutdown_tun(vpninfo);
 	return ret < 0 ? ret : -EIO;
 }
 
-static int ka_check_deadline(int *timeout, time_t now, time_t due)
+/* The connection has (re)started; the deadlines count from now */
+void ka_reset(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+	ka->last_rekey = ka->last_rx = ka->last_tx = timer_update(vpninfo);
+	ka->stalled = 0;
+	timer_cancel(vpninfo, &ka->timer);
+}
+
+static int ka_check_deadline(uint64_t *next, uint64_t now, uint64_t due)
 {
 	if (now >= due)
 		return 1;
-	if (*timeout > (due - now) * 1000)
-		*timeout = (due - now) * 1000;
+	if (*next > due)
+		*next = due;
 	return 0;
 }
 
+static void ka_set_timer(struct openconnect_info *vpninfo,
+			 struct keepalive_info *ka, uint64_t next)
+{
+	if (next == UINT64_MAX)
+		timer_cancel(vpninfo, &ka->timer);
+	else
+		timer_set(vpninfo, &ka->timer, next);
+}
+
 /* Called when the socket is unwritable, to get the deadline for DPD.
    Returns 1 if DPD deadline has already arrived. */
-int ka_stalled_action(struct keepalive_info *ka, int *timeout)
+int ka_stalled_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
 {
-	time_t now = time(NULL);
+	uint64_t now = vpninfo->now;
+	uint64_t next = UINT64_MAX;
+
+	/* Its timer no longer covers what keepalive_action() looks for */
+	ka->stalled = 1;
 
 	/* We only support the new-tunnel rekey method for now. */
 	if (ka->rekey_method != REKEY_NONE &&
-	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
+	    ka_check_deadline(&next, now, ka->last_rekey + ka->rekey * 1000ULL)) {
 		ka->last_rekey = now;
 		return KA_REKEY;
 	}
 
 	if (ka->dpd &&
-	    ka_check_deadline(timeout, now, ka->last_rx + (2 * ka->dpd)))
+	    ka_check_deadline(&next, now, ka->last_rx + 2 * ka->dpd * 1000ULL))
 		return KA_DPD_DEAD;
 
+	ka_set_timer(vpninfo, ka, next);
 	return KA_NONE;
 }
 
-
-int keepalive_action(struct keepalive_info *ka, int *timeout)
+/* Packets coming and going only ever push the deadlines back, so until
+   the timer for the earliest of them fires there's nothing to look at.
+   After an action the next call works them all out again. */
+int keepalive_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
 {
-	time_t now = time(NULL);
+	uint64_t now = vpninfo->now;
+	uint64_t next = UINT64_MAX;
+
+	if (!ka->stalled && timer_pending(&ka->timer, now))
+		return KA_NONE;
+	ka->stalled = 0;
+	timer_cancel(vpninfo, &ka->timer);
 
 	if (ka->rekey_method != REKEY_NONE &&
-	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
+	    ka_check_deadline(&next, now, ka->last_rekey + ka->rekey * 1000ULL)) {
 		ka->last_rekey = now;
 		return KA_REKEY;
 	}
 
 	/* DPD is bidirectional -- PKT 3 out, PKT 4 back */
 	if (ka->dpd) {
-		time_t due = ka->last_rx + ka->dpd;
-		time_t overdue = ka->last_rx + (2 * ka->dpd);
+		uint64_t due = ka->last_rx + ka->dpd * 1000ULL;
+		uint64_t overdue = ka->last_rx + 2 * ka->dpd * 1000ULL;
 
 		/* Peer didn't respond */
 		if (now > overdue)
@@ -365,22 +1115,26 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 		/* If we already have DPD outstanding, don't flood. Repeat by
 		   all means, but only after half the DPD period. */
 		if (ka->last_dpd > ka->last_rx)
-			due = ka->last_dpd + ka->dpd / 2;
+			due = ka->last_dpd + ka->dpd * 500ULL;
 
 		/* We haven't seen a packet from this host for $DPD seconds.
 		   Prod it to see if it's still alive */
-		if (ka_check_deadline(timeout, now, due)) {
+		if (ka_check_deadline(&next, now, due)) {
 			ka->last_dpd = now;
 			return KA_DPD;
 		}
+
+		/* Wake up to declare it dead, if nothing else */
+		ka_check_deadline(&next, now, overdue + 1);
 	}
 
 	/* Keepalive is just client -> server.
 	   If we haven't sent anything for $KEEPALIVE seconds, send a
 	   dummy packet (which the server will discard) */
 	if (ka->keepalive &&
-	    ka_check_deadline(timeout, now, ka->last_tx + ka->keepalive))
+	    ka_check_deadline(&next, now, ka->last_tx + ka->keepalive * 1000ULL))
 		return KA_KEEPALIVE;
 
+	ka_set_timer(vpninfo, ka, next);
 	return KA_NONE;
 }
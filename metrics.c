@@ -0,0 +1,183 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "openconnect-internal.h"
+#include "openconnect-metrics.h"
+
+/*
+ * The statistics from openconnect_get_stats_ext(), published in a shared
+ * file mapping as described in openconnect-metrics.h. A scraper can read
+ * them as often as it likes without any system calls, and without
+ * waiting on the mainloop as OC_CMD_STATS does.
+ *
+ * Copying them in for every packet would cost more than the packets do,
+ * so the mainloop does it at most every METRICS_INTERVAL_MS, and only
+ * while something is happening.
+ */
+#define METRICS_INTERVAL_MS 100
+
+int metrics_open(struct openconnect_info *vpninfo)
+{
+	struct oc_metrics *m = MAP_FAILED;
+	struct stat st;
+	char *tmpname;
+	int fd, err;
+
+	/* We usually run as root, so never write through whatever is at
+	   that path already; it could be a symlink to anything. Set up a
+	   new file alongside, which mkstemp() creates without following
+	   symlinks, then rename() it over the old one. Readers never see
+	   it half done, either. */
+	if (asprintf(&tmpname, "%s.XXXXXX", vpninfo->metrics_file) == -1) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open metrics file %s: %s\n"),
+			     vpninfo->metrics_file, strerror(ENOMEM));
+		return -ENOMEM;
+	}
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		err = errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open metrics file %s: %s\n"),
+			     vpninfo->metrics_file, strerror(err));
+		free(tmpname);
+		return -err;
+	}
+	set_fd_cloexec(fd);
+
+	/* Monitoring tools need to read it, even if it's ours */
+	if (fstat(fd, &st) || fchmod(fd, 0644) ||
+	    ftruncate(fd, sizeof(*m))) {
+		err = errno;
+		goto fail;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+		err = EPERM;
+		goto fail;
+	}
+
+	m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		err = errno;
+		goto fail;
+	}
+
+	m->version = OC_METRICS_VERSION;
+	m->size = sizeof(*m);
+	m->interval_ms = METRICS_INTERVAL_MS;
+	m->pid = getpid();
+	/* Readers look for this first */
+	__atomic_store_n(&m->magic, OC_METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	if (rename(tmpname, vpninfo->metrics_file)) {
+		err = errno;
+		goto fail;
+	}
+	close(fd);
+	free(tmpname);
+
+	vpninfo->metrics = m;
+	vpninfo->metrics_dirty = 1;
+	return 0;
+
+ fail:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Failed to set up metrics file %s: %s\n"),
+		     vpninfo->metrics_file, strerror(err));
+	if (m != MAP_FAILED)
+		munmap(m, sizeof(*m));
+	close(fd);
+	unlink(tmpname);
+	free(tmpname);
+	return -err;
+}
+
+static void metrics_publish(struct openconnect_info *vpninfo, uint64_t now)
+{
+	struct oc_metrics *m = vpninfo->metrics;
+	uint32_t seq = m->seq;
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	esp_collect_worker_stats(vpninfo);
+#endif
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	openconnect_get_stats_ext(vpninfo, &m->stats, sizeof(m->stats));
+	m->updated_us = now;
+
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+
+	vpninfo->metrics_time = now;
+	vpninfo->metrics_dirty = 0;
+}
+
+/* Called on each pass of the mainloop, with did_work saying whether it
+   handled any traffic */
+void metrics_update(struct openconnect_info *vpninfo, int did_work,
+		    int *timeout)
+{
+	uint64_t now, due;
+
+	if (!vpninfo->metrics)
+		return;
+
+	/* The ESP workers' traffic doesn't show up in did_work */
+#ifdef HAVE_TUN_MULTIQUEUE
+	if (vpninfo->nr_esp_workers)
+		did_work = 1;
+#endif
+	if (did_work)
+		vpninfo->metrics_dirty = 1;
+	if (!vpninfo->metrics_dirty)
+		return;
+
+	now = stats_clock_us();
+	due = vpninfo->metrics_time + METRICS_INTERVAL_MS * 1000;
+	if (now >= due) {
+		metrics_publish(vpninfo, now);
+		return;
+	}
+
+	/* Come back to publish what has changed, even if it goes quiet */
+	if (*timeout > (due - now + 999) / 1000)
+		*timeout = (due - now + 999) / 1000;
+}
+
+void metrics_close(struct openconnect_info *vpninfo)
+{
+	struct oc_metrics *m = vpninfo->metrics;
+
+	if (!m)
+		return;
+
+	/* The final figures stay in the file */
+	metrics_publish(vpninfo, stats_clock_us());
+	__atomic_store_n(&m->pid, 0, __ATOMIC_RELEASE);
+
+	munmap(m, sizeof(*m));
+	vpninfo->metrics = NULL;
+}
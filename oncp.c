@@ -365,7 +365,7 @@ static int process_attr(struct openconnect_info *vpninfo, int group, int attr,
 	case GRP_ATTR(7, 1):
 		if (attrlen != 4)
 			goto badlen;
-		memcpy(&vpninfo->esp_out.spi, data, 4);
+		memcpy(&vpninfo->esp_out_next.spi, data, 4);
 		vpn_progress(vpninfo, PRG_DEBUG, _("ESP SPI (outbound): %x\n"),
 			     load_be32(data));
 		break;
@@ -373,7 +373,7 @@ static int process_attr(struct openconnect_info *vpninfo, int group, int attr,
 	case GRP_ATTR(7, 2):
 		if (attrlen != 0x40)
 			goto badlen;
-		memcpy(vpninfo->esp_out.secrets, data, 0x40);
+		memcpy(vpninfo->esp_out_next.secrets, data, 0x40);
 		vpn_progress(vpninfo, PRG_DEBUG, _("%d bytes of ESP secrets\n"),
 			     attrlen);
 		break;
@@ -449,11 +449,12 @@ static const struct pkt esp_enable_pkt = {
 
 int queue_esp_control(struct openconnect_info *vpninfo, int enable)
 {
-	struct pkt *new = malloc(sizeof(*new) + 13);
+	struct pkt *new = alloc_pkt(vpninfo, 13);
 	if (!new)
 		return -ENOMEM;
 
-	memcpy(new, &esp_enable_pkt, sizeof(*new) + 13);
+	new->len = esp_enable_pkt.len;
+	memcpy(&new->oncp, &esp_enable_pkt.oncp, sizeof(new->oncp) + 13);
 	new->data[12] = enable;
 	queue_packet(&vpninfo->oncp_control_queue, new);
 	return 0;
@@ -796,6 +797,7 @@ int oncp_connect(struct openconnect_info *vpninfo)
 	if (ret)
 		openconnect_close_https(vpninfo, 0);
 	else {
+		ssl_enable_ktls(vpninfo);
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
@@ -803,7 +805,7 @@ int oncp_connect(struct openconnect_info *vpninfo)
 	buf_free(reqbuf);
 
 	vpninfo->oncp_rec_size = 0;
-	free(vpninfo->cstp_pkt);
+	free_pkt(vpninfo, vpninfo->cstp_pkt);
 	vpninfo->cstp_pkt = NULL;
 
 	return ret;
@@ -835,7 +837,7 @@ static int oncp_receive_espkeys(struct openconnect_info *vpninfo, int len)
 		vpninfo->cstp_pkt = NULL;
 
 		print_esp_keys(vpninfo, _("new incoming"), esp);
-		print_esp_keys(vpninfo, _("new outgoing"), &vpninfo->esp_out);
+		print_esp_keys(vpninfo, _("new outgoing"), &vpninfo->esp_out_next);
 	}
 	return ret;
 #else
@@ -913,7 +915,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		len = vpninfo->ip_info.mtu + vpninfo->pkt_trailer;
 		if (!vpninfo->cstp_pkt) {
-			vpninfo->cstp_pkt = malloc(sizeof(struct pkt) + len);
+			vpninfo->cstp_pkt = alloc_pkt(vpninfo, len);
 			if (!vpninfo->cstp_pkt) {
 				vpn_progress(vpninfo, PRG_ERR, _("Allocation failed\n"));
 				break;
@@ -961,7 +963,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			goto do_reconnect;
 		}
 		vpninfo->cstp_pkt->len += len;
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = vpninfo->now;
 		if (vpninfo->cstp_pkt->len < 20)
 			continue;
 
@@ -1003,22 +1005,23 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 				continue;
 
 			work_done = 1;
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received uncompressed data packet of %d bytes\n"),
-				     iplen);
+			vpn_pkt_trace(vpninfo,
+				      _("Received uncompressed data packet of %d bytes\n"),
+				      iplen);
 
 			/* If there's nothing after the IP packet, and it's the last (or
 			 * only) packet in this KMP300 so we don't need to keep the KMP
 			 * header either, then just queue it. */
 			if (iplen == kmplen && iplen == vpninfo->cstp_pkt->len - 20) {
 				vpninfo->cstp_pkt->len = iplen;
-				queue_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt);
+				queue_rx_packet(vpninfo, &vpninfo->data_stats.cstp,
+						vpninfo->cstp_pkt);
 				vpninfo->cstp_pkt = NULL;
 				continue;
 			}
 
 			/* OK, we have a whole packet, and we have stuff after it */
-			queue_new_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt->data, iplen);
+			queue_new_packet(vpninfo, &vpninfo->data_stats.cstp, vpninfo->cstp_pkt->data, iplen);
 			kmplen -= iplen;
 			if (kmplen) {
 				/* Still data packets to come in this KMP300 */
@@ -1071,13 +1074,15 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = vpninfo->now;
 		unmonitor_write_fd(vpninfo, ssl);
 
-		vpn_progress(vpninfo, PRG_TRACE, _("Packet outgoing:\n"));
-		dump_buf_hex(vpninfo, PRG_TRACE, '>',
-			     vpninfo->current_ssl_pkt->oncp.rec,
-			     vpninfo->current_ssl_pkt->len + 22);
+		if (PACKET_TRACE) {
+			vpn_progress(vpninfo, PRG_TRACE, _("Packet outgoing:\n"));
+			dump_buf_hex(vpninfo, PRG_TRACE, '>',
+				     vpninfo->current_ssl_pkt->oncp.rec,
+				     vpninfo->current_ssl_pkt->len + 22);
+		}
 
 		ret = ssl_nonblock_write(vpninfo,
 					 vpninfo->current_ssl_pkt->oncp.rec,
@@ -1104,7 +1109,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			   fd to ->select_wfds if appropriate, so we can just
 			   return and wait. Unless it's been stalled for so long
 			   that DPD kicks in and we kill the connection. */
-			switch (ka_stalled_action(&vpninfo->ssl_times, timeout)) {
+			switch (ka_stalled_action(vpninfo, &vpninfo->ssl_times)) {
 			case KA_DPD_DEAD:
 				goto peer_dead;
 			case KA_REKEY:
@@ -1129,7 +1134,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 		/* Don't free the 'special' packets */
 		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
-			free(vpninfo->pending_deflated_pkt);
+			free_pkt(vpninfo, vpninfo->pending_deflated_pkt);
 		} else {
 			/* Only set the ESP state to connected and actually start
 			   sending packets on it once the enable message has been
@@ -1143,7 +1148,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 				vpninfo->dtls_state = DTLS_CONNECTED;
 				work_done = 1;
 			}
-			free(vpninfo->current_ssl_pkt);
+			free_pkt(vpninfo, vpninfo->current_ssl_pkt);
 		}
 		vpninfo->current_ssl_pkt = NULL;
 	}
@@ -1155,7 +1160,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		goto handle_outgoing;
 	}
 
-	switch (keepalive_action(&vpninfo->ssl_times, timeout)) {
+	switch (keepalive_action(vpninfo, &vpninfo->ssl_times)) {
 	case KA_REKEY:
 	do_rekey:
 		/* Not that this will ever happen; we don't even process
@@ -1164,6 +1169,10 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (vpninfo->ssl_times.rekey_method == REKEY_TUNNEL)
 			goto do_reconnect;
 		else if (vpninfo->ssl_times.rekey_method == REKEY_SSL) {
+			/* The TLS library no longer has the keys */
+			if (vpninfo->ktls_active)
+				goto do_reconnect;
+
 			ret = cstp_handshake(vpninfo, 0);
 			if (ret) {
 				/* if we failed rehandshake try establishing a new-tunnel instead of failing */
@@ -1227,15 +1236,17 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	       (vpninfo->current_ssl_pkt = dequeue_packet(&vpninfo->outgoing_queue))) {
 		struct pkt *this = vpninfo->current_ssl_pkt;
 
+		record_tx_packet(vpninfo, &vpninfo->data_stats.cstp, this);
+
 		/* Little-endian overall record length */
 		store_le16(this->oncp.rec, (this->len + 20));
 		memcpy(this->oncp.kmp, data_hdr, 18);
 		/* Big-endian length in KMP message header */
 		store_be16(this->oncp.kmp + 18, this->len);
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Sending uncompressed data packet of %d bytes\n"),
-			     this->len);
+		vpn_pkt_trace(vpninfo,
+			      _("Sending uncompressed data packet of %d bytes\n"),
+			      this->len);
 
 		goto handle_outgoing;
 	}
@@ -37,6 +37,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #endif
 
 #include "openconnect.h"
@@ -70,6 +73,7 @@
 
 #include <zlib.h>
 #include <stdint.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -126,6 +130,8 @@
 
 struct pkt {
 	int len;
+	int alloc_len; /* Size of data[] as allocated by alloc_pkt() */
+	uint64_t stamp; /* When it entered the data path, in µs; or zero */
 	struct pkt *next;
 	union {
 		struct {
@@ -151,6 +157,17 @@ struct pkt {
 	unsigned char data[];
 };
 
+/* The ESP header and IV always end at pkt->data. The 16-byte IV of
+   AES-CBC fills all of pkt->esp, while the 8-byte IV of AES-GCM leaves
+   the datagram starting part way into it. */
+struct esp_hdr {
+	uint32_t spi;
+	uint32_t seq;
+	unsigned char iv[];
+};
+
+#define esp_pkt_hdr(_v, _p) ((struct esp_hdr *)((_p)->data - (_v)->esp_hdrlen))
+
 #define REKEY_NONE      0
 #define REKEY_TUNNEL    1
 #define REKEY_SSL       2
@@ -168,6 +185,10 @@ struct pkt {
 #define DTLS_CONNECTING	4	/* ESP probe received; must tell server */
 #define DTLS_CONNECTED	5	/* Server informed and should be sending ESP */
 
+#define MTU_NONE	0	/* No DTLS path MTU discovery running */
+#define MTU_SEARCH	1	/* Probing for the largest MTU that gets through */
+#define MTU_DONE	2	/* Waiting to try for a larger one again */
+
 #define COMPR_DEFLATE	(1<<0)
 #define COMPR_LZS	(1<<1)
 #define COMPR_LZ4	(1<<2)
@@ -182,15 +203,24 @@ struct pkt {
 
 #define DTLS_APP_ID_EXT 48018
 
+/* See timer.c */
+struct oc_timer {
+	uint64_t due;		/* timer_now() milliseconds */
+	int slot;		/* Index in vpninfo->timers[] plus one, or 0 */
+};
+#define MAX_TIMERS 8
+
 struct keepalive_info {
-	int dpd;
+	int dpd;		/* Intervals in seconds */
 	int keepalive;
 	int rekey;
 	int rekey_method;
-	time_t last_rekey;
-	time_t last_tx;
-	time_t last_rx;
-	time_t last_dpd;
+	uint64_t last_rekey;	/* Times from timer_now() */
+	uint64_t last_tx;
+	uint64_t last_rx;
+	uint64_t last_dpd;
+	struct oc_timer timer;	/* The earliest of the deadlines */
+	int stalled;		/* Timer set by ka_stalled_action() */
 };
 
 struct pin_cache {
@@ -289,12 +319,21 @@ struct vpn_proto {
 
 	/* Catch probe packet confirming the (UDP) session */
 	int (*udp_catch_probe)(struct openconnect_info *vpninfo, struct pkt *p);
+
+	/* Obtain new keys for the (UDP) session before the old ones expire.
+	   This may block, so the mainloop calls it between passes. */
+	int (*udp_rekey)(struct openconnect_info *vpninfo);
+
+	/* The TCP channel is parsed as a stream, not relying on TLS record
+	   boundaries, so the kernel may merge records when it decrypts them */
+	int tls_stream;
 };
 
 struct pkt_q {
 	struct pkt *head;
 	struct pkt **tail;
 	int count;
+	int max;	/* High-water mark of count */
 };
 
 static inline struct pkt *dequeue_packet(struct pkt_q *q)
@@ -322,7 +361,9 @@ static inline int queue_packet(struct pkt_q *q, struct pkt *p)
 	*(q->tail) = p;
 	p->next = NULL;
 	q->tail = &p->next;
-	return ++q->count;
+	if (++q->count > q->max)
+		q->max = q->count;
+	return q->count;
 }
 
 static inline void init_pkt_queue(struct pkt_q *q)
@@ -330,6 +371,38 @@ static inline void init_pkt_queue(struct pkt_q *q)
 	q->tail = &q->head;
 }
 
+#define EVENT_LOOP_SELECT	0
+#define EVENT_LOOP_EPOLL	1 /* Level-triggered */
+#define EVENT_LOOP_EPOLL_ET	2 /* Edge-triggered */
+
+/* Directions of the TLS data channel handed over to the kernel */
+#define KTLS_RX		1
+#define KTLS_TX		2
+
+/* Operations tagged into the low bits of io_uring user_data. The rest
+   is the struct pkt which owns the buffer, or NULL for cancellations. */
+#define URING_TUN_READ	0
+#define URING_TUN_WRITE	1
+#define URING_UDP_RECV	2
+#define URING_UDP_SEND	3
+#define URING_OP_MASK	3
+
+/* Submission queue size; the completion queue is twice this */
+#define URING_ENTRIES	256
+
+/* Maximum number of idle buffers kept in the packet pool */
+#define MAX_PKT_POOL 256
+
+/* Upper bound on the number of tun queues (including the main thread's) */
+#define MAX_TUN_QUEUES 16
+
+/* Upper bound on the number of datagrams in one recvmmsg()/sendmmsg() call */
+#define MAX_UDP_BATCH 64
+#define DEFAULT_UDP_BATCH 32
+
+/* The most that one receive from a socket with UDP_GRO can return */
+#define UDP_GRO_BUFLEN 65536
+
 #define DTLS_OVERHEAD (1 /* packet + header */ + 13 /* DTLS header */ + \
 	 20 /* biggest supported MAC (SHA1) */ +  16 /* biggest supported IV (AES-128) */ + \
 	 16 /* max padding */)
@@ -338,16 +411,42 @@ struct esp {
 #if defined(OPENCONNECT_GNUTLS)
 	gnutls_cipher_hd_t cipher;
 	gnutls_hmac_hd_t hmac;
+#ifdef HAVE_GNUTLS_AEAD_CIPHER
+	gnutls_aead_cipher_hd_t aead;
+#endif
 #elif defined(OPENCONNECT_OPENSSL)
-	HMAC_CTX *hmac, *pkt_hmac;
+	HMAC_CTX *hmac;
 	EVP_CIPHER_CTX *cipher;
 #endif
 	uint64_t seq_backlog;
 	uint64_t seq;
+	uint64_t *shared_seq; /* An ESP worker's clone sends from the SA's seq */
 	uint32_t spi; /* Stored network-endian */
 	unsigned char secrets[0x40]; /* Encryption key bytes, then HMAC key bytes */
+	unsigned char seq_lock; /* Guards the replay window against worker threads */
 };
 
+/* Without extended sequence numbers an SA can send no more than 2^32
+   packets. With AES-GCM the sequence number is the nonce too, so going
+   past that would reuse nonces under the same key. */
+#define ESP_SEQ_MAX 0xffffffffULL
+/* Where to ask for new keys, leaving time for the rekey to finish */
+#define ESP_SEQ_REKEY (ESP_SEQ_MAX - (ESP_SEQ_MAX >> 4))
+
+/* Outbound sequence numbers are shared with the ESP worker threads,
+   whose clones of the SA take them from the original's counter.
+   Returns -ENOSPC once they have run out, until the SA is rekeyed. */
+static inline int esp_next_seq(struct esp *esp, uint32_t *seq)
+{
+	uint64_t *ctr = esp->shared_seq ? esp->shared_seq : &esp->seq;
+	uint64_t next = __atomic_fetch_add(ctr, 1, __ATOMIC_RELAXED);
+
+	if (next > ESP_SEQ_MAX)
+		return -ENOSPC;
+	*seq = next;
+	return 0;
+}
+
 struct openconnect_info {
 	const struct vpn_proto *proto;
 
@@ -369,6 +468,12 @@ struct openconnect_info {
 	int old_esp_maxseq;
 	struct esp esp_in[2];
 	struct esp esp_out;
+	struct esp esp_out_next;	/* Outbound keys from the server, not yet in use */
+	int esp_rekey_pending;		/* Still sending on the old SA... */
+	uint64_t esp_rekey_start;	/* ... since then */
+	struct oc_timer esp_rekey_timer;
+	struct oc_stats esp_sa_stats;	/* data_stats.esp when the keys last changed */
+	int udp_rekey_due;		/* For the mainloop to call udp_rekey() */
 
 	int tncc_fd; /* For Juniper TNCC */
 	const char *csd_xmltag;
@@ -491,9 +596,11 @@ struct openconnect_info {
 	X509 *cert_x509;
 	SSL_CTX *https_ctx;
 	SSL *https_ssl;
+	SSL_SESSION *https_session;	/* To resume on reconnect */
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_session_t https_sess;
 	gnutls_certificate_credentials_t https_cred;
+	gnutls_datum_t https_session;	/* To resume on reconnect */
 	gnutls_psk_client_credentials_t psk_cred;
 	char local_cert_md5[MD5_SIZE * 2 + 1]; /* For CSD */
 	char gnutls_prio[256];
@@ -522,13 +629,37 @@ struct openconnect_info {
 	struct pkt *deflate_pkt;		/* For compressing outbound packets into */
 	struct pkt *pending_deflated_pkt;	/* The original packet associated with above */
 	struct pkt *current_ssl_pkt;		/* Partially sent SSL packet */
+	struct pkt *cstp_tx_pkt;		/* Queued packets coalesced for CSTP */
 	struct pkt_q oncp_control_queue;		/* Control packets to be sent on oNCP next */
 	int oncp_rec_size;			/* For packetising incoming oNCP stream */
 	/* Packet buffers for receiving into */
 	struct pkt *cstp_pkt;
 	struct pkt *dtls_pkt;
 	struct pkt *tun_pkt;
+	struct pkt *udp_rx_pkts[MAX_UDP_BATCH];	/* For recvmmsg() on the ESP socket */
+	int udp_batch;				/* Datagrams per recvmmsg()/sendmmsg() call */
+	struct pkt *esp_unsent[MAX_UDP_BATCH];	/* Encrypted, but sendmmsg() would have blocked */
+	int esp_unsent_len[MAX_UDP_BATCH];	/* Their lengths on the wire */
+	int nr_esp_unsent;
+	int udp_gso;				/* Kernel supports UDP_SEGMENT on dtls_fd */
+	int udp_gro;				/* UDP_GRO is enabled on dtls_fd */
+	int udp_gro_chunk;			/* Segment size expected in the next ESP train */
+	unsigned char *udp_gro_buf;		/* Overflow for ESP, and all of it for DTLS */
+	int udp_gro_off, udp_gro_len, udp_gro_seg; /* DTLS datagrams still in udp_gro_buf */
+	unsigned long udp_gro_recvs;		/* Receives from the socket with UDP_GRO... */
+	unsigned long udp_gro_dgrams;		/* ... and the datagrams they returned */
+	int ktls;				/* Try to offload TLS on ssl_fd to the kernel */
+	int ktls_active;			/* KTLS_RX and/or KTLS_TX, once it is */
+	const void *ktls_tx_buf;		/* Buffer of a write only partly sent... */
+	int ktls_tx_done;			/* ... and how much of it has gone */
+	char *tls_session_cache;		/* File to keep the TLS session in */
+	char *tls_session_host;			/* Server the TLS session is for */
+	int tls_session_port;
+	int tls_resume_tries;			/* Connections which offered a session... */
+	int tls_resume_hits;			/* ... and the server resumed it */
 	int pkt_trailer; /* How many bytes after payload for encryption (ESP HMAC) */
+	int esp_hdrlen;	/* SPI, sequence number and IV before the ESP payload */
+	int esp_icvlen;	/* Truncated HMAC or GCM tag after it */
 
 	z_stream inflate_strm;
 	uint32_t inflate_adler32;
@@ -539,7 +670,8 @@ struct openconnect_info {
 	int reconnect_timeout;
 	int reconnect_interval;
 	int dtls_attempt_period;
-	time_t new_dtls_started;
+	uint64_t new_dtls_started;
+	struct oc_timer dtls_timer;		/* Next attempt to bring up DTLS or ESP */
 #if defined(OPENCONNECT_OPENSSL)
 	SSL_CTX *dtls_ctx;
 	SSL *dtls_ssl;
@@ -556,6 +688,17 @@ struct openconnect_info {
 	int dtls_state;
 	int dtls_need_reconnect;
 	struct keepalive_info dtls_times;
+
+	/* DTLS path MTU discovery; see dtls_detect_mtu() */
+	int mtu_state;
+	int mtu_ceiling;			/* Largest MTU to search for */
+	int mtu_min, mtu_max;			/* Known to work, and not known not to */
+	int mtu_ok;				/* Whether mtu_min has actually been seen to work */
+	int mtu_probe;				/* Size being tried */
+	int mtu_probes;				/* Probes sent at that size so far */
+	uint64_t mtu_probe_time;		/* Last one sent, or when to search again */
+	struct oc_timer mtu_timer;		/* For the probe's timeout or the next search */
+	unsigned char mtu_probe_id[4];
 	unsigned char dtls_session_id[32];
 	unsigned char dtls_secret[48];
 	unsigned char dtls_app_id[32];
@@ -584,12 +727,23 @@ struct openconnect_info {
 #ifdef _WIN32
 	long dtls_monitored, ssl_monitored, cmd_monitored, tun_monitored;
 	HANDLE dtls_event, ssl_event, cmd_event;
+#elif defined(HAVE_EPOLL)
+	/* EPOLLIN/EPOLLOUT/EPOLLPRI interest in each fd. The select()
+	   fallback builds its fd_sets from these too. */
+	uint32_t dtls_monitored, ssl_monitored, cmd_monitored, tun_monitored;
+	int epoll_fd;
 #else
 	int _select_nfds;
 	fd_set _select_rfds;
 	fd_set _select_wfds;
 	fd_set _select_efds;
 #endif
+	int event_loop; /* EVENT_LOOP_xxx */
+
+	struct oc_timer *timers[MAX_TIMERS];	/* Min-heap by due time */
+	int nr_timers;
+	uint64_t now;				/* timer_now() as of this mainloop pass */
+	uint64_t now_us;			/* stats_clock_us() likewise */
 
 #ifdef __sun__
 	int ip_fd;
@@ -620,6 +774,52 @@ struct openconnect_info {
 	int max_qlen;
 	struct oc_stats stats;
 	openconnect_stats_vfn stats_handler;
+	/* Everything but total and the queue high-water marks, which
+	   openconnect_get_stats_ext() fills in from the above */
+	struct oc_stats_ext data_stats;
+#ifndef _WIN32
+	char *metrics_file;
+	struct oc_metrics *metrics;	/* Shared mapping of metrics_file */
+	uint64_t metrics_time;		/* When it was last updated */
+	int metrics_dirty;		/* Traffic since then */
+#endif
+
+	/* Recycled packet buffers, all with alloc_len == pkt_pool_len */
+	struct pkt *pkt_pool;
+	int pkt_pool_count;
+	int pkt_pool_len;
+	unsigned long pkt_pool_allocs;	/* Total calls to alloc_pkt() */
+	unsigned long pkt_pool_hits;	/* ... satisfied without malloc() */
+	unsigned long pkt_mem;		/* Bytes malloc()ed for packet buffers */
+	unsigned long pkt_mem_max;	/* ... and the high-water mark */
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* Extra tun queues, each with an ESP worker thread of its own */
+	int tun_queues;
+	int tun_queue_fds[MAX_TUN_QUEUES - 1];	/* Detached while there are no workers */
+	int nr_tun_queue_fds;
+	struct esp_worker *esp_workers;
+	int nr_esp_workers;
+	int esp_worker_stop_fd;
+	unsigned int esp_worker_next;	/* Whose turn it is to decrypt */
+#endif
+
+#ifdef HAVE_XFRM
+	/* ESP SAs handed to the kernel, with --esp-offload */
+	int esp_offload;
+	struct esp_xfrm *esp_xfrm;	/* While they're installed */
+#endif
+
+#ifdef HAVE_IO_URING
+	/* io_uring data path for the tun device and the ESP socket */
+	int use_uring;
+	struct oc_uring *uring;
+	int uring_fd;			/* The ring, polled for completions */
+	uint32_t uring_monitored;
+	int uring_inflight;		/* Requests not yet reaped */
+	int uring_tun_reads, uring_udp_recvs;
+	unsigned long uring_enters, uring_cqes;
+#endif
 
 	socklen_t peer_addrlen;
 	struct sockaddr *peer_addr;
@@ -632,6 +832,9 @@ struct openconnect_info {
 	int dtls_compr; /* Accepted for DTLS */
 
 	int is_dyndns; /* Attempt to redo DNS lookup on each CSTP reconnect */
+	struct dns_query *dns_cache;		/* The last lookup, for reconnecting */
+	struct dns_query *dns_pending;		/* Refreshing it in the background */
+	uint64_t dns_refresh_time;		/* Last background lookup, from timer_now() */
 	char *useragent;
 
 	const char *quit_reason;
@@ -663,6 +866,17 @@ struct openconnect_info {
 #define monitor_fd_new(_v, _n) do { if (!_v->_n##_event) _v->_n##_event = CreateEvent(NULL, FALSE, FALSE, NULL); } while (0)
 #define read_fd_monitored(_v, _n) (_v->_n##_monitored & FD_READ)
 
+#elif defined(HAVE_EPOLL)
+#define monitor_read_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored | EPOLLIN)
+#define unmonitor_read_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored & ~EPOLLIN)
+#define monitor_write_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored | EPOLLOUT)
+#define unmonitor_write_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored & ~EPOLLOUT)
+#define monitor_except_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored | EPOLLPRI)
+#define unmonitor_except_fd(_v, _n) monitor_fd_events(_v, _v->_n##_fd, &_v->_n##_monitored, _v->_n##_monitored & ~EPOLLPRI)
+
+#define monitor_fd_new(_v, _n) do { } while (0)
+#define read_fd_monitored(_v, _n) (_v->_n##_monitored & EPOLLIN)
+
 #else
 #define monitor_read_fd(_v, _n) FD_SET(_v-> _n##_fd, &vpninfo->_select_rfds)
 #define unmonitor_read_fd(_v, _n) FD_CLR(_v-> _n##_fd, &vpninfo->_select_rfds)
@@ -700,12 +914,54 @@ struct openconnect_info {
 #define HMAC_MD5		1
 #define HMAC_SHA1		2
 
+/* AES-GCM (RFC4106) is only offered by GlobalProtect. Juniper has no
+   encoding for it, so use values well clear of the ones it does have. */
+#define ENC_AES_128_GCM		0x80
+#define ENC_AES_256_GCM		0x81
+#define ENC_IS_AEAD(enc) ((enc) == ENC_AES_128_GCM || (enc) == ENC_AES_256_GCM)
+
+#if defined(HAVE_GNUTLS_AEAD_CIPHER) || (defined(OPENCONNECT_OPENSSL) && defined(EVP_CTRL_GCM_SET_TAG))
+#define HAVE_ESP_GCM
+#endif
+
 #define vpn_progress(_v, lvl, ...) do {					\
 	if ((_v)->verbose >= (lvl))					\
 		(_v)->progress((_v)->cbdata, lvl, __VA_ARGS__);	\
 	} while(0)
 #define vpn_perror(vpninfo, msg) vpn_progress((vpninfo), PRG_ERR, "%s: %s\n", (msg), strerror(errno))
 
+/* For messages about each packet. Even when they're not shown, checking
+   verbose for every packet costs something, so they can be left out of
+   the build altogether with --disable-packet-trace. */
+#ifdef NO_PACKET_TRACE
+#define PACKET_TRACE 0
+#else
+#define PACKET_TRACE 1
+#endif
+#define vpn_pkt_trace(_v, ...) do {					\
+	if (PACKET_TRACE)						\
+		vpn_progress(_v, PRG_TRACE, __VA_ARGS__);		\
+	} while(0)
+
+/* USDT probes in the data path, for bpftrace or SystemTap to attach to
+ * without turning up the verbosity. Each is a single nop until something
+ * does. They are, all in provider "openconnect":
+ *
+ *   esp_rx(spi, seq, len)	  ESP packet received, before decryption
+ *   esp_decrypt(spi, seq, len)	  ESP packet decrypted and accepted
+ *   dtls_rx(type, len)		  DTLS packet received
+ *   rx_queue(len, queue_len)	  Data packet queued for the tun device
+ *   tun_write(len, latency_us)	  Data packet written to the tun device
+ *   drop(reason)		  Packet dropped, with a reason string as
+ *				  in the metrics
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define oc_probe(name, ...) STAP_PROBEV(openconnect, name, __VA_ARGS__)
+#else
+#define oc_probe(name, ...) do { } while (0)
+#endif
+
 /****************************************************************************/
 /* Oh Solaris how we hate thee! */
 #ifdef HAVE_SUNOS_BROKEN_TIME
@@ -821,6 +1077,10 @@ void os_shutdown_tun(struct openconnect_info *vpninfo);
 int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt);
 intptr_t os_setup_tun(struct openconnect_info *vpninfo);
+int os_set_tun_mtu(struct openconnect_info *vpninfo);
+#ifdef HAVE_TUN_MULTIQUEUE
+void os_close_tun_queues(struct openconnect_info *vpninfo);
+#endif
 
 /* {gnutls,openssl}-dtls.c */
 int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd);
@@ -835,8 +1095,6 @@ void dtls_close(struct openconnect_info *vpninfo);
 void dtls_shutdown(struct openconnect_info *vpninfo);
 void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *buf);
 void dtls_detect_mtu(struct openconnect_info *vpninfo);
-int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms);
-int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len);
 char *openconnect_bin2hex(const char *prefix, const uint8_t *data, unsigned len);
 
 /* cstp.c */
@@ -844,7 +1102,8 @@ void cstp_common_headers(struct openconnect_info *vpninfo, struct oc_text_buf *b
 int cstp_connect(struct openconnect_info *vpninfo);
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout);
 int cstp_bye(struct openconnect_info *vpninfo, const char *reason);
-int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
+int decompress_and_queue_packet(struct openconnect_info *vpninfo,
+				struct oc_stats *via, int compr_type,
 				unsigned char *buf, int len);
 int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this);
 
@@ -869,6 +1128,7 @@ int gpst_xml_or_error(struct openconnect_info *vpninfo, int result, char *respon
 					  char **prompt, char **inputStr);
 int gpst_setup(struct openconnect_info *vpninfo);
 int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout);
+int gpst_esp_rekey(struct openconnect_info *vpninfo);
 
 /* lzs.c */
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
@@ -901,9 +1161,43 @@ FILE *openconnect_fopen_utf8(struct openconnect_info *vpninfo,
 			     const char *fname, const char *mode);
 int udp_sockaddr(struct openconnect_info *vpninfo, int port);
 int udp_connect(struct openconnect_info *vpninfo);
+#ifdef HAVE_UDP_GRO
+int udp_recv_gro(struct openconnect_info *vpninfo, struct iovec *iov, int iovlen, int *seg);
+#endif
 int ssl_reconnect(struct openconnect_info *vpninfo);
+int tls_session_matches(struct openconnect_info *vpninfo);
+int load_tls_session(struct openconnect_info *vpninfo, unsigned char **data);
+void save_tls_session(struct openconnect_info *vpninfo, const void *data, int len);
+void tls_session_resumed(struct openconnect_info *vpninfo, int resumed);
 void openconnect_clear_cookies(struct openconnect_info *vpninfo);
 
+/* dns.c */
+int dns_lookup(struct openconnect_info *vpninfo, const char *host,
+	       const char *port, const struct addrinfo *hints,
+	       struct addrinfo **result, int *cached);
+void dns_refresh(struct openconnect_info *vpninfo, int *timeout);
+void dns_cache_flush(struct openconnect_info *vpninfo);
+void dns_cache_free(struct openconnect_info *vpninfo);
+
+/* timer.c */
+uint64_t timer_now(void);
+uint64_t timer_update(struct openconnect_info *vpninfo);
+void timer_set(struct openconnect_info *vpninfo, struct oc_timer *t,
+	       uint64_t due);
+void timer_cancel(struct openconnect_info *vpninfo, struct oc_timer *t);
+void timers_next(struct openconnect_info *vpninfo, int *timeout);
+/* Armed, and not yet due */
+static inline int timer_pending(struct oc_timer *t, uint64_t now)
+{
+	return t->slot && now < t->due;
+}
+
+/* metrics.c */
+int metrics_open(struct openconnect_info *vpninfo);
+void metrics_update(struct openconnect_info *vpninfo, int did_work,
+		    int *timeout);
+void metrics_close(struct openconnect_info *vpninfo);
+
 /* openssl-pkcs11.c */
 int load_pkcs11_key(struct openconnect_info *vpninfo);
 int load_pkcs11_certificate(struct openconnect_info *vpninfo);
@@ -921,12 +1215,35 @@ int esp_send_probes(struct openconnect_info *vpninfo);
 int esp_send_probes_gp(struct openconnect_info *vpninfo);
 int esp_catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt);
 int esp_catch_probe_gp(struct openconnect_info *vpninfo, struct pkt *pkt);
+int esp_decrypt_rx(struct openconnect_info *vpninfo, struct esp *esp,
+		   struct esp *old_esp, struct pkt *pkt, int len);
+void esp_switch_out(struct openconnect_info *vpninfo);
+#ifdef HAVE_IO_URING
+void esp_uring_rx(struct openconnect_info *vpninfo, struct pkt *pkt, int len);
+#endif
+
+/* esp-worker.c */
+int esp_start_workers(struct openconnect_info *vpninfo);
+void esp_stop_workers(struct openconnect_info *vpninfo);
+void esp_collect_worker_stats(struct openconnect_info *vpninfo);
+void esp_collect_worker_times(struct openconnect_info *vpninfo);
+int esp_worker_queue_rx(struct openconnect_info *vpninfo, struct pkt *pkt, int len);
+
+/* esp-xfrm.c */
+int esp_xfrm_install(struct openconnect_info *vpninfo);
+void esp_xfrm_remove(struct openconnect_info *vpninfo);
+int esp_xfrm_reserve_seq(struct openconnect_info *vpninfo);
+int esp_xfrm_poll(struct openconnect_info *vpninfo, int force);
 
 /* {gnutls,openssl}-esp.c */
 int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys);
 void destroy_esp_ciphers(struct esp *esp);
+int clone_esp_ciphers(struct openconnect_info *vpninfo, struct esp *dst,
+		      struct esp *src, int decrypt);
 int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt);
-int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt);
+int encrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt);
+int encrypt_esp_packets(struct openconnect_info *vpninfo, struct esp *esp,
+			struct pkt **pkts, int *lens, int n);
 
 /* {gnutls,openssl}.c */
 int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen);
@@ -934,6 +1251,7 @@ int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen);
 int openconnect_open_https(struct openconnect_info *vpninfo);
 void openconnect_close_https(struct openconnect_info *vpninfo, int final);
 int cstp_handshake(struct openconnect_info *vpninfo, unsigned init);
+void ssl_enable_ktls(struct openconnect_info *vpninfo);
 int get_cert_md5_fingerprint(struct openconnect_info *vpninfo, void *cert,
 			     char *buf);
 int openconnect_sha1(unsigned char *result, void *data, int len);
@@ -956,9 +1274,35 @@ int hotp_hmac(struct openconnect_info *vpninfo, const void *challenge);
 
 /* mainloop.c */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout);
-int queue_new_packet(struct pkt_q *q, void *buf, int len);
-int keepalive_action(struct keepalive_info *ka, int *timeout);
-int ka_stalled_action(struct keepalive_info *ka, int *timeout);
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len);
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt);
+void free_pkt_pool(struct openconnect_info *vpninfo);
+void print_pkt_pool_stats(struct openconnect_info *vpninfo);
+#ifdef HAVE_EPOLL
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd,
+		       uint32_t *monitored, uint32_t events);
+#endif
+int queue_new_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		     void *buf, int len);
+int queue_rx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		    struct pkt *pkt);
+void record_tx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		      struct pkt *pkt);
+void print_data_stats(struct openconnect_info *vpninfo);
+uint64_t stats_clock_us(void);
+/* The ESP code calls this from the worker threads too */
+#define count_drop(vpninfo, reason) do {					\
+	__atomic_fetch_add(&(vpninfo)->data_stats.drop_##reason, 1, __ATOMIC_RELAXED); \
+	oc_probe(drop, #reason);					\
+	} while(0)
+void ka_reset(struct openconnect_info *vpninfo, struct keepalive_info *ka);
+int keepalive_action(struct openconnect_info *vpninfo, struct keepalive_info *ka);
+int ka_stalled_action(struct openconnect_info *vpninfo, struct keepalive_info *ka);
+#ifdef HAVE_IO_URING
+int uring_post(struct openconnect_info *vpninfo, int op, int fd,
+	       struct pkt *pkt, void *buf, int len);
+void uring_cancel_fd(struct openconnect_info *vpninfo, int fd);
+#endif
 
 /* xml.c */
 ssize_t read_file_into_string(struct openconnect_info *vpninfo, const char *fname,
@@ -0,0 +1,171 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Reads the file kept up to date by openconnect --metrics-file=FILE and
+ * prints what's in it in the Prometheus text exposition format, for the
+ * node exporter's textfile collector or anything else which speaks it.
+ * It's also meant as an example of how to read the file.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "openconnect-metrics.h"
+
+static void print_transport(const char *name, const struct oc_stats *s)
+{
+	printf("openconnect_packets_total{transport=\"%s\",direction=\"tx\"} %llu\n",
+	       name, (unsigned long long)s->tx_pkts);
+	printf("openconnect_packets_total{transport=\"%s\",direction=\"rx\"} %llu\n",
+	       name, (unsigned long long)s->rx_pkts);
+	printf("openconnect_bytes_total{transport=\"%s\",direction=\"tx\"} %llu\n",
+	       name, (unsigned long long)s->tx_bytes);
+	printf("openconnect_bytes_total{transport=\"%s\",direction=\"rx\"} %llu\n",
+	       name, (unsigned long long)s->rx_bytes);
+}
+
+static void print_drops(const char *reason, uint64_t count)
+{
+	printf("openconnect_dropped_packets_total{reason=\"%s\"} %llu\n",
+	       reason, (unsigned long long)count);
+}
+
+static void print_latency(const char *stage, const struct oc_latency_hist *h)
+{
+	uint64_t total = 0;
+	int i;
+
+	/* Latencies are whole microseconds, so bucket i holds those up to
+	   one less than where the next one starts */
+	for (i = 0; i < OC_LATENCY_BUCKETS - 1; i++) {
+		total += h->buckets[i];
+		printf("openconnect_latency_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+		       stage, (oc_latency_bucket_start(i + 1) - 1) / 1e6,
+		       (unsigned long long)total);
+	}
+	printf("openconnect_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+	       stage, (unsigned long long)h->count);
+	printf("openconnect_latency_seconds_sum{stage=\"%s\"} %g\n",
+	       stage, h->total_us / 1e6);
+	printf("openconnect_latency_seconds_count{stage=\"%s\"} %llu\n",
+	       stage, (unsigned long long)h->count);
+}
+
+static void print_metrics(const struct oc_metrics *m)
+{
+	const struct oc_stats_ext *s = &m->stats;
+	struct timespec ts;
+	double age = 0;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		age = ts.tv_sec + ts.tv_nsec / 1e9 - m->updated_us / 1e6;
+
+	printf("# HELP openconnect_up Whether OpenConnect is still updating the metrics.\n");
+	printf("# TYPE openconnect_up gauge\n");
+	printf("openconnect_up %d\n", m->pid != 0);
+	printf("# HELP openconnect_metrics_age_seconds Time since OpenConnect last updated the metrics.\n");
+	printf("# TYPE openconnect_metrics_age_seconds gauge\n");
+	printf("openconnect_metrics_age_seconds %g\n", age);
+
+	printf("# HELP openconnect_packets_total Packets through the tunnel, by transport.\n");
+	printf("# TYPE openconnect_packets_total counter\n");
+	printf("# HELP openconnect_bytes_total Bytes through the tunnel, by transport.\n");
+	printf("# TYPE openconnect_bytes_total counter\n");
+	print_transport("all", &s->total);
+	print_transport("cstp", &s->cstp);
+	print_transport("dtls", &s->dtls);
+	print_transport("esp", &s->esp);
+
+	printf("# HELP openconnect_dropped_packets_total Packets dropped, by reason.\n");
+	printf("# TYPE openconnect_dropped_packets_total counter\n");
+	print_drops("bad_hmac", s->drop_bad_hmac);
+	print_drops("replay", s->drop_replay);
+	print_drops("bad_padding", s->drop_bad_padding);
+	print_drops("unknown_spi", s->drop_unknown_spi);
+	print_drops("decompress", s->drop_decompress);
+	print_drops("sock_full", s->drop_sock_full);
+	print_drops("queue_full", s->drop_queue_full);
+
+	printf("# HELP openconnect_queue_max_packets Most packets ever waiting on each queue.\n");
+	printf("# TYPE openconnect_queue_max_packets gauge\n");
+	printf("openconnect_queue_max_packets{queue=\"incoming\"} %u\n",
+	       (unsigned)s->incoming_queue_max);
+	printf("openconnect_queue_max_packets{queue=\"outgoing\"} %u\n",
+	       (unsigned)s->outgoing_queue_max);
+
+	printf("# HELP openconnect_latency_seconds Time for packets to cross OpenConnect.\n");
+	printf("# TYPE openconnect_latency_seconds histogram\n");
+	print_latency("tun_to_wire", &s->tun_to_wire);
+	print_latency("wire_to_tun", &s->wire_to_tun);
+}
+
+int main(int argc, char **argv)
+{
+	struct oc_metrics *m, copy;
+	struct stat st;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		fprintf(stderr, "Print the metrics which openconnect --metrics-file=FILE keeps in FILE\n");
+		return 2;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (st.st_size < sizeof(*m)) {
+		fprintf(stderr, "%s: Not an OpenConnect metrics file\n", argv[1]);
+		return 1;
+	}
+
+	m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != OC_METRICS_MAGIC ||
+	    m->size < sizeof(*m)) {
+		fprintf(stderr, "%s: Not an OpenConnect metrics file\n", argv[1]);
+		return 1;
+	}
+	if (m->version != OC_METRICS_VERSION) {
+		fprintf(stderr, "%s: Unknown metrics version %u\n", argv[1],
+			(unsigned)m->version);
+		return 1;
+	}
+
+	if (oc_metrics_read(m, &copy)) {
+		fprintf(stderr, "%s: Metrics kept changing while being read\n", argv[1]);
+		return 1;
+	}
+
+	print_metrics(&copy);
+	return 0;
+}
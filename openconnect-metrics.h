@@ -0,0 +1,89 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __OPENCONNECT_METRICS_H__
+#define __OPENCONNECT_METRICS_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "openconnect.h"
+
+/*
+ * Layout of the file which openconnect --metrics-file=FILE keeps mapped
+ * and updates while the tunnel is up, for other processes to map and
+ * read without involving OpenConnect at all.
+ *
+ * The fixed header is written once when the file is created. After that
+ * the mainloop copies its statistics in at most every interval_ms while
+ * there is traffic, under a sequence lock: seq is odd while an update is
+ * in progress, and goes up by two with each update. Readers must use
+ * oc_metrics_read() below, or do the same, to get a consistent copy.
+ *
+ * Fields are only ever added at the end, with size growing to match.
+ * OC_METRICS_VERSION changes only if the existing fields change meaning,
+ * so a reader should refuse a version it doesn't know, but accept a size
+ * larger than its own. The stats themselves have a size of their own too.
+ * Everything is in the writer's native byte order.
+ */
+#define OC_METRICS_MAGIC	0x544d434f /* "OCMT" in little-endian */
+#define OC_METRICS_VERSION	1
+
+struct oc_metrics {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* sizeof(struct oc_metrics) for the writer */
+	uint32_t interval_ms;	/* Least time between updates */
+
+	uint32_t seq;
+	uint32_t pid;		/* Of the writer; zero once it has stopped */
+	uint64_t updated_us;	/* CLOCK_MONOTONIC at the last update */
+	struct oc_stats_ext stats;
+};
+
+/* Copy a consistent snapshot of *m, which is shared with the writer,
+ * into *out. Check magic, version and size first: the mapping must hold
+ * at least a whole struct oc_metrics. Returns zero on success, or -1 if
+ * the writer was busy the whole time; try again a little later. */
+static inline int oc_metrics_read(const struct oc_metrics *m,
+				  struct oc_metrics *out)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(out, (const void *)m, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -1;
+}
+
+/* Where latency histogram bucket i starts, in microseconds, as described
+   with OC_LATENCY_BUCKETS in openconnect.h */
+static inline uint64_t oc_latency_bucket_start(int i)
+{
+	if (i < 4)
+		return i;
+
+	return (uint64_t)(4 + (i & 3)) << (i / 4 - 1);
+}
+
+#endif /* __OPENCONNECT_METRICS_H__ */
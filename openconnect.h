@@ -33,9 +33,12 @@ extern "C" {
 #endif
 
 #define OPENCONNECT_API_VERSION_MAJOR 5
-#define OPENCONNECT_API_VERSION_MINOR 4
+#define OPENCONNECT_API_VERSION_MINOR 5
 
 /*
+ * API version 5.5:
+ *  - Add openconnect_get_stats_ext()
+ *
  * API version 5.4 (v7.08; 2016-12-13):
  *  - Add openconnect_set_pass_tos()
  *
@@ -280,6 +283,56 @@ struct oc_stats {
 	uint64_t rx_bytes;
 };
 
+/* Latencies in microseconds, in buckets spaced logarithmically as in
+ * HdrHistogram. Bucket i counts latencies of exactly i µs for i < 4.
+ * Above that each power of two is split four ways, and bucket i counts
+ * those from (4 + i % 4) << (i / 4 - 1) µs up to where the next bucket
+ * starts. The last bucket also counts anything longer. */
+#define OC_LATENCY_BUCKETS 96
+
+struct oc_latency_hist {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[OC_LATENCY_BUCKETS];
+};
+
+/* Filled in by openconnect_get_stats_ext(). Fields are only ever added
+ * at the end, and size says how many bytes of it the library filled in. */
+struct oc_stats_ext {
+	uint32_t size;
+
+	/* The same as the stats_handler gets */
+	struct oc_stats total;
+
+	/* Data packets by the transport which carried them */
+	struct oc_stats cstp;
+	struct oc_stats dtls;
+	struct oc_stats esp;
+
+	/* Packets dropped, by reason */
+	uint64_t drop_bad_hmac;		/* ESP HMAC or AEAD tag check failed */
+	uint64_t drop_replay;		/* ESP sequence number replayed or too old */
+	uint64_t drop_bad_padding;	/* ESP padding invalid */
+	uint64_t drop_unknown_spi;	/* ESP for an SA we don't have */
+	uint64_t drop_decompress;	/* Failed to decompress */
+	uint64_t drop_sock_full;	/* No room in the UDP socket (or io_uring) to send it */
+	uint64_t drop_queue_full;	/* No room on an ESP worker thread's receive queue */
+
+	/* The most packets ever waiting to go to the tun device, and to
+	   the server */
+	uint32_t incoming_queue_max;
+	uint32_t outgoing_queue_max;
+
+	/* From reading a packet from the tun device until a transport
+	 * sends it (or, for CSTP, hands it to TLS), and from receiving one
+	 * until it has been written to the tun device. The transport's end
+	 * is timed from when the mainloop pass handling it began. Packets
+	 * handled by the threads of extra tun queues are not included. */
+	struct oc_latency_hist tun_to_wire;
+	struct oc_latency_hist wire_to_tun;
+};
+
 struct oc_cert {
 	int der_len;
 	unsigned char *der_data;
@@ -627,6 +680,13 @@ typedef void (*openconnect_stats_vfn) (void *privdata, const struct oc_stats *st
 void openconnect_set_stats_handler(struct openconnect_info *vpninfo,
 				   openconnect_stats_vfn stats_handler);
 
+/* Fill in up to size bytes of *stats, so a caller built against an
+ * older or newer struct oc_stats_ext gets the fields both know about.
+ * Only call this from the thread running the mainloop; the stats_handler
+ * is a good place. Returns the number of bytes filled in. */
+int openconnect_get_stats_ext(struct openconnect_info *vpninfo,
+			      struct oc_stats_ext *stats, size_t size);
+
 /* SSL certificate capabilities. openconnect_has_pkcs11_support() means that we
    can accept PKCS#11 URLs in place of filenames, for the certificate and key. */
 int openconnect_has_pkcs11_support(void);
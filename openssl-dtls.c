@@ -29,6 +29,9 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_UDP_GRO
+#include <netinet/udp.h>
+#endif
 
 #include "openconnect-internal.h"
 
@@ -453,6 +456,16 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 		SSL_SESSION_free(dtls_session);
 	}
 
+#ifdef HAVE_UDP_GRO
+	/* The socket BIO would read the coalesced datagrams as one */
+	if (vpninfo->udp_gro) {
+		int off = 0;
+
+		setsockopt(dtls_fd, SOL_UDP, UDP_GRO, &off, sizeof(off));
+		vpninfo->udp_gro = 0;
+	}
+#endif
+
 	dtls_bio = BIO_new_socket(dtls_fd, BIO_NOCLOSE);
 	/* Set non-blocking */
 	BIO_set_nbio(dtls_bio, 1);
@@ -522,8 +535,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 				     _("DTLS connection compression using %s.\n"), c);
 		}
 
-		vpninfo->dtls_times.last_rekey = vpninfo->dtls_times.last_rx = 
-			vpninfo->dtls_times.last_tx = time(NULL);
+		ka_reset(vpninfo, &vpninfo->dtls_times);
 
 		/* From about 8.4.1(11) onwards, the ASA seems to get
 		   very unhappy if we resend ChangeCipherSpec messages
@@ -594,7 +606,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	ret = SSL_get_error(vpninfo->dtls_ssl, ret);
 	if (ret == SSL_ERROR_WANT_WRITE || ret == SSL_ERROR_WANT_READ) {
 		static int badossl_bitched = 0;
-		if (time(NULL) < vpninfo->new_dtls_started + 12)
+		if (vpninfo->now < vpninfo->new_dtls_started + 12000)
 			return 0;
 		if (((OPENSSL_VERSION_NUMBER >= 0x100000b0L && OPENSSL_VERSION_NUMBER <= 0x100000c0L) || \
 		     (OPENSSL_VERSION_NUMBER >= 0x10001040L && OPENSSL_VERSION_NUMBER <= 0x10001060L) || \
@@ -614,7 +626,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	dtls_close(vpninfo);
 
 	vpninfo->dtls_state = DTLS_SLEEPING;
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = timer_update(vpninfo);
 	return -EINVAL;
 }
 
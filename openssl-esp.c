@@ -21,11 +21,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include "openconnect-internal.h"
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <openssl/err.h>
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 
@@ -35,7 +37,6 @@
 #define HMAC_CTX_free(c) do {					\
 				    HMAC_CTX_cleanup(c);	\
 				    free(c); } while (0)
-#define HMAC_CTX_reset HMAC_CTX_cleanup
 
 static inline HMAC_CTX *HMAC_CTX_new(void)
 {
@@ -56,10 +57,6 @@ void destroy_esp_ciphers(struct esp *esp)
 		HMAC_CTX_free(esp->hmac);
 		esp->hmac = NULL;
 	}
-	if (esp->pkt_hmac) {
-		HMAC_CTX_free(esp->pkt_hmac);
-		esp->pkt_hmac = NULL;
-	}
 }
 
 static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
@@ -93,9 +90,12 @@ static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
 	}
 	EVP_CIPHER_CTX_set_padding(esp->cipher, 0);
 
+	/* With AES-GCM the salt for the nonce follows the key; there's no HMAC */
+	if (!macalg)
+		goto out;
+
 	esp->hmac = HMAC_CTX_new();
-	esp->pkt_hmac = HMAC_CTX_new();
-	if (!esp->hmac || !esp->pkt_hmac) {
+	if (!esp->hmac) {
 		destroy_esp_ciphers(esp);
 		return -ENOMEM;
 	}
@@ -107,44 +107,76 @@ static int init_esp_ciphers(struct openconnect_info *vpninfo, struct esp *esp,
 		openconnect_report_ssl_errors(vpninfo);
 		destroy_esp_ciphers(esp);
 	}
+ out:
 	esp->seq = 0;
 	esp->seq_backlog = 0;
 	return 0;
 }
 
-int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
+static int esp_algs(struct openconnect_info *vpninfo,
+		    const EVP_MD **macalg, const EVP_CIPHER **encalg)
 {
-	struct esp *esp_in;
-	const EVP_CIPHER *encalg;
-	const EVP_MD *macalg;
-	int ret;
-
-	if (vpninfo->dtls_state == DTLS_DISABLED)
-		return -EOPNOTSUPP;
-	if (!vpninfo->dtls_addr)
-		return -EINVAL;
-
 	switch (vpninfo->esp_enc) {
 	case 0x02:
-		encalg = EVP_aes_128_cbc();
+		*encalg = EVP_aes_128_cbc();
 		break;
 	case 0x05:
-		encalg = EVP_aes_256_cbc();
+		*encalg = EVP_aes_256_cbc();
 		break;
+#ifdef EVP_CTRL_GCM_SET_TAG
+	case ENC_AES_128_GCM:
+		*encalg = EVP_aes_128_gcm();
+		*macalg = NULL;
+		return 0;
+	case ENC_AES_256_GCM:
+		*encalg = EVP_aes_256_gcm();
+		*macalg = NULL;
+		return 0;
+#endif
 	default:
 		return -EINVAL;
 	}
 
 	switch (vpninfo->esp_hmac) {
 	case 0x01:
-		macalg = EVP_md5();
+		*macalg = EVP_md5();
 		break;
 	case 0x02:
-		macalg = EVP_sha1();
+		*macalg = EVP_sha1();
 		break;
 	default:
 		return -EINVAL;
 	}
+	return 0;
+}
+
+int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
+{
+	struct esp *esp_in;
+	const EVP_CIPHER *encalg;
+	const EVP_MD *macalg;
+	int ret;
+
+	if (vpninfo->dtls_state == DTLS_DISABLED)
+		return -EOPNOTSUPP;
+	if (!vpninfo->dtls_addr)
+		return -EINVAL;
+
+#ifdef HAVE_TUN_MULTIQUEUE
+	/* Workers are restarted with the new keys by esp_mainloop() */
+	esp_stop_workers(vpninfo);
+#endif
+#ifdef HAVE_XFRM
+	/* Nor can the kernel switch to a new SA by itself; it would drop
+	   whatever arrived on it. So the rekey is done in userspace, from
+	   where the kernel's SAs had got to. esp_mainloop() puts them back
+	   once the old SA is finished with. */
+	esp_xfrm_remove(vpninfo);
+#endif
+
+	ret = esp_algs(vpninfo, &macalg, &encalg);
+	if (ret)
+		return ret;
 
 	if (new_keys) {
 		vpninfo->old_esp_maxseq = vpninfo->esp_in[vpninfo->current_esp_in].seq + 32;
@@ -163,83 +195,188 @@ int setup_esp_keys(struct openconnect_info *vpninfo, int new_keys)
 		}
 	}
 
-	ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out, macalg, encalg, 0);
+	ret = init_esp_ciphers(vpninfo, esp_in, macalg, encalg, 1);
 	if (ret)
 		return ret;
 
-	ret = init_esp_ciphers(vpninfo, esp_in, macalg, encalg, 1);
-	if (ret) {
-		destroy_esp_ciphers(&vpninfo->esp_out);
-		return ret;
+	if (vpninfo->dtls_state == DTLS_CONNECTED) {
+		/* Keep sending on the old SA until the server is seen using
+		   the new one. Then esp_switch_out() installs it. */
+		ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out_next, macalg, encalg, 0);
+		if (ret)
+			return ret;
+		vpninfo->esp_rekey_pending = 1;
+		vpninfo->esp_rekey_start = timer_update(vpninfo);
+	} else {
+		vpninfo->esp_out.spi = vpninfo->esp_out_next.spi;
+		memcpy(vpninfo->esp_out.secrets, vpninfo->esp_out_next.secrets,
+		       sizeof(vpninfo->esp_out.secrets));
+		ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out, macalg, encalg, 0);
+		if (ret)
+			return ret;
 	}
 
+	/* Byte lifetimes count from here */
+	vpninfo->esp_sa_stats = vpninfo->data_stats.esp;
+
 	if (vpninfo->dtls_state == DTLS_NOSECRET)
 		vpninfo->dtls_state = DTLS_SECRET;
-	vpninfo->pkt_trailer = 16 + 20; /* 16 for pad, 20 for HMAC (of which we use 16) */
+	if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+		vpninfo->esp_hdrlen = 8 + 8;
+		vpninfo->esp_icvlen = 16;
+		vpninfo->pkt_trailer = 3 + 2 + 16; /* 3 for pad, 2 for pad length and next header, 16 for ICV */
+	} else {
+		vpninfo->esp_hdrlen = 8 + 16;
+		vpninfo->esp_icvlen = 12;
+		vpninfo->pkt_trailer = 16 + 20; /* 16 for pad, 20 for HMAC (of which we use 16) */
+	}
 	return 0;
 }
 
-/* pkt->len shall be the *payload* length. Omitting the header and the 12-byte HMAC */
-int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+/* Give an ESP worker thread its own cipher state, keyed the same as 'src'.
+   An outbound clone goes on drawing sequence numbers from 'src'. */
+int clone_esp_ciphers(struct openconnect_info *vpninfo, struct esp *dst,
+		      struct esp *src, int decrypt)
 {
-	unsigned char hmac_buf[20];
-	unsigned int hmac_len = sizeof(hmac_buf);
-	int crypt_len = pkt->len;
+	const EVP_CIPHER *encalg;
+	const EVP_MD *macalg;
+	int ret;
 
-	HMAC_CTX_copy(esp->pkt_hmac, esp->hmac);
-	HMAC_Update(esp->pkt_hmac, (void *)&pkt->esp, sizeof(pkt->esp) + pkt->len);
-	HMAC_Final(esp->pkt_hmac, hmac_buf, &hmac_len);
-	HMAC_CTX_reset(esp->pkt_hmac);
+	ret = esp_algs(vpninfo, &macalg, &encalg);
+	if (ret)
+		return ret;
 
-	if (memcmp(hmac_buf, pkt->data + pkt->len, 12)) {
-		vpn_progress(vpninfo, PRG_DEBUG,
-			     _("Received ESP packet with invalid HMAC\n"));
-		return -EINVAL;
+	memset(dst, 0, sizeof(*dst));
+	dst->spi = src->spi;
+	memcpy(dst->secrets, src->secrets, sizeof(dst->secrets));
+	ret = init_esp_ciphers(vpninfo, dst, macalg, encalg, decrypt);
+	if (!ret && !decrypt)
+		dst->shared_seq = &src->seq;
+	return ret;
+}
+
+#ifdef EVP_CTRL_GCM_SET_TAG
+/* RFC4106: the 4-byte salt which follows the key, then the explicit IV */
+static void esp_gcm_nonce(struct openconnect_info *vpninfo, struct esp *esp,
+			  const unsigned char *iv, unsigned char *nonce)
+{
+	int keylen = vpninfo->esp_enc == ENC_AES_128_GCM ? 16 : 32;
+
+	memcpy(nonce, esp->secrets + keylen, 4);
+	memcpy(nonce + 4, iv, 8);
+}
+
+static int decrypt_esp_gcm(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	unsigned char nonce[12];
+	int len;
+
+	esp_gcm_nonce(vpninfo, esp, hdr->iv, nonce);
+
+	if (!EVP_DecryptInit_ex(esp->cipher, NULL, NULL, NULL, nonce) ||
+	    !EVP_CIPHER_CTX_ctrl(esp->cipher, EVP_CTRL_GCM_SET_TAG, 16,
+				 pkt->data + pkt->len)) {
+		ERR_clear_error();
+		return -EIO;
 	}
 
-	/* Why in $DEITY's name would you ever *not* set this? Perhaps we
-	 * should do th check anyway, but only warn instead of discarding
-	 * the packet? */
-	if (vpninfo->esp_replay_protect &&
-	    verify_packet_seqno(vpninfo, esp, ntohl(pkt->esp.seq)))
+	/* SPI and sequence number are the additional authenticated data */
+	if (!EVP_DecryptUpdate(esp->cipher, NULL, &len, (void *)hdr, 8) ||
+	    !EVP_DecryptUpdate(esp->cipher, pkt->data, &len, pkt->data, pkt->len) ||
+	    !EVP_DecryptFinal_ex(esp->cipher, pkt->data + len, &len)) {
+		ERR_clear_error();
 		return -EINVAL;
+	}
+	return 0;
+}
 
+static int encrypt_esp_gcm(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+	struct esp_hdr *hdr = esp_pkt_hdr(vpninfo, pkt);
+	unsigned char nonce[12];
+	uint32_t seq;
+	int i, padlen, crypt_len, len;
+
+	if (esp_next_seq(esp, &seq))
+		return -ENOSPC;
+
+	/* The IV need only be unique for the key, and the sequence number is.
+	   So there's no need for a random one. */
+	hdr->spi = esp->spi;
+	hdr->seq = htonl(seq);
+	store_be32(hdr->iv, 0);
+	store_be32(hdr->iv + 4, seq);
+	esp_gcm_nonce(vpninfo, esp, hdr->iv, nonce);
+
+	/* Pad to a multiple of four bytes; GCM itself needs no block padding */
+	padlen = 3 - ((pkt->len + 1) & 3);
+	for (i = 0; i < padlen; i++)
+		pkt->data[pkt->len + i] = i + 1;
+	pkt->data[pkt->len + padlen] = padlen;
+	pkt->data[pkt->len + padlen + 1] = 0x04; /* Legacy IP */
 
-	if (!EVP_DecryptInit_ex(esp->cipher, NULL, NULL, NULL,
-				pkt->esp.iv)) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to set up decryption context for ESP packet:\n"));
-		openconnect_report_ssl_errors(vpninfo);
-		return -EINVAL;
+	crypt_len = pkt->len + padlen + 2;
+	if (!EVP_EncryptInit_ex(esp->cipher, NULL, NULL, NULL, nonce) ||
+	    !EVP_EncryptUpdate(esp->cipher, NULL, &len, (void *)hdr, 8) ||
+	    !EVP_EncryptUpdate(esp->cipher, pkt->data, &len, pkt->data, crypt_len) ||
+	    !EVP_EncryptFinal_ex(esp->cipher, pkt->data + crypt_len, &len) ||
+	    !EVP_CIPHER_CTX_ctrl(esp->cipher, EVP_CTRL_GCM_GET_TAG, 16,
+				 pkt->data + crypt_len)) {
+		ERR_clear_error();
+		return -EIO;
 	}
+	return vpninfo->esp_hdrlen + crypt_len + 16;
+}
+#endif
 
-	if (!EVP_DecryptUpdate(esp->cipher, pkt->data, &crypt_len,
-			       pkt->data, pkt->len)) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to decrypt ESP packet:\n"));
-		openconnect_report_ssl_errors(vpninfo);
+/* pkt->len shall be the *payload* length. Omitting the header and the 12-byte HMAC (or 16-byte GCM ICV)
+ *
+ * Returns -EINVAL if the packet fails authentication, or -EIO if the
+ * crypto library does. Nothing is logged, since the ESP worker threads
+ * use this too; esp_decrypt_rx() reports failures for the main thread. */
+int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+	unsigned char hmac_buf[20];
+	unsigned int hmac_len = sizeof(hmac_buf);
+	int crypt_len = pkt->len;
+
+#ifdef EVP_CTRL_GCM_SET_TAG
+	if (ENC_IS_AEAD(vpninfo->esp_enc))
+		return decrypt_esp_gcm(vpninfo, esp, pkt);
+#endif
+	HMAC_Init_ex(esp->hmac, NULL, 0, NULL, NULL);
+	HMAC_Update(esp->hmac, (void *)&pkt->esp, sizeof(pkt->esp) + pkt->len);
+	HMAC_Final(esp->hmac, hmac_buf, &hmac_len);
+
+	if (memcmp(hmac_buf, pkt->data + pkt->len, 12))
 		return -EINVAL;
+
+	if (!EVP_DecryptInit_ex(esp->cipher, NULL, NULL, NULL,
+				pkt->esp.iv) ||
+	    !EVP_DecryptUpdate(esp->cipher, pkt->data, &crypt_len,
+			       pkt->data, pkt->len)) {
+		ERR_clear_error();
+		return -EIO;
 	}
 
 	return 0;
 }
 
-int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
+/* The CBC transform proper, once the caller has filled in the IV */
+static int encrypt_esp_cbc(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
 {
 	int i, padlen;
 	const int blksize = 16;
 	unsigned int hmac_len = 20;
 	int crypt_len;
+	uint32_t seq;
 
-	/* This gets much more fun if the IV is variable-length */
-	pkt->esp.spi = vpninfo->esp_out.spi;
-	pkt->esp.seq = htonl(vpninfo->esp_out.seq++);
-	if (!RAND_bytes((void *)&pkt->esp.iv, sizeof(pkt->esp.iv))) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to generate random IV for ESP packet:\n"));
-		openconnect_report_ssl_errors(vpninfo);
-		return -EIO;
-	}
+	if (esp_next_seq(esp, &seq))
+		return -ENOSPC;
+
+	pkt->esp.spi = esp->spi;
+	pkt->esp.seq = htonl(seq);
 
 	padlen = blksize - 1 - ((pkt->len + 1) % blksize);
 	for (i=0; i<padlen; i++)
@@ -247,27 +384,68 @@ int encrypt_esp_packet(struct openconnect_info *vpninfo, struct pkt *pkt)
 	pkt->data[pkt->len + padlen] = padlen;
 	pkt->data[pkt->len + padlen + 1] = 0x04; /* Legacy IP */
 
-	if (!EVP_EncryptInit_ex(vpninfo->esp_out.cipher, NULL, NULL, NULL,
-				pkt->esp.iv)) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to set up encryption context for ESP packet:\n"));
-		openconnect_report_ssl_errors(vpninfo);
-		return -EINVAL;
-	}
-
 	crypt_len = pkt->len + padlen + 2;
-	if (!EVP_EncryptUpdate(vpninfo->esp_out.cipher, pkt->data, &crypt_len,
+	if (!EVP_EncryptInit_ex(esp->cipher, NULL, NULL, NULL,
+				pkt->esp.iv) ||
+	    !EVP_EncryptUpdate(esp->cipher, pkt->data, &crypt_len,
 			       pkt->data, crypt_len)) {
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to encrypt ESP packet:\n"));
-		openconnect_report_ssl_errors(vpninfo);
-		return -EINVAL;
+		ERR_clear_error();
+		return -EIO;
 	}
 
-	HMAC_CTX_copy(vpninfo->esp_out.pkt_hmac, vpninfo->esp_out.hmac);
-	HMAC_Update(vpninfo->esp_out.pkt_hmac, (void *)&pkt->esp, sizeof(pkt->esp) + crypt_len);
-	HMAC_Final(vpninfo->esp_out.pkt_hmac, pkt->data + crypt_len, &hmac_len);
-	HMAC_CTX_reset(vpninfo->esp_out.pkt_hmac);
+	/* Restart from the keyed state, rather than copying the context */
+	HMAC_Init_ex(esp->hmac, NULL, 0, NULL, NULL);
+	HMAC_Update(esp->hmac, (void *)&pkt->esp, sizeof(pkt->esp) + crypt_len);
+	HMAC_Final(esp->hmac, pkt->data + crypt_len, &hmac_len);
 
 	return sizeof(pkt->esp) + crypt_len + 12;
 }
+
+/* Returns the length to send, -ENOSPC once the sequence numbers for the
+ * SA run out, or -EIO if the crypto library fails. As with decryption,
+ * nothing is logged; the callers in esp.c report failures for the main
+ * thread, and the workers count theirs for esp_collect_worker_times(). */
+int encrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct pkt *pkt)
+{
+#ifdef EVP_CTRL_GCM_SET_TAG
+	if (ENC_IS_AEAD(vpninfo->esp_enc))
+		return encrypt_esp_gcm(vpninfo, esp, pkt);
+#endif
+	/* This gets much more fun if the IV is variable-length */
+	if (!RAND_bytes((void *)&pkt->esp.iv, sizeof(pkt->esp.iv))) {
+		ERR_clear_error();
+		return -EIO;
+	}
+	return encrypt_esp_cbc(vpninfo, esp, pkt);
+}
+
+/* As encrypt_esp_packet() on each of the packets in turn, leaving the
+ * result for each in lens[]. The CBC IVs for a whole batch come from a
+ * single call into the RNG, which otherwise costs about as much as
+ * encrypting a small packet. Returns the number of packets encrypted. */
+int encrypt_esp_packets(struct openconnect_info *vpninfo, struct esp *esp,
+			struct pkt **pkts, int *lens, int n)
+{
+	unsigned char ivs[MAX_UDP_BATCH][sizeof(pkts[0]->esp.iv)];
+	int i, iv, done = 0;
+
+	for (i = 0; i < n; i++) {
+		if (ENC_IS_AEAD(vpninfo->esp_enc)) {
+			lens[i] = encrypt_esp_packet(vpninfo, esp, pkts[i]);
+		} else {
+			iv = i % MAX_UDP_BATCH;
+			if (!iv && !RAND_bytes((void *)ivs, sizeof(ivs[0]) *
+					       (n - i < MAX_UDP_BATCH ? n - i : MAX_UDP_BATCH))) {
+				ERR_clear_error();
+				while (i < n)
+					lens[i++] = -EIO;
+				break;
+			}
+			memcpy(pkts[i]->esp.iv, ivs[iv], sizeof(ivs[iv]));
+			lens[i] = encrypt_esp_cbc(vpninfo, esp, pkts[i]);
+		}
+		if (lens[i] > 0)
+			done++;
+	}
+	return done;
+}
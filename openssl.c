@@ -164,11 +164,6 @@ static int openconnect_openssl_write(struct openconnect_info *vpninfo, char *buf
 	return _openconnect_openssl_write(vpninfo->https_ssl, vpninfo->ssl_fd, vpninfo, buf, len);
 }
 
-int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len)
-{
-	return _openconnect_openssl_write(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len);
-}
-
 /* set ms to zero for no timeout */
 static int _openconnect_openssl_read(SSL *ssl, int fd, struct openconnect_info *vpninfo, char *buf, size_t len, unsigned ms)
 {
@@ -217,11 +212,6 @@ static int openconnect_openssl_read(struct openconnect_info *vpninfo, char *buf,
 	return _openconnect_openssl_read(vpninfo->https_ssl, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
-int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms)
-{
-	return _openconnect_openssl_read(vpninfo->dtls_ssl, vpninfo->dtls_fd, vpninfo, buf, len, ms);
-}
-
 static int openconnect_openssl_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
 	int i = 0;
@@ -310,6 +300,7 @@ int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 		/* Waiting for the socket to become writable -- it's
 		   probably stalled, and/or the buffers are full */
 		monitor_write_fd(vpninfo, ssl);
+		/* fall through */
 	case SSL_ERROR_WANT_READ:
 		return 0;
 
@@ -1600,6 +1591,85 @@ static int ssl_app_verify_callback(X509_STORE_CTX *ctx, void *arg)
 	return 0;
 }
 
+/* The server sends no certificate when it resumes a session. Check the
+   one the session was set up with, as if it had. */
+static int verify_resumed_peer(struct openconnect_info *vpninfo, SSL *https_ssl)
+{
+	X509_STORE_CTX *ctx;
+	X509 *cert;
+	int ret = 0;
+
+	cert = SSL_get_peer_certificate(https_ssl);
+	ctx = X509_STORE_CTX_new();
+	if (cert && ctx &&
+	    X509_STORE_CTX_init(ctx, SSL_CTX_get_cert_store(vpninfo->https_ctx),
+				cert, SSL_get_peer_cert_chain(https_ssl))) {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		X509_VERIFY_PARAM_inherit(X509_STORE_CTX_get0_param(ctx),
+					  SSL_get0_param(https_ssl));
+#endif
+		ret = ssl_app_verify_callback(ctx, vpninfo);
+	}
+	X509_STORE_CTX_free(ctx);
+	X509_free(cert);
+	return ret;
+}
+
+/* OpenSSL's own session cache is turned off, and the latest session
+   from the server kept here instead, ready for the next connection. */
+static int new_tls_session(SSL *ssl, SSL_SESSION *sess)
+{
+	struct openconnect_info *vpninfo = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	unsigned char *data, *p;
+	int len;
+
+	if (vpninfo->https_session)
+		SSL_SESSION_free(vpninfo->https_session);
+	vpninfo->https_session = sess;
+
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len > 0 && (data = malloc(len))) {
+		p = data;
+		i2d_SSL_SESSION(sess, &p);
+		save_tls_session(vpninfo, data, len);
+		free(data);
+	}
+	return 1;
+}
+
+/* Offer the session from the last connection to this server, or from
+   the cache file. Returns nonzero if there was one. */
+static int offer_tls_session(struct openconnect_info *vpninfo, SSL *https_ssl)
+{
+	const unsigned char *p;
+	unsigned char *data;
+	int len;
+
+	if (vpninfo->https_session && !tls_session_matches(vpninfo)) {
+		SSL_SESSION_free(vpninfo->https_session);
+		vpninfo->https_session = NULL;
+	}
+	if (!vpninfo->https_session) {
+		len = load_tls_session(vpninfo, &data);
+		if (!len)
+			return 0;
+		p = data;
+		vpninfo->https_session = d2i_SSL_SESSION(NULL, &p, len);
+		free(data);
+		if (!vpninfo->https_session)
+			return 0;
+	}
+
+	if (!SSL_set_session(https_ssl, vpninfo->https_session)) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Discarding unusable TLS session\n"));
+		SSL_SESSION_free(vpninfo->https_session);
+		vpninfo->https_session = NULL;
+		return 0;
+	}
+	return 1;
+}
+
 static int check_certificate_expiry(struct openconnect_info *vpninfo)
 {
 	method_const ASN1_TIME *notAfter;
@@ -1649,6 +1719,7 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	SSL *https_ssl;
 	BIO *https_bio;
 	int ssl_sock;
+	int offered;
 	int err;
 
 	if (vpninfo->https_ssl)
@@ -1722,6 +1793,12 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		SSL_CTX_set_cert_verify_callback(vpninfo->https_ctx,
 						 ssl_app_verify_callback, vpninfo);
 
+		SSL_CTX_set_app_data(vpninfo->https_ctx, vpninfo);
+		SSL_CTX_set_session_cache_mode(vpninfo->https_ctx,
+					       SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(vpninfo->https_ctx, new_tls_session);
+
 		if (!vpninfo->no_system_trust)
 			SSL_CTX_set_default_verify_paths(vpninfo->https_ctx);
 
@@ -1823,6 +1900,14 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		SSL_set_tlsext_host_name(https_ssl, vpninfo->hostname);
 #endif
 	SSL_set_verify(https_ssl, SSL_VERIFY_PEER, NULL);
+#if defined(HAVE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+	/* OpenSSL installs the keys in the kernel itself as the handshake
+	   completes, and keeps using the socket through the kernel after
+	   that. It just carries on by itself if the kernel can't do it. */
+	if (vpninfo->ktls && vpninfo->proto->tls_stream)
+		SSL_set_options(https_ssl, SSL_OP_ENABLE_KTLS);
+#endif
+	offered = offer_tls_session(vpninfo, https_ssl);
 
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
@@ -1857,6 +1942,19 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	if (offered) {
+		tls_session_resumed(vpninfo, SSL_session_reused(https_ssl));
+		if (SSL_session_reused(https_ssl) &&
+		    !verify_resumed_peer(vpninfo, https_ssl)) {
+			vpn_progress(vpninfo, PRG_ERR, _("SSL connection failure\n"));
+			SSL_SESSION_free(vpninfo->https_session);
+			vpninfo->https_session = NULL;
+			SSL_free(https_ssl);
+			closesocket(ssl_sock);
+			return -EINVAL;
+		}
+	}
+
 	vpninfo->cstp_cipher = (char *)SSL_get_cipher_name(https_ssl);
 
 	vpninfo->ssl_fd = ssl_sock;
@@ -1878,12 +1976,42 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 	return -EOPNOTSUPP;
 }
 
+/* Report whether OpenSSL managed to use kernel TLS for the session */
+void ssl_enable_ktls(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo->ktls || !vpninfo->proto->tls_stream)
+		return;
+
+#if defined(HAVE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+	vpninfo->ktls_active = 0;
+	if (BIO_get_ktls_recv(SSL_get_rbio(vpninfo->https_ssl)))
+		vpninfo->ktls_active |= KTLS_RX;
+	if (BIO_get_ktls_send(SSL_get_wbio(vpninfo->https_ssl)))
+		vpninfo->ktls_active |= KTLS_TX;
+
+	if (vpninfo->ktls_active)
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Kernel TLS enabled for %s\n"),
+			     vpninfo->ktls_active == KTLS_RX ? _("receive") :
+			     vpninfo->ktls_active == KTLS_TX ? _("send") :
+			     _("send and receive"));
+	else
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Kernel TLS not supported with %s\n"),
+			     vpninfo->cstp_cipher);
+#else
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("This build does not support kernel TLS\n"));
+#endif
+}
+
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->https_ssl) {
 		SSL_free(vpninfo->https_ssl);
 		vpninfo->https_ssl = NULL;
 	}
+	vpninfo->ktls_active = 0;
 	if (vpninfo->ssl_fd != -1) {
 		closesocket(vpninfo->ssl_fd);
 		unmonitor_read_fd(vpninfo, ssl);
@@ -1891,7 +2019,13 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		unmonitor_except_fd(vpninfo, ssl);
 		vpninfo->ssl_fd = -1;
 	}
+	/* Nothing to keep alive until the next connection */
+	timer_cancel(vpninfo, &vpninfo->ssl_times.timer);
 	if (final) {
+		if (vpninfo->https_session) {
+			SSL_SESSION_free(vpninfo->https_session);
+			vpninfo->https_session = NULL;
+		}
 		if (vpninfo->https_ctx) {
 			SSL_CTX_free(vpninfo->https_ctx);
 			vpninfo->https_ctx = NULL;
@@ -40,6 +40,10 @@
 
 #include "openconnect-internal.h"
 
+#if defined(HAVE_UDP_SEGMENT) || defined(HAVE_UDP_GRO)
+#include <netinet/udp.h>
+#endif
+
 #ifdef ANDROID_KEYSTORE
 #include <sys/un.h>
 #endif
@@ -64,43 +68,32 @@ static inline int connect_pending()
  * negative value, that's a normal errno and should be handled with
  * strerror(). No, you can't just pass the latter value (negated) to
  * openconnect__win32_strerror() because it gives nonsense results. */
-static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
-			       const struct sockaddr *addr, socklen_t addrlen)
+/* Returns 1 if the connection is still in progress */
+static int start_connect(struct openconnect_info *vpninfo, int sockfd,
+			 const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_storage peer;
-	socklen_t peerlen = sizeof(peer);
-	fd_set wr_set, rd_set, ex_set;
-	int maxfd = sockfd;
-	int err;
-
 	set_sock_nonblock(sockfd);
 	if (vpninfo->protect_socket)
 		vpninfo->protect_socket(vpninfo->cbdata, sockfd);
 
-	if (connect(sockfd, addr, addrlen) < 0 && !connect_pending()) {
+	if (connect(sockfd, addr, addrlen) < 0) {
+		if (connect_pending())
+			return 1;
 #ifdef _WIN32
 		return WSAGetLastError();
 #else
 		return -errno;
 #endif
 	}
+	return 0;
+}
 
-	do {
-		FD_ZERO(&wr_set);
-		FD_ZERO(&rd_set);
-		FD_ZERO(&ex_set);
-		FD_SET(sockfd, &wr_set);
-#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
-		FD_SET(sockfd, &ex_set);
-#endif
-		cmd_fd_set(vpninfo, &rd_set, &maxfd);
-		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
-		if (is_cancel_pending(vpninfo, &rd_set)) {
-			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
-			return -EINTR;
-		}
-	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
-		 !vpninfo->got_pause_cmd);
+/* Once select() says the socket is ready, find out how it went */
+static int finish_connect(int sockfd)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	int err;
 
 	/* Check whether connect() succeeded or failed by using
 	   getpeername(). See http://cr.yp.to/docs/connect.html */
@@ -131,6 +124,37 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	return err;
 }
 
+static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
+			       const struct sockaddr *addr, socklen_t addrlen)
+{
+	fd_set wr_set, rd_set, ex_set;
+	int maxfd = sockfd;
+	int err;
+
+	err = start_connect(vpninfo, sockfd, addr, addrlen);
+	if (err <= 0)
+		return err;
+
+	do {
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		FD_SET(sockfd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+		FD_SET(sockfd, &ex_set);
+#endif
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, NULL);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			return -EINTR;
+		}
+	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
+		 !vpninfo->got_pause_cmd);
+
+	return finish_connect(sockfd);
+}
+
 /* checks whether the provided string is an IP or a hostname.
  */
 unsigned string_is_hostname(const char *str)
@@ -163,6 +187,254 @@ static int match_sockaddr(struct sockaddr *a, struct sockaddr *b)
 		return 0;
 }
 
+/*
+ * Happy Eyeballs (RFC8305). Rather than waiting for each address in turn
+ * to time out, start connecting to the next one if the earlier ones
+ * haven't got anywhere after CONNECT_ATTEMPT_DELAY ms, alternating between
+ * IPv6 and Legacy IP. The first connection to complete is used, and the
+ * rest are abandoned.
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+
+struct connect_attempt {
+	struct addrinfo *rp;
+	int fd;
+	uint64_t start;		/* timer_now() when the attempt began */
+	char host[80];
+};
+
+static long ms_since(uint64_t start)
+{
+	return (long)(timer_now() - start);
+}
+
+static void connect_failed(struct openconnect_info *vpninfo,
+			   struct connect_attempt *a, const char *port, int err)
+{
+	struct addrinfo *rp = a->rp;
+
+	if (a->host[0]) {
+		char *errstr;
+#ifdef _WIN32
+		if (err > 0)
+			errstr = openconnect__win32_strerror(err);
+		else
+#endif
+			errstr = strerror(-err);
+
+		vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s after %ld ms: %s\n"),
+			     rp->ai_family == AF_INET6 ? "[" : "",
+			     a->host,
+			     rp->ai_family == AF_INET6 ? "]" : "",
+			     port, ms_since(a->start), errstr);
+#ifdef _WIN32
+		if (err > 0)
+			free(errstr);
+#endif
+	}
+	if (a->fd >= 0) {
+		closesocket(a->fd);
+		a->fd = -1;
+	}
+
+	/* If we're in DynDNS mode but this *was* the cached IP address,
+	 * don't bother falling back to it if it didn't work. */
+	if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
+	    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Forgetting non-functional previous peer address\n"));
+		free(vpninfo->peer_addr);
+		vpninfo->peer_addr = 0;
+		vpninfo->peer_addrlen = 0;
+		free(vpninfo->ip_info.gateway_addr);
+		vpninfo->ip_info.gateway_addr = NULL;
+	}
+}
+
+/* Returns 1 if the connection is in progress, 0 if it completed at once,
+   or an error if it has already failed. */
+static int start_attempt(struct openconnect_info *vpninfo,
+			 struct connect_attempt *a, const char *port)
+{
+	struct addrinfo *rp = a->rp;
+	int err;
+
+	a->host[0] = 0;
+	if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, a->host,
+			 sizeof(a->host), NULL, 0, NI_NUMERICHOST))
+		vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
+				     _("Attempting to connect to proxy %s%s%s:%s\n") :
+				     _("Attempting to connect to server %s%s%s:%s\n"),
+			     rp->ai_family == AF_INET6 ? "[" : "",
+			     a->host,
+			     rp->ai_family == AF_INET6 ? "]" : "",
+			     port);
+
+	a->start = timer_now();
+	a->fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	if (a->fd < 0) {
+#ifdef _WIN32
+		return WSAGetLastError();
+#else
+		return -errno;
+#endif
+	}
+	set_fd_cloexec(a->fd);
+
+	err = start_connect(vpninfo, a->fd, rp->ai_addr, rp->ai_addrlen);
+	if (err && err != 1) {
+		closesocket(a->fd);
+		a->fd = -1;
+	}
+	return err;
+}
+
+/* Returns the connected socket, with *winner pointing at the address it
+   is connected to, or a negative error. */
+static int happy_eyeballs_connect(struct openconnect_info *vpninfo,
+				  struct addrinfo *result, const char *port,
+				  struct addrinfo **winner, char *host, int hostlen)
+{
+	struct connect_attempt *attempts, *a;
+	struct addrinfo *rp, *other;
+	fd_set rd_set, wr_set, ex_set;
+	struct timeval tv, *tvp;
+	int n = 0, i, next = 0, pending = 0, start_now = 1;
+	int maxfd, err, ret = -EINVAL;
+	long delay;
+
+	for (rp = result; rp; rp = rp->ai_next)
+		n++;
+	attempts = calloc(n, sizeof(*attempts));
+	if (!attempts)
+		return -ENOMEM;
+
+	/* Take addresses alternately from the family getaddrinfo() put
+	   first, and from the others, keeping their order within each. */
+	rp = result;
+	for (other = result; other && other->ai_family == result->ai_family; )
+		other = other->ai_next;
+	for (i = 0; i < n; ) {
+		for (; rp && rp->ai_family != result->ai_family; rp = rp->ai_next)
+			;
+		if (rp) {
+			attempts[i++].rp = rp;
+			rp = rp->ai_next;
+		}
+		for (; other && other->ai_family == result->ai_family; other = other->ai_next)
+			;
+		if (other) {
+			attempts[i++].rp = other;
+			other = other->ai_next;
+		}
+	}
+	for (i = 0; i < n; i++)
+		attempts[i].fd = -1;
+
+	a = NULL;
+	while (1) {
+		/* Start another attempt if it's time, or if there are none
+		   left to wait for */
+		if (next < n && (start_now || !pending ||
+				 ms_since(attempts[next - 1].start) >= CONNECT_ATTEMPT_DELAY)) {
+			start_now = 0;
+			err = start_attempt(vpninfo, &attempts[next], port);
+			if (!err) {
+				a = &attempts[next++];
+				break;
+			}
+			if (err == 1) {
+				pending++;
+			} else {
+				connect_failed(vpninfo, &attempts[next], port, err);
+				start_now = 1;
+			}
+			next++;
+			continue;
+		}
+		if (!pending)
+			break;
+
+		FD_ZERO(&rd_set);
+		FD_ZERO(&wr_set);
+		FD_ZERO(&ex_set);
+		maxfd = -1;
+		for (i = 0; i < next; i++) {
+			if (attempts[i].fd < 0)
+				continue;
+			FD_SET(attempts[i].fd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(attempts[i].fd, &ex_set);
+#endif
+			if (attempts[i].fd > maxfd)
+				maxfd = attempts[i].fd;
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		tvp = NULL;
+		if (next < n) {
+			delay = CONNECT_ATTEMPT_DELAY - ms_since(attempts[next - 1].start);
+			if (delay < 0)
+				delay = 0;
+			tv.tv_sec = delay / 1000;
+			tv.tv_usec = (delay % 1000) * 1000;
+			tvp = &tv;
+		}
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, tvp);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			ret = -EINTR;
+			break;
+		}
+
+		for (i = 0; i < next; i++) {
+			if (attempts[i].fd < 0 ||
+			    (!FD_ISSET(attempts[i].fd, &wr_set) &&
+			     !FD_ISSET(attempts[i].fd, &ex_set)))
+				continue;
+			err = finish_connect(attempts[i].fd);
+			if (!err) {
+				a = &attempts[i];
+				break;
+			}
+			connect_failed(vpninfo, &attempts[i], port, err);
+			pending--;
+			/* No point waiting for the timer to go off */
+			start_now = 1;
+		}
+		if (a)
+			break;
+	}
+
+	if (a) {
+		if (a->host[0])
+			vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s in %ld ms\n"),
+				     a->rp->ai_family == AF_INET6 ? "[" : "",
+				     a->host,
+				     a->rp->ai_family == AF_INET6 ? "]" : "",
+				     port, ms_since(a->start));
+		ret = a->fd;
+		a->fd = -1;
+		*winner = a->rp;
+		snprintf(host, hostlen, "%s", a->host);
+	}
+
+	for (i = 0; i < next; i++) {
+		if (attempts[i].fd < 0)
+			continue;
+		if (attempts[i].host[0])
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Abandoned connection to %s%s%s:%s after %ld ms\n"),
+				     attempts[i].rp->ai_family == AF_INET6 ? "[" : "",
+				     attempts[i].host,
+				     attempts[i].rp->ai_family == AF_INET6 ? "]" : "",
+				     port, ms_since(attempts[i].start));
+		closesocket(attempts[i].fd);
+	}
+	free(attempts);
+	return ret;
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
@@ -222,9 +494,11 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			goto out;
 		}
 	} else {
-		struct addrinfo hints, *result, *rp;
+		struct addrinfo hints, *result, *rp = NULL;
 		char *hostname;
+		char host[80];
 		char port[6];
+		int cached;
 
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
@@ -298,11 +572,8 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			hints.ai_flags |= AI_NUMERICHOST;
 		}
 
-		if (vpninfo->getaddrinfo_override)
-			err = vpninfo->getaddrinfo_override(vpninfo->cbdata, hostname, port, &hints, &result);
-		else
-			err = getaddrinfo(hostname, port, &hints, &result);
-
+	lookup:
+		err = dns_lookup(vpninfo, hostname, port, &hints, &result, &cached);
 		if (err) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("getaddrinfo failed for host '%s': %s\n"),
@@ -319,118 +590,65 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			}
 			goto out;
 		}
+		ssl_sock = happy_eyeballs_connect(vpninfo, result, port, &rp,
+						  host, sizeof(host));
+		/* The server may have moved since it was looked up */
+		if (ssl_sock < 0 && ssl_sock != -EINTR && cached) {
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Cached addresses for %s failed; looking it up again\n"),
+				     hostname);
+			dns_cache_flush(vpninfo);
+			goto lookup;
+		}
 		if (hints.ai_flags & AI_NUMERICHOST)
 			free(hostname);
 
-		for (rp = result; rp ; rp = rp->ai_next) {
-			char host[80];
-
-			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port);
-
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			set_fd_cloexec(ssl_sock);
-			err = cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen);
-			if (!err) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
-
-				if (host[0]) {
-					vpninfo->ip_info.gateway_addr = strdup(host);
-					vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
-						     rp->ai_family == AF_INET6 ? "[" : "",
-						     host,
-						     rp->ai_family == AF_INET6 ? "]" : "",
-						     port);
-				}
+		if (ssl_sock >= 0) {
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			free(vpninfo->ip_info.gateway_addr);
+			vpninfo->ip_info.gateway_addr = NULL;
 
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addrlen = 0;
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					closesocket(ssl_sock);
-					ssl_sock = -ENOMEM;
-					goto out;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, ensure that we output *this* IP address in
-				 * authentication results because we're going to need to
-				 * reconnect to the *same* server from the rotation. And with
-				 * some trick DNS setups, it might possibly be a "rotation"
-				 * even if we only got one result from getaddrinfo() this
-				 * time.
-				 *
-				 * If there's a proxy, we're kind of screwed; we can't know
-				 * which IP address we connected to. Perhaps we ought to do
-				 * the DNS lookup locally and connect to a specific IP? */
-				if (!vpninfo->proxy && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
-				}
-				break;
-			}
-			if (host[0]) {
-				char *errstr;
-#ifdef _WIN32
-				if (err > 0)
-					errstr = openconnect__win32_strerror(err);
-				else
-#endif
-					errstr = strerror(-err);
+			if (host[0])
+				vpninfo->ip_info.gateway_addr = strdup(host);
 
-				vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port, errstr);
-#ifdef _WIN32
-				if (err > 0)
-					free(errstr);
-#endif
+			free(vpninfo->peer_addr);
+			vpninfo->peer_addrlen = 0;
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				closesocket(ssl_sock);
+				ssl_sock = -ENOMEM;
+				goto out;
 			}
-			closesocket(ssl_sock);
-			ssl_sock = -1;
-
-			/* If we're in DynDNS mode but this *was* the cached IP address,
-			 * don't bother falling back to it if it didn't work. */
-			if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
-			    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
-				vpn_progress(vpninfo, PRG_TRACE,
-					     _("Forgetting non-functional previous peer address\n"));
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addr = 0;
-				vpninfo->peer_addrlen = 0;
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+			/* If no proxy, ensure that we output *this* IP address in
+			 * authentication results because we're going to need to
+			 * reconnect to the *same* server from the rotation. And with
+			 * some trick DNS setups, it might possibly be a "rotation"
+			 * even if we only got one result from getaddrinfo() this
+			 * time.
+			 *
+			 * If there's a proxy, we're kind of screwed; we can't know
+			 * which IP address we connected to. Perhaps we ought to do
+			 * the DNS lookup locally and connect to a specific IP? */
+			if (!vpninfo->proxy && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
+				}
 			}
 		}
-		freeaddrinfo(result);
 
 		if (ssl_sock < 0) {
 			vpn_progress(vpninfo, PRG_ERR,
@@ -796,8 +1014,27 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 		vpninfo->got_pause_cmd = 1;
 		break;
 	case OC_CMD_STATS:
+#if defined(HAVE_ESP) && defined(HAVE_TUN_MULTIQUEUE)
+		esp_collect_worker_stats(vpninfo);
+#endif
 		if (vpninfo->stats_handler)
 			vpninfo->stats_handler(vpninfo->cbdata, &vpninfo->stats);
+		print_pkt_pool_stats(vpninfo);
+		print_data_stats(vpninfo);
+#ifdef HAVE_UDP_GRO
+		if (vpninfo->udp_gro_recvs) {
+			unsigned long per100 = vpninfo->udp_gro_dgrams * 100 / vpninfo->udp_gro_recvs;
+
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("UDP GRO: %lu datagrams in %lu receives (%lu.%02lu per receive)\n"),
+				     vpninfo->udp_gro_dgrams, vpninfo->udp_gro_recvs,
+				     per100 / 100, per100 % 100);
+		}
+#endif
+		if (vpninfo->tls_resume_tries)
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("TLS session resumed on %d of %d connections\n"),
+				     vpninfo->tls_resume_hits, vpninfo->tls_resume_tries);
 	}
 }
 
@@ -943,8 +1180,38 @@ int udp_connect(struct openconnect_info *vpninfo)
 		vpninfo->protect_socket(vpninfo->cbdata, fd);
 
 	sndbuf = vpninfo->ip_info.mtu * 2;
+	/* Leave room for a whole sendmmsg() burst */
+	if (vpninfo->udp_batch > 1)
+		sndbuf *= vpninfo->udp_batch;
 	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf));
 
+#ifdef HAVE_UDP_SEGMENT
+	/* Older kernels silently ignore the UDP_SEGMENT cmsg, which would
+	   send one giant datagram. Only use it if the kernel knows about it. */
+	{
+		int gso_size;
+		socklen_t gso_len = sizeof(gso_size);
+
+		vpninfo->udp_gso = !getsockopt(fd, SOL_UDP, UDP_SEGMENT,
+					       (void *)&gso_size, &gso_len);
+	}
+#endif
+
+	vpninfo->udp_gro = 0;
+#ifdef HAVE_UDP_GRO
+	/* Let the kernel hand over trains of datagrams from the server in
+	   one go. Not for io_uring, whose receives can't be split again. */
+#ifdef HAVE_IO_URING
+	if (!vpninfo->use_uring)
+#endif
+	{
+		int one = 1;
+
+		vpninfo->udp_gro = !setsockopt(fd, SOL_UDP, UDP_GRO,
+					       (void *)&one, sizeof(one));
+	}
+#endif
+
 	if (vpninfo->dtls_local_port) {
 		union {
 			struct sockaddr_in in;
@@ -993,11 +1260,52 @@ int udp_connect(struct openconnect_info *vpninfo)
 	return fd;
 }
 
+#ifdef HAVE_UDP_GRO
+/* Receive from dtls_fd with UDP_GRO enabled. That may return a train of
+ * datagrams run together, all of '*seg' bytes except perhaps the last.
+ * Returns the total length, or a negative errno. Zero is one empty
+ * datagram, not the end of the data; -EAGAIN means there's no more. */
+int udp_recv_gro(struct openconnect_info *vpninfo, struct iovec *iov, int iovlen, int *seg)
+{
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int len, gso_size;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovlen;
+	msg.msg_control = &cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(vpninfo->dtls_fd, &msg, MSG_DONTWAIT);
+	if (len < 0)
+		return -errno;
+
+	*seg = len;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+			if (gso_size > 0 && gso_size < len)
+				*seg = gso_size;
+		}
+	}
+
+	vpninfo->udp_gro_recvs++;
+	vpninfo->udp_gro_dgrams += len ? (len + *seg - 1) / *seg : 1;
+	return len;
+}
+#endif
+
 int ssl_reconnect(struct openconnect_info *vpninfo)
 {
 	int ret;
 	int timeout;
 	int interval;
+	int i;
 
 	openconnect_close_https(vpninfo, 0);
 
@@ -1005,9 +1313,13 @@ int ssl_reconnect(struct openconnect_info *vpninfo)
 	timeout = vpninfo->reconnect_timeout;
 	interval = vpninfo->reconnect_interval;
 
-	free(vpninfo->dtls_pkt);
+	free_pkt(vpninfo, vpninfo->dtls_pkt);
 	vpninfo->dtls_pkt = NULL;
-	free(vpninfo->tun_pkt);
+	for (i = 0; i < MAX_UDP_BATCH; i++) {
+		free_pkt(vpninfo, vpninfo->udp_rx_pkts[i]);
+		vpninfo->udp_rx_pkts[i] = NULL;
+	}
+	free_pkt(vpninfo, vpninfo->tun_pkt);
 	vpninfo->tun_pkt = NULL;
 
 	while ((ret = vpninfo->proto->tcp_connect(vpninfo))) {
@@ -1038,3 +1350,166 @@ int ssl_reconnect(struct openconnect_info *vpninfo)
 
 	return 0;
 }
+
+/*
+ * TLS session resumption. After a full handshake the backend keeps the
+ * session, and offers it to the server on the next connection so that
+ * the handshake can skip the key exchange and, more to the point, the
+ * signature with a client certificate which may be in a slow TPM or
+ * smartcard. These take care of the optional file which lets the
+ * session outlive the process, and of counting how often it works.
+ */
+#define TLS_SESSION_MAGIC "OpenConnect TLS session\n"
+#define TLS_SESSION_MAX 65536
+
+static int set_tls_session_host(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->tls_session_host &&
+	    !strcmp(vpninfo->tls_session_host, vpninfo->hostname)) {
+		vpninfo->tls_session_port = vpninfo->port;
+		return 0;
+	}
+
+	free(vpninfo->tls_session_host);
+	vpninfo->tls_session_host = strdup(vpninfo->hostname);
+	vpninfo->tls_session_port = vpninfo->port;
+	return vpninfo->tls_session_host ? 0 : -ENOMEM;
+}
+
+/* Whether a session the backend holds is for the server we're about
+   to connect to, after a redirect perhaps. */
+int tls_session_matches(struct openconnect_info *vpninfo)
+{
+	return vpninfo->tls_session_host &&
+		!strcmp(vpninfo->tls_session_host, vpninfo->hostname) &&
+		vpninfo->tls_session_port == vpninfo->port;
+}
+
+/* Returns the length of the session read from the cache file into a
+   newly allocated *data, or zero if there's nothing for this server. */
+int load_tls_session(struct openconnect_info *vpninfo, unsigned char **data)
+{
+	char line[256];
+	char *p;
+	FILE *f;
+	int len = 0;
+
+	*data = NULL;
+	if (!vpninfo->tls_session_cache)
+		return 0;
+
+	f = openconnect_fopen_utf8(vpninfo, vpninfo->tls_session_cache, "rb");
+	if (!f)
+		return 0;
+
+	if (!fgets(line, sizeof(line), f) || strcmp(line, TLS_SESSION_MAGIC) ||
+	    !fgets(line, sizeof(line), f))
+		goto out;
+	p = strrchr(line, ' ');
+	if (!p || atoi(p + 1) != vpninfo->port)
+		goto out;
+	*p = 0;
+	if (strcmp(line, vpninfo->hostname))
+		goto out;
+
+	*data = malloc(TLS_SESSION_MAX);
+	if (!*data)
+		goto out;
+	len = fread(*data, 1, TLS_SESSION_MAX, f);
+	if (len <= 0 || len == TLS_SESSION_MAX || set_tls_session_host(vpninfo)) {
+		free(*data);
+		*data = NULL;
+		len = 0;
+	}
+ out:
+	fclose(f);
+	if (len)
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Loaded TLS session for %s from %s\n"),
+			     vpninfo->hostname, vpninfo->tls_session_cache);
+	return len;
+}
+
+/* Called by the backend with each new session it is given */
+void save_tls_session(struct openconnect_info *vpninfo, const void *data, int len)
+{
+	FILE *f;
+	int fd;
+#ifndef _WIN32
+	char *fname, *tmpname;
+#endif
+
+	if (set_tls_session_host(vpninfo) || !vpninfo->tls_session_cache)
+		return;
+
+#ifdef _WIN32
+	fd = openconnect_open_utf8(vpninfo, vpninfo->tls_session_cache,
+				   O_WRONLY|O_CREAT|O_TRUNC|O_BINARY|O_CLOEXEC);
+#else
+	/* Anyone who can read it can take over the session. So it's written
+	   to a new file alongside, which mkstemp() creates readable only by
+	   us and without following any symlink, and renamed over the old
+	   one when it's complete. */
+	fname = openconnect_utf8_to_legacy(vpninfo, vpninfo->tls_session_cache);
+	if (asprintf(&tmpname, "%s.XXXXXX", fname) == -1) {
+		tmpname = NULL;
+		errno = ENOMEM;
+		fd = -1;
+	} else {
+		fd = mkstemp(tmpname);
+	}
+#endif
+	if (fd < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to save TLS session to %s: %s\n"),
+			     vpninfo->tls_session_cache, strerror(errno));
+		goto out;
+	}
+	set_fd_cloexec(fd);
+
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		goto fail;
+	}
+	fprintf(f, TLS_SESSION_MAGIC "%s %d\n", vpninfo->hostname, vpninfo->port);
+	fwrite(data, 1, len, f);
+	if (fclose(f))
+		goto fail;
+#ifndef _WIN32
+	if (rename(tmpname, fname))
+		goto fail;
+#endif
+	goto out;
+
+ fail:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Failed to save TLS session to %s: %s\n"),
+		     vpninfo->tls_session_cache, strerror(errno));
+#ifndef _WIN32
+	unlink(tmpname);
+#endif
+ out:
+#ifndef _WIN32
+	free(tmpname);
+	if (fname != vpninfo->tls_session_cache)
+		free(fname);
+#endif
+	return;
+}
+
+/* Called by the backend after a handshake in which a session was offered */
+void tls_session_resumed(struct openconnect_info *vpninfo, int resumed)
+{
+	vpninfo->tls_resume_tries++;
+	if (resumed) {
+		vpninfo->tls_resume_hits++;
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Resumed TLS session (%d of %d attempts resumed)\n"),
+			     vpninfo->tls_resume_hits, vpninfo->tls_resume_tries);
+	} else {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Server did not resume TLS session (%d of %d attempts resumed)\n"),
+			     vpninfo->tls_resume_hits, vpninfo->tls_resume_tries);
+	}
+}
@@ -0,0 +1,117 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Clock benchmark. Reads each of the clocks the data path could stamp
+ * packets with in a tight loop, and reports the cost of one read: the
+ * full CLOCK_MONOTONIC, time(), timer_now() as the mainloop reads it
+ * once per pass, and the vpninfo->now everything else uses after that.
+ *
+ * Usage: clockbench [reads]
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../timer.c"
+
+/* As in mainloop.c, for timer_now() without CLOCK_MONOTONIC_COARSE */
+uint64_t stats_clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t read_monotonic(struct openconnect_info *vpninfo)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t read_time(struct openconnect_info *vpninfo)
+{
+	return time(NULL);
+}
+
+static uint64_t read_timer_now(struct openconnect_info *vpninfo)
+{
+	return timer_now();
+}
+
+static uint64_t read_cached(struct openconnect_info *vpninfo)
+{
+	return __atomic_load_n(&vpninfo->now, __ATOMIC_RELAXED);
+}
+
+static const struct {
+	const char *name;
+	uint64_t (*read)(struct openconnect_info *);
+} clocks[] = {
+	{ "CLOCK_MONOTONIC", read_monotonic },
+	{ "time(NULL)", read_time },
+	{ "timer_now()", read_timer_now },
+	{ "vpninfo->now", read_cached },
+};
+
+int main(int argc, char **argv)
+{
+	struct openconnect_info *vpninfo;
+	long reads = argc > 1 ? atol(argv[1]) : 20000000;
+	volatile uint64_t sink = 0;
+	double start, elapsed;
+	long n;
+	int i;
+
+	if (reads < 1) {
+		fprintf(stderr, "Usage: %s [reads]\n", argv[0]);
+		return 1;
+	}
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	timer_update(vpninfo);
+
+	for (i = 0; i < sizeof(clocks) / sizeof(clocks[0]); i++) {
+		uint64_t (*read)(struct openconnect_info *) = clocks[i].read;
+
+		start = now();
+		for (n = 0; n < reads; n++)
+			sink += read(vpninfo);
+		elapsed = now() - start;
+
+		printf("%-16s %6.1f ns/read\n", clocks[i].name,
+		       elapsed * 1e9 / reads);
+	}
+
+	free(vpninfo);
+	return sink == 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives happy_eyeballs_connect() against fake sockets whose connect()
+ * completes, fails or hangs on a schedule, with a clock that only moves
+ * when select() waits. Attempts must alternate between address families
+ * in getaddrinfo() order, start CONNECT_ATTEMPT_DELAY ms apart while the
+ * earlier ones hang, start at once when an earlier one fails, and the
+ * first to complete must win whichever order they were started in.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* Everything ssl.c includes, before the fakes below are defined */
+#include "../openconnect-internal.h"
+
+static int fake_connect(int fd, const struct sockaddr *addr, socklen_t len);
+static int fake_getpeername(int fd, struct sockaddr *addr, socklen_t *len);
+static int fake_select(int nfds, fd_set *rd, fd_set *wr, fd_set *ex,
+		       struct timeval *tv);
+
+#define connect(f, a, l) fake_connect(f, a, l)
+#define getpeername(f, a, l) fake_getpeername(f, a, l)
+#define select(n, r, w, e, t) fake_select(n, r, w, e, t)
+
+#include "../ssl.c"
+
+#define NR_ADDRS 5
+#define NEVER -1
+
+static uint64_t now;
+
+/* How each address behaves: its connect() fails at once with
+   'refused', or else completes 'delay' ms after it was started with
+   'result' (0 or an errno), or never if 'delay' is NEVER. */
+struct fake_addr {
+	struct sockaddr_in6 sin6;
+	struct sockaddr_in sin;
+	struct addrinfo ai;
+	int refused;
+	int delay;
+	int result;
+};
+
+static struct fake_addr addrs[NR_ADDRS];
+
+/* What happened to each fd: which address it was connecting to, when
+   that will be over, and the order the addresses were tried in. */
+#define MAX_FDS 64
+static int fd_addr[MAX_FDS];
+static uint64_t fd_done[MAX_FDS];
+static int order[NR_ADDRS];
+static uint64_t started[NR_ADDRS];
+static int nr_started;
+
+uint64_t timer_now(void)
+{
+	return now;
+}
+
+static int fake_connect(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	int i;
+
+	for (i = 0; i < NR_ADDRS; i++)
+		if (addr == addrs[i].ai.ai_addr)
+			break;
+	if (i == NR_ADDRS || fd >= MAX_FDS) {
+		fprintf(stderr, "connect() to unknown address or fd %d\n", fd);
+		exit(1);
+	}
+
+	order[nr_started] = i;
+	started[nr_started++] = now;
+	fd_addr[fd] = i;
+
+	if (addrs[i].refused) {
+		errno = addrs[i].refused;
+		return -1;
+	}
+	fd_done[fd] = addrs[i].delay == NEVER ? UINT64_MAX : now + addrs[i].delay;
+	errno = EINPROGRESS;
+	return -1;
+}
+
+static int fake_getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	int err = addrs[fd_addr[fd]].result;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves the clock on to the first connection to finish, or to the end
+   of the timeout, and reports whichever are finished by then. */
+static int fake_select(int nfds, fd_set *rd, fd_set *wr, fd_set *ex,
+		       struct timeval *tv)
+{
+	uint64_t until = UINT64_MAX;
+	int fd, ready = 0;
+
+	if (tv)
+		until = now + tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	for (fd = 0; fd < nfds && fd < MAX_FDS; fd++)
+		if (FD_ISSET(fd, wr) && fd_done[fd] < until)
+			until = fd_done[fd];
+	if (until == UINT64_MAX) {
+		fprintf(stderr, "select() would wait forever\n");
+		exit(1);
+	}
+	now = until;
+
+	FD_ZERO(rd);
+	for (fd = 0; fd < nfds; fd++) {
+		if (!FD_ISSET(fd, wr))
+			continue;
+		if (fd < MAX_FDS && fd_done[fd] <= now)
+			ready++;
+		else
+			FD_CLR(fd, wr);
+	}
+	FD_ZERO(ex);
+	return ready;
+}
+
+/* Stand-ins for the rest of the library */
+int dns_lookup(struct openconnect_info *vpninfo, const char *host,
+	       const char *port, const struct addrinfo *hints,
+	       struct addrinfo **res, int *cached)
+{
+	return EAI_FAIL;
+}
+
+void dns_cache_flush(struct openconnect_info *vpninfo)
+{
+}
+
+void print_pkt_pool_stats(struct openconnect_info *vpninfo)
+{
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	free(pkt);
+}
+
+#if defined(HAVE_ESP) && defined(HAVE_TUN_MULTIQUEUE)
+void esp_collect_worker_stats(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+int process_proxy(struct openconnect_info *vpninfo, int ssl_sock)
+{
+	return -EIO;
+}
+
+int process_auth_form(struct openconnect_info *vpninfo, struct oc_auth_form *form)
+{
+	return OC_FORM_RESULT_ERR;
+}
+
+void clear_auth_states(struct openconnect_info *vpninfo,
+		       struct http_auth_state *auth_states, int reset)
+{
+}
+
+int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	return 0;
+}
+
+#ifdef HAVE_ICONV
+char *openconnect_utf8_to_legacy(struct openconnect_info *vpninfo, const char *utf8)
+{
+	return (char *)utf8;
+}
+#endif
+
+void print_data_stats(struct openconnect_info *vpninfo)
+{
+}
+
+void openconnect_close_https(struct openconnect_info *vpninfo, int final)
+{
+}
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Three IPv6 addresses then two Legacy IP, as getaddrinfo() might
+   return them, each with its own behaviour. */
+static struct addrinfo *make_addrs(const int *behaviour)
+{
+	int i;
+
+	memset(addrs, 0, sizeof(addrs));
+	for (i = 0; i < NR_ADDRS; i++) {
+		struct fake_addr *a = &addrs[i];
+
+		a->ai.ai_socktype = SOCK_STREAM;
+		if (i < 3) {
+			a->sin6.sin6_family = AF_INET6;
+			a->sin6.sin6_addr.s6_addr[0] = 0x20;
+			a->sin6.sin6_addr.s6_addr[1] = 0x01;
+			a->sin6.sin6_addr.s6_addr[2] = 0x0d;
+			a->sin6.sin6_addr.s6_addr[3] = 0xb8;
+			a->sin6.sin6_addr.s6_addr[15] = i + 1;
+			a->sin6.sin6_port = htons(443);
+			a->ai.ai_family = AF_INET6;
+			a->ai.ai_addr = (void *)&a->sin6;
+			a->ai.ai_addrlen = sizeof(a->sin6);
+		} else {
+			a->sin.sin_family = AF_INET;
+			a->sin.sin_addr.s_addr = htonl(0xc0000200 + i);
+			a->sin.sin_port = htons(443);
+			a->ai.ai_family = AF_INET;
+			a->ai.ai_addr = (void *)&a->sin;
+			a->ai.ai_addrlen = sizeof(a->sin);
+		}
+		if (i + 1 < NR_ADDRS)
+			a->ai.ai_next = &addrs[i + 1].ai;
+
+		a->refused = behaviour[i * 3];
+		a->delay = behaviour[i * 3 + 1];
+		a->result = behaviour[i * 3 + 2];
+	}
+	return &addrs[0].ai;
+}
+
+/* Expected: the addresses tried, in order, and when; then the winner */
+static int run(struct openconnect_info *vpninfo, const char *name,
+	       const int *behaviour, const int *exp_order,
+	       const int *exp_start, int nr_exp, int exp_winner)
+{
+	struct addrinfo *result, *winner = NULL;
+	char host[80];
+	int fd, i, ret = 0;
+
+	result = make_addrs(behaviour);
+	now = 1000;
+	nr_started = 0;
+	memset(fd_done, 0, sizeof(fd_done));
+
+	fd = happy_eyeballs_connect(vpninfo, result, "443", &winner,
+				    host, sizeof(host));
+
+	if (nr_started != nr_exp) {
+		fprintf(stderr, "%s: %d attempts, expected %d\n",
+			name, nr_started, nr_exp);
+		ret = 1;
+	}
+	for (i = 0; i < nr_started && i < nr_exp; i++) {
+		if (order[i] != exp_order[i] ||
+		    started[i] - 1000 != (uint64_t)exp_start[i]) {
+			fprintf(stderr, "%s: attempt %d was address %d at %d ms, expected %d at %d ms\n",
+				name, i, order[i], (int)(started[i] - 1000),
+				exp_order[i], exp_start[i]);
+			ret = 1;
+		}
+	}
+
+	if (exp_winner < 0) {
+		if (fd >= 0) {
+			fprintf(stderr, "%s: connected when all should fail\n", name);
+			ret = 1;
+		}
+	} else if (fd < 0 || winner != &addrs[exp_winner].ai) {
+		fprintf(stderr, "%s: got %d to address %d, expected address %d\n",
+			name, fd, fd >= 0 && fd < MAX_FDS ? fd_addr[fd] : -1,
+			exp_winner);
+		ret = 1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+int main(void)
+{
+	/* refused, delay, result for each of v6 #0-2, v4 #3-4 */
+	static const int hang[] = {
+		0, NEVER, 0,   0, NEVER, 0,   0, 50, 0,
+		0, NEVER, 0,   0, NEVER, 0 };
+	static const int hang_order[] = { 0, 3, 1, 4, 2 };
+	static const int hang_start[] = { 0, 250, 500, 750, 1000 };
+
+	static const int slow_first[] = {
+		0, 400, 0,     0, NEVER, 0,   0, NEVER, 0,
+		0, 1000, 0,    0, NEVER, 0 };
+	static const int slow_order[] = { 0, 3 };
+	static const int slow_start[] = { 0, 250 };
+
+	static const int failing[] = {
+		ECONNREFUSED, 0, 0,   0, NEVER, 0,   0, NEVER, 0,
+		0, 100, ECONNREFUSED, 0, 20, 0 };
+	static const int failing_order[] = { 0, 3, 1, 4 };
+	static const int failing_start[] = { 0, 0, 100, 350 };
+
+	static const int none[] = {
+		ECONNREFUSED, 0, 0,   0, 10, ENETUNREACH,   0, 300, ETIMEDOUT,
+		0, 600, EHOSTUNREACH, ECONNREFUSED, 0, 0 };
+	static const int none_order[] = { 0, 3, 1, 4, 2 };
+	static const int none_start[] = { 0, 0, 250, 260, 260 };
+
+	struct openconnect_info *vpninfo;
+	int ret = 0;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
+
+	/* Each hanging attempt holds up the next for the full delay */
+	ret |= run(vpninfo, "hang", hang, hang_order, hang_start, 5, 2);
+	/* The first one started wins if it finishes first, even once
+	   another has been started alongside it */
+	ret |= run(vpninfo, "slow first", slow_first, slow_order, slow_start, 2, 0);
+	/* A failure lets the next one start without waiting */
+	ret |= run(vpninfo, "failing", failing, failing_order, failing_start, 4, 4);
+	/* And when every one fails, so does the connection */
+	ret |= run(vpninfo, "none", none, none_order, none_start, 5, -1);
+
+	free(vpninfo);
+	return ret;
+}
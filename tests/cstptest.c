@@ -0,0 +1,365 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Feeds cstp_mainloop() a stream of CSTP packets over a fake TLS session,
+ * cut into reads of various sizes: packets split across reads (down to a
+ * byte at a time, through the middle of a header), several packets and
+ * a partial one merged into a single read, and a packet which starts
+ * near the end of the receive buffer. Every data packet must come out
+ * once, intact and in order, and every DPD request must be answered.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "../cstp.c"
+
+#define MAX_STREAM 262144
+#define MAX_DATA 64
+
+static unsigned char stream[MAX_STREAM];
+static int stream_len, stream_pos;
+
+/* Sizes of successive reads, cycled through; zero for one at a time */
+static const int *chunks;
+static int nr_chunks, chunk_idx;
+static int again;
+
+/* What went into the stream, and what came out */
+static int data_lens[MAX_DATA];
+static int nr_data, nr_dpd;
+static int data_rcvd, dpd_resps, bad_data;
+
+static void add_pkt(unsigned char type, int len)
+{
+	unsigned char *p = stream + stream_len;
+	int i;
+
+	memcpy(p, data_hdr, 8);
+	store_be16(p + 4, len);
+	p[6] = type;
+	for (i = 0; i < len; i++)
+		p[8 + i] = (nr_data + i) & 0xff;
+	stream_len += 8 + len;
+
+	if (type == AC_PKT_DATA)
+		data_lens[nr_data++] = len;
+	else if (type == AC_PKT_DPD_OUT)
+		nr_dpd++;
+}
+
+static void make_stream(void)
+{
+	static const int lens[] = { 1400, 1, 64, 9000, 1500, 16384, 100, 3 };
+	int i;
+
+	stream_len = stream_pos = 0;
+	nr_data = nr_dpd = 0;
+	data_rcvd = dpd_resps = bad_data = 0;
+
+	for (i = 0; i < 40; i++) {
+		add_pkt(AC_PKT_DATA, lens[i % (sizeof(lens) / sizeof(lens[0]))]);
+		if (i % 5 == 2)
+			add_pkt(AC_PKT_KEEPALIVE, 0);
+		if (i % 7 == 3)
+			add_pkt(AC_PKT_DPD_OUT, 0);
+		if (i % 11 == 6)
+			add_pkt(AC_PKT_DPD_RESP, 0);
+	}
+}
+
+/* Stand-ins for the TLS session */
+int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
+{
+	int len;
+
+	/* Like a TLS read, each one has to be asked for again after EAGAIN */
+	if (again || stream_pos == stream_len) {
+		again = 0;
+		return 0;
+	}
+	again = 1;
+
+	len = stream_len - stream_pos;
+	if (nr_chunks) {
+		if (len > chunks[chunk_idx])
+			len = chunks[chunk_idx];
+		chunk_idx = (chunk_idx + 1) % nr_chunks;
+	}
+	if (len > maxlen)
+		len = maxlen;
+
+	memcpy(buf, stream + stream_pos, len);
+	stream_pos += len;
+	return len;
+}
+
+int ssl_nonblock_write(struct openconnect_info *vpninfo, void *buf, int buflen)
+{
+	unsigned char *p = buf;
+
+	if (buflen >= 8 && p[6] == AC_PKT_DPD_RESP)
+		dpd_resps++;
+	return buflen;
+}
+
+int queue_new_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		     void *buf, int len)
+{
+	unsigned char *p = buf;
+	int i;
+
+	if (data_rcvd >= nr_data || len != data_lens[data_rcvd]) {
+		bad_data++;
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		if (p[i] != ((data_rcvd + i) & 0xff)) {
+			bad_data++;
+			break;
+		}
+	}
+	data_rcvd++;
+	return 0;
+}
+
+/* Stand-ins for the rest of the library */
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	struct pkt *pkt = malloc(sizeof(*pkt) + len);
+
+	if (pkt)
+		pkt->alloc_len = len;
+	return pkt;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	free(pkt);
+}
+
+int queue_rx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		    struct pkt *pkt)
+{
+	free(pkt);
+	return 0;
+}
+
+void record_tx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		      struct pkt *pkt)
+{
+}
+
+int keepalive_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+	return KA_NONE;
+}
+
+int ka_stalled_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+	return KA_NONE;
+}
+
+void ka_reset(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+}
+
+#ifdef HAVE_EPOLL
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd,
+		       uint32_t *monitored, uint32_t events)
+{
+	*monitored = events;
+}
+#endif
+
+int ssl_reconnect(struct openconnect_info *vpninfo)
+{
+	return -EIO;
+}
+
+int openconnect_open_https(struct openconnect_info *vpninfo)
+{
+	return -EIO;
+}
+
+void openconnect_close_https(struct openconnect_info *vpninfo, int final)
+{
+}
+
+int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
+{
+	return -EIO;
+}
+
+void ssl_enable_ktls(struct openconnect_info *vpninfo)
+{
+}
+
+const char *openconnect_get_cstp_cipher(struct openconnect_info *vpninfo)
+{
+	return NULL;
+}
+
+const char *openconnect_version_str = "test";
+
+int openconnect_random(void *bytes, int len)
+{
+	return -EIO;
+}
+
+void append_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *buf)
+{
+}
+
+void http_common_headers(struct openconnect_info *vpninfo, struct oc_text_buf *buf)
+{
+}
+
+void free_split_routes(struct openconnect_info *vpninfo)
+{
+}
+
+void dump_buf(struct openconnect_info *vpninfo, char prefix, char *buf)
+{
+}
+
+unsigned char unhex(const char *data)
+{
+	return 0;
+}
+
+struct oc_text_buf *buf_alloc(void)
+{
+	return NULL;
+}
+
+void buf_append(struct oc_text_buf *buf, const char *fmt, ...)
+{
+}
+
+int buf_error(struct oc_text_buf *buf)
+{
+	return -ENOMEM;
+}
+
+int buf_free(struct oc_text_buf *buf)
+{
+	return 0;
+}
+
+int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+{
+	return -EINVAL;
+}
+
+int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+{
+	return -EINVAL;
+}
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static int run(struct openconnect_info *vpninfo, const char *name,
+	       const int *sizes, int nr_sizes)
+{
+	int timeout, passes = 0;
+
+	/* As a new connection would, start with nothing held over */
+	free(vpninfo->cstp_pkt);
+	vpninfo->cstp_pkt = NULL;
+
+	make_stream();
+	chunks = sizes;
+	nr_chunks = nr_sizes;
+	chunk_idx = 0;
+	again = 0;
+
+	while (stream_pos < stream_len && passes++ < 2 * MAX_STREAM) {
+		timeout = 1000;
+		if (cstp_mainloop(vpninfo, &timeout) < 0 || vpninfo->quit_reason) {
+			fprintf(stderr, "%s: mainloop failed: %s\n", name,
+				vpninfo->quit_reason);
+			return 1;
+		}
+	}
+
+	if (stream_pos < stream_len || vpninfo->cstp_pkt->len ||
+	    data_rcvd != nr_data || bad_data || dpd_resps != nr_dpd) {
+		fprintf(stderr, "%s: %d/%d bytes read, %d left over, %d/%d packets (%d bad), %d/%d DPD responses\n",
+			name, stream_pos, stream_len, vpninfo->cstp_pkt->len,
+			data_rcvd, nr_data, bad_data, dpd_resps, nr_dpd);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	static const int bytewise[] = { 1 };
+	static const int split[] = { 3, 20, 1, 9000, 5 };
+	static const int odd[] = { 7, 8, 9, 1409, 16391 };
+	struct openconnect_info *vpninfo;
+	int timeout, ret = 0;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->ssl_fd = 0;
+	vpninfo->dtls_state = DTLS_DISABLED;
+	vpninfo->ip_info.mtu = 1400;
+	init_pkt_queue(&vpninfo->outgoing_queue);
+
+	/* As much as fits in the buffer each time, so several packets are
+	   merged into each read and the last is usually cut short */
+	ret |= run(vpninfo, "merged", NULL, 0);
+	ret |= run(vpninfo, "bytewise", bytewise, 1);
+	ret |= run(vpninfo, "split", split, 5);
+	ret |= run(vpninfo, "odd", odd, 5);
+
+	/* One which could never fit in the buffer ends the session */
+	stream_len = stream_pos = 0;
+	nr_data = data_rcvd = bad_data = 0;
+	add_pkt(AC_PKT_DATA, 64);
+	memcpy(stream + stream_len, data_hdr, 8);
+	store_be16(stream + stream_len + 4, vpninfo->cstp_pkt->alloc_len + 1);
+	stream_len += 8;
+	nr_chunks = 0;
+	again = 0;
+	timeout = 1000;
+	if (cstp_mainloop(vpninfo, &timeout) != 1 || !vpninfo->quit_reason ||
+	    data_rcvd != 1) {
+		fprintf(stderr, "Oversized packet not rejected\n");
+		ret = 1;
+	}
+
+	free(vpninfo->cstp_pkt);
+	free(vpninfo);
+	return ret;
+}
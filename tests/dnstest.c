@@ -0,0 +1,229 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives the resolver cache in dns.c with a fake getaddrinfo() which
+ * counts its calls and hands out whatever address the test says the
+ * server has now, and a clock which only moves when told to. Lookups
+ * must come from the cache while it is fresh, a dynamic DNS server must
+ * be refreshed in the background, and the getaddrinfo_override hook must
+ * still be used, but never from another thread.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+/* Everything dns.c includes, before the fakes below are defined */
+#include "../openconnect-internal.h"
+#ifdef HAVE_DNS_THREAD
+#include <pthread.h>
+#endif
+
+/* Milliseconds, as from timer_now() */
+static uint64_t now = 1000000000;
+static const char *server_addr = "192.0.2.1";
+static int lookups, override_lookups;
+
+uint64_t timer_now(void)
+{
+	return now;
+}
+
+static int fake_getaddrinfo(const char *node, const char *service,
+			    const struct addrinfo *hints, struct addrinfo **res)
+{
+	struct addrinfo h = *hints;
+
+	__atomic_add_fetch(&lookups, 1, __ATOMIC_SEQ_CST);
+	h.ai_flags |= AI_NUMERICHOST;
+	return getaddrinfo(server_addr, service, &h, res);
+}
+
+#define getaddrinfo(n, s, h, r) fake_getaddrinfo(n, s, h, r)
+
+#include "../dns.c"
+
+#undef getaddrinfo
+
+#ifdef HAVE_DNS_THREAD
+static pthread_t main_thread;
+#endif
+
+static int override(void *privdata, const char *node, const char *service,
+		    const struct addrinfo *hints, struct addrinfo **res)
+{
+#ifdef HAVE_DNS_THREAD
+	if (!pthread_equal(pthread_self(), main_thread)) {
+		fprintf(stderr, "getaddrinfo_override called from another thread\n");
+		exit(1);
+	}
+#endif
+	override_lookups++;
+	return fake_getaddrinfo(node, service, hints, res);
+}
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Looks up the server, and checks how it was done and what came back */
+static int check(struct openconnect_info *vpninfo, const char *what,
+		 const char *host, int expect_cached, int expect_lookups,
+		 const char *expect_addr)
+{
+	struct addrinfo hints, *result;
+	char addr[80];
+	int cached, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	err = dns_lookup(vpninfo, host, "443", &hints, &result, &cached);
+	if (err) {
+		fprintf(stderr, "%s: lookup failed: %s\n", what, gai_strerror(err));
+		return 1;
+	}
+	getnameinfo(result->ai_addr, result->ai_addrlen, addr, sizeof(addr),
+		    NULL, 0, NI_NUMERICHOST);
+	if (cached != expect_cached || lookups != expect_lookups ||
+	    strcmp(addr, expect_addr)) {
+		fprintf(stderr, "%s: got %s%s after %d lookups; expected %s%s after %d\n",
+			what, addr, cached ? " from cache" : "", lookups,
+			expect_addr, expect_cached ? " from cache" : "", expect_lookups);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo;
+	int ret = 0, timeout;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+#ifdef HAVE_DNS_THREAD
+	main_thread = pthread_self();
+#endif
+
+	ret |= check(vpninfo, "first", "vpn.example.com", 0, 1, "192.0.2.1");
+	now += 10000;
+	ret |= check(vpninfo, "fresh", "vpn.example.com", 1, 1, "192.0.2.1");
+	ret |= check(vpninfo, "other host", "vpn2.example.com", 0, 2, "192.0.2.1");
+	ret |= check(vpninfo, "back again", "vpn.example.com", 0, 3, "192.0.2.1");
+
+	/* Too old to use */
+	now += DNS_CACHE_TTL * 1000;
+	server_addr = "192.0.2.2";
+	ret |= check(vpninfo, "expired", "vpn.example.com", 0, 4, "192.0.2.2");
+
+	/* Flushed because it didn't work */
+	server_addr = "192.0.2.3";
+	dns_cache_flush(vpninfo);
+	ret |= check(vpninfo, "flushed", "vpn.example.com", 0, 5, "192.0.2.3");
+
+	/* Not a dynamic DNS server; it's left alone */
+	now += DNS_REFRESH_INTERVAL * 1000;
+	timeout = INT_MAX;
+	vpninfo->now = now;
+	dns_refresh(vpninfo, &timeout);
+	if (vpninfo->dns_pending || timeout != INT_MAX) {
+		fprintf(stderr, "Refreshing the address of a static server\n");
+		ret = 1;
+	}
+
+#ifdef HAVE_DNS_THREAD
+	/* A dynamic one gets refreshed once the interval is up ... */
+	vpninfo->is_dyndns = 1;
+	now -= (DNS_REFRESH_INTERVAL - 10) * 1000;
+	timeout = INT_MAX;
+	vpninfo->now = now;
+	dns_refresh(vpninfo, &timeout);
+	if (vpninfo->dns_pending || timeout != (DNS_REFRESH_INTERVAL - 10) * 1000) {
+		fprintf(stderr, "Refresh due in %d ms, not %d\n", timeout,
+			(DNS_REFRESH_INTERVAL - 10) * 1000);
+		ret = 1;
+	}
+	now += (DNS_REFRESH_INTERVAL - 10) * 1000;
+	server_addr = "192.0.2.4";
+	vpninfo->now = now;
+	dns_refresh(vpninfo, &timeout);
+	if (!vpninfo->dns_pending) {
+		fprintf(stderr, "No background refresh\n");
+		ret = 1;
+	} else {
+		while (__atomic_load_n(&vpninfo->dns_pending->refs, __ATOMIC_ACQUIRE) != 1)
+			usleep(1000);
+	}
+	/* ... and the result used without another lookup */
+	now += 10000;
+	ret |= check(vpninfo, "refreshed", "vpn.example.com", 1, 6, "192.0.2.4");
+
+	/* A lookup still going when it's all freed cleans up after itself */
+	now += DNS_REFRESH_INTERVAL * 1000;
+	vpninfo->now = now;
+	dns_refresh(vpninfo, &timeout);
+	dns_cache_free(vpninfo);
+	if (vpninfo->dns_cache || vpninfo->dns_pending) {
+		fprintf(stderr, "Cache not freed\n");
+		ret = 1;
+	}
+	while (__atomic_load_n(&lookups, __ATOMIC_ACQUIRE) < 7)
+		usleep(1000);
+	usleep(10000);
+#endif
+
+	/* With the override, it's looked up in the foreground */
+	vpninfo->getaddrinfo_override = override;
+	vpninfo->is_dyndns = 1;
+	lookups = 0;
+	server_addr = "192.0.2.5";
+	ret |= check(vpninfo, "override", "vpn.example.com", 0, 1, "192.0.2.5");
+	now += DNS_REFRESH_INTERVAL * 1000;
+	vpninfo->now = now;
+	dns_refresh(vpninfo, &timeout);
+	if (vpninfo->dns_pending) {
+		fprintf(stderr, "Background refresh with getaddrinfo_override\n");
+		ret = 1;
+	}
+	now += DNS_CACHE_TTL * 1000;
+	ret |= check(vpninfo, "override expired", "vpn.example.com", 0, 2, "192.0.2.5");
+	if (override_lookups != 2) {
+		fprintf(stderr, "getaddrinfo_override called %d times, not 2\n",
+			override_lookups);
+		ret = 1;
+	}
+
+	dns_cache_free(vpninfo);
+	free(vpninfo);
+	return ret;
+}
@@ -0,0 +1,179 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * What the ESP tests have in common: the userspace ESP code, a client
+ * and a peer keyed to talk to each other with it, and the sockets and
+ * packets to pass between them.
+ */
+
+#ifndef __OPENCONNECT_TESTS_ESP_COMMON_H__
+#define __OPENCONNECT_TESTS_ESP_COMMON_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <poll.h>
+
+#if defined(OPENCONNECT_GNUTLS)
+#include "../gnutls-esp.c"
+#elif defined(OPENCONNECT_OPENSSL)
+#include "../openssl-esp.c"
+
+int openconnect_print_err_cb(const char *str, size_t len, void *ptr)
+{
+	fprintf(stderr, "%s", str);
+	return 0;
+}
+#endif
+
+#define SKIP 77
+
+static const struct {
+	const char *name;
+	unsigned char enc, hmac;
+} algs[] = {
+	{ "aes-128-cbc/sha1", ENC_AES_128_CBC, HMAC_SHA1 },
+	{ "aes-256-cbc/md5", ENC_AES_256_CBC, HMAC_MD5 },
+	{ "aes-128-gcm", ENC_AES_128_GCM, 0 },
+	{ "aes-256-gcm", ENC_AES_256_GCM, 0 },
+};
+#define NR_ALGS (sizeof(algs) / sizeof(algs[0]))
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Random keys for each direction, with SPIs particular to algs[i] */
+static inline void new_keys(int i, struct esp *k1, struct esp *k2)
+{
+	int j;
+
+	memset(k1, 0, sizeof(*k1));
+	memset(k2, 0, sizeof(*k2));
+	for (j = 0; j < sizeof(k1->secrets); j++) {
+		k1->secrets[j] = rand();
+		k2->secrets[j] = rand();
+	}
+	k1->spi = htonl(0x1000 + i);
+	k2->spi = htonl(0x2000 + i);
+}
+
+/* One end of the SA, sending with 'out' and receiving with 'in', whose
+   ESP goes to 'addr' */
+static inline struct openconnect_info *new_side(int enc, int hmac,
+						struct esp *out, struct esp *in,
+						struct sockaddr_in *addr)
+{
+	struct openconnect_info *vpninfo = calloc(1, sizeof(*vpninfo));
+
+	if (!vpninfo)
+		exit(1);
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->dtls_addr = (void *)addr;
+	vpninfo->peer_addrlen = sizeof(*addr);
+	vpninfo->dtls_state = DTLS_SECRET;
+	vpninfo->esp_enc = enc;
+	vpninfo->esp_hmac = hmac;
+	vpninfo->esp_replay_protect = 1;
+	vpninfo->esp_out_next = *out;
+	vpninfo->esp_in[0] = *in;
+	if (setup_esp_keys(vpninfo, 0))
+		return NULL;
+	return vpninfo;
+}
+
+static inline void free_side(struct openconnect_info *vpninfo)
+{
+	if (!vpninfo)
+		return;
+	destroy_esp_ciphers(&vpninfo->esp_out);
+	destroy_esp_ciphers(&vpninfo->esp_in[0]);
+	free(vpninfo);
+}
+
+static inline struct sockaddr_in inaddr(const char *addr, int port)
+{
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, addr, &sin.sin_addr);
+	return sin;
+}
+
+static inline int udp_socket(const char *addr)
+{
+	struct sockaddr_in sin = inaddr(addr, 0);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd < 0 || bind(fd, (void *)&sin, sizeof(sin)))
+		exit(1);
+	return fd;
+}
+
+static inline int wait_recv(int fd, void *buf, int len, int ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, ms) != 1)
+		return -1;
+	return recv(fd, buf, len, MSG_DONTWAIT);
+}
+
+static inline uint16_t ip_csum(uint16_t *buf, int nwords)
+{
+	uint32_t sum = 0;
+
+	while (nwords--)
+		sum += *buf++;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return ~sum;
+}
+
+/* A Legacy IP UDP datagram from port 9 at 'src' to 'dport' at 'dst' */
+static inline int make_udp(unsigned char *p, const char *src, const char *dst,
+			   uint16_t dport, const char *payload)
+{
+	int len = 28 + strlen(payload);
+	uint16_t csum;
+
+	memset(p, 0, 28);
+	p[0] = 0x45;
+	store_be16(p + 2, len);
+	p[8] = 64;
+	p[9] = IPPROTO_UDP;
+	inet_pton(AF_INET, src, p + 12);
+	inet_pton(AF_INET, dst, p + 16);
+	csum = ip_csum((void *)p, 10);
+	memcpy(p + 10, &csum, 2);
+	store_be16(p + 20, 9);
+	memcpy(p + 22, &dport, 2);
+	store_be16(p + 24, len - 20);
+	memcpy(p + 28, payload, strlen(payload));
+	return len;
+}
+
+#endif /* __OPENCONNECT_TESTS_ESP_COMMON_H__ */
@@ -0,0 +1,263 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * ESP crypto benchmark. Encrypts and then decrypts packets of the given
+ * size in a loop with each of the supported transforms, using whichever
+ * of the GnuTLS and OpenSSL backends this tree was configured with, and
+ * checks that each packet survives the round trip. Reports the cost per
+ * byte of encrypting single packets and batches, and of decrypting.
+ *
+ * Usage: espbench [seconds [pktlen]]
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(OPENCONNECT_GNUTLS)
+#include "../gnutls-esp.c"
+#define BACKEND "GnuTLS"
+#elif defined(OPENCONNECT_OPENSSL)
+#include "../openssl-esp.c"
+#define BACKEND "OpenSSL"
+
+int openconnect_print_err_cb(const char *str, size_t len, void *ptr)
+{
+	fprintf(stderr, "%s", str);
+	return 0;
+}
+#endif
+
+#ifdef HAVE_TUN_MULTIQUEUE
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+#ifdef HAVE_XFRM
+void esp_xfrm_remove(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = time(NULL) * 1000ULL;
+}
+
+static const struct {
+	const char *name;
+	unsigned char enc, hmac;
+} algs[] = {
+	{ "aes-128-cbc/sha1", ENC_AES_128_CBC, HMAC_SHA1 },
+	{ "aes-256-cbc/sha1", ENC_AES_256_CBC, HMAC_SHA1 },
+	{ "aes-128-gcm", ENC_AES_128_GCM, 0 },
+	{ "aes-256-gcm", ENC_AES_256_GCM, 0 },
+};
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cycle counts where the CPU has a cheap counter, else nanoseconds */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS "cycles"
+static uint64_t ticks(void)
+{
+	return __rdtsc();
+}
+#else
+#define TICKS "ns"
+static uint64_t ticks(void)
+{
+	return now() * 1e9;
+}
+#endif
+
+/* Packets per call to encrypt_esp_packets() */
+#define BATCH 32
+
+static void fill_pkt(struct pkt *pkt, int pktlen)
+{
+	int i;
+
+	for (i = 0; i < pktlen; i++)
+		pkt->data[i] = i;
+	pkt->len = pktlen;
+}
+
+/* As esp_decrypt_rx() does with what it receives */
+static int check_pkt(struct openconnect_info *vpninfo, struct pkt *pkt,
+		     int len, int pktlen)
+{
+	int i;
+
+	if (len <= 0)
+		return -EINVAL;
+
+	pkt->len = len - vpninfo->esp_hdrlen - vpninfo->esp_icvlen;
+	if (decrypt_esp_packet(vpninfo, &vpninfo->esp_in[0], pkt))
+		return -EINVAL;
+
+	for (i = 0; i < pktlen; i++) {
+		if (pkt->data[i] != (unsigned char)i)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+/* Spend the first half of the time on single packets and the second
+ * on batches, decrypting everything to check it and to time that too. */
+static int run(struct openconnect_info *vpninfo, const char *name,
+	       double secs, int pktlen)
+{
+	struct pkt *pkts[BATCH];
+	int lens[BATCH];
+	unsigned long pkts1 = 0, pktsb = 0;
+	uint64_t enc1 = 0, encb = 0, dec = 0, t;
+	double start, mid, end, single;
+	int i, ret = -ENOMEM;
+
+	for (i = 0; i < BATCH; i++)
+		pkts[i] = malloc(sizeof(struct pkt) + pktlen + vpninfo->pkt_trailer);
+	for (i = 0; i < BATCH; i++) {
+		if (!pkts[i])
+			goto out;
+	}
+	ret = -EINVAL;
+
+	start = now();
+	mid = start + secs / 2;
+	end = start + secs;
+	while (1) {
+		/* Only check the clock every so often */
+		if (!(pkts1 & 255) && now() >= mid)
+			break;
+
+		fill_pkt(pkts[0], pktlen);
+		t = ticks();
+		lens[0] = encrypt_esp_packet(vpninfo, &vpninfo->esp_out, pkts[0]);
+		enc1 += ticks() - t;
+
+		t = ticks();
+		if (check_pkt(vpninfo, pkts[0], lens[0], pktlen))
+			goto fail;
+		dec += ticks() - t;
+		pkts1++;
+	}
+	single = now() - start;
+
+	while (now() < end) {
+		for (i = 0; i < BATCH; i++)
+			fill_pkt(pkts[i], pktlen);
+		t = ticks();
+		encrypt_esp_packets(vpninfo, &vpninfo->esp_out, pkts, lens, BATCH);
+		encb += ticks() - t;
+
+		t = ticks();
+		for (i = 0; i < BATCH; i++) {
+			if (check_pkt(vpninfo, pkts[i], lens[i], pktlen))
+				goto fail;
+		}
+		dec += ticks() - t;
+		pktsb += BATCH;
+	}
+
+	printf("%-8s %-17s %4d bytes: %10.0f pkts/s, %8.1f MB/s\n", BACKEND,
+	       name, pktlen, pkts1 / single, pkts1 * pktlen / single / 1e6);
+	printf("%-8s %-17s %s/byte: encrypt %.2f, batch %.2f, decrypt %.2f\n",
+	       "", "", TICKS, (double)enc1 / pkts1 / pktlen,
+	       (double)encb / pktsb / pktlen,
+	       (double)dec / (pkts1 + pktsb) / pktlen);
+	ret = 0;
+	goto out;
+
+ fail:
+	fprintf(stderr, "%s: packet %lu did not survive the round trip\n",
+		name, pkts1 + pktsb);
+ out:
+	for (i = 0; i < BATCH; i++)
+		free(pkts[i]);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct openconnect_info *vpninfo;
+	struct sockaddr_in addr;
+	double secs = argc > 1 ? atof(argv[1]) : 1;
+	int pktlen = argc > 2 ? atoi(argv[2]) : 1400;
+	int i, ret = 0;
+
+	if (pktlen < 1 || pktlen > 16384) {
+		fprintf(stderr, "Usage: %s [seconds [pktlen]]\n", argv[0]);
+		return 1;
+	}
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->dtls_addr = (void *)&addr;
+	vpninfo->dtls_state = DTLS_SECRET;
+
+	/* Both directions share keys, so that each packet can be decrypted
+	   straight back again */
+	srand(time(NULL));
+	for (i = 0; i < sizeof(vpninfo->esp_out_next.secrets); i++)
+		vpninfo->esp_out_next.secrets[i] = rand();
+	vpninfo->esp_out_next.spi = htonl(0x12345678);
+
+	for (i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+		vpninfo->esp_enc = algs[i].enc;
+		vpninfo->esp_hmac = algs[i].hmac;
+		vpninfo->esp_in[0] = vpninfo->esp_out_next;
+
+		if (setup_esp_keys(vpninfo, 0)) {
+			printf("%-8s %-17s not supported\n", BACKEND, algs[i].name);
+			continue;
+		}
+		if (run(vpninfo, algs[i].name, secs, pktlen))
+			ret = 1;
+
+		destroy_esp_ciphers(&vpninfo->esp_out);
+		destroy_esp_ciphers(&vpninfo->esp_in[0]);
+	}
+
+	free(vpninfo);
+	return ret;
+}
@@ -0,0 +1,124 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs an outbound SA up to the end of its sequence numbers. The last
+ * two packets must go out with the last two sequence numbers, and be
+ * accepted by the peer. After that, encryption must be refused rather
+ * than wrapping round to zero, which with AES-GCM would reuse a nonce.
+ */
+
+#include <config.h>
+
+#include "esp-common.h"
+
+#ifdef HAVE_TUN_MULTIQUEUE
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+#ifdef HAVE_XFRM
+void esp_xfrm_remove(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = time(NULL) * 1000ULL;
+}
+
+/* Encrypt a packet at 'from' and decrypt it at 'to'. Returns the
+   sequence number it went out with, or a negative errno. */
+static int64_t send_one(struct openconnect_info *from,
+			struct openconnect_info *to, struct pkt *pkt)
+{
+	struct esp_hdr *hdr;
+	int len;
+
+	pkt->len = 20;
+	memset(pkt->data, 0x45, pkt->len);
+	len = encrypt_esp_packet(from, &from->esp_out, pkt);
+	if (len < 0)
+		return len;
+
+	hdr = esp_pkt_hdr(to, pkt);
+	/* With AES-GCM, the IV is the sequence number too */
+	if (ENC_IS_AEAD(from->esp_enc) &&
+	    (load_be32(hdr->iv) || load_be32(hdr->iv + 4) != ntohl(hdr->seq)))
+		return -EINVAL;
+
+	pkt->len = len - to->esp_hdrlen - to->esp_icvlen;
+	if (decrypt_esp_packet(to, &to->esp_in[0], pkt) ||
+	    pkt->data[pkt->len - 1] != 0x04)
+		return -EBADMSG;
+	return ntohl(hdr->seq);
+}
+
+static int test_alg(int i)
+{
+	struct openconnect_info *client, *peer;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	struct esp k1, k2;
+	struct pkt *pkt;
+	int64_t seq;
+	int j, ret = 1;
+
+	new_keys(i, &k1, &k2);
+	client = new_side(algs[i].enc, algs[i].hmac, &k1, &k2, &addr);
+	peer = new_side(algs[i].enc, algs[i].hmac, &k2, &k1, &addr);
+	pkt = malloc(sizeof(*pkt) + 2048);
+	if (!client || !peer || !pkt)
+		exit(1);
+
+	client->esp_out.seq = 0xfffffffe;
+	for (j = 0; j < 2; j++) {
+		seq = send_one(client, peer, pkt);
+		if (seq != 0xfffffffeLL + j) {
+			fprintf(stderr, "%s: packet %d went out with %lld, not %llu\n",
+				algs[i].name, j, (long long)seq, 0xfffffffeULL + j);
+			goto out;
+		}
+	}
+	for (j = 0; j < 2; j++) {
+		seq = send_one(client, peer, pkt);
+		if (seq != -ENOSPC) {
+			fprintf(stderr, "%s: encrypted beyond the last sequence number (%lld)\n",
+				algs[i].name, (long long)seq);
+			goto out;
+		}
+	}
+
+	printf("%s: ok\n", algs[i].name);
+	ret = 0;
+ out:
+	free(pkt);
+	free_side(client);
+	free_side(peer);
+	return ret;
+}
+
+int main(void)
+{
+	int i, failed = 0;
+
+	srand(getpid());
+	for (i = 0; i < NR_ALGS; i++) {
+		if (test_alg(i))
+			failed++;
+	}
+	return failed ? 1 : 0;
+}
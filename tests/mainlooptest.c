@@ -0,0 +1,272 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives openconnect_mainloop() against a fake gateway on the other end
+ * of a socketpair, with a protocol whose only work is to read records
+ * from it, and counts the select()/epoll_wait() calls the mainloop makes
+ * along the way. A busy mainloop must not poll the command pipe on every
+ * pass, but a command must still get through while it is busy.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+static int waits;
+
+#define select(...) (waits++, select(__VA_ARGS__))
+#define epoll_wait(...) (waits++, epoll_wait(__VA_ARGS__))
+
+#include "../mainloop.c"
+#include "../timer.c"
+#ifdef HAVE_IO_URING
+#include "../uring.c"
+#endif
+
+#undef select
+#undef epoll_wait
+
+#define RECORDS 1024
+#define RECLEN 16
+
+static char recs[RECORDS * RECLEN];
+static int records;
+
+/* Stand-ins for the rest of the library */
+int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
+				 const char *vpnc_script, const char *ifname)
+{
+	return -EINVAL;
+}
+
+int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
+				 const char *tun_script)
+{
+	return -EINVAL;
+}
+
+int os_read_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	return -1;
+}
+
+int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	return 0;
+}
+
+void os_shutdown_tun(struct openconnect_info *vpninfo)
+{
+}
+
+void openconnect_close_https(struct openconnect_info *vpninfo, int final)
+{
+}
+
+void dns_refresh(struct openconnect_info *vpninfo, int *timeout)
+{
+}
+
+int metrics_open(struct openconnect_info *vpninfo)
+{
+	return 0;
+}
+
+void metrics_update(struct openconnect_info *vpninfo, int did_work,
+		    int *timeout)
+{
+}
+
+#if defined(HAVE_ESP) && defined(HAVE_TUN_MULTIQUEUE)
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+#ifdef HAVE_IO_URING
+void esp_uring_rx(struct openconnect_info *vpninfo, struct pkt *pkt, int len)
+{
+}
+#endif
+
+void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
+{
+	fprintf(stderr, "poll_cmd_fd() called from the mainloop\n");
+	exit(1);
+}
+
+void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
+{
+	char cmd;
+
+	if (vpninfo->cmd_fd == -1 || !FD_ISSET(vpninfo->cmd_fd, fds))
+		return;
+	if (read(vpninfo->cmd_fd, &cmd, 1) != 1)
+		return;
+	if (cmd == OC_CMD_CANCEL) {
+		vpninfo->got_cancel_cmd = 1;
+		vpninfo->cancel_type = cmd;
+	}
+}
+
+static int fake_tcp_mainloop(struct openconnect_info *vpninfo, int *timeout)
+{
+	char rec[RECLEN];
+	int len;
+
+	len = read(vpninfo->ssl_fd, rec, sizeof(rec));
+	if (!len) {
+		vpninfo->quit_reason = "Gateway closed the connection";
+		return 1;
+	}
+	if (len < 0) {
+		monitor_read_fd(vpninfo, ssl);
+		return 0;
+	}
+	records++;
+	return 1;
+}
+
+static struct vpn_proto fake_proto = {
+	.name = "fake",
+	.tcp_mainloop = fake_tcp_mainloop,
+};
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Queue 'nr' records from the gateway, and optionally a command, then
+   run the mainloop until it returns */
+static int run(int event_loop, int nr, int close_gw, char cmd)
+{
+	struct openconnect_info *vpninfo;
+	int gw[2], cmdpipe[2], tunpipe[2];
+	int ret;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, gw) ||
+	    pipe(cmdpipe) || pipe(tunpipe))
+		exit(1);
+
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->proto = &fake_proto;
+	vpninfo->dtls_state = DTLS_DISABLED;
+	vpninfo->max_qlen = 10;
+	vpninfo->event_loop = event_loop;
+	vpninfo->epoll_fd = -1;
+	vpninfo->dtls_fd = -1;
+#ifdef HAVE_IO_URING
+	vpninfo->uring_fd = -1;
+#endif
+	/* A tun device that is never readable, so it counts as up */
+	vpninfo->tun_fd = tunpipe[0];
+	monitor_fd_new(vpninfo, tun);
+	vpninfo->ssl_fd = gw[0];
+	set_sock_nonblock(gw[0]);
+	monitor_fd_new(vpninfo, ssl);
+	vpninfo->cmd_fd = cmdpipe[0];
+	vpninfo->cmd_fd_write = cmdpipe[1];
+	set_sock_nonblock(cmdpipe[0]);
+
+	if (nr && write(gw[1], recs, nr * RECLEN) != nr * RECLEN)
+		exit(1);
+	if (close_gw)
+		close(gw[1]);
+	if (cmd && write(cmdpipe[1], &cmd, 1) != 1)
+		exit(1);
+
+	waits = records = 0;
+	ret = openconnect_mainloop(vpninfo, 0, 0);
+
+	if (vpninfo->epoll_fd != -1)
+		close(vpninfo->epoll_fd);
+	if (!close_gw)
+		close(gw[1]);
+	close(gw[0]);
+	close(cmdpipe[0]);
+	close(cmdpipe[1]);
+	close(tunpipe[0]);
+	close(tunpipe[1]);
+	free(vpninfo);
+	return ret;
+}
+
+static int test_loop(int event_loop, const char *name)
+{
+	int ret;
+
+	/* Streaming records: one wait per CMD_POLL_LOOPS busy passes, not
+	   a poll of the command pipe on every one */
+	ret = run(event_loop, RECORDS, 1, 0);
+	if (ret != -EIO || records != RECORDS) {
+		fprintf(stderr, "%s: mainloop returned %d after %d records\n",
+			name, ret, records);
+		return 1;
+	}
+	if (waits > RECORDS / CMD_POLL_LOOPS + 2) {
+		fprintf(stderr, "%s: %d waits for %d records\n",
+			name, waits, RECORDS);
+		return 1;
+	}
+
+	/* A cancel must get through while the mainloop is still busy */
+	ret = run(event_loop, RECORDS, 0, OC_CMD_CANCEL);
+	if (ret != -EINTR || records > CMD_POLL_LOOPS) {
+		fprintf(stderr, "%s: cancel under load returned %d after %d records\n",
+			name, ret, records);
+		return 1;
+	}
+
+	/* ... and when it's idle */
+	ret = run(event_loop, 0, 0, OC_CMD_CANCEL);
+	if (ret != -EINTR || waits != 1) {
+		fprintf(stderr, "%s: idle cancel returned %d after %d waits\n",
+			name, ret, waits);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+#ifdef HAVE_EPOLL
+	ret |= test_loop(EVENT_LOOP_SELECT, "select");
+	ret |= test_loop(EVENT_LOOP_EPOLL, "epoll");
+	ret |= test_loop(EVENT_LOOP_EPOLL_ET, "epoll-et");
+#else
+	ret |= test_loop(0, "select");
+#endif
+	return ret;
+}
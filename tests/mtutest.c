@@ -0,0 +1,456 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Drives the DTLS path MTU discovery in dtls_mainloop() over a fake DTLS
+ * session, whose "path" drops anything bigger than path_mtu and echoes
+ * DPD requests back, with a clock that only moves when told to. The MTU
+ * must come down to the path MTU without holding up the data packets
+ * queued meanwhile, and go back up again once the path allows it. With
+ * an IPv6 peer, the path MTU the kernel reports must be tried first.
+ * If the tun device won't take a new MTU, the old one must be kept.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+
+/* Everything dtls.c includes, before the fakes below are defined */
+#include "../openconnect-internal.h"
+#if defined(OPENCONNECT_GNUTLS)
+#include <gnutls/dtls.h>
+#endif
+
+/* Milliseconds, as from timer_now() */
+static uint64_t now = 1000000000;
+
+static int fake_send(void *ssl, const void *buf, size_t len);
+static int fake_recv(void *ssl, void *buf, size_t len);
+
+static int fake_getsockopt(int fd, int level, int optname,
+			   void *optval, socklen_t *optlen);
+
+#define getsockopt(f, l, o, v, n) fake_getsockopt(f, l, o, v, n)
+#if defined(OPENCONNECT_OPENSSL)
+#define SSL_write(s, b, l) fake_send(s, b, l)
+#define SSL_read(s, b, l) fake_recv(s, b, l)
+#else
+#define gnutls_record_send(s, b, l) fake_send(s, b, l)
+#define gnutls_record_recv(s, b, l) fake_recv(s, b, l)
+#define gnutls_dtls_set_data_mtu(s, m) do { } while (0)
+#define gnutls_dtls_set_mtu(s, m) do { } while (0)
+#endif
+
+#include "../dtls.c"
+
+#undef getsockopt
+
+static int path_mtu;
+static int data_sent;
+static int probes_sent;
+static int tun_mtu_set;
+static int tun_mtu_err;
+
+/* The IPv6 path MTU the kernel will report, once an oversized packet has
+   provoked an ICMPv6 Packet Too Big; zero if it won't. */
+static int icmp6_pmtu;
+static int kernel_pmtu;
+
+/* Echoed DPD responses, waiting to be read */
+#define MAX_ECHOES 8
+static unsigned char echoes[MAX_ECHOES][2048];
+static int echo_lens[MAX_ECHOES];
+static int nr_echoes;
+
+static int fake_send(void *ssl, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (p[0] == AC_PKT_DPD_OUT)
+		probes_sent++;
+
+	if (len - 1 > path_mtu) {
+		kernel_pmtu = icmp6_pmtu;
+		return len;
+	}
+
+	if (p[0] == AC_PKT_DPD_OUT && nr_echoes < MAX_ECHOES) {
+		memcpy(echoes[nr_echoes], buf, len);
+		echoes[nr_echoes][0] = AC_PKT_DPD_RESP;
+		echo_lens[nr_echoes++] = len;
+	} else if (p[0] == AC_PKT_DATA) {
+		data_sent++;
+	}
+	return len;
+}
+
+static int fake_recv(void *ssl, void *buf, size_t len)
+{
+	int ret;
+
+	if (!nr_echoes)
+		return -1;
+
+	/* Like a DTLS read, truncate a record which doesn't fit */
+	ret = echo_lens[0] < len ? echo_lens[0] : len;
+	memcpy(buf, echoes[0], ret);
+	memmove(echoes[0], echoes[1], sizeof(echoes[0]) * (nr_echoes - 1));
+	memmove(echo_lens, echo_lens + 1, sizeof(echo_lens[0]) * (nr_echoes - 1));
+	nr_echoes--;
+	return ret;
+}
+
+static int fake_getsockopt(int fd, int level, int optname,
+			   void *optval, socklen_t *optlen)
+{
+#ifdef HAVE_IPV6_PATHMTU
+	if (kernel_pmtu && level == IPPROTO_IPV6 && optname == IPV6_PATHMTU) {
+		struct ip6_mtuinfo *mtuinfo = optval;
+
+		memset(mtuinfo, 0, sizeof(*mtuinfo));
+		mtuinfo->ip6m_mtu = kernel_pmtu;
+		*optlen = sizeof(*mtuinfo);
+		return 0;
+	}
+#endif
+	errno = ENOPROTOOPT;
+	return -1;
+}
+
+/* Stand-ins for the rest of the library */
+int udp_connect(struct openconnect_info *vpninfo)
+{
+	return -EINVAL;
+}
+
+int udp_sockaddr(struct openconnect_info *vpninfo, int port)
+{
+	return -EINVAL;
+}
+
+int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
+{
+	return -EINVAL;
+}
+
+int dtls_try_handshake(struct openconnect_info *vpninfo)
+{
+	return -EINVAL;
+}
+
+void dtls_ssl_free(struct openconnect_info *vpninfo)
+{
+}
+
+int keepalive_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+	return KA_NONE;
+}
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = now;
+}
+
+/* Only the MTU timer matters here, and run() looks at that directly */
+void timer_set(struct openconnect_info *vpninfo, struct oc_timer *t,
+	       uint64_t due)
+{
+	t->due = due;
+	t->slot = 1;
+}
+
+void timer_cancel(struct openconnect_info *vpninfo, struct oc_timer *t)
+{
+	t->slot = 0;
+}
+
+int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this)
+{
+	return -EINVAL;
+}
+
+int decompress_and_queue_packet(struct openconnect_info *vpninfo,
+				struct oc_stats *via, int compr_type,
+				unsigned char *buf, int len)
+{
+	return -EINVAL;
+}
+
+int queue_rx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		    struct pkt *pkt)
+{
+	return queue_packet(&vpninfo->incoming_queue, pkt);
+}
+
+void record_tx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		      struct pkt *pkt)
+{
+}
+
+int openconnect_random(void *bytes, int len)
+{
+	unsigned char *p = bytes;
+
+	while (len--)
+		*p++ = rand();
+	return 0;
+}
+
+#ifdef HAVE_EPOLL
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd,
+		       uint32_t *monitored, uint32_t events)
+{
+	*monitored = events;
+}
+#endif
+
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	if (tun_mtu_err)
+		return tun_mtu_err;
+	tun_mtu_set = vpninfo->ip_info.mtu;
+	return 0;
+}
+
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	struct pkt *pkt = malloc(sizeof(*pkt) + len);
+
+	if (pkt)
+		pkt->alloc_len = len;
+	return pkt;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	free(pkt);
+}
+
+struct oc_text_buf *buf_alloc(void)
+{
+	return NULL;
+}
+
+void buf_append(struct oc_text_buf *buf, const char *fmt, ...)
+{
+}
+
+void buf_append_hex(struct oc_text_buf *buf, const void *str, unsigned len)
+{
+}
+
+int buf_error(struct oc_text_buf *buf)
+{
+	return -ENOMEM;
+}
+
+int buf_free(struct oc_text_buf *buf)
+{
+	return 0;
+}
+
+#if defined(OPENCONNECT_OPENSSL)
+int openconnect_print_err_cb(const char *str, size_t len, void *ptr)
+{
+	fprintf(stderr, "%s", str);
+	return 0;
+}
+#endif
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Run the mainloop until the search is over, moving the clock on to
+   when the MTU timer is due whenever there's nothing to do. Returns the
+   number of times it was called. */
+static int run(struct openconnect_info *vpninfo, int queue_data)
+{
+	uint64_t start = now;
+	int timeout, passes = 0;
+
+	while (1) {
+		passes++;
+		if (queue_data) {
+			struct pkt *pkt = alloc_pkt(vpninfo, 64);
+
+			pkt->len = 64;
+			queue_packet(&vpninfo->outgoing_queue, pkt);
+		}
+
+		timeout = INT_MAX;
+		vpninfo->now = now;
+		dtls_mainloop(vpninfo, &timeout);
+		if (nr_echoes)
+			continue;
+		if (vpninfo->mtu_state != MTU_SEARCH || now - start > 3600000)
+			break;
+		if (!vpninfo->mtu_timer.slot || vpninfo->mtu_timer.due <= now) {
+			fprintf(stderr, "No timer set for the next MTU probe\n");
+			break;
+		}
+		now = vpninfo->mtu_timer.due;
+	}
+	return passes;
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo;
+	struct sockaddr_in peer4 = { .sin_family = AF_INET };
+#ifdef HAVE_IPV6_PATHMTU
+	struct sockaddr_in6 peer6 = { .sin6_family = AF_INET6 };
+#endif
+	int ret = 0, passes;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->dtls_state = DTLS_CONNECTED;
+	vpninfo->dtls_ssl = (void *)vpninfo;
+	vpninfo->dtls_fd = open("/dev/null", O_RDONLY);
+	vpninfo->epoll_fd = -1;
+	vpninfo->tun_fd = 0;
+	vpninfo->ip_info.mtu = 1400;
+	vpninfo->peer_addr = (void *)&peer4;
+	init_pkt_queue(&vpninfo->incoming_queue);
+	init_pkt_queue(&vpninfo->outgoing_queue);
+
+	/* Down to the path MTU, with data still going out meanwhile */
+	path_mtu = 1234;
+	dtls_detect_mtu(vpninfo);
+	passes = run(vpninfo, 1);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != path_mtu ||
+	    tun_mtu_set != path_mtu) {
+		fprintf(stderr, "Detected MTU %d (tun %d) for path MTU %d\n",
+			vpninfo->ip_info.mtu, tun_mtu_set, path_mtu);
+		ret = 1;
+	}
+	if (data_sent != passes || vpninfo->outgoing_queue.head) {
+		fprintf(stderr, "%d data packets sent in %d passes of the mainloop\n",
+			data_sent, passes);
+		ret = 1;
+	}
+
+	/* Nothing more to find out until it's time to look for more */
+	if (!vpninfo->mtu_timer.slot ||
+	    vpninfo->mtu_timer.due != now + MTU_RAISE_INTERVAL * 1000) {
+		fprintf(stderr, "No timer set for the next MTU search\n");
+		ret = 1;
+	}
+	now += MTU_RAISE_INTERVAL * 1000 - 1;
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || nr_echoes) {
+		fprintf(stderr, "Probed for a larger MTU too early\n");
+		ret = 1;
+	}
+
+	/* ... and then back up to the ceiling when the path allows it */
+	path_mtu = 1500;
+	now++;
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != 1400 ||
+	    tun_mtu_set != 1400) {
+		fprintf(stderr, "MTU raised to %d (tun %d), not 1400\n",
+			vpninfo->ip_info.mtu, tun_mtu_set);
+		ret = 1;
+	}
+
+#ifdef HAVE_IPV6_PATHMTU
+	/* With an IPv6 peer, straight to what the kernel learned from the
+	   Packet Too Big that the first probe provoked */
+	dtls_close(vpninfo);
+	vpninfo->dtls_state = DTLS_CONNECTED;
+	vpninfo->dtls_fd = open("/dev/null", O_RDONLY);
+	vpninfo->peer_addr = (void *)&peer6;
+	path_mtu = 1234;
+	icmp6_pmtu = path_mtu + 40 + 8 + DTLS_OVERHEAD;
+	probes_sent = 0;
+	dtls_detect_mtu(vpninfo);
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != path_mtu ||
+	    probes_sent != MTU_MAX_PROBES + 1) {
+		fprintf(stderr, "Detected IPv6 MTU %d with %d probes for path MTU %d\n",
+			vpninfo->ip_info.mtu, probes_sent, path_mtu);
+		ret = 1;
+	}
+
+	/* ... and a later search starts out there too */
+	path_mtu = 1300;
+	icmp6_pmtu = kernel_pmtu = path_mtu + 40 + 8 + DTLS_OVERHEAD;
+	probes_sent = 0;
+	now += MTU_RAISE_INTERVAL * 1000;
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != path_mtu ||
+	    probes_sent != 1) {
+		fprintf(stderr, "Raised IPv6 MTU to %d with %d probes for path MTU %d\n",
+			vpninfo->ip_info.mtu, probes_sent, path_mtu);
+		ret = 1;
+	}
+
+	vpninfo->peer_addr = (void *)&peer4;
+	icmp6_pmtu = kernel_pmtu = 0;
+#endif
+
+	/* No change if nothing gets through at all */
+	dtls_close(vpninfo);
+	vpninfo->dtls_state = DTLS_CONNECTED;
+	vpninfo->ip_info.mtu = 1400;
+	path_mtu = 0;
+	dtls_detect_mtu(vpninfo);
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != 1400) {
+		fprintf(stderr, "MTU %d after no probes got through\n",
+			vpninfo->ip_info.mtu);
+		ret = 1;
+	}
+
+	/* Nor if the tun device won't take it, as after -U. Then there's
+	   no point in searching again later either. */
+	dtls_close(vpninfo);
+	vpninfo->dtls_state = DTLS_CONNECTED;
+	path_mtu = 1234;
+	tun_mtu_err = -EPERM;
+	dtls_detect_mtu(vpninfo);
+	run(vpninfo, 0);
+	if (vpninfo->mtu_state != MTU_DONE || vpninfo->ip_info.mtu != 1400 ||
+	    vpninfo->mtu_timer.slot) {
+		fprintf(stderr, "MTU %d%s when the tun device refused %d\n",
+			vpninfo->ip_info.mtu,
+			vpninfo->mtu_timer.slot ? ", searching again later," : "",
+			path_mtu);
+		ret = 1;
+	}
+
+	while (vpninfo->outgoing_queue.head)
+		free(dequeue_packet(&vpninfo->outgoing_queue));
+	free(vpninfo->dtls_pkt);
+	free(vpninfo);
+	return ret;
+}
@@ -19,10 +19,14 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#ifdef HAVE_TUN_MULTIQUEUE
+#include <pthread.h>
+#endif
 
 #define __OPENCONNECT_INTERNAL_H__
 
 #define vpn_progress(v, d, ...) printf(__VA_ARGS__)
+#define vpn_pkt_trace(v, ...) printf(__VA_ARGS__)
 #define _(x) x
 
 struct openconnect_info;
@@ -30,14 +34,53 @@ struct openconnect_info;
 struct esp {
 	uint64_t seq_backlog;
 	uint64_t seq;
+	unsigned char seq_lock;
 };
 
 #include "../esp-seqno.c"
 
+#ifdef HAVE_TUN_MULTIQUEUE
+/* The mainloop and the ESP worker threads check sequence numbers on
+   the same incoming SA at once. Even if a replayed packet reaches two
+   of them together, whatever the interleaving, it may be accepted only
+   once. */
+#define THREAD_SEQS 4096
+
+static struct esp thread_esp;
+static int accepted[THREAD_SEQS];
+
+static void *seq_thread(void *arg)
+{
+	uint32_t seq;
+
+	for (seq = 0; seq < THREAD_SEQS; seq++) {
+		if (!verify_packet_seqno(NULL, &thread_esp, seq))
+			__atomic_fetch_add(&accepted[seq], 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static int test_threads(void)
+{
+	pthread_t threads[2];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (pthread_create(&threads[i], NULL, seq_thread, NULL))
+			return 1;
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < THREAD_SEQS; i++)
+		if (accepted[i] > 1)
+			return 1;
+	return 0;
+}
+#endif
 
 int main(void)
 {
-	struct esp esptest = { 0, 0 };
+	struct esp esptest = { 0, 0, 0 };
 
 	if (verify_packet_seqno(NULL, &esptest, 0) ||
 	    verify_packet_seqno(NULL, &esptest, 2) ||
@@ -82,5 +125,9 @@ int main(void)
 	    verify_packet_seqno(NULL, &esptest, 0xffffffc0))
 		return 1;
 
+#ifdef HAVE_TUN_MULTIQUEUE
+	if (test_threads())
+		return 1;
+#endif
 	return 0;
 }
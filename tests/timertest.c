@@ -0,0 +1,185 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Sets, moves and cancels the timers in timer.c at random, with the
+ * mainloop's cached clock moving only when told to, and checks after
+ * each step that the heap is in order and that timers_next() wakes up
+ * for the earliest of the timers which a simple list says should be
+ * armed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "../openconnect-internal.h"
+
+/* Only for when there's no CLOCK_MONOTONIC_COARSE */
+uint64_t stats_clock_us(void)
+{
+	return 0;
+}
+
+#include "../timer.c"
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static int armed[MAX_TIMERS];
+
+static int check_heap(struct openconnect_info *vpninfo, struct oc_timer *t,
+		      int step)
+{
+	int expect_nr = 0, i;
+
+	for (i = 0; i < MAX_TIMERS; i++) {
+		if (!t[i].slot != !armed[i]) {
+			fprintf(stderr, "Step %d: timer %d %sarmed\n", step, i,
+				armed[i] ? "not " : "");
+			return 1;
+		}
+		expect_nr += armed[i];
+	}
+	if (vpninfo->nr_timers != expect_nr) {
+		fprintf(stderr, "Step %d: %d timers armed, not %d\n",
+			step, vpninfo->nr_timers, expect_nr);
+		return 1;
+	}
+	for (i = 0; i < vpninfo->nr_timers; i++) {
+		if (vpninfo->timers[i]->slot != i + 1) {
+			fprintf(stderr, "Step %d: timer in slot %d thinks it's in %d\n",
+				step, i + 1, vpninfo->timers[i]->slot);
+			return 1;
+		}
+		if (i && vpninfo->timers[(i - 1) / 2]->due > vpninfo->timers[i]->due) {
+			fprintf(stderr, "Step %d: heap out of order at %d\n", step, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct openconnect_info *vpninfo;
+	struct oc_timer t[MAX_TIMERS];
+	uint64_t now, earliest;
+	int step, i, timeout, ret = 0;
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->now = 1000000;
+	memset(t, 0, sizeof(t));
+	srand(1);
+
+	for (step = 0; step < 100000 && !ret; step++) {
+		i = rand() % MAX_TIMERS;
+		now = vpninfo->now;
+
+		switch (rand() % 4) {
+		case 0:
+		case 1:
+			/* Duplicate due times happen too */
+			timer_set(vpninfo, &t[i], now + rand() % 100);
+			armed[i] = 1;
+			break;
+		case 2:
+			timer_cancel(vpninfo, &t[i]);
+			armed[i] = 0;
+			break;
+		case 3:
+			vpninfo->now += rand() % 50;
+			now = vpninfo->now;
+
+			/* Those which have come due stay armed, and there's
+			   no waiting until they've been dealt with */
+			earliest = UINT64_MAX;
+			for (i = 0; i < MAX_TIMERS; i++) {
+				if (armed[i] && t[i].due < earliest)
+					earliest = t[i].due;
+			}
+			if (earliest < now)
+				earliest = now;
+
+			timeout = INT_MAX;
+			timers_next(vpninfo, &timeout);
+			if (earliest == UINT64_MAX ? timeout != INT_MAX :
+			    timeout != earliest - now) {
+				fprintf(stderr, "Step %d: wait %d ms, not %d\n",
+					step, timeout, earliest == UINT64_MAX ?
+					INT_MAX : (int)(earliest - now));
+				ret = 1;
+			}
+			break;
+		}
+		ret |= check_heap(vpninfo, t, step);
+	}
+
+	/* A wait already shorter than any timer is left alone */
+	for (i = 0; i < MAX_TIMERS; i++)
+		timer_cancel(vpninfo, &t[i]);
+	timer_set(vpninfo, &t[0], vpninfo->now + 5000);
+	timeout = 1000;
+	timers_next(vpninfo, &timeout);
+	if (timeout != 1000) {
+		fprintf(stderr, "Wait of 1000 ms changed to %d\n", timeout);
+		ret = 1;
+	}
+
+	/* One which has come due is left for its owner, with no waiting
+	   until it has been re-armed or cancelled */
+	timer_set(vpninfo, &t[1], vpninfo->now + 100);
+	vpninfo->now += 200;
+	for (i = 0; i < 2; i++) {
+		timeout = 1000;
+		timers_next(vpninfo, &timeout);
+		if (timeout || !t[1].slot) {
+			fprintf(stderr, "Pass %d: due timer %sarmed, wait %d ms\n",
+				i, t[1].slot ? "" : "not ", timeout);
+			ret = 1;
+		}
+	}
+	timer_set(vpninfo, &t[1], vpninfo->now + 300);
+	timeout = INT_MAX;
+	timers_next(vpninfo, &timeout);
+	if (timeout != 300) {
+		fprintf(stderr, "Wait %d ms after re-arming, not 300\n", timeout);
+		ret = 1;
+	}
+	timer_cancel(vpninfo, &t[1]);
+	timeout = INT_MAX;
+	timers_next(vpninfo, &timeout);
+	if (timeout != 4800) {
+		fprintf(stderr, "Wait %d ms after cancelling, not 4800\n", timeout);
+		ret = 1;
+	}
+
+	free(vpninfo);
+	return ret;
+}
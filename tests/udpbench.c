@@ -0,0 +1,496 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Loopback ESP benchmark. Runs esp_mainloop() itself, with the crypto
+ * backend this tree was configured with, on a UDP socket connected to
+ * another on the loopback interface.
+ *
+ * To send, it keeps the outgoing queue full and lets esp_mainloop()
+ * encrypt and send it: with one send() per packet, with sendmmsg() in
+ * batches of the given size, and then with UDP_SEGMENT where the kernel
+ * has it. To receive, a child process floods the socket with ESP packets
+ * while esp_mainloop() receives and decrypts them: with one recv() per
+ * packet, with recvmmsg() in batches, and with UDP_GRO, for which it
+ * also reports how many datagrams the kernel coalesced into each.
+ *
+ * Usage: udpbench [batch [seconds [pktlen]]]
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../esp.c"
+#include "../esp-seqno.c"
+#include "../ssl.c"
+#if defined(OPENCONNECT_GNUTLS)
+#include "../gnutls-esp.c"
+#elif defined(OPENCONNECT_OPENSSL)
+#include "../openssl-esp.c"
+#endif
+
+/* Packets kept in the outgoing queue while sending */
+#define QUEUE_LEN 256
+
+static unsigned long rx_pkts, tx_pkts;
+
+/* Where the packets end up: counted, and nothing more */
+int queue_rx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		    struct pkt *pkt)
+{
+	rx_pkts++;
+	free_pkt(vpninfo, pkt);
+	return 0;
+}
+
+void record_tx_packet(struct openconnect_info *vpninfo, struct oc_stats *via,
+		      struct pkt *pkt)
+{
+	tx_pkts++;
+}
+
+/* Stand-ins for the rest of the library */
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	struct pkt *pkt = malloc(sizeof(*pkt) + len);
+
+	if (pkt) {
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->alloc_len = len;
+	}
+	return pkt;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	free(pkt);
+}
+
+int keepalive_action(struct openconnect_info *vpninfo, struct keepalive_info *ka)
+{
+	return KA_NONE;
+}
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = time(NULL) * 1000ULL;
+}
+
+void timer_set(struct openconnect_info *vpninfo, struct oc_timer *t,
+	       uint64_t due)
+{
+}
+
+void timer_cancel(struct openconnect_info *vpninfo, struct oc_timer *t)
+{
+}
+
+uint64_t timer_now(void)
+{
+	return time(NULL) * 1000ULL;
+}
+
+int queue_esp_control(struct openconnect_info *vpninfo, int enable)
+{
+	return 0;
+}
+
+int av_lzo1x_decode(void *out, int *outlen, const void *in, int *inlen)
+{
+	return -EINVAL;
+}
+
+#ifdef HAVE_EPOLL
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd,
+		       uint32_t *monitored, uint32_t events)
+{
+	*monitored = events;
+}
+#endif
+
+#ifdef HAVE_TUN_MULTIQUEUE
+int esp_start_workers(struct openconnect_info *vpninfo)
+{
+	return -EINVAL;
+}
+
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+}
+
+void esp_collect_worker_times(struct openconnect_info *vpninfo)
+{
+}
+
+void esp_collect_worker_stats(struct openconnect_info *vpninfo)
+{
+}
+
+int esp_worker_queue_rx(struct openconnect_info *vpninfo, struct pkt *pkt,
+			int len)
+{
+	return 0;
+}
+
+void os_close_tun_queues(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+#ifdef HAVE_XFRM
+int esp_xfrm_install(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+
+void esp_xfrm_remove(struct openconnect_info *vpninfo)
+{
+}
+
+int esp_xfrm_reserve_seq(struct openconnect_info *vpninfo)
+{
+	return -EOPNOTSUPP;
+}
+
+int esp_xfrm_poll(struct openconnect_info *vpninfo, int timeout)
+{
+	return 0;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+int uring_post(struct openconnect_info *vpninfo, int type, int fd,
+	       struct pkt *pkt, void *buf, int len)
+{
+	return -EOPNOTSUPP;
+}
+
+void uring_cancel_fd(struct openconnect_info *vpninfo, int fd)
+{
+}
+#endif
+
+int dns_lookup(struct openconnect_info *vpninfo, const char *host,
+	       const char *port, const struct addrinfo *hints,
+	       struct addrinfo **res, int *cached)
+{
+	return EAI_FAIL;
+}
+
+void dns_cache_flush(struct openconnect_info *vpninfo)
+{
+}
+
+void print_pkt_pool_stats(struct openconnect_info *vpninfo)
+{
+}
+
+void print_data_stats(struct openconnect_info *vpninfo)
+{
+}
+
+void openconnect_close_https(struct openconnect_info *vpninfo, int final)
+{
+}
+
+int process_proxy(struct openconnect_info *vpninfo, int ssl_sock)
+{
+	return -EIO;
+}
+
+int process_auth_form(struct openconnect_info *vpninfo, struct oc_auth_form *form)
+{
+	return OC_FORM_RESULT_ERR;
+}
+
+void clear_auth_states(struct openconnect_info *vpninfo,
+		       struct http_auth_state *auth_states, int reset)
+{
+}
+
+int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	return 0;
+}
+
+#ifdef HAVE_ICONV
+char *openconnect_utf8_to_legacy(struct openconnect_info *vpninfo, const char *utf8)
+{
+	return (char *)utf8;
+}
+#endif
+
+static void __attribute__ ((format(printf, 3, 4)))
+	progress(void *cbdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const struct vpn_proto bench_proto = {
+	.name = "udpbench",
+};
+
+static void report(const char *name, int batch, double secs,
+		   unsigned long pkts, int pktlen)
+{
+	printf("%-12s batch %2d: %10.0f pkts/s, %8.1f MB/s\n",
+	       name, batch, pkts / secs, pkts * pktlen / secs / 1e6);
+}
+
+/* Wait up to 100ms for the socket to be ready */
+static void wait_fd(int fd, int write)
+{
+	struct timeval tv = { 0, 100000 };
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	select(fd + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv);
+}
+
+static void run_send(struct openconnect_info *vpninfo, const char *name,
+		     int batch, double secs, int pktlen)
+{
+	struct pkt *pkt;
+	double start, end;
+	int timeout;
+
+	vpninfo->udp_batch = batch;
+	tx_pkts = 0;
+
+	start = now();
+	end = start + secs;
+	while (now() < end) {
+		while (vpninfo->outgoing_queue.count < QUEUE_LEN) {
+			pkt = alloc_pkt(vpninfo, pktlen + vpninfo->pkt_trailer);
+			if (!pkt)
+				return;
+			memset(pkt->data, 0x5a, pktlen);
+			pkt->len = pktlen;
+			queue_packet(&vpninfo->outgoing_queue, pkt);
+		}
+		timeout = 1000;
+		esp_mainloop(vpninfo, &timeout);
+		if (vpninfo->nr_esp_unsent || vpninfo->outgoing_queue.count)
+			wait_fd(vpninfo->dtls_fd, 1);
+	}
+	report(name, batch, now() - start, tx_pkts, pktlen);
+
+	while ((pkt = dequeue_packet(&vpninfo->outgoing_queue)))
+		free_pkt(vpninfo, pkt);
+}
+
+static void run_recv(struct openconnect_info *vpninfo, const char *name,
+		     int batch, double secs, int pktlen)
+{
+	double start, end;
+	int timeout;
+
+	vpninfo->udp_batch = batch;
+	rx_pkts = 0;
+
+	start = now();
+	end = start + secs;
+	while (now() < end) {
+		wait_fd(vpninfo->dtls_fd, 0);
+		timeout = 1000;
+		esp_mainloop(vpninfo, &timeout);
+	}
+	report(name, batch, now() - start, rx_pkts, pktlen);
+}
+
+/* Send the same few ESP packets over and over; replay protection is
+   off in the receiver, so it decrypts every one of them. */
+static void flood(struct openconnect_info *vpninfo, int fd, int pktlen)
+{
+	struct pkt *pkts[MAX_UDP_BATCH];
+	int lens[MAX_UDP_BATCH];
+	int i;
+
+	for (i = 0; i < MAX_UDP_BATCH; i++) {
+		pkts[i] = alloc_pkt(vpninfo, pktlen + vpninfo->pkt_trailer);
+		if (!pkts[i])
+			exit(1);
+		memset(pkts[i]->data, 0x5a, pktlen);
+		pkts[i]->len = pktlen;
+	}
+	encrypt_esp_packets(vpninfo, &vpninfo->esp_out, pkts, lens, MAX_UDP_BATCH);
+
+	for (i = 0; ; i = (i + 1) % MAX_UDP_BATCH) {
+		if (send(fd, (void *)esp_pkt_hdr(vpninfo, pkts[i]), lens[i], 0) < 0 &&
+		    errno != ENOBUFS && errno != ECONNREFUSED)
+			exit(0);
+	}
+}
+
+/* Two loopback UDP sockets, connected to each other */
+static int socket_pair(int *fds)
+{
+	struct sockaddr_in addr[2];
+	socklen_t addrlen;
+	int i, bufsize = 4 << 20;
+
+	for (i = 0; i < 2; i++) {
+		fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		memset(&addr[i], 0, sizeof(addr[i]));
+		addr[i].sin_family = AF_INET;
+		addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addrlen = sizeof(addr[i]);
+		if (fds[i] < 0 || bind(fds[i], (void *)&addr[i], sizeof(addr[i])) < 0 ||
+		    getsockname(fds[i], (void *)&addr[i], &addrlen) < 0)
+			return -errno;
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+	}
+	if (connect(fds[0], (void *)&addr[1], sizeof(addr[1])) < 0 ||
+	    connect(fds[1], (void *)&addr[0], sizeof(addr[0])) < 0)
+		return -errno;
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct openconnect_info *vpninfo;
+	struct sockaddr_in addr;
+	int batch = argc > 1 ? atoi(argv[1]) : 32;
+	double secs = argc > 2 ? atof(argv[2]) : 2;
+	int pktlen = argc > 3 ? atoi(argv[3]) : 1400;
+	int fds[2], i;
+	pid_t child;
+
+	if (batch < 1 || batch > MAX_UDP_BATCH || pktlen < 1 || pktlen > 1500) {
+		fprintf(stderr, "Usage: %s [batch [seconds [pktlen]]]\n", argv[0]);
+		return 1;
+	}
+
+	vpninfo = calloc(1, sizeof(*vpninfo));
+	if (!vpninfo)
+		return 1;
+	vpninfo->progress = progress;
+	vpninfo->verbose = PRG_ERR;
+	vpninfo->proto = &bench_proto;
+	vpninfo->ip_info.mtu = pktlen;
+	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
+	init_pkt_queue(&vpninfo->outgoing_queue);
+
+	if (socket_pair(fds)) {
+		perror("socket");
+		return 1;
+	}
+	vpninfo->dtls_fd = fds[0];
+	vpninfo->dtls_addr = (void *)&addr;
+	vpninfo->dtls_state = DTLS_SECRET;
+
+	/* Both directions share keys, so that the child's packets can be
+	   decrypted by the parent */
+	vpninfo->esp_enc = ENC_AES_128_GCM;
+	srand(time(NULL));
+	for (i = 0; i < sizeof(vpninfo->esp_out_next.secrets); i++)
+		vpninfo->esp_out_next.secrets[i] = rand();
+	vpninfo->esp_out_next.spi = htonl(0x12345678);
+	vpninfo->esp_in[0] = vpninfo->esp_out_next;
+	if (setup_esp_keys(vpninfo, 0)) {
+		fprintf(stderr, "ESP setup failed\n");
+		return 1;
+	}
+	vpninfo->dtls_state = DTLS_CONNECTED;
+
+	run_send(vpninfo, "send()", 1, secs, pktlen);
+#ifdef HAVE_SENDMMSG
+	if (batch > 1)
+		run_send(vpninfo, "sendmmsg()", batch, secs, pktlen);
+#ifdef HAVE_UDP_SEGMENT
+	vpninfo->udp_gso = !setsockopt(fds[0], SOL_UDP, UDP_SEGMENT, &(int){ 0 },
+				       sizeof(int));
+	if (batch > 1 && vpninfo->udp_gso)
+		run_send(vpninfo, "UDP_SEGMENT", batch, secs, pktlen);
+	vpninfo->udp_gso = 0;
+#endif
+#endif
+
+	/* Whatever the sends left unread would skew the receive numbers */
+	close(fds[1]);
+	close(fds[0]);
+	if (socket_pair(fds)) {
+		perror("socket");
+		return 1;
+	}
+	vpninfo->dtls_fd = fds[0];
+	vpninfo->esp_replay_protect = 0;
+
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!child)
+		flood(vpninfo, fds[1], pktlen);
+
+	run_recv(vpninfo, "recv()", 1, secs, pktlen);
+#ifdef HAVE_RECVMMSG
+	if (batch > 1)
+		run_recv(vpninfo, "recvmmsg()", batch, secs, pktlen);
+#endif
+#ifdef HAVE_UDP_GRO
+	vpninfo->udp_gro = !setsockopt(fds[0], SOL_UDP, UDP_GRO, &(int){ 1 },
+				       sizeof(int));
+	if (vpninfo->udp_gro) {
+		run_recv(vpninfo, "UDP_GRO", batch, secs, pktlen);
+		printf("%-12s %.2f datagrams per receive\n", "",
+		       vpninfo->udp_gro_recvs ?
+		       (double)vpninfo->udp_gro_dgrams / vpninfo->udp_gro_recvs : 0.0);
+	}
+#endif
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	esp_shutdown(vpninfo);
+	close(fds[1]);
+	free(vpninfo->udp_gro_buf);
+	for (i = 0; i < MAX_UDP_BATCH; i++)
+		free(vpninfo->udp_rx_pkts[i]);
+	free(vpninfo->dtls_pkt);
+	free(vpninfo);
+	return 0;
+}
@@ -0,0 +1,416 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs the ESP worker threads over a real multi-queue tun device, in a
+ * private network namespace, with a peer at the other end of the
+ * loopback which does its ESP with the userspace code. This program
+ * plays the part of the mainloop: it receives from the ESP socket,
+ * hands datagrams to the workers as esp_decrypt_rx() does, and serves
+ * the first tun queue.
+ *
+ *   127.0.0.1	the client's end of the ESP socket
+ *   127.0.0.2	the peer's end
+ *   10.9.0.1	the client's VPN address, on the tun device
+ *   10.9.0.2	a host on the far side of the peer
+ *
+ * Everything the peer sends must be decrypted by the workers or by us
+ * into the tun device, and reach a socket on the VPN address; probe
+ * replies and packets on another SA must not be handed to the workers.
+ * Packets sent through the tun device must reach the peer, encrypted
+ * by the workers or by us, whichever queue the kernel picked. The
+ * extra queues are opened detached, as os_setup_tun() leaves them, and
+ * must be detached again once the workers have stopped.
+ *
+ * Skipped where network namespaces or the tun device are unavailable.
+ */
+
+#include <config.h>
+
+#include <sched.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+
+#include "esp-common.h"
+#include "../esp-seqno.c"
+#include "../lzo.c"
+#include "../esp-worker.c"
+
+#define TUN_NAME "octest0"
+#define QUEUES 4
+#define ROUNDS 16
+#define FLOWS 16
+
+#ifdef HAVE_XFRM
+void esp_xfrm_remove(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+uint64_t timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = timer_now();
+}
+
+static int open_queue(void)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = open("/dev/net/tun", O_RDWR);
+	if (fd < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+	strcpy(ifr.ifr_name, TUN_NAME);
+	if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+		close(fd);
+		return -1;
+	}
+	set_sock_nonblock(fd);
+	return fd;
+}
+
+/* The extra queues, opened and detached up front as os_setup_tun() does */
+static int extra_fds[QUEUES - 1];
+
+/* Detaching a queue which is already detached fails with EINVAL */
+static int queue_detached(int fd)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_DETACH_QUEUE;
+	return ioctl(fd, TUNSETQUEUE, (void *)&ifr) < 0 && errno == EINVAL;
+}
+
+static int probes_caught;
+
+static int catch_probe(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	if (pkt->len < 33 || memcmp(pkt->data + 28, "probe", 5))
+		return 0;
+	__atomic_fetch_add(&probes_caught, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static const struct vpn_proto proto = {
+	.udp_catch_probe = catch_probe,
+};
+
+static int if_up(const char *name, const char *addr)
+{
+	struct ifreq ifr;
+	struct sockaddr_in *sin = (void *)&ifr.ifr_addr;
+	int fd, ret = 0;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, name);
+	if (addr) {
+		sin->sin_family = AF_INET;
+		inet_pton(AF_INET, addr, &sin->sin_addr);
+		ret = ioctl(fd, SIOCSIFADDR, &ifr);
+		inet_pton(AF_INET, "255.255.255.0", &sin->sin_addr);
+		ret |= ioctl(fd, SIOCSIFNETMASK, &ifr);
+	}
+	ifr.ifr_flags = IFF_UP | IFF_RUNNING;
+	ret |= ioctl(fd, SIOCSIFFLAGS, &ifr);
+	close(fd);
+	return ret;
+}
+
+/* A datagram from a host beyond the peer to the VPN address */
+static int make_inbound(unsigned char *p, uint16_t dport, const char *payload)
+{
+	return make_udp(p, "10.9.0.2", "10.9.0.1", dport, payload);
+}
+
+/* What esp_decrypt_rx() does with what it keeps, minus the checks */
+static int main_rx(struct openconnect_info *vpninfo, struct pkt *pkt,
+		   int len, int tun_fd)
+{
+	len -= vpninfo->esp_hdrlen + vpninfo->esp_icvlen;
+	pkt->len = len;
+	if (decrypt_esp_packet(vpninfo, &vpninfo->esp_in[0], pkt))
+		return -1;
+	pkt->len = len - 2 - pkt->data[len - 2];
+	if (catch_probe(vpninfo, pkt))
+		return 0;
+	return write(tun_fd, pkt->data, pkt->len) == pkt->len ? 0 : -1;
+}
+
+/* Is this one of our UDP datagrams from the VPN address? */
+static int outbound_nr(const unsigned char *p, int len)
+{
+	int nr;
+
+	if (len < 28 || p[9] != IPPROTO_UDP ||
+	    sscanf((const char *)p + 28, "out %d", &nr) != 1)
+		return -1;
+	return nr;
+}
+
+static int test_alg(int i, int tun_fd)
+{
+	struct openconnect_info *client = NULL, *peer = NULL;
+	struct esp k1, k2;
+	struct sockaddr_in client_addr, peer_addr, app_addr;
+	socklen_t alen = sizeof(client_addr);
+	struct esp_hdr *hdr;
+	struct pkt *pkt, *cpkt;
+	unsigned char buf[2048], seen[ROUNDS * 8];
+	char payload[32];
+	int client_fd, peer_fd, app_fd, flow_fd[FLOWS];
+	int j, k, nr, len, got, ret = 1;
+
+	new_keys(i, &k1, &k2);
+	client_fd = udp_socket("127.0.0.1");
+	peer_fd = udp_socket("127.0.0.2");
+	app_fd = udp_socket("10.9.0.1");
+	getsockname(client_fd, (void *)&client_addr, &alen);
+	alen = sizeof(peer_addr);
+	getsockname(peer_fd, (void *)&peer_addr, &alen);
+	alen = sizeof(app_addr);
+	getsockname(app_fd, (void *)&app_addr, &alen);
+	if (connect(client_fd, (void *)&peer_addr, sizeof(peer_addr)) ||
+	    connect(peer_fd, (void *)&client_addr, sizeof(client_addr)))
+		exit(1);
+	for (j = 0; j < FLOWS; j++)
+		flow_fd[j] = udp_socket("10.9.0.1");
+
+	client = new_side(algs[i].enc, algs[i].hmac, &k1, &k2, &peer_addr);
+	peer = new_side(algs[i].enc, algs[i].hmac, &k2, &k1, &client_addr);
+	pkt = malloc(sizeof(*pkt) + sizeof(buf));
+	cpkt = malloc(sizeof(*cpkt) + sizeof(buf));
+	if (!client || !peer || !pkt || !cpkt)
+		exit(1);
+	client->proto = &proto;
+	client->ip_info.mtu = 1400;
+	client->esp_worker_stop_fd = -1;
+	client->dtls_fd = client_fd;
+	client->dtls_state = DTLS_CONNECTED;
+	client->tun_queues = QUEUES;
+	memcpy(client->tun_queue_fds, extra_fds, sizeof(extra_fds));
+	client->nr_tun_queue_fds = QUEUES - 1;
+	probes_caught = 0;
+
+	if (esp_start_workers(client) || client->nr_esp_workers != QUEUES - 1) {
+		fprintf(stderr, "%s: workers not started\n", algs[i].name);
+		goto out;
+	}
+
+	/* In from the peer, in rounds small enough for the socket buffers */
+	memset(seen, 0, sizeof(seen));
+	for (j = 0; j < ROUNDS; j++) {
+		for (k = 0; k < 8; k++) {
+			snprintf(payload, sizeof(payload), "in %d", j * 8 + k);
+			pkt->len = make_inbound(pkt->data, app_addr.sin_port, payload);
+			len = encrypt_esp_packet(peer, &peer->esp_out, pkt);
+			if (send(peer_fd, esp_pkt_hdr(peer, pkt), len, 0) != len)
+				exit(1);
+
+			len = wait_recv(client_fd, esp_pkt_hdr(client, cpkt), sizeof(buf), 1000);
+			if (len <= 0)
+				exit(1);
+			if (!esp_worker_queue_rx(client, cpkt, len) &&
+			    main_rx(client, cpkt, len, tun_fd)) {
+				fprintf(stderr, "%s: failed to decrypt our share\n", algs[i].name);
+				goto out;
+			}
+		}
+		for (k = 0; k < 8; k++) {
+			len = wait_recv(app_fd, buf, sizeof(buf) - 1, 1000);
+			if (len <= 0) {
+				fprintf(stderr, "%s: only %d of round %d delivered\n",
+					algs[i].name, k, j);
+				goto out;
+			}
+			buf[len] = 0;
+			if (sscanf((char *)buf, "in %d", &nr) != 1 ||
+			    nr < j * 8 || nr >= j * 8 + 8 || seen[nr]++) {
+				fprintf(stderr, "%s: unexpected delivery '%s'\n",
+					algs[i].name, buf);
+				goto out;
+			}
+		}
+	}
+	for (j = 0; j < client->nr_esp_workers; j++) {
+		if (client->esp_workers[j].stats.rx_pkts != ROUNDS * 8 / QUEUES) {
+			fprintf(stderr, "%s: worker %d decrypted %lu packets\n",
+				algs[i].name, j,
+				(unsigned long)client->esp_workers[j].stats.rx_pkts);
+			goto out;
+		}
+	}
+
+	/* Probe replies are caught, whoever decrypts them, and not delivered.
+	   Nor does anything on another SA go to the workers. */
+	for (j = 0; j < QUEUES; j++) {
+		pkt->len = make_inbound(pkt->data, app_addr.sin_port, "probe");
+		len = encrypt_esp_packet(peer, &peer->esp_out, pkt);
+		memcpy(esp_pkt_hdr(client, cpkt), esp_pkt_hdr(peer, pkt), len);
+		if (!esp_worker_queue_rx(client, cpkt, len) &&
+		    main_rx(client, cpkt, len, tun_fd))
+			goto out;
+
+		hdr = esp_pkt_hdr(client, cpkt);
+		memcpy(hdr, esp_pkt_hdr(peer, pkt), len);
+		hdr->spi = htonl(0x3000);
+		if (esp_worker_queue_rx(client, cpkt, len)) {
+			fprintf(stderr, "%s: packet on unknown SA handed to a worker\n",
+				algs[i].name);
+			goto out;
+		}
+	}
+	if (wait_recv(app_fd, buf, sizeof(buf), 200) >= 0) {
+		fprintf(stderr, "%s: probe reply delivered\n", algs[i].name);
+		goto out;
+	}
+	if (__atomic_load_n(&probes_caught, __ATOMIC_RELAXED) != QUEUES) {
+		fprintf(stderr, "%s: %d probe replies caught\n", algs[i].name,
+			probes_caught);
+		goto out;
+	}
+
+	/* Out through whichever queues the kernel picks, to the peer */
+	app_addr = inaddr("10.9.0.2", 9);
+	for (j = 0; j < FLOWS * 2; j++) {
+		snprintf(payload, sizeof(payload), "out %d", j);
+		if (sendto(flow_fd[j % FLOWS], payload, strlen(payload), 0,
+			   (void *)&app_addr, sizeof(app_addr)) < 0) {
+			perror("sendto");
+			goto out;
+		}
+	}
+	memset(seen, 0, sizeof(seen));
+	for (got = 0; got < FLOWS * 2; ) {
+		struct pollfd pfd[2] = {
+			{ .fd = peer_fd, .events = POLLIN },
+			{ .fd = tun_fd, .events = POLLIN },
+		};
+
+		if (poll(pfd, 2, 1000) <= 0) {
+			fprintf(stderr, "%s: only %d packets sent\n", algs[i].name, got);
+			goto out;
+		}
+		if (pfd[0].revents) {
+			len = recv(peer_fd, esp_pkt_hdr(peer, pkt), sizeof(buf), MSG_DONTWAIT);
+			pkt->len = len - peer->esp_hdrlen - peer->esp_icvlen;
+			if (len <= peer->esp_hdrlen + peer->esp_icvlen ||
+			    decrypt_esp_packet(peer, &peer->esp_in[0], pkt)) {
+				fprintf(stderr, "%s: peer failed to decrypt\n", algs[i].name);
+				goto out;
+			}
+			nr = outbound_nr(pkt->data, pkt->len);
+		} else {
+			/* Our own queue; the mainloop would send this */
+			len = read(tun_fd, buf, sizeof(buf) - 1);
+			if (len < 0)
+				continue;
+			buf[len] = 0;
+			nr = outbound_nr(buf, len);
+		}
+		if (nr < 0)
+			continue;
+		if (nr >= FLOWS * 2 || seen[nr]++) {
+			fprintf(stderr, "%s: packet %d seen twice\n", algs[i].name, nr);
+			goto out;
+		}
+		got++;
+	}
+	for (j = 0, got = 0; j < client->nr_esp_workers; j++)
+		got += client->esp_workers[j].stats.tx_pkts;
+	if (!got) {
+		fprintf(stderr, "%s: no packets went out through the workers\n",
+			algs[i].name);
+		goto out;
+	}
+
+	printf("%s: ok (%d of %d sent by the workers)\n", algs[i].name,
+	       got, FLOWS * 2);
+	ret = 0;
+ out:
+	if (client) {
+		esp_stop_workers(client);
+		for (j = 0; j < QUEUES - 1; j++) {
+			if (!queue_detached(extra_fds[j])) {
+				fprintf(stderr, "%s: tun queue left attached\n",
+					algs[i].name);
+				ret = 1;
+			}
+		}
+	}
+	close(client_fd);
+	close(peer_fd);
+	close(app_fd);
+	for (j = 0; j < FLOWS; j++)
+		close(flow_fd[j]);
+	free(pkt);
+	free(cpkt);
+	free_side(client);
+	free_side(peer);
+	return ret;
+}
+
+int main(void)
+{
+	int i, tun_fd, failed = 0;
+
+	if (unshare(CLONE_NEWNET) &&
+	    unshare(CLONE_NEWUSER | CLONE_NEWNET)) {
+		printf("No network namespace; skipping\n");
+		return SKIP;
+	}
+	tun_fd = open_queue();
+	if (tun_fd < 0) {
+		printf("No multi-queue tun device; skipping\n");
+		return SKIP;
+	}
+	for (i = 0; i < QUEUES - 1; i++) {
+		extra_fds[i] = open_queue();
+		if (extra_fds[i] < 0 || queue_detached(extra_fds[i])) {
+			fprintf(stderr, "Cannot open a detached tun queue\n");
+			return 1;
+		}
+	}
+	if (if_up("lo", NULL) || if_up(TUN_NAME, "10.9.0.1")) {
+		printf("Cannot configure interfaces; skipping\n");
+		return SKIP;
+	}
+
+	srand(getpid());
+	for (i = 0; i < NR_ALGS; i++) {
+		if (test_alg(i, tun_fd))
+			failed++;
+	}
+
+	for (i = 0; i < QUEUES - 1; i++)
+		close(extra_fds[i]);
+	close(tun_fd);
+	return failed ? 1 : 0;
+}
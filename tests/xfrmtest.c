@@ -0,0 +1,257 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Offloads ESP to the kernel inside a private network namespace, with
+ * a peer at the other end of the loopback which does its ESP with the
+ * userspace code. A packet sent from the VPN address must reach the
+ * peer encrypted, the peer's reply must be decrypted by the kernel and
+ * delivered, and the sequence numbers and replay window must survive
+ * the trip into the kernel and back.
+ *
+ *   127.0.0.1	the client's end of the ESP socket
+ *   127.0.0.2	the peer's end
+ *   127.0.0.10	the client's VPN address
+ *   127.0.0.20	a host on the far side of the peer
+ *
+ * Skipped where user namespaces or the kernel's ESP support are missing.
+ */
+
+#include <config.h>
+
+#include <sched.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+
+#include "esp-common.h"
+#include "../esp-xfrm.c"
+
+#ifdef HAVE_TUN_MULTIQUEUE
+void esp_stop_workers(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	return vpninfo->now = time(NULL) * 1000ULL;
+}
+
+static int lo_up(void)
+{
+	struct ifreq ifr;
+	int fd, ret;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, "lo");
+	ifr.ifr_flags = IFF_UP | IFF_LOOPBACK | IFF_RUNNING;
+	ret = ioctl(fd, SIOCSIFFLAGS, &ifr);
+	close(fd);
+	return ret;
+}
+
+/* A reply from the far side of the peer to the VPN address */
+static int make_reply(unsigned char *p, uint16_t dport, const char *payload)
+{
+	return make_udp(p, "127.0.0.20", "127.0.0.10", dport, payload);
+}
+
+static int test_alg(int i)
+{
+	struct openconnect_info *client, *peer;
+	struct esp k1, k2;
+	struct sockaddr_in client_addr, peer_addr, app_addr;
+	socklen_t alen = sizeof(client_addr);
+	struct esp_hdr *hdr;
+	struct pkt *pkt;
+	unsigned char buf[2048];
+	int client_fd, peer_fd, app_fd, len, ret = 1;
+
+	new_keys(i, &k1, &k2);
+	client_fd = udp_socket("127.0.0.1");
+	peer_fd = udp_socket("127.0.0.2");
+	app_fd = udp_socket("127.0.0.10");
+	getsockname(client_fd, (void *)&client_addr, &alen);
+	alen = sizeof(peer_addr);
+	getsockname(peer_fd, (void *)&peer_addr, &alen);
+	alen = sizeof(app_addr);
+	getsockname(app_fd, (void *)&app_addr, &alen);
+	if (connect(client_fd, (void *)&peer_addr, sizeof(peer_addr)) ||
+	    connect(peer_fd, (void *)&client_addr, sizeof(client_addr)))
+		exit(1);
+
+	client = new_side(algs[i].enc, algs[i].hmac, &k1, &k2, &peer_addr);
+	peer = new_side(algs[i].enc, algs[i].hmac, &k2, &k1, &client_addr);
+	pkt = malloc(sizeof(*pkt) + sizeof(buf));
+	if (!client || !peer || !pkt)
+		exit(1);
+	client->ip_info.addr = "127.0.0.10";
+	client->dtls_fd = client_fd;
+	client->dtls_state = DTLS_CONNECTED;
+
+	/* As if some packets had already gone each way in userspace */
+	client->esp_out.seq = 7;
+	client->esp_in[0].seq = 4;
+	peer->esp_out.seq = 5;
+
+	ret = esp_xfrm_install(client);
+	if (ret == -EPROTONOSUPPORT || ret == -ENOSYS || ret == -ENOENT) {
+		printf("%s: no kernel support\n", algs[i].name);
+		ret = SKIP;
+		goto out;
+	}
+	if (ret) {
+		fprintf(stderr, "%s: install failed: %s\n", algs[i].name, strerror(-ret));
+		ret = 1;
+		goto out;
+	}
+	ret = 1;
+
+	/* Out through the kernel's SA to the peer */
+	app_addr = inaddr("127.0.0.20", 9);
+	if (sendto(app_fd, "hello", 5, 0, (void *)&app_addr, sizeof(app_addr)) != 5) {
+		perror("sendto");
+		goto out;
+	}
+	len = wait_recv(peer_fd, esp_pkt_hdr(peer, pkt), sizeof(buf), 1000);
+	hdr = esp_pkt_hdr(peer, pkt);
+	if (len <= peer->esp_hdrlen + peer->esp_icvlen ||
+	    hdr->spi != k1.spi || ntohl(hdr->seq) != 7) {
+		fprintf(stderr, "%s: bad or missing ESP packet (%d bytes, seq %u)\n",
+			algs[i].name, len, len > 8 ? (unsigned)ntohl(hdr->seq) : 0);
+		goto out;
+	}
+	pkt->len = len - peer->esp_hdrlen - peer->esp_icvlen;
+	if (decrypt_esp_packet(peer, &peer->esp_in[0], pkt) ||
+	    pkt->data[pkt->len - 1] != 0x04 || pkt->len < 33 ||
+	    memcmp(pkt->data + 12, "\x7f\x00\x00\x0a\x7f\x00\x00\x14", 8) ||
+	    memcmp(pkt->data + 28, "hello", 5)) {
+		fprintf(stderr, "%s: peer failed to decrypt the packet\n", algs[i].name);
+		goto out;
+	}
+
+	/* ... and back in through the kernel to the application */
+	alen = sizeof(app_addr);
+	getsockname(app_fd, (void *)&app_addr, &alen);
+	pkt->len = make_reply(pkt->data, app_addr.sin_port, "world");
+	len = encrypt_esp_packet(peer, &peer->esp_out, pkt);
+	if (send(peer_fd, esp_pkt_hdr(peer, pkt), len, 0) != len ||
+	    wait_recv(app_fd, buf, sizeof(buf), 1000) != 5 || memcmp(buf, "world", 5)) {
+		fprintf(stderr, "%s: reply was not delivered\n", algs[i].name);
+		goto out;
+	}
+
+	if (esp_xfrm_poll(client, 1) ||
+	    client->stats.tx_pkts != 1 || client->stats.rx_pkts != 1 ||
+	    !client->dtls_times.last_rx || !client->dtls_times.last_tx) {
+		fprintf(stderr, "%s: SA counters not picked up\n", algs[i].name);
+		goto out;
+	}
+
+	/* A DPD probe goes out from here with the SAs still installed, on
+	   a sequence number set aside in the kernel, which carries on from
+	   beyond the gap */
+	if (esp_xfrm_reserve_seq(client) || client->esp_out.seq != 8) {
+		fprintf(stderr, "%s: no sequence numbers set aside for probes (%lu)\n",
+			algs[i].name, (unsigned long)client->esp_out.seq);
+		goto out;
+	}
+	pkt->len = 1;
+	pkt->data[0] = 0;
+	len = encrypt_esp_packet(client, &client->esp_out, pkt);
+	if (send(client_fd, esp_pkt_hdr(client, pkt), len, 0) != len) {
+		perror("send");
+		goto out;
+	}
+	len = wait_recv(peer_fd, esp_pkt_hdr(peer, pkt), sizeof(buf), 1000);
+	hdr = esp_pkt_hdr(peer, pkt);
+	pkt->len = len - peer->esp_hdrlen - peer->esp_icvlen;
+	if (len <= peer->esp_hdrlen + peer->esp_icvlen || ntohl(hdr->seq) != 8 ||
+	    decrypt_esp_packet(peer, &peer->esp_in[0], pkt)) {
+		fprintf(stderr, "%s: bad or missing probe\n", algs[i].name);
+		goto out;
+	}
+	app_addr = inaddr("127.0.0.20", 9);
+	if (sendto(app_fd, "hello", 5, 0, (void *)&app_addr, sizeof(app_addr)) != 5) {
+		perror("sendto");
+		goto out;
+	}
+	len = wait_recv(peer_fd, esp_pkt_hdr(peer, pkt), sizeof(buf), 1000);
+	if (len <= peer->esp_hdrlen + peer->esp_icvlen ||
+	    ntohl(hdr->seq) != 7 + XFRM_SEQ_GAP + 1) {
+		fprintf(stderr, "%s: kernel sent seq %u after the probe\n", algs[i].name,
+			len > 8 ? (unsigned)ntohl(hdr->seq) : 0);
+		goto out;
+	}
+
+	/* The kernel sent 7 and the one after the gap, and received 5 but not 4 */
+	esp_xfrm_remove(client);
+	if (client->esp_xfrm || client->esp_out.seq != 7 + XFRM_SEQ_GAP + 2 ||
+	    client->esp_in[0].seq != 6 || (client->esp_in[0].seq_backlog & 3) != 1) {
+		fprintf(stderr, "%s: bad state after removal: out %lu in %lu backlog %lx\n",
+			algs[i].name, (unsigned long)client->esp_out.seq,
+			(unsigned long)client->esp_in[0].seq,
+			(unsigned long)client->esp_in[0].seq_backlog);
+		goto out;
+	}
+
+	/* Now ESP arrives on the socket again */
+	pkt->len = make_reply(pkt->data, app_addr.sin_port, "again");
+	len = encrypt_esp_packet(peer, &peer->esp_out, pkt);
+	if (send(peer_fd, esp_pkt_hdr(peer, pkt), len, 0) != len ||
+	    wait_recv(client_fd, buf, sizeof(buf), 1000) != len) {
+		fprintf(stderr, "%s: ESP not received on the socket after removal\n",
+			algs[i].name);
+		goto out;
+	}
+
+	printf("%s: ok\n", algs[i].name);
+	ret = 0;
+ out:
+	esp_xfrm_remove(client);
+	close(client_fd);
+	close(peer_fd);
+	close(app_fd);
+	free(pkt);
+	free_side(client);
+	free_side(peer);
+	return ret;
+}
+
+int main(void)
+{
+	int i, ret, skipped = 0, failed = 0;
+
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNET) || lo_up()) {
+		printf("No network namespace; skipping\n");
+		return SKIP;
+	}
+
+	srand(getpid());
+	for (i = 0; i < NR_ALGS; i++) {
+		ret = test_alg(i);
+		if (ret == SKIP)
+			skipped++;
+		else if (ret)
+			failed++;
+	}
+
+	if (failed)
+		return 1;
+	return skipped == i ? SKIP : 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <limits.h>
+#include <time.h>
+
+#include "openconnect-internal.h"
+
+/*
+ * Deadlines for DPD, keepalive, rekey, and retrying UDP, kept in a small
+ * binary min-heap in vpninfo->timers[] so that the mainloop can sleep
+ * until exactly the earliest of them.
+ *
+ * A timer only says when to wake up. Its owner still looks at the clock
+ * on each pass and decides for itself whether anything is due, and arms
+ * it again if not. A timer which has come due stays armed, and the
+ * mainloop doesn't wait at all, until its owner has re-armed or
+ * cancelled it. So when an owner loses interest (the DTLS connection it
+ * was for has gone, say) it must cancel its timer.
+ *
+ * Times are CLOCK_MONOTONIC milliseconds, from timer_now(). Rather than
+ * read the clock for every packet that goes by, the mainloop does it
+ * once each time it wakes up, with timer_update(), and everything on
+ * that thread uses vpninfo->now. Anything which may have blocked for a
+ * while since then, like making a new connection, should update it
+ * again first. The latency statistics need microseconds, so the mainloop
+ * takes a second, finer reading at the same time for vpninfo->now_us;
+ * only the tun device's bursts read that clock for themselves.
+ */
+
+uint64_t timer_now(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+	/* Only as fine as the kernel's tick, but cheaper to read, and
+	   plenty for intervals measured in seconds */
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+		return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	return stats_clock_us() / 1000;
+}
+
+uint64_t timer_update(struct openconnect_info *vpninfo)
+{
+	uint64_t now = timer_now();
+
+	/* The ESP workers read it too */
+	__atomic_store_n(&vpninfo->now, now, __ATOMIC_RELAXED);
+	return now;
+}
+
+static void heap_place(struct openconnect_info *vpninfo, struct oc_timer *t,
+		       int i)
+{
+	vpninfo->timers[i] = t;
+	t->slot = i + 1;
+}
+
+static void heap_up(struct openconnect_info *vpninfo, int i)
+{
+	struct oc_timer *t = vpninfo->timers[i];
+
+	while (i) {
+		int parent = (i - 1) / 2;
+
+		if (vpninfo->timers[parent]->due <= t->due)
+			break;
+		heap_place(vpninfo, vpninfo->timers[parent], i);
+		i = parent;
+	}
+	heap_place(vpninfo, t, i);
+}
+
+static void heap_down(struct openconnect_info *vpninfo, int i)
+{
+	struct oc_timer *t = vpninfo->timers[i];
+	int n = vpninfo->nr_timers;
+
+	while (2 * i + 1 < n) {
+		int child = 2 * i + 1;
+
+		if (child + 1 < n &&
+		    vpninfo->timers[child + 1]->due < vpninfo->timers[child]->due)
+			child++;
+		if (t->due <= vpninfo->timers[child]->due)
+			break;
+		heap_place(vpninfo, vpninfo->timers[child], i);
+		i = child;
+	}
+	heap_place(vpninfo, t, i);
+}
+
+/* Arm t for 'due', or move it there if it's already armed */
+void timer_set(struct openconnect_info *vpninfo, struct oc_timer *t,
+	       uint64_t due)
+{
+	int i;
+
+	if (t->slot) {
+		if (t->due == due)
+			return;
+		i = t->slot - 1;
+		t->due = due;
+		heap_up(vpninfo, i);
+		heap_down(vpninfo, t->slot - 1);
+		return;
+	}
+
+	if (vpninfo->nr_timers == MAX_TIMERS) {
+		/* Only if a new one was added without raising MAX_TIMERS */
+		vpn_progress(vpninfo, PRG_ERR, _("Too many timers\n"));
+		return;
+	}
+	t->due = due;
+	i = vpninfo->nr_timers++;
+	vpninfo->timers[i] = t;
+	heap_up(vpninfo, i);
+}
+
+void timer_cancel(struct openconnect_info *vpninfo, struct oc_timer *t)
+{
+	struct oc_timer *last;
+	int i = t->slot - 1;
+
+	if (!t->slot)
+		return;
+	t->slot = 0;
+
+	last = vpninfo->timers[--vpninfo->nr_timers];
+	if (last == t)
+		return;
+	vpninfo->timers[i] = last;
+	heap_up(vpninfo, i);
+	heap_down(vpninfo, last->slot - 1);
+}
+
+/* Called by the mainloop before it waits, once everything has had its
+   chance to look at the timers. The wait is cut short for the earliest
+   of them, or skipped altogether if one has come due and is still
+   waiting for its owner to deal with it on the next pass. */
+void timers_next(struct openconnect_info *vpninfo, int *timeout)
+{
+	uint64_t now = vpninfo->now;
+	uint64_t due;
+
+	if (!vpninfo->nr_timers)
+		return;
+
+	due = vpninfo->timers[0]->due;
+	if (due <= now)
+		*timeout = 0;
+	else if (due - now < (uint64_t)*timeout)
+		*timeout = due - now;
+}
@@ -353,8 +353,8 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	char *errstr;
 
 	if (WriteFile(vpninfo->tun_fh, pkt->data, pkt->len, &pkt_size, &vpninfo->tun_wr_overlap)) {
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Wrote %ld bytes to tun\n"), pkt_size);
+		vpn_pkt_trace(vpninfo,
+			      _("Wrote %ld bytes to tun\n"), pkt_size);
 		return 0;
 	}
 
@@ -363,11 +363,11 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 		/* Theoretically we should let the mainloop handle this blocking,
 		   but that's non-trivial and it doesn't ever seem to happen in
 		   practice anyway. */
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("Waiting for tun write...\n"));
+		vpn_pkt_trace(vpninfo,
+			      _("Waiting for tun write...\n"));
 		if (GetOverlappedResult(vpninfo->tun_fh, &vpninfo->tun_wr_overlap, &pkt_size, TRUE)) {
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Wrote %ld bytes to tun after waiting\n"), pkt_size);
+			vpn_pkt_trace(vpninfo,
+				      _("Wrote %ld bytes to tun after waiting\n"), pkt_size);
 			return 0;
 		}
 		err = GetLastError();
@@ -379,6 +379,12 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 	return -1;
 }
 
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+	/* The TAP device's MTU is set through the vpnc-script */
+	return -EOPNOTSUPP;
+}
+
 void os_shutdown_tun(struct openconnect_info *vpninfo)
 {
 	script_config_tun(vpninfo, "disconnect");
@@ -198,7 +198,7 @@ static void ifreq_set_ifname(struct openconnect_info *vpninfo, struct ifreq *ifr
 static int set_tun_mtu(struct openconnect_info *vpninfo)
 {
 	struct ifreq ifr;
-	int net_fd;
+	int net_fd, ret = 0;
 
 	net_fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (net_fd < 0) {
@@ -210,14 +210,73 @@ static int set_tun_mtu(struct openconnect_info *vpninfo)
 	ifreq_set_ifname(vpninfo, &ifr);
 	ifr.ifr_mtu = vpninfo->ip_info.mtu;
 
-	if (ioctl(net_fd, SIOCSIFMTU, &ifr) < 0)
+	if (ioctl(net_fd, SIOCSIFMTU, &ifr) < 0) {
+		ret = -errno;
 		vpn_perror(vpninfo, _("SIOCSIFMTU"));
+	}
 
 	close(net_fd);
-	return 0;
+	return ret;
 }
 
 #ifdef IFF_TUN /* Linux */
+#ifdef HAVE_TUN_MULTIQUEUE
+/* The extra queues for the ESP workers. Attaching to the device needs the
+ * privileges which -U is about to drop, so they are all opened now, and
+ * detached so that the kernel gives them nothing until there are workers
+ * to read them. The workers attach and detach them with TUNSETQUEUE,
+ * which needs no privileges. */
+static void open_tun_queues(struct openconnect_info *vpninfo, const char *name)
+{
+	struct ifreq ifr;
+	int fd;
+
+	while (vpninfo->nr_tun_queue_fds < vpninfo->tun_queues - 1) {
+		fd = open("/dev/net/tun", O_RDWR);
+		if (fd < 0) {
+			vpn_perror(vpninfo, _("Open /dev/net/tun"));
+			break;
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+		snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", name);
+		if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to attach tun queue (TUNSETIFF): %s\n"),
+				     strerror(errno));
+			close(fd);
+			break;
+		}
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_DETACH_QUEUE;
+		if (ioctl(fd, TUNSETQUEUE, (void *) &ifr) < 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to detach tun queue (TUNSETQUEUE): %s\n"),
+				     strerror(errno));
+			close(fd);
+			break;
+		}
+
+		set_fd_cloexec(fd);
+		set_sock_nonblock(fd);
+		vpninfo->tun_queue_fds[vpninfo->nr_tun_queue_fds++] = fd;
+	}
+
+	if (vpninfo->nr_tun_queue_fds < vpninfo->tun_queues - 1)
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Using %d tun queues instead of %d\n"),
+			     vpninfo->nr_tun_queue_fds + 1, vpninfo->tun_queues);
+}
+
+void os_close_tun_queues(struct openconnect_info *vpninfo)
+{
+	while (vpninfo->nr_tun_queue_fds)
+		close(vpninfo->tun_queue_fds[--vpninfo->nr_tun_queue_fds]);
+}
+#endif
+
 intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 {
 	int tun_fd = -1;
@@ -245,6 +304,10 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	}
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+#ifdef HAVE_TUN_MULTIQUEUE
+	if (vpninfo->tun_queues > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+#endif
 	if (vpninfo->ifname)
 		ifreq_set_ifname(vpninfo, &ifr);
 	if (ioctl(tun_fd, TUNSETIFF, (void *) &ifr) < 0) {
@@ -263,11 +326,17 @@ intptr_t os_setup_tun(struct openconnect_info *vpninfo)
 	if (!vpninfo->ifname)
 		vpninfo->ifname = strdup(ifr.ifr_name);
 
+#ifdef HAVE_TUN_MULTIQUEUE
+	if (vpninfo->tun_queues > 1)
+		open_tun_queues(vpninfo, ifr.ifr_name);
+#endif
+
 	/* Ancient vpnc-scripts might not get this right */
 	set_tun_mtu(vpninfo);
 
 	return tun_fd;
 }
+
 #else /* BSD et al, including OS X */
 
 #ifdef SIOCIFCREATE
@@ -570,6 +639,16 @@ int os_write_tun(struct openconnect_info *vpninfo, struct pkt *pkt)
 
 }
 
+/* The MTU changed after the tun device was set up */
+int os_set_tun_mtu(struct openconnect_info *vpninfo)
+{
+#if !defined(__sun__) && !defined(__native_client__)
+	if (vpninfo->ifname)
+		return set_tun_mtu(vpninfo);
+#endif
+	return -EOPNOTSUPP;
+}
+
 void os_shutdown_tun(struct openconnect_info *vpninfo)
 {
 	if (vpninfo->script_tun) {
@@ -590,4 +669,7 @@ void os_shutdown_tun(struct openconnect_info *vpninfo)
 	if (vpninfo->vpnc_script)
 		close(vpninfo->tun_fd);
 	vpninfo->tun_fd = -1;
+#ifdef HAVE_TUN_MULTIQUEUE
+	os_close_tun_queues(vpninfo);
+#endif
 }
@@ -0,0 +1,167 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+int oc_uring_init(struct oc_uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err;
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto err;
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->cq_entries = p.cq_entries;
+
+	return 0;
+
+ err:
+	ret = -errno;
+	oc_uring_free(ring);
+	return ret;
+}
+
+void oc_uring_free(struct oc_uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* Returns NULL if the submission queue is full */
+struct io_uring_sqe *oc_uring_get_sqe(struct oc_uring *ring)
+{
+	unsigned head = smp_load_acquire(ring->sq_head);
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void oc_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buf,
+		      unsigned len, uint64_t user_data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->user_data = user_data;
+}
+
+/* Publish all queued SQEs to the kernel with a single io_uring_enter(),
+ * optionally waiting for wait_nr completions. Anything the kernel didn't
+ * consume last time (sq_head short of our tail) is submitted again. */
+int oc_uring_submit(struct oc_uring *ring, unsigned wait_nr)
+{
+	unsigned to_submit = ring->sqe_tail - smp_load_acquire(ring->sq_head);
+	int ret;
+
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	smp_store_release(ring->sq_tail, ring->sqe_tail);
+
+	ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+				 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+struct io_uring_cqe *oc_uring_peek_cqe(struct oc_uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == smp_load_acquire(ring->cq_tail))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void oc_uring_cqe_seen(struct oc_uring *ring)
+{
+	smp_store_release(ring->cq_head, *ring->cq_head + 1);
+}
@@ -0,0 +1,52 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2026 The OpenConnect Authors.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __OPENCONNECT_URING_H__
+#define __OPENCONNECT_URING_H__
+
+/* Just enough of an io_uring to post reads/writes on the tun device and
+ * the UDP socket, without pulling in liburing. The ring fd itself polls
+ * readable while there are completions waiting. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct oc_uring {
+	int fd;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;	/* Locally queued SQEs, not yet published */
+	unsigned sq_entries;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned cq_entries;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+int oc_uring_init(struct oc_uring *ring, unsigned entries);
+void oc_uring_free(struct oc_uring *ring);
+struct io_uring_sqe *oc_uring_get_sqe(struct oc_uring *ring);
+void oc_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buf,
+		      unsigned len, uint64_t user_data);
+int oc_uring_submit(struct oc_uring *ring, unsigned wait_nr);
+struct io_uring_cqe *oc_uring_peek_cqe(struct oc_uring *ring);
+void oc_uring_cqe_seen(struct oc_uring *ring);
+
+#endif /* __OPENCONNECT_URING_H__ */